@@ -85,7 +85,9 @@ static void * mn_thr(void * arg)
 	/* Loop */
 	while (1) {
 		int current_count, limit_count, highest_count;
+		int thr_cur, thr_min, thr_max;
 		long long total_count;
+		long long shed_to, shed_res;
 		struct timespec total, blocking, last;
 		struct fd_list * li;
 	
@@ -101,12 +103,21 @@ static void * mn_thr(void * arg)
 		
 		CHECK_FCT_DO( fd_stat_getstats(STAT_G_LOCAL, NULL, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 		display_info("Local delivery", NULL, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+		CHECK_FCT_DO( fd_stat_getthreads(STAT_G_LOCAL, &thr_cur, &thr_min, &thr_max), );
+		TRACE_DEBUG(INFO, "Global 'Local delivery': %d threads (min:%d, max:%d)", thr_cur, thr_min, thr_max);
 		
 		CHECK_FCT_DO( fd_stat_getstats(STAT_G_INCOMING, NULL, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 		display_info("Total received", NULL, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+		CHECK_FCT_DO( fd_stat_getthreads(STAT_G_INCOMING, &thr_cur, &thr_min, &thr_max), );
+		TRACE_DEBUG(INFO, "Global 'Total received': %d threads (min:%d, max:%d)", thr_cur, thr_min, thr_max);
 		
 		CHECK_FCT_DO( fd_stat_getstats(STAT_G_OUTGOING, NULL, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 		display_info("Total sending", NULL, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+		CHECK_FCT_DO( fd_stat_getthreads(STAT_G_OUTGOING, &thr_cur, &thr_min, &thr_max), );
+		TRACE_DEBUG(INFO, "Global 'Total sending': %d threads (min:%d, max:%d)", thr_cur, thr_min, thr_max);
+		
+		CHECK_FCT_DO( fd_stat_getshed(&shed_to, &shed_res), );
+		TRACE_DEBUG(INFO, "Shed requests: %lld expired while queued, %lld over MaxResidence", shed_to, shed_res);
 		
 		
 		CHECK_FCT_DO( pthread_rwlock_rdlock(&fd_g_peers_rw), /* continue */ );
@@ -122,6 +133,9 @@ static void * mn_thr(void * arg)
 			CHECK_FCT_DO( fd_stat_getstats(STAT_P_TOSEND, p, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 			display_info("Outgoing", p->info.pi_diamid, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
 			
+			CHECK_FCT_DO( fd_stat_getstats(STAT_P_INCOMING, p, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
+			display_info("Incoming", p->info.pi_diamid, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+			
 		}
 
 		CHECK_FCT_DO( pthread_rwlock_unlock(&fd_g_peers_rw), /* continue */ );
@@ -134,6 +134,7 @@ struct fd_config {
 	uint16_t	 cnf_port_3436; /* Open an additional server port to listen to old TLS/SCTP clients (RFC3436, freeDiameter versions < 1.2.0) */
 	uint16_t	 cnf_sctp_str;	/* default max number of streams for SCTP associations (def: 30) */
 	struct fd_list	 cnf_endpoints;	/* the local endpoints to bind the server to. list of struct fd_endpoint. default is empty (bind all). After servers are started, this is the actual list of endpoints including port information. */
+	char *		 cnf_local_path;	/* if not NULL, a server also accepts the connections of the co-located peers on this unix socket */
 	int		 cnf_thr_srv;	/* Number of threads per servers handling the connection state machines */
 	int		 cnf_processing_peers_minimum;	/* Number of processing peers that must be connected before other peers may connect */
 	regex_t		 cnf_processing_peers_pattern_regex;	/* Regex pattern for identifying processing peers */
@@ -141,10 +142,25 @@ struct fd_config {
 	uint16_t	 cnf_dispthr;	/* Number of dispatch threads to create */
 	uint16_t     cnf_rtinthr;  /* Number of routing in threads to create */
 	uint16_t     cnf_rtoutthr;  /* Number of routing out threads to create */
+	uint16_t	 cnf_dispthr_max;	/* Max number of dispatch threads when the local queue fills up (0: no more than cnf_dispthr) */
+	uint16_t	 cnf_rtinthr_max;	/* Same for the routing in threads */
+	uint16_t	 cnf_rtoutthr_max;	/* Same for the routing out threads */
+	uint16_t	 cnf_fuse;	/* Max number of next stages (dispatch, routing-out) a routing thread runs inline for one message. 0: always use the queues */
+	int		 cnf_io_engine;	/* How the messages are received on the connections: */
+		#define FD_IO_THREADS	0	/* one receiver thread per connection (default) */
+		#define FD_IO_EPOLL	1	/* a pool of epoll loop threads */
+		#define FD_IO_URING	2	/* a pool of io_uring loop threads (falls back to FD_IO_EPOLL if not available) */
+	uint16_t	 cnf_io_thr;	/* Number of threads of the I/O engine, if not FD_IO_THREADS */
 	uint16_t	 cnf_rr_in_answers;	/* include Route-Record AVP in answers */
 	int		 cnf_qin_limit;	/* limit for incoming queue*/
 	int		 cnf_qout_limit;	/* limit for outgoing queue */
 	int		 cnf_qlocal_limit;	/* limit for local queue */
+	int		 cnf_qpeer_limit;	/* if not 0, the incoming messages are fair queued per peer, with this limit for each peer */
+	int		 cnf_doic_depth;	/* if not 0, report overload (RFC 7683) in answers, the reduction is maximal when this many messages wait to be routed or dispatched */
+	int		 cnf_doic_latency;	/* if not 0, same with the average time (ms) spent by the messages in these queues */
+	uint32_t	 cnf_doic_validity;	/* OC-Validity-Duration of the overload reports we send, in seconds */
+	int		 cnf_max_residence;	/* if not 0, requests waiting longer than this (ms) in the queues are shed */
+	int		 cnf_peer_window;	/* if not 0, maximum number of requests sent to a peer and not answered yet */
 	struct {
 		unsigned no_fwd : 1;	/* the peer does not relay messages (0xffffff app id) */
 		unsigned no_ip4 : 1;	/* disable IP */
@@ -154,6 +170,13 @@ struct fd_config {
 		unsigned pr_tcp	: 1;	/* prefer TCP over SCTP */
 		unsigned tls_alg: 1;	/* TLS algorithm for initiated cnx. 0: separate port. 1: inband-security (old) */
 		unsigned no_bind: 1;	/* disable client bind to cnf_endpoints if non configured (bind all) */
+		unsigned ktls	: 1;	/* hand the TLS sessions over to the kernel after the handshake, when possible */
+		unsigned no_resume: 1;	/* disable TLS session resumption (tickets issued as server, cached sessions as client) */
+		unsigned rt_realm: 1;	/* route the requests only among the peers of the realm routing table entry, when one matches */
+		unsigned sess_aff: 1;	/* dispatch the messages of a session in order, by the same thread */
+		unsigned qpeer_shed: 1;	/* answer DIAMETER_TOO_BUSY to the requests of a peer whose incoming queue is full, instead of blocking its receiver */
+		unsigned sctp_sess: 1;	/* send the messages of a session on the same SCTP stream, chosen by hash of the Session-Id */
+		unsigned doic: 1;	/* act as a DOIC reacting node (RFC 7683): advertise the support in requests and abate the traffic as requested in the overload reports received */
 	} 		 cnf_flags;
 	
 	struct {
@@ -179,6 +202,9 @@ struct fd_config {
 		gnutls_certificate_credentials_t credentials; /* contains local cert + trust anchors */
 		gnutls_x509_trust_list_t         trustlist; /* the logic to check local certificate has changed */
 		
+		/* Key protecting the session tickets issued to the clients (random, valid until restart) */
+		gnutls_datum_t			 ticket_key;
+		
 	} 		 cnf_sec_data;
 	
 	uint32_t	 cnf_orstateid;	/* The value to use in Origin-State-Id, default to random value */
@@ -285,6 +311,7 @@ struct peer_info {
 			unsigned	sctpsec :1;	/* PI_SCTPSEC_* */
 			unsigned	exp :1;		/* PI_EXP_* */
 			unsigned	persist :1;	/* PI_PRST_* */
+			unsigned	clrlanes :1;	/* accept the additional connections (pic_lanes) when the principal one is not protected by TLS */
 			
 		}		pic_flags;	/* Flags influencing the connection to the remote peer */
 		
@@ -297,6 +324,12 @@ struct peer_info {
 		
 		char *		pic_priority;	/* Priority string for GnuTLS if we don't use the default */
 		
+		uint16_t	pic_weight;	/* share of the routing of the incoming messages given to this peer when they are fair queued (cnf_qpeer_limit). 0 means 1 */
+		
+		char *		pic_local_path;	/* if not NULL, connect to the peer through this unix socket instead of TCP or SCTP */
+		
+		uint16_t	pic_lanes;	/* number of parallel TCP connections to use with this peer, if both sides configure it. 0 or 1 means a single one */
+		
 	} config;	/* Configured data (static for this peer entry) */
 	
 	struct {
@@ -444,6 +477,25 @@ int fd_peer_cnx_proto_info(struct peer_hdr *peer, char * buf, size_t len);
  */
 int fd_peer_get_load_pending(struct peer_hdr *peer, long * to_receive, long * to_send);
 
+/* 
+ * FUNCTION:	fd_peer_get_window
+ *
+ * PARAMETERS:
+ *  peer	: The peer which window to read
+ *  window      : (out) number of requests that can be in flight to this peer currently, 0 if PeerWindow is not set.
+ *  in_flight   : (out) number of requests sent to this peer without matching answer yet.
+ *
+ * DESCRIPTION: 
+ *   Returns the flow control state of the peer. The window is reduced when the requests
+ *  sent to this peer time out, and grows back up to PeerWindow as the answers come.
+ *  The peer is not preferred for routing while in_flight >= window.
+ *
+ * RETURN VALUE:
+ *  0  : The values have been updated.
+ * !0  : An error occurred
+ */
+int fd_peer_get_window(struct peer_hdr *peer, long * window, long * in_flight);
+
 /*
  * FUNCTION:	fd_peer_validate_register
  *
@@ -1212,6 +1264,7 @@ enum fd_stat_type {
 	/* For the following, the peer must be provided */
 	STAT_P_PSM,		/* Peer state machine queue (events to be processed for this peer, including received messages) */
 	STAT_P_TOSEND,		/* Queue of messages for sending to this peer */
+	STAT_P_INCOMING,	/* Messages received from this peer and waiting for the routing_in threads, when cnf_qpeer_limit is set */
 };
 
 /*
@@ -1240,6 +1293,57 @@ int fd_stat_getstats(enum fd_stat_type stat, struct peer_hdr * peer,
 			int * current_count, int * limit_count, int * highest_count, long long * total_count,
 			struct timespec * total, struct timespec * blocking, struct timespec * last);
 
+/*
+ * FUNCTION:	fd_stat_getthreads
+ *
+ * PARAMETERS:
+ *  stat	  : STAT_G_LOCAL, STAT_G_INCOMING or STAT_G_OUTGOING
+ *  current	  : (out) The number of threads currently serving this queue
+ *  min		  : (out) The number of threads started with the framework
+ *  max		  : (out) The number of threads the pool may grow to when the queue fills up
+ *  
+ * DESCRIPTION: 
+ *   Get the size of the pool of threads that processes one of the global queues.
+ *  Any of the (out) parameters can be NULL if not requested.
+ *
+ * RETURN VALUE:
+ *  0      	: The values have been retrieved.
+ *  EINVAL 	: The stat parameter is invalid.
+ */
+int fd_stat_getthreads(enum fd_stat_type stat, int * current, int * min, int * max);
+
+/*
+ * FUNCTION:	fd_stat_tls_handshakes
+ *
+ * PARAMETERS:
+ *  full	  : (out) Number of TLS handshakes completed with a full key exchange and certificate verification
+ *  resumed	  : (out) Number of TLS handshakes that resumed a previous session
+ *  
+ * DESCRIPTION: 
+ *   Get the number of successful TLS handshakes since startup, client and server sides together (always growing, use deltas for monitoring).
+ *  Any of the (out) parameters can be NULL if not requested.
+ *
+ * RETURN VALUE:
+ *  0      	: The values have been retrieved.
+ */
+int fd_stat_tls_handshakes(long long * full, long long * resumed);
+
+/*
+ * FUNCTION:	fd_stat_getshed
+ *
+ * PARAMETERS:
+ *  timeout	  : (out) Number of local requests answered DIAMETER_UNABLE_TO_DELIVER because their answer timeout passed while they were queued
+ *  residence	  : (out) Number of requests answered DIAMETER_TOO_BUSY because they stayed longer than MaxResidence in the queues
+ *  
+ * DESCRIPTION: 
+ *   Get the number of requests shed by the framework since startup (always growing, use deltas for monitoring).
+ *  Any of the (out) parameters can be NULL if not requested.
+ *
+ * RETURN VALUE:
+ *  0      	: The values have been retrieved.
+ */
+int fd_stat_getshed(long long * timeout, long long * residence);
+
 /*============================================================*/
 /*                         EOF                                */
 /*============================================================*/
@@ -1844,6 +1844,17 @@ The "parent" parameter can not be NULL. It points to the object (grouped avp or
 #define AC_INBAND_SECURITY_ID		299
 #define ACV_ISI_NO_INBAND_SECURITY		0
 #define ACV_ISI_TLS				1
+/* Overload control (RFC 7683) */
+#define AC_OC_SUPPORTED_FEATURES	621
+#define AC_OC_FEATURE_VECTOR		622
+#define ACV_OC_LOSS				1	/* OLR_DEFAULT_ALGO bit */
+#define AC_OC_OLR			623
+#define AC_OC_SEQUENCE_NUMBER		624
+#define AC_OC_VALIDITY_DURATION		625
+#define AC_OC_REPORT_TYPE		626
+#define ACV_OC_HOST_REPORT			0
+#define ACV_OC_REALM_REPORT			1
+#define AC_OC_REDUCTION_PERCENTAGE	627
 
 /* Error codes from Base protocol
 (reference: http://www.iana.org/assignments/aaa-parameters/aaa-parameters.xml#aaa-parameters-4)
@@ -2169,6 +2180,11 @@ struct rtd_candidate {
 /* Reorder the list of peers by score */
 int  fd_rtd_candidate_reorder(struct fd_list * candidates);
 
+/* Set the candidates list at once from nb entries ordered by diamid (only the diamid and realm fields are used), with a single allocation.
+ The diamid and realm strings are not copied: they must remain valid until release(ref) is called, when the rt_data is freed.
+ The candidates list must be empty. On error, release is not called. */
+int  fd_rtd_candidate_set(struct rt_data * rtd, struct rtd_candidate * src, int nb, void (*release)(void *), void * ref);
+
 /* Note : it is fine for a callback to add a new entry in the candidates list after the list has been extracted. The diamid must then be malloc'd. */
 /* Beware that this could lead to routing loops */
 
@@ -2592,6 +2608,50 @@ int fd_msg_source_set( struct msg * msg, DiamId_t diamid, size_t diamidlen );
 int fd_msg_source_setrr( struct msg * msg, DiamId_t diamid, size_t diamidlen, struct dictionary * dict );
 int fd_msg_source_get( struct msg * msg, DiamId_t *diamid, size_t * diamidlen );
 
+/*
+ * FUNCTION:	fd_msg_prio_(g/s)et
+ *
+ * PARAMETERS:
+ *  msg		: A msg object.
+ *  prio	: The priority class of the message.
+ *
+ * DESCRIPTION:
+ *   Tag a message with a priority class, or retrieve it. The framework queues a message ahead of
+ * the messages of a lower class, in the global queues as well as in the sending queue of a peer.
+ * An answer created with fd_msg_new_answer_from_req inherits the class of the request.
+ * MSG_PRIO_CONTROL cannot be set; fd_msg_prio_get returns it for all non-routable messages
+ * (base protocol CER/CEA, DWR/DWA, DPR/DPA) so that they are never delayed by the application traffic.
+ *
+ * RETURN VALUE:
+ *  0      	: Operation complete.
+ *  EINVAL 	: A parameter is invalid.
+ */
+enum {
+	MSG_PRIO_NORMAL = 0,	/* default */
+	MSG_PRIO_HIGH,		/* e.g. emergency or priority services */
+	MSG_PRIO_CONTROL	/* reserved, base protocol messages */
+};
+int fd_msg_prio_set( struct msg * msg, int prio );
+int fd_msg_prio_get( struct msg * msg, int * prio );
+
+/*
+ * FUNCTION:	fd_msg_arrival_(g/s)et
+ *
+ * PARAMETERS:
+ *  msg		: A msg object.
+ *  ts		: The time (CLOCK_REALTIME) when the message entered the daemon.
+ *
+ * DESCRIPTION:
+ *   Record or retrieve the arrival time of a message, used to shed the requests that waited too long
+ * in the queues (see MaxResidence in the configuration). A zeroed value means it was not recorded.
+ *
+ * RETURN VALUE:
+ *  0      	: Operation complete.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_msg_arrival_set( struct msg * msg, const struct timespec * ts );
+int fd_msg_arrival_get( struct msg * msg, struct timespec * ts );
+
 /*
  * FUNCTION:	fd_msg_eteid_get
  *
@@ -2638,6 +2698,9 @@ struct fd_msg_pmdl {
 };
 struct fd_msg_pmdl * fd_msg_pmdl_get(struct msg * msg);
 
+/* Also used by the libfdcore: the received buffers come from a pool, this sets the function to release the buffer passed to fd_msg_parse_buffer (default: free) */
+int fd_msg_rawbuffer_setfree(struct msg * msg, void (*rawfree)(void *));
+
 
 /***************************************/
 /*   Manage AVP values                 */
@@ -3192,6 +3255,48 @@ int fd_fifo_post_int ( struct fifo * queue, void ** item );
 only for failure recovery for example. */
 int fd_fifo_post_noblock( struct fifo * queue, void ** item );
 
+/*
+ * FUNCTION:	fd_fifo_post_prio
+ *
+ * PARAMETERS:
+ *  queue	: The queue in which the element must be posted.
+ *  item	: The element that is put in the queue.
+ *  prio	: The priority of the element, 0 is the normal traffic.
+ *
+ * DESCRIPTION:
+ *  Same as fd_fifo_post, but the element is queued ahead of all the elements posted with a lower priority,
+ * and after those with the same or a higher one. With prio 0 this is exactly fd_fifo_post. Elements with
+ * a priority greater than 0 can use some reserved room above the maximum size of the queue (a quarter of it,
+ * plus one), so they are not blocked by the normal traffic they overtake. They block when this room is full too.
+ *
+ * RETURN VALUE:
+ *  0		: The element is queued.
+ *  EINVAL 	: A parameter is invalid.
+ *  ENOMEM 	: Not enough memory to complete the operation.
+ */
+int fd_fifo_post_prio ( struct fifo * queue, void ** item, int prio );
+
+/*
+ * FUNCTION:	fd_fifo_trypost
+ *
+ * PARAMETERS:
+ *  queue	: The queue in which the element must be posted.
+ *  item	: The element that is put in the queue.
+ *  prio	: The priority of the element, 0 is the normal traffic.
+ *
+ * DESCRIPTION:
+ *  This function is similar to fd_fifo_post_prio, except that it will not block if
+ * the queue is full (including the reserved room for a priority greater than 0), but return EWOULDBLOCK instead.
+ * The element is not queued in this case.
+ *
+ * RETURN VALUE:
+ *  0		: The element is queued.
+ *  EINVAL 	: A parameter is invalid.
+ *  ENOMEM 	: Not enough memory to complete the operation.
+ *  EWOULDBLOCK : The queue was full.
+ */
+int fd_fifo_trypost ( struct fifo * queue, void ** item, int prio );
+
 /*
  * FUNCTION:	fd_fifo_get
  *
@@ -39,12 +39,26 @@
 #include <net/if.h>
 #include <ifaddrs.h> /* for getifaddrs */
 #include <sys/uio.h> /* writev */
+#include <limits.h> /* IOV_MAX */
 
 /* The maximum size of Diameter message we accept to receive (<= 2^24) to avoid too big mallocs in case of trashed headers */
 #ifndef DIAMETER_MSG_SIZE_MAX
 #define DIAMETER_MSG_SIZE_MAX	65535	/* in bytes */
 #endif /* DIAMETER_MSG_SIZE_MAX */
 
+/* The size of the buffer used by the receiver threads of stream connections (TCP, TLS). It must hold the largest message. */
+#ifndef RCV_BUFFER_SIZE
+#define RCV_BUFFER_SIZE	65536	/* in bytes */
+#endif /* RCV_BUFFER_SIZE */
+/* The number of messages given to one writev by fd_cnx_sendv_sess (<= IOV_MAX), copied on the stack so that a partial write does not alter the caller's array */
+#ifndef SENDV_IOV_CHUNK
+#define SENDV_IOV_CHUNK	64
+#endif /* SENDV_IOV_CHUNK */
+
+#if RCV_BUFFER_SIZE < DIAMETER_MSG_SIZE_MAX
+#error "RCV_BUFFER_SIZE must not be smaller than DIAMETER_MSG_SIZE_MAX"
+#endif
+
 
 /* Connections contexts (cnxctx) in freeDiameter are wrappers around the sockets and TLS operations .
  * They are used to hide the details of the processing to the higher layers of the daemon.
@@ -153,6 +167,37 @@ error:
 	return NULL;
 }
 
+/* Same function for the co-located peers, on a unix socket. The connections are then handled as TCP ones */
+struct cnxctx * fd_cnx_serv_local(char * path)
+{
+	struct cnxctx * cnx = NULL;
+	struct sockaddr_un sun;
+
+	TRACE_ENTRY("%p", path);
+	CHECK_PARAMS_DO( path && (strlen(path) < sizeof(sun.sun_path)), return NULL );
+
+	/* The connection object */
+	CHECK_MALLOC_DO( cnx = fd_cnx_init(0), return NULL );
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	cnx->cc_family = AF_UNIX;
+
+	/* Create the socket */
+	CHECK_FCT_DO( fd_tcp_create_bind_server( &cnx->cc_socket, (sSA *)&sun, sizeof(sun) ), goto error );
+
+	snprintf(cnx->cc_id, sizeof(cnx->cc_id), CC_ID_HDR "Local srv %s (%d)", path, cnx->cc_socket);
+
+	cnx->cc_proto = IPPROTO_TCP;
+
+	return cnx;
+
+error:
+	fd_cnx_destroy(cnx);
+	return NULL;
+}
+
 /* Same function for SCTP, with a list of local endpoints to bind to */
 struct cnxctx * fd_cnx_serv_sctp(uint16_t port, struct fd_list * ep_list)
 {
@@ -239,7 +284,11 @@ struct cnxctx * fd_cnx_serv_accept(struct cnxctx * serv)
 	fd_cnx_s_setto(cli->cc_socket);
 
 	/* Generate the name for the connection object */
-	{
+	if (cli->cc_family == AF_UNIX) {
+		/* The remote unix sockets are not bound, the peer is known only from its CER */
+		snprintf(cli->cc_id, sizeof(cli->cc_id), CC_ID_HDR "Local (%d<-%d)", serv->cc_socket, cli->cc_socket);
+		snprintf(cli->cc_remid, sizeof(cli->cc_remid), "local");
+	} else {
 		char addrbuf[INET6_ADDRSTRLEN];
 		char portbuf[10];
 		int  rc;
@@ -330,6 +379,50 @@ struct cnxctx * fd_cnx_cli_connect_tcp(sSA * sa /* contains the port already */,
 	return cnx;
 }
 
+/* Same for a co-located peer, through its unix socket */
+struct cnxctx * fd_cnx_cli_connect_local(char * path)
+{
+	int sock = 0;
+	struct cnxctx * cnx = NULL;
+	struct sockaddr_un sun;
+
+	TRACE_ENTRY("%p", path);
+	CHECK_PARAMS_DO( path && (strlen(path) < sizeof(sun.sun_path)), return NULL );
+
+	LOG_D("Connecting to local socket %s...", path);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	/* Create the socket and connect */
+	{
+		int ret = fd_tcp_client( &sock, (sSA *)&sun, sizeof(sun) );
+		if (ret != 0) {
+			LOG_N("Connection to local socket %s failed: %s", path, strerror(ret));
+			return NULL;
+		}
+	}
+
+	/* Once the socket is created successfully, prepare the remaining of the cnx */
+	CHECK_MALLOC_DO( cnx = fd_cnx_init(1), { shutdown(sock, SHUT_RDWR); close(sock); return NULL; } );
+
+	cnx->cc_socket = sock;
+	cnx->cc_family = AF_UNIX;
+	cnx->cc_proto  = IPPROTO_TCP;
+
+	/* Set the timeout */
+	fd_cnx_s_setto(cnx->cc_socket);
+
+	/* Generate the names for the object */
+	snprintf(cnx->cc_id, sizeof(cnx->cc_id), CC_ID_HDR "Local,#%d->%s", cnx->cc_socket, path);
+	snprintf(cnx->cc_remid, sizeof(cnx->cc_remid), "%s", path);
+
+	LOG_A("Connection to local socket %s succeed (socket:%d).", path, sock);
+
+	return cnx;
+}
+
 /* Same for SCTP, accepts a list of remote addresses to connect to (see sctp_connectx for how they are used).
  * If src_list is not NULL and not empty, list of local addresses to connect from via sctp_bindx(). */
 struct cnxctx * fd_cnx_cli_connect_sctp(int no_ip6, uint16_t port, struct fd_list * list, struct fd_list * src_list)
@@ -432,6 +525,13 @@ int fd_cnx_getproto(struct cnxctx * conn)
 	return conn->cc_proto;
 }
 
+/* Return true if the connection is with a co-located peer, through a unix socket */
+int fd_cnx_islocal(struct cnxctx * conn)
+{
+	CHECK_PARAMS_DO( conn, return 0 );
+	return conn->cc_family == AF_UNIX;
+}
+
 /* Set the hostname to check during handshake */
 void fd_cnx_sethostname(struct cnxctx * conn, DiamId_t hn)
 {
@@ -532,6 +632,10 @@ int fd_cnx_getremoteeps(struct cnxctx * conn, struct fd_list * eps)
 
 	/* Delete any previous endpoint information discovered from link only */
 	CHECK_FCT_DO( fd_ep_filter( eps, EP_FL_CONF | EP_FL_DISC | EP_FL_ADV ), /* ignore the error */);
+	
+	/* A unix socket has no address to reconnect to, the configuration gives the path */
+	if (conn->cc_family == AF_UNIX)
+		return 0;
 
 	/* Retrieve the peer endpoint(s) of the connection */
 	switch (conn->cc_proto) {
@@ -572,7 +676,7 @@ int fd_cnx_proto_info(struct cnxctx * conn, char * buf, size_t len)
 	CHECK_PARAMS( conn );
 
 	if (fd_cnx_teststate(conn, CC_STATUS_TLS)) {
-		snprintf(buf, len, "%s,%s,soc#%d", IPPROTO_NAME(conn->cc_proto), fd_cnx_may_dtls(conn) ? "DTLS" : "TLS", conn->cc_socket);
+		snprintf(buf, len, "%s,%s,soc#%d", IPPROTO_NAME(conn->cc_proto), fd_cnx_may_dtls(conn) ? "DTLS" : ((conn->cc_ktls & FD_KTLS_TX) ? "kTLS" : "TLS"), conn->cc_socket);
 	} else {
 		snprintf(buf, len, "%s,soc#%d", IPPROTO_NAME(conn->cc_proto), conn->cc_socket);
 	}
@@ -754,18 +858,20 @@ static uint8_t * fd_cnx_alloc_msg_buffer(size_t expected_len, struct fd_msg_pmdl
 {
 	uint8_t * ret = NULL;
 
-	CHECK_MALLOC_DO(  ret = malloc( fd_msg_pmdl_sizewithoverhead(expected_len) ), return NULL );
-	CHECK_FCT_DO( fd_cnx_init_msg_buffer(ret, expected_len, pmdl), {free(ret); return NULL;} );
+	CHECK_MALLOC_DO(  ret = fd_rcvbuf_alloc( fd_msg_pmdl_sizewithoverhead(expected_len) ), return NULL );
+	CHECK_FCT_DO( fd_cnx_init_msg_buffer(ret, expected_len, pmdl), {fd_rcvbuf_free(ret); return NULL;} );
 	return ret;
 }
 
 #ifndef DISABLE_SCTP /* WE use this function only in SCTP code */
+/* The buffer received from the SCTP layer is malloc'd, move the data into a buffer from the pool */
 static uint8_t * fd_cnx_realloc_msg_buffer(uint8_t * buffer, size_t expected_len, struct fd_msg_pmdl ** pmdl)
 {
 	uint8_t * ret = NULL;
 
-	CHECK_MALLOC_DO(  ret = realloc( buffer, fd_msg_pmdl_sizewithoverhead(expected_len) ), return NULL );
-	CHECK_FCT_DO( fd_cnx_init_msg_buffer(ret, expected_len, pmdl), {free(ret); return NULL;} );
+	CHECK_MALLOC_DO(  ret = fd_cnx_alloc_msg_buffer( expected_len, pmdl ), return NULL );
+	memcpy(ret, buffer, expected_len);
+	free(buffer);
 	return ret;
 }
 #endif /* DISABLE_SCTP */
@@ -775,94 +881,261 @@ static void free_rcvdata(void * arg)
 	struct fd_cnx_rcvdata * data = arg;
 	struct fd_msg_pmdl * pmdl = fd_msg_pmdl_get_inbuf(data->buffer, data->length);
 	(void) pthread_mutex_destroy(&pmdl->lock);
-	free(data->buffer);
+	fd_rcvbuf_free(data->buffer);
 }
 
-/* Receiver thread (TCP & noTLS) : incoming message is directly saved into the target queue */
-static void * rcvthr_notls_tcp(void * arg)
+/* Pass a received message to the daemon. Returns 0 or an error code if the daemon must stop.
+ * If st->nowait and the target queue is full, the message is saved in st and EWOULDBLOCK is returned. */
+static int fd_cnx_deliver(struct cnxctx * conn, struct fd_cnx_rcvdata * rcv_data, struct fd_msg_pmdl * pmdl, struct fd_cnx_rcvstate * st)
 {
-	struct cnxctx * conn = arg;
-
-	TRACE_ENTRY("%p", arg);
-	CHECK_PARAMS_DO(conn && (conn->cc_socket > 0), goto out);
-
-	/* Set the thread name */
-	{
-		char buf[48];
-		snprintf(buf, sizeof(buf), "Receiver (%d) TCP/noTLS)", conn->cc_socket);
-		fd_log_threadname ( buf );
+	int ret, prio = MSG_PRIO_NORMAL;
+	uint8_t * hdr = rcv_data->buffer;
+
+	fd_hook_call(HOOK_DATA_RECEIVED, NULL, NULL, rcv_data, pmdl);
+
+	/* A DWR or DWA overtakes the messages of this peer still waiting for the PSM, so that a
+	 backlog of application traffic does not make the watchdog fail. The other messages keep
+	 their order (a DPR must not overtake the requests received before it). */
+	if ((rcv_data->length >= 20)
+	 && (hdr[5] == 0) && (hdr[6] == (CC_DEVICE_WATCHDOG >> 8)) && (hdr[7] == (CC_DEVICE_WATCHDOG & 0xff))
+	 && !(hdr[8] | hdr[9] | hdr[10] | hdr[11]))
+		prio = MSG_PRIO_CONTROL;
+
+	if (st->nowait) {
+		ret = fd_event_trysend_prio( fd_cnx_target_queue(conn), prio, FDEVP_CNX_MSG_RECV, rcv_data->length, rcv_data->buffer);
+		if (ret == EWOULDBLOCK) {
+			st->pend = *rcv_data;
+			st->pendprio = prio;
+			return ret;
+		}
+		CHECK_FCT_DO( ret, { free_rcvdata(rcv_data); return ret; } );
+		return 0;
 	}
 
-	ASSERT( conn->cc_proto == IPPROTO_TCP );
-	ASSERT( ! fd_cnx_teststate(conn, CC_STATUS_TLS ) );
-	ASSERT( fd_cnx_target_queue(conn) );
+	CHECK_FCT_DO( ret = fd_event_send_prio( fd_cnx_target_queue(conn), prio, FDEVP_CNX_MSG_RECV, rcv_data->length, rcv_data->buffer),
+		{
+			free_rcvdata(rcv_data);
+			return ret;
+		} );
+	return 0;
+}
 
-	/* Receive from a TCP connection: we have to rebuild the message boundaries */
-	do {
-		uint8_t header[4];
-		struct fd_cnx_rcvdata rcv_data;
-		struct fd_msg_pmdl *pmdl=NULL;
-		ssize_t ret = 0;
-		size_t	received = 0;
+/* Receive data from a stream and re-build the Diameter messages boundaries.
+ *
+ * The data is read by large chunks (RCV_BUFFER_SIZE) into the buffer of the reception state, and the messages are
+ * split directly in this buffer; so when the peer sends many small messages, one system call (or TLS record) yields
+ * several of them. Each message is then copied into its own buffer of the exact size, since the buffer is handed over
+ * to the message parser.
+ *
+ * Each call delivers the complete messages already received, then calls recv_fct once.
+ * If loop is 0, the reception stops after the first message and no byte past this message is ever read
+ * (the following data may be a TLS handshake, for example).
+ *
+ * Returns:
+ *  0		: some data was received, call again.
+ *  EAGAIN	: recv_fct returned RCV_AGAIN (non-blocking functions only).
+ *  ENOBUFS	: st->nowait is set and the target queue is full. The message is kept in st, call again later.
+ *  ENOTCONN	: the connection was closed or failed (the event was already sent), or the first message was delivered and loop is 0.
+ *  other	: an unrecoverable error occurred, the daemon is being stopped.
+ */
+static int fd_cnx_rcv_step(struct cnxctx * conn, struct fd_cnx_rcvstate * st, stream_recv_fct recv_fct, void * session, int loop)
+{
+	struct fd_cnx_rcvdata rcv_data;
+	struct fd_msg_pmdl *pmdl=NULL;
+	ssize_t ret;
+	size_t avail, want;
+	int err;
+
+	if (st->pend.buffer) {
+		/* Try again to deliver the message that did not fit in the target queue */
+		err = fd_event_trysend_prio( fd_cnx_target_queue(conn), st->pendprio, FDEVP_CNX_MSG_RECV, st->pend.length, st->pend.buffer);
+		if (err == EWOULDBLOCK)
+			return ENOBUFS;
+		CHECK_FCT_DO( err, { free_rcvdata(&st->pend); st->pend.buffer = NULL; goto fatal; } );
+		st->pend.buffer = NULL;
+	}
 
-		do {
-			ret = fd_cnx_s_recv(conn, &header[received], sizeof(header) - received);
-			if (ret <= 0) {
-				goto out; /* Stop the thread, the event was already sent */
-			}
+	/* Deliver the complete messages that are already in the buffer */
+	rcv_data.length = 0;
+	while ((avail = st->end - st->start) > 0) {
+		uint8_t * header = st->rbuf + st->start;
 
-			received += ret;
+		if (header[0] != DIAMETER_VERSION) {	/* defined in <libfdproto.h> */
+			/* The message is suspect, no need to wait for 4 bytes in this case */
+			LOG_E( "Received suspect header [ver: %d] from '%s', assuming disconnection", (int)header[0], conn->cc_remid);
+			goto suspect;
+		}
 
-			if (header[0] != DIAMETER_VERSION)
-				break; /* No need to wait for 4 bytes in this case */
-		} while (received < sizeof(header));
+		if (avail < 4)
+			break;
 
 		rcv_data.length = ((size_t)header[1] << 16) + ((size_t)header[2] << 8) + (size_t)header[3];
 
 		/* Check the received word is a valid beginning of a Diameter message */
-		if ((header[0] != DIAMETER_VERSION)	/* defined in <libfdproto.h> */
+		if ((rcv_data.length < 4)
 		   || (rcv_data.length > DIAMETER_MSG_SIZE_MAX)) { /* to avoid too big mallocs */
 			/* The message is suspect */
 			LOG_E( "Received suspect header [ver: %d, size: %zd] from '%s', assuming disconnection", (int)header[0], rcv_data.length, conn->cc_remid);
-			fd_cnx_markerror(conn);
-			goto out; /* Stop the thread, the recipient of the event will cleanup */
+			goto suspect;
 		}
 
-		/* Ok, now we can really receive the data */
-		CHECK_MALLOC_DO(  rcv_data.buffer = fd_cnx_alloc_msg_buffer( rcv_data.length, &pmdl ), goto fatal );
-		memcpy(rcv_data.buffer, header, sizeof(header));
+		if (avail < rcv_data.length)
+			break;
 
-		while (received < rcv_data.length) {
-			pthread_cleanup_push(free_rcvdata, &rcv_data); /* In case we are canceled, clean the partially built buffer */
-			ret = fd_cnx_s_recv(conn, rcv_data.buffer + received, rcv_data.length - received);
-			pthread_cleanup_pop(0);
+		/* The complete message is in the buffer */
+		CHECK_MALLOC_DO(  rcv_data.buffer = fd_cnx_alloc_msg_buffer( rcv_data.length, &pmdl ), { err = ENOMEM; goto fatal; } );
+		memcpy(rcv_data.buffer, header, rcv_data.length);
+		st->start += rcv_data.length;
 
-			if (ret <= 0) {
-				free_rcvdata(&rcv_data);
-				goto out;
-			}
-			received += ret;
-		}
+		err = fd_cnx_deliver(conn, &rcv_data, pmdl, st);
+		if (err == EWOULDBLOCK)
+			return ENOBUFS;
+		CHECK_FCT_DO( err, goto fatal );
+		if (!loop)
+			return ENOTCONN;
+	}
 
-		fd_hook_call(HOOK_DATA_RECEIVED, NULL, NULL, &rcv_data, pmdl);
+	/* Move the beginning of the next message to the front of the buffer */
+	if (st->start) {
+		avail = st->end - st->start;
+		memmove(st->rbuf, st->rbuf + st->start, avail);
+		st->start = 0;
+		st->end = avail;
+	}
 
-		/* We have received a complete message, pass it to the daemon */
-		CHECK_FCT_DO( fd_event_send( fd_cnx_target_queue(conn), FDEVP_CNX_MSG_RECV, rcv_data.length, rcv_data.buffer),
-			{
-				free_rcvdata(&rcv_data);
-				goto fatal;
-			} );
+	if (!st->rbuf) {
+		CHECK_MALLOC_DO( st->rbuf = fd_rcvbuf_alloc(RCV_BUFFER_SIZE), { err = ENOMEM; goto fatal; } );
+	}
 
-	} while (conn->cc_loop);
+	/* Receive more data */
+	want = RCV_BUFFER_SIZE - st->end;
+	if (!loop) {
+		/* Do not read past the end of the message */
+		if (st->end < 4)
+			want = 4 - st->end;
+		else
+			want = rcv_data.length - st->end;
+	}
 
-out:
-	TRACE_DEBUG(FULL, "Thread terminated");
-	return NULL;
+	ret = (*recv_fct)(conn, session, st->rbuf + st->end, want);
+	if (ret == RCV_AGAIN)
+		return EAGAIN;
+	if (ret <= 0)
+		goto closed;
+	st->end += ret;
+	return 0;
+
+closed:
+	st->eof = (ret == 0);
+	return ENOTCONN; /* The event was already sent */
+
+suspect:
+	fd_cnx_markerror(conn);
+	return ENOTCONN; /* The recipient of the event will cleanup */
 
 fatal:
 	/* An unrecoverable error occurred, stop the daemon */
 	CHECK_FCT_DO(fd_core_shutdown(), );
-	goto out;
+	return err;
+}
+
+/* Release the resources of a reception state */
+void fd_cnx_rcvstate_free(struct fd_cnx_rcvstate * st)
+{
+	if (st->pend.buffer) {
+		free_rcvdata(&st->pend);
+		st->pend.buffer = NULL;
+	}
+	fd_rcvbuf_free(st->rbuf);
+	st->rbuf = NULL;
+	st->start = st->end = 0;
+}
+
+/* Receive from a stream until the connection is closed (or after the first message if loop is 0), in a receiver thread.
+ * Returns 0 when the connection was closed by the peer, ENOTCONN on other connection errors or after the first message,
+ * or another error code in case of unrecoverable error. */
+static int fd_cnx_rcv_stream(struct cnxctx * conn, stream_recv_fct recv_fct, void * session, int loop)
+{
+	struct fd_cnx_rcvstate st;
+	int ret;
+
+	memset(&st, 0, sizeof(st));
+	pthread_cleanup_push((void *)fd_cnx_rcvstate_free, &st); /* In case we are canceled */
+
+	do {
+		ret = fd_cnx_rcv_step(conn, &st, recv_fct, session, loop);
+	} while (ret == 0);
+
+	if ((ret == ENOTCONN) && st.eof)
+		ret = 0;
+
+	pthread_cleanup_pop(1);
+	return ret;
+}
+
+/* Adapter for fd_cnx_rcv_stream on a clear TCP connection */
+static ssize_t fd_cnx_s_recv_stream(struct cnxctx * conn, void * session, void * buffer, size_t length)
+{
+	return fd_cnx_s_recv(conn, buffer, length);
+}
+
+/* Non-blocking version of fd_cnx_s_recv_stream, used by the I/O engine. Returns RCV_AGAIN if no data is available */
+static ssize_t fd_cnx_s_recv_stream_nb(struct cnxctx * conn, void * session, void * buffer, size_t length)
+{
+	ssize_t ret;
+again:
+	ret = recv(conn->cc_socket, buffer, length, MSG_DONTWAIT);
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto again;
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return RCV_AGAIN;
+	}
+
+	/* Mark the error */
+	if (ret <= 0) {
+		CHECK_SYS_DO(ret, /* continue, this is only used to log the error here */);
+		fd_cnx_markerror(conn);
+	}
+
+	return ret;
+}
+
+/* The pull function for gnutls on a connection handled by the I/O engine */
+static ssize_t fd_cnx_s_pull_nb(gnutls_transport_ptr_t ptr, void *buffer, size_t length)
+{
+	struct cnxctx * conn = ptr;
+	ssize_t ret = recv(conn->cc_socket, buffer, length, MSG_DONTWAIT);
+	if (ret < 0)
+		gnutls_transport_set_errno(conn->cc_tls_para.session, (errno == EWOULDBLOCK) ? EAGAIN : errno);
+	return ret;
+}
+
+/* Receiver thread (TCP & noTLS) : incoming message is directly saved into the target queue */
+static void * rcvthr_notls_tcp(void * arg)
+{
+	struct cnxctx * conn = arg;
+
+	TRACE_ENTRY("%p", arg);
+	CHECK_PARAMS_DO(conn && (conn->cc_socket > 0), goto out);
+
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "Receiver (%d) TCP/noTLS)", conn->cc_socket);
+		fd_log_threadname ( buf );
+	}
+
+	ASSERT( conn->cc_proto == IPPROTO_TCP );
+	ASSERT( ! fd_cnx_teststate(conn, CC_STATUS_TLS ) );
+	ASSERT( fd_cnx_target_queue(conn) );
+
+	/* Receive from a TCP connection: we have to rebuild the message boundaries */
+	(void) fd_cnx_rcv_stream(conn, fd_cnx_s_recv_stream, NULL, conn->cc_loop);
+
+out:
+	TRACE_DEBUG(FULL, "Thread terminated");
+	return NULL;
 }
 
 #ifndef DISABLE_SCTP
@@ -919,6 +1192,16 @@ fatal:
 }
 #endif /* DISABLE_SCTP */
 
+/* Hand the reception on a TCP connection over to the configured I/O engine */
+static int fd_cnx_engine_add(struct cnxctx * conn)
+{
+	if ((fd_g_config->cnf_io_engine == FD_IO_URING) && (fd_uring_add(conn) == 0))
+		return 0;
+
+	/* Otherwise (or if io_uring cannot be used on this system) use epoll */
+	return fd_ioloop_add(conn);
+}
+
 /* Start receiving messages in clear (no TLS) on the connection */
 int fd_cnx_start_clear(struct cnxctx * conn, int loop)
 {
@@ -934,6 +1217,11 @@ int fd_cnx_start_clear(struct cnxctx * conn, int loop)
 
 	switch (conn->cc_proto) {
 		case IPPROTO_TCP:
+			if (loop && (fd_g_config->cnf_io_engine != FD_IO_THREADS)) {
+				/* Let the I/O engine receive the messages */
+				CHECK_FCT( fd_cnx_engine_add(conn) );
+				break;
+			}
 			/* Start the tcp_notls thread */
 			CHECK_POSIX( pthread_create( &conn->cc_rcvthr, NULL, rcvthr_notls_tcp, conn ) );
 			break;
@@ -960,7 +1248,8 @@ static ssize_t fd_tls_recv_handle_error(struct cnxctx * conn, gnutls_session_t s
 {
 	ssize_t ret;
 again:
-	CHECK_GNUTLS_DO( ret = gnutls_record_recv(session, data, sz),
+	/* GNUTLS_E_AGAIN is also returned after a post-handshake message without data, such as a TLS 1.3 session ticket: not worth an error */
+	CHECK_GNUTLS_GEN( ((ret == GNUTLS_E_AGAIN) || (ret == GNUTLS_E_INTERRUPTED)) ? FD_LOG_DEBUG : FD_LOG_ERROR, ret = gnutls_record_recv(session, data, sz),
 		{
 			switch (ret) {
 				case GNUTLS_E_REHANDSHAKE:
@@ -995,8 +1284,13 @@ again:
 			}
 		} );
 
-	if (ret == 0)
-		CHECK_GNUTLS_DO( gnutls_bye(session, GNUTLS_SHUT_RDWR),  );
+	if (ret == 0) {
+		if (conn->cc_ktls & FD_KTLS_TX) {
+			CHECK_FCT_DO( fd_ktls_bye(conn), );
+		} else {
+			CHECK_GNUTLS_DO( gnutls_bye(session, GNUTLS_SHUT_RDWR),  );
+		}
+	}
 
 end:
 	if (ret <= 0)
@@ -1052,74 +1346,157 @@ end:
 }
 
 
-/* The function that receives TLS data and re-builds a Diameter message -- it exits only on error or cancellation */
-/* 	   For the case of DTLS, since we are not using SCTP_UNORDERED, the messages over a single stream are ordered.
-	   Furthermore, as long as messages are shorter than the MTU [2^14 = 16384 bytes], they are delivered in a single
-	   record, as far as I understand.
-	   For larger messages, however, it is possible that pieces of messages coming from different streams can get interleaved.
-	   As a result, we do not use the following function for DTLS reception, because we use the sequence number to rebuild the
-	   messages. */
-int fd_tls_rcvthr_core(struct cnxctx * conn, gnutls_session_t session)
+/* Adapter for fd_cnx_rcv_stream on a TLS session */
+static ssize_t fd_tls_recv_stream(struct cnxctx * conn, void * session, void * buffer, size_t length)
 {
-	ssize_t ret = 0;
-	/* No guarantee that GnuTLS preserves the message boundaries, so we re-build it as in TCP. */
-	do {
-		uint8_t header[4];
-		struct fd_cnx_rcvdata rcv_data;
-		struct fd_msg_pmdl *pmdl=NULL;
-		size_t	received = 0;
-		ret = 0;
+	return fd_tls_recv_handle_error(conn, (gnutls_session_t)session, buffer, length);
+}
 
-		do {
-			ret = fd_tls_recv_handle_error(conn, session, &header[received], sizeof(header) - received);
-			if (ret <= 0) {
-				/* The connection is closed */
-				goto out;
+/* Non-blocking version of fd_tls_recv_stream, used by the I/O engine. */
+static ssize_t fd_tls_recv_stream_nb(struct cnxctx * conn, void * session, void * buffer, size_t length)
+{
+	ssize_t ret;
+again:
+	ret = gnutls_record_recv((gnutls_session_t)session, buffer, length);
+	if (ret > 0)
+		return ret;
+
+	switch (ret) {
+		case 0:
+			/* The peer closed the session */
+			if (conn->cc_ktls & FD_KTLS_TX) {
+				CHECK_FCT_DO( fd_ktls_bye(conn), );
+			} else {
+				CHECK_GNUTLS_DO( gnutls_bye((gnutls_session_t)session, GNUTLS_SHUT_WR),  );
 			}
-			received += ret;
-		} while (received < sizeof(header));
+			break;
 
-		rcv_data.length = ((size_t)header[1] << 16) + ((size_t)header[2] << 8) + (size_t)header[3];
+		case GNUTLS_E_AGAIN:
+		case GNUTLS_E_INTERRUPTED:
+			return RCV_AGAIN;
 
-		/* Check the received word is a valid beginning of a Diameter message */
-		if ((header[0] != DIAMETER_VERSION)	/* defined in <libfreeDiameter.h> */
-		   || (rcv_data.length > DIAMETER_MSG_SIZE_MAX)) { /* to avoid too big mallocs */
-			/* The message is suspect */
-			LOG_E( "Received suspect header [ver: %d, size: %zd] from '%s', assume disconnection", (int)header[0], rcv_data.length, conn->cc_remid);
-			fd_cnx_markerror(conn);
-			goto out;
-		}
+		case GNUTLS_E_UNEXPECTED_PACKET_LENGTH:
+			/* The connection is closed */
+			TRACE_DEBUG(FULL, "Got 0 size while reading the socket, probably connection closed...");
+			break;
 
-		/* Ok, now we can really receive the data */
-		CHECK_MALLOC(  rcv_data.buffer = fd_cnx_alloc_msg_buffer( rcv_data.length, &pmdl ) );
-		memcpy(rcv_data.buffer, header, sizeof(header));
+		default:
+			if (gnutls_error_is_fatal (ret) == 0) {
+				/* This includes re-handshake requests, which we do not honor in this mode */
+				LOG_N("Ignoring non-fatal GNU TLS error: %s", gnutls_strerror (ret));
+				goto again;
+			}
+			LOG_E("Fatal GNUTLS error: %s", gnutls_strerror (ret));
+	}
 
-		while (received < rcv_data.length) {
-			pthread_cleanup_push(free_rcvdata, &rcv_data); /* In case we are canceled, clean the partially built buffer */
-			ret = fd_tls_recv_handle_error(conn, session, rcv_data.buffer + received, rcv_data.length - received);
-			pthread_cleanup_pop(0);
+	fd_cnx_markerror(conn);
+	return (ret == 0) ? 0 : -1;
+}
 
-			if (ret <= 0) {
-				free_rcvdata(&rcv_data);
-				goto out;
-			}
-			received += ret;
-		}
+/* Adapters for fd_cnx_rcv_stream on a TLS connection offloaded to the kernel */
+static ssize_t fd_ktls_recv_stream(struct cnxctx * conn, void * session, void * buffer, size_t length)
+{
+	return fd_ktls_recv(conn, buffer, length, 0);
+}
 
-		fd_hook_call(HOOK_DATA_RECEIVED, NULL, NULL, &rcv_data, pmdl);
+static ssize_t fd_ktls_recv_stream_nb(struct cnxctx * conn, void * session, void * buffer, size_t length)
+{
+	return fd_ktls_recv(conn, buffer, length, 1);
+}
 
-		/* We have received a complete message, pass it to the daemon */
-		CHECK_FCT_DO( ret = fd_event_send( fd_cnx_target_queue(conn), FDEVP_CNX_MSG_RECV, rcv_data.length, rcv_data.buffer),
-			{
-				free_rcvdata(&rcv_data);
-				CHECK_FCT_DO(fd_core_shutdown(), );
-				return ret;
-			} );
+/* Process the data available on a connection handled by the I/O engine, without blocking.
+ * Same return values as fd_cnx_rcv_step. When all the data was consumed, the buffer is given back to the pool, since
+ * there may be many idle connections. */
+int fd_cnx_rcv_nb(struct cnxctx * conn, struct fd_cnx_rcvstate * st)
+{
+	int ret;
 
-	} while (1);
+	if (conn->cc_ktls & FD_KTLS_RX)
+		ret = fd_cnx_rcv_step(conn, st, fd_ktls_recv_stream_nb, NULL, 1);
+	else if (fd_cnx_teststate(conn, CC_STATUS_TLS))
+		ret = fd_cnx_rcv_step(conn, st, fd_tls_recv_stream_nb, conn->cc_tls_para.session, 1);
+	else
+		ret = fd_cnx_rcv_step(conn, st, fd_cnx_s_recv_stream_nb, NULL, 1);
 
-out:
-	return (ret == 0) ? 0 : ENOTCONN;
+	if ((ret == EAGAIN) && (st->start == st->end) && st->rbuf) {
+		fd_rcvbuf_free(st->rbuf);
+		st->rbuf = NULL;
+		st->start = st->end = 0;
+	}
+	return ret;
+}
+
+/* Data already read from the socket by the I/O engine (io_uring), consumed by fd_cnx_rcv_chunk */
+struct rcv_chunk {
+	uint8_t *	data;
+	size_t		len;
+	int		eof;	/* the connection was closed by the peer after this data */
+	int		err;	/* or the reception failed with this error */
+};
+
+static ssize_t fd_cnx_chunk_recv_stream(struct cnxctx * conn, void * session, void * buffer, size_t length)
+{
+	struct rcv_chunk * c = session;
+
+	if (c->len) {
+		if (length > c->len)
+			length = c->len;
+		memcpy(buffer, c->data, length);
+		c->data += length;
+		c->len -= length;
+		return length;
+	}
+
+	if (c->eof) {
+		fd_cnx_markerror(conn);
+		return 0;
+	}
+
+	if (c->err) {
+		errno = c->err;
+		CHECK_SYS_DO(-1, /* continue, this is only used to log the error here */);
+		fd_cnx_markerror(conn);
+		return -1;
+	}
+
+	return RCV_AGAIN;
+}
+
+/* Process a chunk of clear data received by the I/O engine. res is the result of the read: the number of bytes in data,
+ * 0 if the connection was closed, or -errno. Same return values as fd_cnx_rcv_nb; EAGAIN means all the data was consumed. */
+int fd_cnx_rcv_chunk(struct cnxctx * conn, struct fd_cnx_rcvstate * st, uint8_t * data, ssize_t res)
+{
+	struct rcv_chunk c;
+	int ret;
+
+	c.data = data;
+	c.len  = (res > 0) ? res : 0;
+	c.eof  = (res == 0);
+	c.err  = (res < 0) ? -res : 0;
+
+	do {
+		ret = fd_cnx_rcv_step(conn, st, fd_cnx_chunk_recv_stream, &c, 1);
+	} while (ret == 0);
+
+	if ((ret == EAGAIN) && (st->start == st->end) && st->rbuf) {
+		fd_rcvbuf_free(st->rbuf);
+		st->rbuf = NULL;
+		st->start = st->end = 0;
+	}
+	return ret;
+}
+
+/* The function that receives TLS data and re-builds a Diameter message -- it exits only on error or cancellation */
+/* 	   For the case of DTLS, since we are not using SCTP_UNORDERED, the messages over a single stream are ordered.
+	   Furthermore, as long as messages are shorter than the MTU [2^14 = 16384 bytes], they are delivered in a single
+	   record, as far as I understand.
+	   For larger messages, however, it is possible that pieces of messages coming from different streams can get interleaved.
+	   As a result, we do not use the following function for DTLS reception, because we use the sequence number to rebuild the
+	   messages. */
+int fd_tls_rcvthr_core(struct cnxctx * conn, gnutls_session_t session)
+{
+	/* No guarantee that GnuTLS preserves the message boundaries, so we re-build it as in TCP. */
+	return fd_cnx_rcv_stream(conn, fd_tls_recv_stream, session, 1);
 }
 
 /* Receiver thread (TLS & 1 stream SCTP or TCP)  */
@@ -1141,7 +1518,11 @@ static void * rcvthr_tls_single(void * arg)
 	ASSERT( fd_cnx_target_queue(conn) );
 
 	/* The next function only returns when there is an error on the socket */
-	CHECK_FCT_DO(fd_tls_rcvthr_core(conn, conn->cc_tls_para.session), /* continue */);
+	if (conn->cc_ktls & FD_KTLS_RX) {
+		CHECK_FCT_DO(fd_cnx_rcv_stream(conn, fd_ktls_recv_stream, NULL, 1), /* continue */);
+	} else {
+		CHECK_FCT_DO(fd_tls_rcvthr_core(conn, conn->cc_tls_para.session), /* continue */);
+	}
 
 	TRACE_DEBUG(FULL, "Thread terminated");
 	return NULL;
@@ -1179,6 +1560,141 @@ int fd_tls_prepare(gnutls_session_t * session, int mode, int dtls, char * priori
 }
 
 
+/* TLS session resumption. The server side issues tickets protected by fd_g_config->cnf_sec_data.ticket_key,
+ the client side keeps the last session data received from each peer, by Diameter Identity. */
+struct tls_resume {
+	struct fd_list	chain;	/* link in tls_resume_list, ordered by id */
+	DiamId_t	id;	/* the remote identity (connection cc_tls_para.cn) */
+	gnutls_datum_t	data;	/* the session data, from gnutls_session_get_data2 */
+};
+static struct fd_list	tls_resume_list = FD_LIST_INITIALIZER(tls_resume_list);
+static pthread_mutex_t	tls_resume_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Successful handshakes, for fd_stat_tls_handshakes */
+static long long tls_hs_full = 0;
+static long long tls_hs_resumed = 0;
+
+/* Search the entry of a peer, or the entry before which it would be inserted. Called with the lock held */
+static struct fd_list * tls_resume_search(DiamId_t id, int * found)
+{
+	struct fd_list * li;
+	
+	*found = 0;
+	for (li = tls_resume_list.next; li != &tls_resume_list; li = li->next) {
+		int cmp = strcasecmp(id, ((struct tls_resume *)li)->id);
+		if (cmp > 0)
+			continue;
+		*found = (cmp == 0);
+		break;
+	}
+	return li;
+}
+
+/* Save the session data of a client connection, to resume it next time */
+static void tls_resume_save(struct cnxctx * conn)
+{
+	gnutls_datum_t data = { NULL, 0 };
+	struct fd_list * li;
+	struct tls_resume * tr;
+	int found;
+	
+	if (!conn->cc_tls_para.cn)
+		return;
+	
+	/* The session may not be resumable (e.g. the server did not send a ticket) */
+	if (gnutls_session_get_data2(conn->cc_tls_para.session, &data) < 0)
+		return;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&tls_resume_lock), { gnutls_free(data.data); return; } );
+	li = tls_resume_search(conn->cc_tls_para.cn, &found);
+	if (found) {
+		tr = (struct tls_resume *)li;
+		gnutls_free(tr->data.data);
+		tr->data = data;
+	} else {
+		CHECK_MALLOC_DO( tr = malloc(sizeof(struct tls_resume)), goto error );
+		memset(tr, 0, sizeof(struct tls_resume));
+		fd_list_init(&tr->chain, tr);
+		CHECK_MALLOC_DO( tr->id = strdup(conn->cc_tls_para.cn), { free(tr); goto error; } );
+		tr->data = data;
+		fd_list_insert_before(li, &tr->chain);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&tls_resume_lock), /* continue */ );
+	return;
+error:
+	gnutls_free(data.data);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&tls_resume_lock), /* continue */ );
+}
+
+/* Load the saved session of the peer in a client session before the handshake, if any */
+static void tls_resume_load(struct cnxctx * conn)
+{
+	struct fd_list * li;
+	int found;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&tls_resume_lock), return );
+	li = tls_resume_search(conn->cc_tls_para.cn, &found);
+	if (found) {
+		struct tls_resume * tr = (struct tls_resume *)li;
+		/* On failure (e.g. expired data), a full handshake is done */
+		CHECK_GNUTLS_DO( gnutls_session_set_data(conn->cc_tls_para.session, tr->data.data, tr->data.size), /* continue */ );
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&tls_resume_lock), /* continue */ );
+}
+
+/* Forget the saved session of a peer */
+static void tls_resume_drop(DiamId_t id)
+{
+	struct fd_list * li;
+	int found;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&tls_resume_lock), return );
+	li = tls_resume_search(id, &found);
+	if (found) {
+		struct tls_resume * tr = (struct tls_resume *)li;
+		fd_list_unlink(&tr->chain);
+		gnutls_free(tr->data.data);
+		free(tr->id);
+		free(tr);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&tls_resume_lock), /* continue */ );
+}
+
+/* With TLS 1.3, the server sends the tickets after the handshake; we save the session when one is received */
+static int tls_resume_ticket_hook(gnutls_session_t session, unsigned int htype, unsigned when, unsigned int incoming, const gnutls_datum_t *msg)
+{
+	struct cnxctx * conn = gnutls_session_get_ptr(session);
+	
+	if (conn && incoming && (gnutls_protocol_get_version(session) == GNUTLS_TLS1_3))
+		tls_resume_save(conn);
+	
+	return 0;
+}
+
+/* Free the saved sessions, at exit */
+void fd_tls_resume_fini(void)
+{
+	CHECK_POSIX_DO( pthread_mutex_lock(&tls_resume_lock), /* continue */ );
+	while (!FD_IS_LIST_EMPTY(&tls_resume_list)) {
+		struct tls_resume * tr = (struct tls_resume *)tls_resume_list.next;
+		fd_list_unlink(&tr->chain);
+		gnutls_free(tr->data.data);
+		free(tr->id);
+		free(tr);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&tls_resume_lock), /* continue */ );
+}
+
+int fd_stat_tls_handshakes(long long * full, long long * resumed)
+{
+	if (full)
+		*full = __atomic_load_n(&tls_hs_full, __ATOMIC_RELAXED);
+	if (resumed)
+		*resumed = __atomic_load_n(&tls_hs_resumed, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
 /* Verify remote credentials DURING handshake (return gnutls status) */
 int fd_tls_verify_credentials_2(gnutls_session_t session)
 {
@@ -1420,14 +1936,9 @@ static int fd_cnx_uses_dtls(struct cnxctx * conn) {
 }
 #endif /* DISABLE_SCTP */
 
-/* TLS handshake a connection; no need to have called start_clear before. Reception is active if handshake is successful */
-int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority, void * alt_creds)
+/* Prepare the TLS session of a connection for the handshake */
+static int fd_cnx_handshake_prepare(struct cnxctx * conn, int mode, int algo, char * priority, void * alt_creds, int * dtls)
 {
-	int dtls = 0;
-
-	TRACE_ENTRY( "%p %d %d %p %p", conn, mode, algo, priority, alt_creds);
-	CHECK_PARAMS( conn && (!fd_cnx_teststate(conn, CC_STATUS_TLS)) && ( (mode == GNUTLS_CLIENT) || (mode == GNUTLS_SERVER) ) && (!conn->cc_loop) );
-
 	/* Save the mode */
 	conn->cc_tls_para.mode = mode;
 	conn->cc_tls_para.algo = algo;
@@ -1438,13 +1949,13 @@ int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority,
 	/* Once TLS handshake is done, we don't stop after the first message */
 	conn->cc_loop = 1;
 
-	dtls = fd_cnx_may_dtls(conn);
+	*dtls = fd_cnx_may_dtls(conn);
 
 	/* Prepare the master session credentials and priority */
-	CHECK_FCT( fd_tls_prepare(&conn->cc_tls_para.session, mode, dtls, priority, alt_creds) );
+	CHECK_FCT( fd_tls_prepare(&conn->cc_tls_para.session, mode, *dtls, priority, alt_creds) );
 
 	/* Special case: multi-stream TLS is not natively managed in GNU TLS, we use a wrapper library */
-	if ((!dtls) && (conn->cc_sctp_para.pairs > 1)) {
+	if ((!*dtls) && (conn->cc_sctp_para.pairs > 1)) {
 #ifdef DISABLE_SCTP
 		ASSERT(0);
 		CHECK_FCT( ENOTSUP );
@@ -1457,7 +1968,7 @@ int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority,
 		GNUTLS_TRACE( gnutls_transport_set_ptr( conn->cc_tls_para.session, (gnutls_transport_ptr_t) conn ) );
 
 		/* Set the push and pull callbacks */
-		if (!dtls) {
+		if (!*dtls) {
 			GNUTLS_TRACE( gnutls_transport_set_pull_timeout_function( conn->cc_tls_para.session, (void *)fd_cnx_s_select ) );
 			GNUTLS_TRACE( gnutls_transport_set_pull_function(conn->cc_tls_para.session, (void *)fd_cnx_s_recv) );
 			GNUTLS_TRACE( gnutls_transport_set_vec_push_function(conn->cc_tls_para.session, (void *)fd_cnx_s_sendv) );
@@ -1465,6 +1976,16 @@ int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority,
 			TODO("DTLS push/pull functions");
 			return ENOTSUP;
 		}
+		
+		/* Let the clients resume their sessions with us, or resume our previous session with this peer */
+		if (!fd_g_config->cnf_flags.no_resume) {
+			if ((mode == GNUTLS_SERVER) && fd_g_config->cnf_sec_data.ticket_key.data) {
+				CHECK_GNUTLS_DO( gnutls_session_ticket_enable_server(conn->cc_tls_para.session, &fd_g_config->cnf_sec_data.ticket_key), /* continue without tickets */ );
+			} else if ((mode == GNUTLS_CLIENT) && conn->cc_tls_para.cn) {
+				tls_resume_load(conn);
+				gnutls_handshake_set_hook_function(conn->cc_tls_para.session, GNUTLS_HANDSHAKE_NEW_SESSION_TICKET, GNUTLS_HOOK_POST, tls_resume_ticket_hook);
+			}
+		}
 	}
 
 	/* additional initialization for gnutls 3.x */
@@ -1484,6 +2005,74 @@ int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority,
 	/* Mark the connection as protected from here, so that the gnutls credentials will be freed */
 	fd_cnx_addstate(conn, CC_STATUS_TLS);
 
+	return 0;
+}
+
+/* Checks and bookkeeping once the handshake of the master session succeeded */
+static int fd_cnx_handshake_done(struct cnxctx * conn, int dtls)
+{
+	int ret;
+
+	/* The certificates are not exchanged when a session is resumed, so the verify function was not called: check the saved ones */
+	if (gnutls_session_is_resumed(conn->cc_tls_para.session)) {
+		ret = fd_tls_verify_credentials_2(conn->cc_tls_para.session);
+		if (ret) {
+			if (TRACE_BOOL(INFO)) {
+				fd_log_debug("TLS resumed session rejected on socket %d (%s) : %s", conn->cc_socket, conn->cc_id, gnutls_strerror(ret));
+			}
+			if ((conn->cc_tls_para.mode == GNUTLS_CLIENT) && conn->cc_tls_para.cn)
+				tls_resume_drop(conn->cc_tls_para.cn);
+			fd_cnx_markerror(conn);
+			return EINVAL;
+		}
+		__atomic_fetch_add(&tls_hs_resumed, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&tls_hs_full, 1, __ATOMIC_RELAXED);
+	}
+	
+	/* Before TLS 1.3, the ticket is part of the handshake: save the session now */
+	if ((conn->cc_tls_para.mode == GNUTLS_CLIENT) && (!fd_g_config->cnf_flags.no_resume) && (!dtls) && (conn->cc_sctp_para.pairs <= 1)
+			&& (gnutls_protocol_get_version(conn->cc_tls_para.session) != GNUTLS_TLS1_3)) {
+		tls_resume_save(conn);
+	}
+
+	return 0;
+}
+
+/* Start receiving the messages on a single-stream TLS connection, after the handshake */
+static int fd_cnx_tls_start_single(struct cnxctx * conn, int dtls)
+{
+	/* Let the kernel protect the records from now on, if possible. Otherwise gnutls keeps doing it. */
+	if ((!dtls) && (conn->cc_proto == IPPROTO_TCP) && fd_g_config->cnf_flags.ktls) {
+		(void) fd_ktls_enable(conn);
+	}
+
+	/* Start decrypting the data */
+	if ((!dtls) && (conn->cc_proto == IPPROTO_TCP) && (fd_g_config->cnf_io_engine != FD_IO_THREADS)) {
+		/* Let the I/O engine receive the messages; the reads must not block from now on */
+		GNUTLS_TRACE( gnutls_transport_set_pull_function(conn->cc_tls_para.session, fd_cnx_s_pull_nb) );
+		CHECK_FCT( fd_cnx_engine_add(conn) );
+	} else if (!dtls) {
+		CHECK_POSIX( pthread_create( &conn->cc_rcvthr, NULL, rcvthr_tls_single, conn ) );
+	} else {
+		TODO("Signal the dtls_push function that multiple streams can be used from this point.");
+		TODO("Create DTLS rcvthr (must reassembly based on seq numbers & stream id ?)");
+		return ENOTSUP;
+	}
+
+	return 0;
+}
+
+/* TLS handshake a connection; no need to have called start_clear before. Reception is active if handshake is successful */
+int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority, void * alt_creds)
+{
+	int dtls = 0;
+
+	TRACE_ENTRY( "%p %d %d %p %p", conn, mode, algo, priority, alt_creds);
+	CHECK_PARAMS( conn && (!fd_cnx_teststate(conn, CC_STATUS_TLS)) && ( (mode == GNUTLS_CLIENT) || (mode == GNUTLS_SERVER) ) && (!conn->cc_loop) );
+
+	CHECK_FCT( fd_cnx_handshake_prepare(conn, mode, algo, priority, alt_creds, &dtls) );
+
 	/* Handshake master session */
 	{
 		int ret;
@@ -1497,6 +2086,7 @@ int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority,
 				return EINVAL;
 			} );
 
+		CHECK_FCT( fd_cnx_handshake_done(conn, dtls) );
 	}
 
 	/* Multi-stream TLS: handshake other streams as well */
@@ -1512,19 +2102,110 @@ int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority,
 		CHECK_FCT(fd_sctp3436_startthreads(conn, 1));
 #endif /* DISABLE_SCTP */
 	} else {
-		/* Start decrypting the data */
-		if (!dtls) {
-			CHECK_POSIX( pthread_create( &conn->cc_rcvthr, NULL, rcvthr_tls_single, conn ) );
-		} else {
-			TODO("Signal the dtls_push function that multiple streams can be used from this point.");
-			TODO("Create DTLS rcvthr (must reassembly based on seq numbers & stream id ?)");
-			return ENOTSUP;
+		CHECK_FCT( fd_cnx_tls_start_single(conn, dtls) );
+	}
+
+	return 0;
+}
+
+/* The pull timeout function of a session handshaking without blocking: never wait */
+static int fd_cnx_s_select_nb(gnutls_transport_ptr_t ptr, unsigned int ms)
+{
+	return fd_cnx_s_select((struct cnxctx *)ptr, 0);
+}
+
+/* Non-blocking handshake of a TCP connection, used by the servers to handle many incoming connections on few threads.
+ * fd_cnx_handshake_nb prepares the session, then fd_cnx_handshake_step is called each time the socket is readable, until it
+ * does not return EAGAIN anymore. The first message is then received with fd_cnx_rcv_first_nb, and fd_cnx_tls_start finally
+ * starts the reception as after fd_cnx_handshake. There is no timeout, the caller enforces its own deadlines. */
+int fd_cnx_handshake_nb(struct cnxctx * conn, int mode, int algo, char * priority, void * alt_creds)
+{
+	int dtls = 0;
+
+	TRACE_ENTRY( "%p %d %d %p %p", conn, mode, algo, priority, alt_creds);
+	CHECK_PARAMS( conn && (conn->cc_proto == IPPROTO_TCP) && (!fd_cnx_teststate(conn, CC_STATUS_TLS)) && ( (mode == GNUTLS_CLIENT) || (mode == GNUTLS_SERVER) ) && (!conn->cc_loop) );
+
+	CHECK_FCT( fd_cnx_handshake_prepare(conn, mode, algo, priority, alt_creds, &dtls) );
+
+	/* The handshake messages are small, so only the reads may block */
+	GNUTLS_TRACE( gnutls_transport_set_pull_timeout_function( conn->cc_tls_para.session, fd_cnx_s_select_nb ) );
+	GNUTLS_TRACE( gnutls_transport_set_pull_function(conn->cc_tls_para.session, fd_cnx_s_pull_nb) );
+	GNUTLS_TRACE( gnutls_handshake_set_timeout( conn->cc_tls_para.session, 0));
+
+	return 0;
+}
+
+/* Continue the handshake with the available data. Returns 0 when complete, EAGAIN if more data is needed, or EINVAL on failure. */
+int fd_cnx_handshake_step(struct cnxctx * conn)
+{
+	int ret;
+
+	TRACE_ENTRY( "%p", conn);
+	CHECK_PARAMS( conn && fd_cnx_teststate(conn, CC_STATUS_TLS) );
+
+	ret = gnutls_handshake(conn->cc_tls_para.session);
+	if ((ret == GNUTLS_E_AGAIN) || (ret == GNUTLS_E_INTERRUPTED))
+		return EAGAIN;
+
+	if (ret < 0) {
+		if (TRACE_BOOL(INFO)) {
+			fd_log_debug("TLS Handshake failed on socket %d (%s) : %s", conn->cc_socket, conn->cc_id, gnutls_strerror(ret));
 		}
+		fd_cnx_markerror(conn);
+		return EINVAL;
 	}
 
+	return fd_cnx_handshake_done(conn, 0);
+}
+
+/* Receive the first message on a connection without blocking (the CER), in clear or after fd_cnx_handshake_step.
+ * No byte past this message is read from the socket. Returns EAGAIN if more data is needed, 0 when the message was
+ * received in buf and len, or ENOTCONN if the connection failed first. */
+int fd_cnx_rcv_first_nb(struct cnxctx * conn, struct fd_cnx_rcvstate * st, unsigned char **buf, size_t * len)
+{
+	struct timespec now;
+	int ret, ev;
+	size_t ev_sz;
+	void * ev_data;
+
+	TRACE_ENTRY( "%p %p %p %p", conn, st, buf, len);
+	CHECK_PARAMS( conn && (conn->cc_proto == IPPROTO_TCP) && (conn->cc_alt == NULL) && st && buf && len );
+
+	do {
+		if (fd_cnx_teststate(conn, CC_STATUS_TLS))
+			ret = fd_cnx_rcv_step(conn, st, fd_tls_recv_stream_nb, conn->cc_tls_para.session, 0);
+		else
+			ret = fd_cnx_rcv_step(conn, st, fd_cnx_s_recv_stream_nb, NULL, 0);
+	} while (ret == 0);
+
+	if (ret == EAGAIN)
+		return EAGAIN;
+	fd_cnx_rcvstate_free(st);
+
+	/* The message, or the error, is now in the queue */
+	CHECK_SYS( clock_gettime(CLOCK_REALTIME, &now) );
+	CHECK_FCT( fd_event_timedget(conn->cc_incoming, &now, FDEVP_PSM_TIMEOUT, &ev, &ev_sz, &ev_data) );
+	if (ev != FDEVP_CNX_MSG_RECV)
+		return ENOTCONN;
+
+	*len = ev_sz;
+	*buf = ev_data;
 	return 0;
 }
 
+/* Start receiving the messages after fd_cnx_handshake_nb and the first message, as fd_cnx_handshake does */
+int fd_cnx_tls_start(struct cnxctx * conn)
+{
+	TRACE_ENTRY( "%p", conn);
+	CHECK_PARAMS( conn && (conn->cc_proto == IPPROTO_TCP) && fd_cnx_teststate(conn, CC_STATUS_TLS) );
+
+	/* Restore the blocking functions for the receiver thread */
+	GNUTLS_TRACE( gnutls_transport_set_pull_timeout_function( conn->cc_tls_para.session, (void *)fd_cnx_s_select ) );
+	GNUTLS_TRACE( gnutls_transport_set_pull_function(conn->cc_tls_para.session, (void *)fd_cnx_s_recv) );
+
+	return fd_cnx_tls_start_single(conn, 0);
+}
+
 /* Retrieve TLS credentials of the remote peer, after handshake */
 int fd_cnx_getcred(struct cnxctx * conn, const gnutls_datum_t **cert_list, unsigned int *cert_list_size)
 {
@@ -1547,6 +2228,7 @@ int fd_cnx_getcred(struct cnxctx * conn, const gnutls_datum_t **cert_list, unsig
 
 /* Receive next message. if timeout is not NULL, wait only until timeout. This function only pulls from a queue, mgr thread is filling that queue aynchrounously. */
 /* if the altfifo has been set on this conn object, this function must not be called */
+/* The received buffer must be released with fd_rcvbuf_free (or passed to fd_msg_parse_buffer, see fd_msg_rawbuffer_setfree) */
 int fd_cnx_receive(struct cnxctx * conn, struct timespec * timeout, unsigned char **buf, size_t * len)
 {
 	int    ev;
@@ -1555,7 +2237,7 @@ int fd_cnx_receive(struct cnxctx * conn, struct timespec * timeout, unsigned cha
 
 	TRACE_ENTRY("%p %p %p %p", conn, timeout, buf, len);
 	CHECK_PARAMS(conn && (conn->cc_socket > 0) && buf && len);
-	CHECK_PARAMS(conn->cc_rcvthr != (pthread_t)NULL);
+	CHECK_PARAMS((conn->cc_rcvthr != (pthread_t)NULL) || conn->cc_ioloop || conn->cc_uring);
 	CHECK_PARAMS(conn->cc_alt == NULL);
 
 	/* Now, pull the first event */
@@ -1566,6 +2248,10 @@ get_next:
 		CHECK_FCT( fd_event_get(conn->cc_incoming, &ev, &ev_sz, &ev_data) );
 	}
 
+	/* There is room in the queue again, resume the reception if the I/O engine paused it */
+	if (conn->cc_ioloop)
+		fd_ioloop_room(conn);
+
 	switch (ev) {
 		case FDEVP_CNX_MSG_RECV:
 			/* We got one */
@@ -1622,7 +2308,7 @@ static int send_simple(struct cnxctx * conn, unsigned char * buf, size_t len)
 	size_t sent = 0;
 	TRACE_ENTRY("%p %p %zd", conn, buf, len);
 	do {
-		if (fd_cnx_teststate(conn, CC_STATUS_TLS)) {
+		if (fd_cnx_teststate(conn, CC_STATUS_TLS) && !(conn->cc_ktls & FD_KTLS_TX)) {
 			CHECK_GNUTLS_DO( ret = fd_tls_send_handle_error(conn, conn->cc_tls_para.session, buf + sent, len - sent),  );
 		} else {
 			struct iovec iov;
@@ -1638,10 +2324,12 @@ static int send_simple(struct cnxctx * conn, unsigned char * buf, size_t len)
 	return 0;
 }
 
-/* Send a message -- this is synchronous -- and we assume it's never called by several threads at the same time (on the same conn), so we don't protect. */
-int fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len)
+/* Send a message -- this is synchronous -- and we assume it's never called by several threads at the same time (on the same conn), so we don't protect.
+ * For SCTP, a message with a non-0 sess value (hash of its Session-Id) always uses the same stream, so that the messages of a session
+ * are delivered in order while the other sessions are not blocked by its losses. The other messages are spread over the streams. */
+static int cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len, uint32_t sess)
 {
-	TRACE_ENTRY("%p %p %zd", conn, buf, len);
+	TRACE_ENTRY("%p %p %zd %u", conn, buf, len, sess);
 
 	CHECK_PARAMS(conn && (conn->cc_socket > 0) && (! fd_cnx_teststate(conn, CC_STATUS_ERROR)) && buf && len);
 
@@ -1665,9 +2353,13 @@ int fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len)
 						limit = conn->cc_sctp_para.str_out;
 
 					if (limit > 1) {
-						conn->cc_sctp_para.next += 1;
-						conn->cc_sctp_para.next %= limit;
-						stream = conn->cc_sctp_para.next;
+						if (sess) {
+							stream = sess % limit;
+						} else {
+							conn->cc_sctp_para.next += 1;
+							conn->cc_sctp_para.next %= limit;
+							stream = conn->cc_sctp_para.next;
+						}
 					}
 				}
 
@@ -1713,6 +2405,112 @@ int fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len)
 	return 0;
 }
 
+int fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len)
+{
+	return cnx_send(conn, buf, len, 0);
+}
+
+
+/* Send several messages with a single call: one writev for TCP, or the TLS records filled up to the maximum size (corked session).
+ * The iov array is not modified, the caller may free its buffers afterwards. For SCTP, each message is sent separately since the boundaries must be kept, 
+ * on the stream of its session if sess is not NULL (see cnx_send). Same restriction as fd_cnx_send regarding concurrent calls. */
+int fd_cnx_sendv_sess(struct cnxctx * conn, const struct iovec * iov, int iovcnt, uint32_t * sess)
+{
+	int i;
+	
+	TRACE_ENTRY("%p %p %d %p", conn, iov, iovcnt, sess);
+
+	CHECK_PARAMS(conn && (conn->cc_socket > 0) && (! fd_cnx_teststate(conn, CC_STATUS_ERROR)) && iov && (iovcnt > 0));
+	
+	if ((iovcnt == 1) || (conn->cc_proto != IPPROTO_TCP)) {
+		for (i = 0; i < iovcnt; i++) {
+			CHECK_FCT( cnx_send(conn, iov[i].iov_base, iov[i].iov_len, sess ? sess[i] : 0) );
+		}
+		return 0;
+	}
+
+	TRACE_DEBUG(FULL, "Sending %d messages %son connection %s", iovcnt, fd_cnx_teststate(conn, CC_STATUS_TLS) ? "TLS-protected ":"", conn->cc_id);
+	
+	if (fd_cnx_teststate(conn, CC_STATUS_TLS) && !(conn->cc_ktls & FD_KTLS_TX)) {
+		gnutls_session_t session = conn->cc_tls_para.session;
+		struct timespec ts, now;
+		ssize_t ret;
+		
+		/* gnutls buffers the data and cuts it in full records when the session is uncorked */
+		gnutls_record_cork(session);
+		for (i = 0; i < iovcnt; i++) {
+			CHECK_GNUTLS_DO( ret = gnutls_record_send(session, iov[i].iov_base, iov[i].iov_len),
+				{
+					(void) gnutls_record_uncork(session, 0);
+					fd_cnx_markerror(conn);
+					return ENOTCONN;
+				} );
+		}
+		
+		CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &ts), return ENOTCONN );
+again:
+		CHECK_GNUTLS_DO( ret = gnutls_record_uncork(session, GNUTLS_RECORD_WAIT),
+			{
+				pthread_testcancel();
+				switch (ret) {
+					case GNUTLS_E_AGAIN:
+					case GNUTLS_E_INTERRUPTED:
+						CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now), return ENOTCONN );
+						if ( ((now.tv_sec - ts.tv_sec) * 1000 + ((now.tv_nsec - ts.tv_nsec) / 1000000L)) > MAX_HOTL_BLOCKING_TIME) {
+							LOG_D("Unable to send any data for %dms, closing the connection", MAX_HOTL_BLOCKING_TIME);
+						} else if (! fd_cnx_teststate(conn, CC_STATUS_CLOSING )) {
+							goto again; /* the data not sent yet is still buffered in the session */
+						}
+						break;
+
+					default:
+						if (gnutls_error_is_fatal (ret) == 0) {
+							LOG_N("Ignoring non-fatal GNU TLS error: %s", gnutls_strerror (ret));
+							goto again;
+						}
+						LOG_E("Fatal GNUTLS error: %s", gnutls_strerror (ret));
+				}
+				fd_cnx_markerror(conn);
+				return ENOTCONN;
+			} );
+	} else {
+		struct iovec cur[SENDV_IOV_CHUNK];
+		size_t off = 0; /* already written from iov[0] */
+		
+		while (iovcnt > 0) {
+			int cnt = (iovcnt > SENDV_IOV_CHUNK) ? SENDV_IOV_CHUNK : iovcnt;
+			ssize_t ret = -1;
+			
+			memcpy(cur, iov, cnt * sizeof(struct iovec));
+			cur[0].iov_base = (uint8_t *)cur[0].iov_base + off;
+			cur[0].iov_len -= off;
+			
+			/* With the io_uring engine, the messages are sent as a chain of linked requests */
+			if ((!conn->cc_uring) || (fd_uring_sendv(conn, cur, cnt, &ret) == ENOTSUP)) {
+				CHECK_SYS_DO( ret = fd_cnx_s_sendv(conn, cur, cnt), );
+			}
+			if (ret <= 0)
+				return ENOTCONN;
+			
+			/* Skip what was written */
+			ret += off;
+			while ((iovcnt > 0) && ((size_t)ret >= iov->iov_len)) {
+				ret -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			off = ret;
+		}
+	}
+	
+	return 0;
+}
+
+int fd_cnx_sendv(struct cnxctx * conn, const struct iovec * iov, int iovcnt)
+{
+	return fd_cnx_sendv_sess(conn, iov, iovcnt, NULL);
+}
+
 
 /**************************************/
 /*     Destruction of connection      */
@@ -1765,10 +2563,19 @@ void fd_cnx_destroy(struct cnxctx * conn)
 		/* We are TLS, but not using the sctp3436 wrapper layer */
 			if (! fd_cnx_teststate(conn, CC_STATUS_ERROR ) ) {
 				/* Master session */
-				CHECK_GNUTLS_DO( gnutls_bye(conn->cc_tls_para.session, GNUTLS_SHUT_WR), fd_cnx_markerror(conn) );
+				if (conn->cc_ktls & FD_KTLS_TX) {
+					CHECK_FCT_DO( fd_ktls_bye(conn), fd_cnx_markerror(conn) );
+				} else {
+					CHECK_GNUTLS_DO( gnutls_bye(conn->cc_tls_para.session, GNUTLS_SHUT_WR), fd_cnx_markerror(conn) );
+				}
 			}
 
-			if (! fd_cnx_teststate(conn, CC_STATUS_ERROR ) ) {
+			if (conn->cc_ioloop) {
+				/* Wait for the I/O engine to receive the end of the session, unless the connection is dead already */
+				fd_ioloop_del(conn, ! fd_cnx_teststate(conn, CC_STATUS_ERROR ));
+			} else if (conn->cc_uring) {
+				fd_uring_del(conn, ! fd_cnx_teststate(conn, CC_STATUS_ERROR ));
+			} else if (! fd_cnx_teststate(conn, CC_STATUS_ERROR ) ) {
 				/* In this case, just wait for thread rcvthr_tls_single to terminate */
 				if (conn->cc_rcvthr != (pthread_t)NULL) {
 					CHECK_POSIX_DO(  pthread_join(conn->cc_rcvthr, NULL), /* continue */  );
@@ -1791,6 +2598,10 @@ void fd_cnx_destroy(struct cnxctx * conn)
 
 	/* Terminate the thread in case it is not done yet -- is there any such case left ?*/
 	CHECK_FCT_DO( fd_thr_term(&conn->cc_rcvthr), /* continue */ );
+	if (conn->cc_ioloop)
+		fd_ioloop_del(conn, 0);
+	if (conn->cc_uring)
+		fd_uring_del(conn, 0);
 
 	/* Shut the connection down */
 	if (conn->cc_socket > 0) {
@@ -1801,7 +2612,7 @@ void fd_cnx_destroy(struct cnxctx * conn)
 
 	/* Empty and destroy FIFO list */
 	if (conn->cc_incoming) {
-		fd_event_destroy( &conn->cc_incoming, free );
+		fd_event_destroy( &conn->cc_incoming, fd_rcvbuf_free );
 	}
 
 	/* Free the object */
@@ -48,8 +48,8 @@ struct cnxctx {
 
 	int 		cc_socket;	/* The socket object of the connection -- <=0 if no socket is created */
 
-	int 		cc_family;	/* AF_INET or AF_INET6 (mixed) */
-	int 		cc_proto;	/* IPPROTO_TCP or IPPROTO_SCTP */
+	int 		cc_family;	/* AF_INET or AF_INET6 (mixed), or AF_UNIX for a co-located peer */
+	int 		cc_proto;	/* IPPROTO_TCP or IPPROTO_SCTP. The unix sockets are handled as TCP */
 
 	uint32_t	cc_state;	/* True if the object is being destroyed: we don't send events anymore. access with fd_cnx_getstate() */
 	#define 	CC_STATUS_CLOSING	1
@@ -59,6 +59,12 @@ struct cnxctx {
 
 	pthread_t	cc_rcvthr;	/* thread for receiving messages on the connection */
 	int		cc_loop;	/* tell the thread if it loops or stops after the first message is received */
+	struct ioloop_ent *cc_ioloop;	/* if not NULL, messages are received by the I/O engine instead of cc_rcvthr */
+	struct uring_ent *cc_uring;	/* same, with the io_uring engine */
+	int		cc_ktls;	/* the TLS records are protected by the kernel (after the handshake) */
+	#define		FD_KTLS_TX	1
+	#define		FD_KTLS_RX	2
+	#define		FD_KTLS_BYE	4	/* close_notify was sent */
 
 	struct fifo *	cc_incoming;	/* FIFO queue of events received on the connection, FDEVP_CNX_* */
 	struct fifo *	cc_alt;		/* alternate fifo to send FDEVP_CNX_* events to. */
@@ -99,10 +105,43 @@ struct fifo * fd_cnx_target_queue(struct cnxctx * conn);
 ssize_t fd_cnx_s_recv(struct cnxctx * conn, void *buffer, size_t length);
 void fd_cnx_s_setto(int sock);
 
+/* Reception on a stream (TCP or TLS): the function used to read, with the same convention as recv. Non-blocking functions return RCV_AGAIN when no data is available. */
+typedef ssize_t (*stream_recv_fct)(struct cnxctx * conn, void * session, void * buffer, size_t length);
+#define RCV_AGAIN	(-2)
+
+/* The state of the reception on a stream, between two reads */
+struct fd_cnx_rcvstate {
+	uint8_t *		rbuf;		/* RCV_BUFFER_SIZE bytes, allocated when needed */
+	size_t			start;		/* the data not processed yet is rbuf[start .. end-1] */
+	size_t			end;
+	int			nowait;		/* do not wait for room in the target queue, return EWOULDBLOCK instead */
+	struct fd_cnx_rcvdata	pend;		/* with nowait, the message waiting for room in the target queue, if pend.buffer is not NULL */
+	int			pendprio;
+	int			eof;		/* the connection was closed by the peer */
+};
+int  fd_cnx_rcv_nb(struct cnxctx * conn, struct fd_cnx_rcvstate * st);
+int  fd_cnx_rcv_first_nb(struct cnxctx * conn, struct fd_cnx_rcvstate * st, unsigned char **buf, size_t * len);
+int  fd_cnx_rcv_chunk(struct cnxctx * conn, struct fd_cnx_rcvstate * st, uint8_t * data, ssize_t res);
+void fd_cnx_rcvstate_free(struct fd_cnx_rcvstate * st);
+
+/* I/O engine */
+int  fd_ioloop_add(struct cnxctx * conn);
+void fd_ioloop_del(struct cnxctx * conn, int graceful);
+void fd_ioloop_room(struct cnxctx * conn);
+int  fd_uring_add(struct cnxctx * conn);
+void fd_uring_del(struct cnxctx * conn, int graceful);
+int  fd_uring_sendv(struct cnxctx * conn, const struct iovec * iov, int iovcnt, ssize_t * sent);
+void fd_uring_stats(long long * rcv, long long * snd);
+
 /* TLS */
 int fd_tls_rcvthr_core(struct cnxctx * conn, gnutls_session_t session);
 int fd_tls_prepare(gnutls_session_t * session, int mode, int dtls, char * priority, void * alt_creds);
 
+/* Kernel TLS */
+int fd_ktls_enable(struct cnxctx * conn);
+int fd_ktls_bye(struct cnxctx * conn);
+ssize_t fd_ktls_recv(struct cnxctx * conn, void * buffer, size_t length, int nonblock);
+
 /* TCP */
 int fd_tcp_create_bind_server( int * sock, sSA * sa, socklen_t salen );
 int fd_tcp_listen( int sock );
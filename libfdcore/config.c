@@ -63,9 +63,12 @@ int fd_conf_init()
 	fd_g_config->cnf_dispthr  = 4;
 	fd_g_config->cnf_rtinthr = 1;
 	fd_g_config->cnf_rtoutthr = 1;
+	fd_g_config->cnf_io_engine = FD_IO_THREADS;
+	fd_g_config->cnf_io_thr = 2;
 	fd_g_config->cnf_qin_limit = 20;
 	fd_g_config->cnf_qout_limit = 30;
 	fd_g_config->cnf_qlocal_limit = 25;
+	fd_g_config->cnf_doic_validity = 30;
 	fd_list_init(&fd_g_config->cnf_endpoints, NULL);
 	fd_list_init(&fd_g_config->cnf_apps, NULL);
 	#ifdef DISABLE_SCTP
@@ -82,6 +85,7 @@ int fd_conf_init()
 	CHECK_GNUTLS_DO( gnutls_certificate_allocate_credentials (&fd_g_config->cnf_sec_data.credentials), return ENOMEM );
 	CHECK_GNUTLS_DO( gnutls_dh_params_init (&fd_g_config->cnf_sec_data.dh_cache), return ENOMEM );
 	CHECK_GNUTLS_DO( gnutls_x509_trust_list_init(&fd_g_config->cnf_sec_data.trustlist, 0), return ENOMEM );
+	CHECK_GNUTLS_DO( gnutls_session_ticket_key_generate(&fd_g_config->cnf_sec_data.ticket_key), return ENOMEM );
 
 	return 0;
 }
@@ -104,13 +108,45 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_conf_dump)
 	}
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of SCTP streams . : %hu\n", fd_g_config->cnf_sctp_str), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of clients thr .. : %d\n", fd_g_config->cnf_thr_srv), return NULL);
-	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of app threads .. : %hu\n", fd_g_config->cnf_dispthr), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of app threads .. : %hu", fd_g_config->cnf_dispthr), return NULL);
+	if (fd_g_config->cnf_dispthr_max > fd_g_config->cnf_dispthr) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, " (up to %hu)", fd_g_config->cnf_dispthr_max), return NULL);
+	}
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Minimal processing peers : %d\n", fd_g_config->cnf_processing_peers_minimum), return NULL);
-	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of rtin threads . : %hu\n", fd_g_config->cnf_rtinthr), return NULL);
-	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of rtout threads  : %hu\n", fd_g_config->cnf_rtoutthr), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of rtin threads . : %hu", fd_g_config->cnf_rtinthr), return NULL);
+	if (fd_g_config->cnf_rtinthr_max > fd_g_config->cnf_rtinthr) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, " (up to %hu)", fd_g_config->cnf_rtinthr_max), return NULL);
+	}
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of rtout threads  : %hu", fd_g_config->cnf_rtoutthr), return NULL);
+	if (fd_g_config->cnf_rtoutthr_max > fd_g_config->cnf_rtoutthr) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, " (up to %hu)", fd_g_config->cnf_rtoutthr_max), return NULL);
+	}
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n"), return NULL);
+	if (fd_g_config->cnf_fuse) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Fused pipeline budget .. : %hu\n", fd_g_config->cnf_fuse), return NULL);
+	}
+	if (fd_g_config->cnf_io_engine == FD_IO_THREADS) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  I/O engine ............. : threads\n"), return NULL);
+	} else {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  I/O engine ............. : %s (%hu threads)\n", (fd_g_config->cnf_io_engine == FD_IO_URING) ? "io_uring" : "epoll", fd_g_config->cnf_io_thr), return NULL);
+	}
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Incoming queue limit     : %d\n", fd_g_config->cnf_qin_limit), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Outgoing queue limit     : %d\n", fd_g_config->cnf_qout_limit), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Local queue limit        : %d\n", fd_g_config->cnf_qlocal_limit), return NULL);
+	if (fd_g_config->cnf_qpeer_limit) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Per peer queue limit     : %d (%s)\n", fd_g_config->cnf_qpeer_limit, fd_g_config->cnf_flags.qpeer_shed ? "shed" : "block"), return NULL);
+	}
+	if (fd_g_config->cnf_doic_depth || fd_g_config->cnf_doic_latency) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Overload reports ....... : depth %d, latency %dms, valid %us\n", fd_g_config->cnf_doic_depth, fd_g_config->cnf_doic_latency, fd_g_config->cnf_doic_validity), return NULL);
+	}
+	if (fd_g_config->cnf_max_residence) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Max residence .......... : %dms\n", fd_g_config->cnf_max_residence), return NULL);
+	}
+	if (fd_g_config->cnf_peer_window) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Peer in-flight window .. : %d\n", fd_g_config->cnf_peer_window), return NULL);
+	}
 	if (FD_IS_LIST_EMPTY(&fd_g_config->cnf_endpoints)) {
 		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Local endpoints ........ : Default (use all available)\n"), return NULL);
 	} else {
@@ -118,6 +154,9 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_conf_dump)
 		CHECK_MALLOC_DO( fd_ep_dump( FD_DUMP_STD_PARAMS, 0, 0, &fd_g_config->cnf_endpoints ), return NULL);
 		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n"), return NULL);
 	}
+	if (fd_g_config->cnf_local_path) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Local socket ........... : %s\n", fd_g_config->cnf_local_path), return NULL);
+	}
 	if (FD_IS_LIST_EMPTY(&fd_g_config->cnf_apps)) {
 		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Local applications ..... : (none)"), return NULL);
 	} else {
@@ -137,15 +176,21 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_conf_dump)
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n  Flags : - IP ........... : %s\n", fd_g_config->cnf_flags.no_ip4 ? "DISABLED" : "Enabled"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - IPv6 ......... : %s\n", fd_g_config->cnf_flags.no_ip6 ? "DISABLED" : "Enabled"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Relay app .... : %s\n", fd_g_config->cnf_flags.no_fwd ? "DISABLED" : "Enabled"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Realm routing  : %s\n", fd_g_config->cnf_flags.rt_realm ? "Enabled" : "DISABLED"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Sess. affinity : %s\n", fd_g_config->cnf_flags.sess_aff ? "Enabled" : "DISABLED"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Overload ctrl  : %s\n", fd_g_config->cnf_flags.doic ? "Enabled" : "DISABLED"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - TCP .......... : %s\n", fd_g_config->cnf_flags.no_tcp ? "DISABLED" : "Enabled"), return NULL);
 	#ifdef DISABLE_SCTP
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - SCTP ......... : DISABLED (at compilation)\n"), return NULL);
 	#else /* DISABLE_SCTP */
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - SCTP ......... : %s\n", fd_g_config->cnf_flags.no_sctp ? "DISABLED" : "Enabled"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - SCTP streams . : %s\n", fd_g_config->cnf_flags.sctp_sess ? "By session" : "Round-robin"), return NULL);
 	#endif /* DISABLE_SCTP */
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Pref. proto .. : %s\n", fd_g_config->cnf_flags.pr_tcp ? "TCP" : "SCTP"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - TLS method ... : %s\n", fd_g_config->cnf_flags.tls_alg ? "INBAND" : "Separate port"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Client bind .. : %s\n", fd_g_config->cnf_flags.no_bind ? "DISABLED" : "Enabled"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Kernel TLS ... : %s\n", fd_g_config->cnf_flags.ktls ? "Enabled" : "DISABLED"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - TLS resumption : %s\n", fd_g_config->cnf_flags.no_resume ? "DISABLED" : "Enabled"), return NULL);
 	
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  TLS :   - Certificate .. : %s\n", fd_g_config->cnf_sec_data.cert_file ?: "(NONE)"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Private key .. : %s\n", fd_g_config->cnf_sec_data.key_file ?: "(NONE)"), return NULL);
@@ -548,6 +593,9 @@ int fd_conf_deinit()
 	gnutls_priority_deinit(fd_g_config->cnf_sec_data.prio_cache);
 	gnutls_dh_params_deinit(fd_g_config->cnf_sec_data.dh_cache);
 	gnutls_certificate_free_credentials(fd_g_config->cnf_sec_data.credentials);
+	gnutls_memset(fd_g_config->cnf_sec_data.ticket_key.data, 0, fd_g_config->cnf_sec_data.ticket_key.size);
+	gnutls_free(fd_g_config->cnf_sec_data.ticket_key.data);
+	fd_g_config->cnf_sec_data.ticket_key.data = NULL;
 	
 	free(fd_g_config->cnf_sec_data.cert_file); fd_g_config->cnf_sec_data.cert_file = NULL;
 	free(fd_g_config->cnf_sec_data.key_file); fd_g_config->cnf_sec_data.key_file = NULL;
@@ -565,6 +613,7 @@ int fd_conf_deinit()
 	/* Destroy the local endpoints and applications */
 	CHECK_FCT_DO(fd_ep_filter(&fd_g_config->cnf_endpoints, 0 ), );
 	CHECK_FCT_DO(fd_app_empty(&fd_g_config->cnf_apps ), );
+	free(fd_g_config->cnf_local_path); fd_g_config->cnf_local_path = NULL;
 	
 	/* Destroy the local identity */	
 	free(fd_g_config->cnf_diamid); fd_g_config->cnf_diamid = NULL;
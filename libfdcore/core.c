@@ -100,10 +100,14 @@ static void core_shutdown(void)
 	CHECK_FCT_DO( fd_servers_stop(), /* Stop accepting new connections */ );
 	CHECK_FCT_DO( fd_rtdisp_cleanstop(), /* Stop dispatch thread(s) after a clean loop if possible */ );
 	CHECK_FCT_DO( fd_peer_fini(), /* Stop all connections */ );
+	fd_ioloop_fini();
+	fd_uring_fini();
+	fd_tls_resume_fini();
 	CHECK_FCT_DO( fd_rtdisp_fini(), /* Stop routing threads and destroy routing queues */ );
 	
 	CHECK_FCT_DO( fd_ext_term(), /* Cleanup all extensions */ );
 	CHECK_FCT_DO( fd_rtdisp_cleanup(), /* destroy remaining handlers */ );
+	fd_rcvbuf_fini();
 	
 	GNUTLS_TRACE( gnutls_global_deinit() );
 	
@@ -205,6 +209,7 @@ int fd_core_initialize(void)
 	CHECK_FCT( fd_hooks_init()  );
 	CHECK_FCT( fd_queues_init() );
 	CHECK_FCT( fd_sess_start()  );
+	CHECK_FCT( fd_peer_init()   );
 	CHECK_FCT( fd_p_expi_init() );
 	
 	core_state_set(CORE_LIBS_INIT);
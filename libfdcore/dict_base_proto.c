@@ -2515,6 +2515,207 @@ int fd_dict_base_protocol(struct dictionary * dict)
 			CHECK_dict_new( DICT_AVP, &data , type, NULL);
 		}
 		
+		/* Overload control AVPs, RFC 7683. The M bit is not fixed, it depends on the application. */
+		
+		/* OC-Feature-Vector */
+		{
+			/*
+				The OC-Feature-Vector AVP (AVP Code 622) is of type Unsigned64 and
+				contains a 64-bit flags field of announced capabilities of a DOIC
+				node.  The value of zero (0) is reserved.
+
+				OLR_DEFAULT_ALGO (0x0000000000000001)
+			*/
+			struct dict_avp_data data = { 
+					622, 					/* Code */
+					#if AC_OC_FEATURE_VECTOR != 622
+					#error "AC_OC_FEATURE_VECTOR definition mismatch"
+					#endif
+					0, 					/* Vendor */
+					"OC-Feature-Vector", 			/* Name */
+					AVP_FLAG_VENDOR, 			/* Fixed flags */
+					0,					/* Fixed flag values */
+					AVP_TYPE_UNSIGNED64 			/* base type of data */
+					};
+			CHECK_dict_new( DICT_AVP, &data , NULL, NULL);
+		}
+		
+		/* OC-Supported-Features */
+		{
+			/*
+				The OC-Supported-Features AVP (AVP Code 621) is of type Grouped.
+				The OC-Supported-Features AVP is used to announce the DOIC features
+				supported by the DOIC node, in the form of the OC-Feature-Vector AVP.
+
+				 OC-Supported-Features ::= < AVP Header: 621 >
+				                           [ OC-Feature-Vector ]
+				                         * [ AVP ]
+			*/
+			struct dict_object * avp;
+			struct dict_avp_data data = { 
+					621, 					/* Code */
+					#if AC_OC_SUPPORTED_FEATURES != 621
+					#error "AC_OC_SUPPORTED_FEATURES definition mismatch"
+					#endif
+					0, 					/* Vendor */
+					"OC-Supported-Features", 		/* Name */
+					AVP_FLAG_VENDOR, 			/* Fixed flags */
+					0,					/* Fixed flag values */
+					AVP_TYPE_GROUPED 			/* base type of data */
+					};
+			struct local_rules_definition rules[] = 
+						{ 	 {  "OC-Feature-Vector", 		RULE_OPTIONAL, -1, 1 }
+						};
+			
+			CHECK_dict_new( DICT_AVP, &data , NULL, &avp);
+			PARSE_loc_rules( rules, avp );
+		}
+		
+		/* OC-Sequence-Number */
+		{
+			/*
+				The OC-Sequence-Number AVP (AVP Code 624) is of type Unsigned64.
+				Its usage in the context of overload control is described in
+				Section 4.
+			*/
+			struct dict_avp_data data = { 
+					624, 					/* Code */
+					#if AC_OC_SEQUENCE_NUMBER != 624
+					#error "AC_OC_SEQUENCE_NUMBER definition mismatch"
+					#endif
+					0, 					/* Vendor */
+					"OC-Sequence-Number", 			/* Name */
+					AVP_FLAG_VENDOR, 			/* Fixed flags */
+					0,					/* Fixed flag values */
+					AVP_TYPE_UNSIGNED64 			/* base type of data */
+					};
+			CHECK_dict_new( DICT_AVP, &data , NULL, NULL);
+		}
+		
+		/* OC-Validity-Duration */
+		{
+			/*
+				The OC-Validity-Duration AVP (AVP Code 625) is of type Unsigned32
+				and indicates in seconds the validity time of the overload report.
+				The number of seconds is measured after reception of the first OC-
+				OLR AVP with a given value of OC-Sequence-Number AVP.  The default
+				value for the OC-Validity-Duration AVP is 30 seconds.  When the OC-
+				Validity-Duration AVP is not present in the OC-OLR AVP, the default
+				value applies.  The maximum value for the OC-Validity-Duration AVP is
+				86,400 seconds (24 hours).
+			*/
+			struct dict_avp_data data = { 
+					625, 					/* Code */
+					#if AC_OC_VALIDITY_DURATION != 625
+					#error "AC_OC_VALIDITY_DURATION definition mismatch"
+					#endif
+					0, 					/* Vendor */
+					"OC-Validity-Duration", 		/* Name */
+					AVP_FLAG_VENDOR, 			/* Fixed flags */
+					0,					/* Fixed flag values */
+					AVP_TYPE_UNSIGNED32 			/* base type of data */
+					};
+			CHECK_dict_new( DICT_AVP, &data , NULL, NULL);
+		}
+		
+		/* OC-Report-Type */
+		{
+			/*
+				The OC-Report-Type AVP (AVP Code 626) is of type Enumerated.  The
+				value of the AVP describes what the overload report concerns.  The
+				following values are initially defined:
+
+				HOST_REPORT 0  The overload report is for a host.  Overload
+				   abatement treatment applies to host-routed requests.
+
+				REALM_REPORT 1  The overload report is for a realm.  Overload
+				   abatement treatment applies to realm-routed requests.
+			*/
+			struct dict_object 	* 	type;
+			struct dict_type_data 		tdata = { AVP_TYPE_INTEGER32,	"Enumerated(OC-Report-Type)"	, NULL, NULL, NULL };
+			struct dict_enumval_data 	t_0 = { "HOST_REPORT", 			{ .i32 = ACV_OC_HOST_REPORT }};
+			struct dict_enumval_data 	t_1 = { "REALM_REPORT", 		{ .i32 = ACV_OC_REALM_REPORT }};
+			struct dict_avp_data 		data = { 
+					626, 					/* Code */
+					#if AC_OC_REPORT_TYPE != 626
+					#error "AC_OC_REPORT_TYPE definition mismatch"
+					#endif
+					0, 					/* Vendor */
+					"OC-Report-Type", 			/* Name */
+					AVP_FLAG_VENDOR, 			/* Fixed flags */
+					0,					/* Fixed flag values */
+					AVP_TYPE_INTEGER32 			/* base type of data */
+					};
+			/* Create the Enumerated type, and then the AVP */
+			CHECK_dict_new( DICT_TYPE, &tdata , NULL, &type);
+			CHECK_dict_new( DICT_ENUMVAL, &t_0 , type, NULL);
+			CHECK_dict_new( DICT_ENUMVAL, &t_1 , type, NULL);
+			CHECK_dict_new( DICT_AVP, &data , type, NULL);
+		}
+		
+		/* OC-Reduction-Percentage */
+		{
+			/*
+				The OC-Reduction-Percentage AVP (AVP Code 627) is of type Unsigned32
+				and describes the percentage of the traffic that the sender is
+				requested to reduce, compared to what it otherwise would send.  The
+				OC-Reduction-Percentage AVP applies to the default (loss) algorithm
+				specified in this specification.
+
+				The value of the Reduction-Percentage AVP is between zero (0) and one
+				hundred (100).  Values greater than 100 are ignored.
+			*/
+			struct dict_avp_data data = { 
+					627, 					/* Code */
+					#if AC_OC_REDUCTION_PERCENTAGE != 627
+					#error "AC_OC_REDUCTION_PERCENTAGE definition mismatch"
+					#endif
+					0, 					/* Vendor */
+					"OC-Reduction-Percentage", 		/* Name */
+					AVP_FLAG_VENDOR, 			/* Fixed flags */
+					0,					/* Fixed flag values */
+					AVP_TYPE_UNSIGNED32 			/* base type of data */
+					};
+			CHECK_dict_new( DICT_AVP, &data , NULL, NULL);
+		}
+		
+		/* OC-OLR */
+		{
+			/*
+				The OC-OLR AVP (AVP Code 623) is of type Grouped and contains the
+				information necessary to convey an overload report on an overload
+				condition at the reporting node.
+
+				 OC-OLR ::= < AVP Header: 623 >
+				            < OC-Sequence-Number >
+				            < OC-Report-Type >
+				            [ OC-Reduction-Percentage ]
+				            [ OC-Validity-Duration ]
+				          * [ AVP ]
+			*/
+			struct dict_object * avp;
+			struct dict_avp_data data = { 
+					623, 					/* Code */
+					#if AC_OC_OLR != 623
+					#error "AC_OC_OLR definition mismatch"
+					#endif
+					0, 					/* Vendor */
+					"OC-OLR", 				/* Name */
+					AVP_FLAG_VENDOR, 			/* Fixed flags */
+					0,					/* Fixed flag values */
+					AVP_TYPE_GROUPED 			/* base type of data */
+					};
+			struct local_rules_definition rules[] = 
+						{ 	 {  "OC-Sequence-Number", 		RULE_FIXED_HEAD, -1, 1 }
+							,{  "OC-Report-Type",			RULE_FIXED_HEAD, -1, 1 }
+							,{  "OC-Reduction-Percentage",		RULE_OPTIONAL,   -1, 1 }
+							,{  "OC-Validity-Duration",		RULE_OPTIONAL,   -1, 1 }
+						};
+			
+			CHECK_dict_new( DICT_AVP, &data , NULL, &avp);
+			PARSE_loc_rules( rules, avp );
+		}
+		
 	}
 	
 	/* Commands section */
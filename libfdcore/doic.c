@@ -0,0 +1,474 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2020, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+
+#include "fdcore-internal.h"
+
+/* Diameter Overload Indication Conveyance (RFC 7683), with the loss abatement algorithm only.
+
+ As a reporting node (cnf_doic_depth or cnf_doic_latency), the overload of this instance is evaluated from the
+ statistics of the queues of the messages waiting to be routed or dispatched, at most once per DOIC_PERIOD.
+ The answers we send to the requests that advertised OC-Supported-Features carry a host report (OC-OLR) while
+ the reduction is not 0, then a report of the end of the overload for one validity duration.
+
+ As a reacting node (cnf_flags.doic), the requests that we originate or relay without OC-Supported-Features
+ get ours, and the reports received in the answers are saved per (host or realm, application). When such
+ a request is routed the first time, it is dropped with the probability of the reduction that applies: a
+ realm report drops all the candidates of a realm-routed request, a host report those that are that host, or
+ all of them for a request to that Destination-Host. */
+
+/* Minimum interval between two evaluations of our overload, in milliseconds */
+#ifndef DOIC_PERIOD
+#define DOIC_PERIOD		1000
+#endif /* DOIC_PERIOD */
+
+/* The reduction we request when the load reaches the configured values, and its granularity */
+#ifndef DOIC_REDUCTION_MAX
+#define DOIC_REDUCTION_MAX	90
+#endif /* DOIC_REDUCTION_MAX */
+#ifndef DOIC_REDUCTION_STEP
+#define DOIC_REDUCTION_STEP	10
+#endif /* DOIC_REDUCTION_STEP */
+
+/* RFC 7683 values */
+#define DOIC_VALIDITY_DEFAULT	30
+#define DOIC_VALIDITY_MAX	86400
+
+static struct dict_object * d_sf, * d_fv, * d_olr, * d_sn, * d_vd, * d_rt, * d_rp;
+
+/* An overload report received */
+struct doic_olr {
+	struct fd_list		chain;		/* link in doic_olrs */
+	int			type;		/* ACV_OC_HOST_REPORT or ACV_OC_REALM_REPORT */
+	application_id_t	app;
+	DiamId_t		id;		/* the host or the realm that the report applies to */
+	size_t			idlen;
+	uint64_t		seq;
+	uint32_t		reduction;
+	struct timespec		expire;
+};
+static struct fd_list doic_olrs = FD_LIST_INITIALIZER(doic_olrs);
+static pthread_rwlock_t doic_olrs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Our own overload */
+static struct {
+	pthread_mutex_t	lock;
+	struct timespec	next;		/* time of the next evaluation */
+	long long	count;		/* statistics of the queues at the last evaluation */
+	struct timespec	total;
+	uint32_t	reduction;	/* current reduction */
+	uint64_t	seq;		/* OC-Sequence-Number of the current report, 0 before the first overload */
+	struct timespec	end;		/* the end of the overload is reported until then */
+} rep = { PTHREAD_MUTEX_INITIALIZER };
+
+/* The AVPs of a message that matter here, the others are not dictionary-resolved */
+struct doic_avps {
+	struct avp_hdr	*dh, *dr, *oh, *orl;	/* Destination-Host, -Realm, Origin-Host, -Realm */
+	struct avp	*sf, *olr;
+};
+
+static int doic_scan(struct msg * msg, struct doic_avps * f)
+{
+	struct avp * avp;
+	
+	memset(f, 0, sizeof(struct doic_avps));
+	
+	CHECK_FCT( fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+	while (avp) {
+		struct avp_hdr * ahdr;
+		struct avp_hdr ** dest = NULL;
+		
+		CHECK_FCT( fd_msg_avp_hdr(avp, &ahdr) );
+		if (!(ahdr->avp_flags & AVP_FLAG_VENDOR)) {
+			switch (ahdr->avp_code) {
+				case AC_DESTINATION_HOST:	dest = &f->dh; break;
+				case AC_DESTINATION_REALM:	dest = &f->dr; break;
+				case AC_ORIGIN_HOST:		dest = &f->oh; break;
+				case AC_ORIGIN_REALM:		dest = &f->orl; break;
+				case AC_OC_SUPPORTED_FEATURES:	f->sf = avp; break;
+				case AC_OC_OLR:
+					CHECK_FCT( fd_msg_parse_dict(avp, fd_g_config->cnf_dict, NULL) );
+					f->olr = avp;
+					break;
+			}
+			if (dest) {
+				CHECK_FCT( fd_msg_parse_dict(avp, fd_g_config->cnf_dict, NULL) );
+				if (ahdr->avp_value)
+					*dest = ahdr;
+			}
+		}
+		
+		CHECK_FCT( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL) );
+	}
+	
+	return 0;
+}
+
+/* Create an AVP with an integer value */
+static int doic_avp_add(msg_or_avp * parent, struct dict_object * model, union avp_value * val)
+{
+	struct avp * avp;
+	
+	CHECK_FCT( fd_msg_avp_new(model, 0, &avp) );
+	CHECK_FCT_DO( fd_msg_avp_setvalue(avp, val), { fd_msg_free(avp); return __ret__; } );
+	CHECK_FCT_DO( fd_msg_avp_add(parent, MSG_BRW_LAST_CHILD, avp), { fd_msg_free(avp); return __ret__; } );
+	return 0;
+}
+
+/* Add our OC-Supported-Features */
+static int doic_add_sf(struct msg * msg)
+{
+	struct avp * sf;
+	union avp_value val;
+	
+	CHECK_FCT( fd_msg_avp_new(d_sf, 0, &sf) );
+	val.u64 = ACV_OC_LOSS;
+	CHECK_FCT_DO( doic_avp_add(sf, d_fv, &val), { fd_msg_free(sf); return __ret__; } );
+	CHECK_FCT_DO( fd_msg_avp_add(msg, MSG_BRW_LAST_CHILD, sf), { fd_msg_free(sf); return __ret__; } );
+	return 0;
+}
+
+/* The reduction to apply, 0 if there is no valid report */
+static uint32_t doic_reduction(int type, application_id_t app, DiamId_t id, size_t idlen, struct timespec * now)
+{
+	struct fd_list * li;
+	uint32_t ret = 0;
+	
+	CHECK_POSIX_DO( pthread_rwlock_rdlock(&doic_olrs_lock), return 0 );
+	for (li = doic_olrs.next; li != &doic_olrs; li = li->next) {
+		struct doic_olr * o = (struct doic_olr *)li;
+		if ((o->type == type) && (o->app == app) && (o->idlen == idlen) && !strncasecmp(o->id, id, idlen)) {
+			if (TS_IS_INFERIOR(now, &o->expire))
+				ret = o->reduction;
+			break;
+		}
+	}
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&doic_olrs_lock), );
+	
+	return ret;
+}
+
+/* Draw if a request is dropped */
+static int doic_drop(uint32_t reduction)
+{
+	return reduction && ((uint32_t)(random() % 100) < reduction);
+}
+
+/* A request is routed for the first time */
+int fd_doic_request(struct msg * msg, struct fd_list * candidates)
+{
+	struct doic_avps f;
+	struct msg_hdr * hdr;
+	struct timespec now;
+	struct fd_list * li;
+	int empty;
+	
+	TRACE_ENTRY("%p %p", msg, candidates);
+	
+	CHECK_FCT( doic_scan(msg, &f) );
+	
+	/* The node that added OC-Supported-Features is the one that abates */
+	if (f.sf)
+		return 0;
+	
+	CHECK_FCT( doic_add_sf(msg) );
+	
+	CHECK_POSIX( pthread_rwlock_rdlock(&doic_olrs_lock) );
+	empty = FD_IS_LIST_EMPTY(&doic_olrs);
+	CHECK_POSIX( pthread_rwlock_unlock(&doic_olrs_lock) );
+	if (empty)
+		return 0;
+	
+	CHECK_FCT( fd_msg_hdr(msg, &hdr) );
+	CHECK_SYS( clock_gettime(CLOCK_REALTIME, &now) );
+	
+	if (f.dh) {
+		/* Host-routed request */
+		if (doic_drop(doic_reduction(ACV_OC_HOST_REPORT, hdr->msg_appl, (DiamId_t)f.dh->avp_value->os.data, f.dh->avp_value->os.len, &now)))
+			goto drop_all;
+	} else if (f.dr) {
+		/* Realm-routed request */
+		if (doic_drop(doic_reduction(ACV_OC_REALM_REPORT, hdr->msg_appl, (DiamId_t)f.dr->avp_value->os.data, f.dr->avp_value->os.len, &now)))
+			goto drop_all;
+	}
+	
+	/* The candidates that reported their own overload */
+	for (li = candidates->next; li != candidates; li = li->next) {
+		struct rtd_candidate * c = (struct rtd_candidate *) li;
+		if (doic_drop(doic_reduction(ACV_OC_HOST_REPORT, hdr->msg_appl, c->diamid, c->diamidlen, &now)))
+			c->score = FD_SCORE_NO_DELIVERY;
+	}
+	return 0;
+	
+drop_all:
+	for (li = candidates->next; li != candidates; li = li->next)
+		((struct rtd_candidate *) li)->score = FD_SCORE_NO_DELIVERY;
+	return 0;
+}
+
+/* An answer is received, save the overload report it contains if any */
+int fd_doic_answer_in(struct msg * msg)
+{
+	struct doic_avps f;
+	struct msg_hdr * hdr;
+	struct avp * avp;
+	struct avp_hdr * id;
+	struct fd_list * li;
+	struct doic_olr * o = NULL;
+	struct timespec now;
+	uint64_t seq = 0;
+	uint32_t reduction = 0, validity = DOIC_VALIDITY_DEFAULT;
+	int type = -1, got_seq = 0;
+	
+	TRACE_ENTRY("%p", msg);
+	
+	CHECK_FCT( doic_scan(msg, &f) );
+	if (!f.olr)
+		return 0;
+	
+	CHECK_FCT( fd_msg_browse(f.olr, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+	while (avp) {
+		struct avp_hdr * ahdr;
+		CHECK_FCT( fd_msg_avp_hdr(avp, &ahdr) );
+		if (!(ahdr->avp_flags & AVP_FLAG_VENDOR) && ahdr->avp_value) {
+			switch (ahdr->avp_code) {
+				case AC_OC_SEQUENCE_NUMBER:	seq = ahdr->avp_value->u64; got_seq = 1; break;
+				case AC_OC_REPORT_TYPE:		type = ahdr->avp_value->i32; break;
+				case AC_OC_REDUCTION_PERCENTAGE: reduction = ahdr->avp_value->u32; break;
+				case AC_OC_VALIDITY_DURATION:	validity = ahdr->avp_value->u32; break;
+			}
+		}
+		CHECK_FCT( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL) );
+	}
+	
+	switch (type) {
+		case ACV_OC_HOST_REPORT:	id = f.oh; break;
+		case ACV_OC_REALM_REPORT:	id = f.orl; break;
+		default:			id = NULL;
+	}
+	if (!id || !got_seq || (reduction > 100)) {
+		TRACE_DEBUG(INFO, "Ignoring an invalid or unsupported OC-OLR");
+		return 0;
+	}
+	if (validity > DOIC_VALIDITY_MAX)
+		validity = DOIC_VALIDITY_MAX;
+	
+	CHECK_FCT( fd_msg_hdr(msg, &hdr) );
+	CHECK_SYS( clock_gettime(CLOCK_REALTIME, &now) );
+	
+	CHECK_POSIX( pthread_rwlock_wrlock(&doic_olrs_lock) );
+	for (li = doic_olrs.next; li != &doic_olrs; ) {
+		struct doic_olr * cur = (struct doic_olr *)li;
+		li = li->next;
+		if ((cur->type == type) && (cur->app == hdr->msg_appl) && (cur->idlen == id->avp_value->os.len) 
+				&& !strncasecmp(cur->id, (char *)id->avp_value->os.data, cur->idlen)) {
+			o = cur;
+		} else if (!TS_IS_INFERIOR(&now, &cur->expire)) {
+			/* Purge the expired reports */
+			fd_list_unlink(&cur->chain);
+			free(cur->id);
+			free(cur);
+		}
+	}
+	
+	if (o && (seq <= o->seq) && TS_IS_INFERIOR(&now, &o->expire)) {
+		/* Already known, or older */
+		CHECK_POSIX( pthread_rwlock_unlock(&doic_olrs_lock) );
+		return 0;
+	}
+	
+	if (!reduction || !validity) {
+		/* The overload condition ended */
+		if (o) {
+			LOG_N("Overload report of %s '%.*s' for application %u ended", type ? "realm" : "host", (int)o->idlen, o->id, o->app);
+			fd_list_unlink(&o->chain);
+			free(o->id);
+			free(o);
+		}
+		CHECK_POSIX( pthread_rwlock_unlock(&doic_olrs_lock) );
+		return 0;
+	}
+	
+	if (!o) {
+		CHECK_MALLOC_DO( o = calloc(1, sizeof(struct doic_olr)), goto error );
+		CHECK_MALLOC_DO( o->id = (DiamId_t)os0dup(id->avp_value->os.data, id->avp_value->os.len), { free(o); goto error; } );
+		fd_list_init(&o->chain, o);
+		o->type = type;
+		o->app = hdr->msg_appl;
+		o->idlen = id->avp_value->os.len;
+		fd_list_insert_before(&doic_olrs, &o->chain);
+	}
+	if (o->reduction != reduction) {
+		LOG_N("Overload report of %s '%.*s' for application %u: reduce by %u%% for %us", type ? "realm" : "host", (int)o->idlen, o->id, o->app, reduction, validity);
+	}
+	o->seq = seq;
+	o->reduction = reduction;
+	o->expire.tv_sec = now.tv_sec + validity;
+	o->expire.tv_nsec = now.tv_nsec;
+	
+	CHECK_POSIX( pthread_rwlock_unlock(&doic_olrs_lock) );
+	return 0;
+	
+error:
+	CHECK_POSIX( pthread_rwlock_unlock(&doic_olrs_lock) );
+	return ENOMEM;
+}
+
+/* Update our overload from the queues statistics, called with rep.lock held */
+static void doic_evaluate(struct timespec * now)
+{
+	int depth, level = 0, reduction = 0;
+	long long count, lat_ms = 0;
+	struct timespec total;
+	
+	if (TS_IS_INFERIOR(now, &rep.next))
+		return;
+	
+	CHECK_FCT_DO( fd_rtdisp_backlog(&depth, &count, &total), return );
+	if (count > rep.count) {
+		long long ns = (total.tv_sec - rep.total.tv_sec) * 1000000000LL + (total.tv_nsec - rep.total.tv_nsec);
+		lat_ms = ns / (count - rep.count) / 1000000;
+	}
+	rep.count = count;
+	rep.total = total;
+	rep.next.tv_sec = now->tv_sec + DOIC_PERIOD / 1000;
+	rep.next.tv_nsec = now->tv_nsec + (DOIC_PERIOD % 1000) * 1000000;
+	if (rep.next.tv_nsec >= 1000000000) {
+		rep.next.tv_nsec -= 1000000000;
+		rep.next.tv_sec++;
+	}
+	
+	/* Load in percent of the configured values; we start reporting at half of them */
+	if (fd_g_config->cnf_doic_depth)
+		level = depth * 100 / fd_g_config->cnf_doic_depth;
+	if (fd_g_config->cnf_doic_latency && (lat_ms * 100 / fd_g_config->cnf_doic_latency > level))
+		level = lat_ms * 100 / fd_g_config->cnf_doic_latency;
+	if (level > 50) {
+		reduction = (level - 50) * 2 * DOIC_REDUCTION_MAX / 100;
+		if (reduction > DOIC_REDUCTION_MAX)
+			reduction = DOIC_REDUCTION_MAX;
+		reduction -= reduction % DOIC_REDUCTION_STEP;
+	}
+	
+	if (reduction != rep.reduction) {
+		/* New report. The sequence starts from the time so that it keeps increasing across restarts */
+		rep.seq = rep.seq ? rep.seq + 1 : ((uint64_t)now->tv_sec << 16);
+		rep.reduction = reduction;
+		if (!reduction) {
+			rep.end.tv_sec = now->tv_sec + fd_g_config->cnf_doic_validity;
+			rep.end.tv_nsec = now->tv_nsec;
+		}
+		LOG_N("Overload: %d messages waiting, %lldms average wait, requesting a reduction of %d%%", depth, lat_ms, reduction);
+	}
+}
+
+/* An answer is about to be sent, add our overload report if the request advertised the support */
+int fd_doic_answer_out(struct msg * ans, struct msg * qry)
+{
+	struct doic_avps f;
+	struct avp * olr;
+	struct timespec now;
+	union avp_value val;
+	uint32_t reduction;
+	uint64_t seq;
+	
+	TRACE_ENTRY("%p %p", ans, qry);
+	
+	CHECK_FCT( doic_scan(qry, &f) );
+	if (!f.sf)
+		return 0;
+	
+	/* Only our own answers, a DOIC node upstream reports for itself */
+	CHECK_FCT( doic_scan(ans, &f) );
+	if (f.sf || !f.oh || fd_os_cmp(f.oh->avp_value->os.data, f.oh->avp_value->os.len, fd_g_config->cnf_diamid, fd_g_config->cnf_diamid_len))
+		return 0;
+	
+	CHECK_FCT( doic_add_sf(ans) );
+	
+	CHECK_SYS( clock_gettime(CLOCK_REALTIME, &now) );
+	CHECK_POSIX( pthread_mutex_lock(&rep.lock) );
+	doic_evaluate(&now);
+	reduction = rep.reduction;
+	seq = rep.seq;
+	if (!reduction && !TS_IS_INFERIOR(&now, &rep.end))
+		seq = 0;
+	CHECK_POSIX( pthread_mutex_unlock(&rep.lock) );
+	
+	if (!seq)
+		return 0;
+	
+	CHECK_FCT( fd_msg_avp_new(d_olr, 0, &olr) );
+	val.u64 = seq;
+	CHECK_FCT_DO( doic_avp_add(olr, d_sn, &val), goto error );
+	val.i32 = ACV_OC_HOST_REPORT;
+	CHECK_FCT_DO( doic_avp_add(olr, d_rt, &val), goto error );
+	val.u32 = reduction;
+	CHECK_FCT_DO( doic_avp_add(olr, d_rp, &val), goto error );
+	val.u32 = reduction ? fd_g_config->cnf_doic_validity : 0;
+	CHECK_FCT_DO( doic_avp_add(olr, d_vd, &val), goto error );
+	CHECK_FCT_DO( fd_msg_avp_add(ans, MSG_BRW_LAST_CHILD, olr), goto error );
+	return 0;
+	
+error:
+	fd_msg_free(olr);
+	return ENOMEM;
+}
+
+int fd_doic_init(void)
+{
+	struct dictionary * dict = fd_g_config->cnf_dict;
+	
+	CHECK_FCT( fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "OC-Supported-Features", &d_sf, ENOENT) );
+	CHECK_FCT( fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "OC-Feature-Vector", &d_fv, ENOENT) );
+	CHECK_FCT( fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "OC-OLR", &d_olr, ENOENT) );
+	CHECK_FCT( fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "OC-Sequence-Number", &d_sn, ENOENT) );
+	CHECK_FCT( fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "OC-Validity-Duration", &d_vd, ENOENT) );
+	CHECK_FCT( fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "OC-Report-Type", &d_rt, ENOENT) );
+	CHECK_FCT( fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "OC-Reduction-Percentage", &d_rp, ENOENT) );
+	
+	return 0;
+}
+
+void fd_doic_fini(void)
+{
+	CHECK_POSIX_DO( pthread_rwlock_wrlock(&doic_olrs_lock), );
+	while (!FD_IS_LIST_EMPTY(&doic_olrs)) {
+		struct doic_olr * o = (struct doic_olr *)doic_olrs.next;
+		fd_list_unlink(&o->chain);
+		free(o->id);
+		free(o);
+	}
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&doic_olrs_lock), );
+}
@@ -38,6 +38,12 @@
 /* Events are a subset of fifo queues, with a known type */
 
 int fd_event_send(struct fifo *queue, int code, size_t datasz, void * data)
+{
+	return fd_event_send_prio(queue, 0, code, datasz, data);
+}
+
+/* Same, the event overtakes the ones of a lower priority already queued */
+int fd_event_send_prio(struct fifo *queue, int prio, int code, size_t datasz, void * data)
 {
 	struct fd_event * ev;
 	int ret = 0;
@@ -45,7 +51,25 @@ int fd_event_send(struct fifo *queue, int code, size_t datasz, void * data)
 	ev->code = code;
 	ev->size = datasz;
 	ev->data = data;
-	CHECK_FCT_DO( ret = fd_fifo_post(queue, &ev), { free(ev); return ret; } );
+	CHECK_FCT_DO( ret = fd_fifo_post_prio(queue, (void **)&ev, prio), { free(ev); return ret; } );
+	return 0;
+}
+
+/* Same, but return EWOULDBLOCK instead of waiting when the queue is full. The data is not consumed in this case */
+int fd_event_trysend_prio(struct fifo *queue, int prio, int code, size_t datasz, void * data)
+{
+	struct fd_event * ev;
+	int ret = 0;
+	CHECK_MALLOC( ev = malloc(sizeof(struct fd_event)) );
+	ev->code = code;
+	ev->size = datasz;
+	ev->data = data;
+	ret = fd_fifo_trypost(queue, (void **)&ev, prio);
+	if (ret == EWOULDBLOCK) {
+		free(ev);
+		return ret;
+	}
+	CHECK_FCT_DO( ret, { free(ev); return ret; } );
 	return 0;
 }
 
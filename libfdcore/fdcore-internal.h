@@ -40,6 +40,7 @@
 
 #include <freeDiameter/freeDiameter-host.h>
 #include <freeDiameter/libfdcore.h>
+#include <sys/un.h>
 
 #ifdef DISABLE_SCTP
 #undef IPPROTO_SCTP
@@ -80,6 +81,15 @@
 #define MY_VENDOR_ID	0 	/* Reserved value to tell it must be ignored */
 #endif /* MY_VENDOR_ID */
 
+/* Maximum number of messages and of bytes the out thread sends with a single call to fd_cnx_sendv.
+ The p_tosend queue of each peer holds up to OUT_BATCH_MAX_MSG messages, so that a full batch can build up. */
+#ifndef OUT_BATCH_MAX_MSG
+#define OUT_BATCH_MAX_MSG	64
+#endif /* OUT_BATCH_MAX_MSG */
+#ifndef OUT_BATCH_MAX_BYTES
+#define OUT_BATCH_MAX_BYTES	65536
+#endif /* OUT_BATCH_MAX_BYTES */
+
 
 
 /* Configuration */
@@ -111,6 +121,20 @@ extern struct fifo * fd_g_local; /* messages to be handled to local extensions *
 int fd_queues_init(void);
 int fd_queues_init_after_conf(void);
 int fd_queues_fini(struct fifo ** queue);
+int fd_queues_post(struct fifo * queue, struct msg ** msg);
+
+/* Pool of buffers for the received messages */
+uint8_t * fd_rcvbuf_alloc(size_t size);
+void fd_rcvbuf_free(void * buf);
+void fd_rcvbuf_fini(void);
+
+/* I/O engine */
+void fd_ioloop_fini(void);
+void fd_uring_fini(void);
+
+/* Events */
+int fd_event_send_prio(struct fifo *queue, int prio, int code, size_t datasz, void * data);
+int fd_event_trysend_prio(struct fifo *queue, int prio, int code, size_t datasz, void * data);
 
 /* Triggered events */
 int fd_event_trig_call_cb(int trigger_val);
@@ -124,17 +148,40 @@ int fd_rtdisp_init(void);
 int fd_rtdisp_cleanstop(void);
 int fd_rtdisp_fini(void);
 int fd_rtdisp_cleanup(void);
+int fd_rtdisp_backlog(int * current_count, long long * total_count, struct timespec * total);
+int fd_rtdisp_shed(struct msg ** pmsg);
+int fd_rtdisp_shed_due(struct msg * msg, int * due);
+
+/* Overload control (RFC 7683) */
+int fd_doic_init(void);
+void fd_doic_fini(void);
+int fd_doic_request(struct msg * msg, struct fd_list * candidates);
+int fd_doic_answer_in(struct msg * msg);
+int fd_doic_answer_out(struct msg * ans, struct msg * qry);
 
 /* Sentinel for the sent requests list */
 struct sr_list {
-	struct fd_list 	srs; /* requests ordered by hop-by-hop id */
-	struct fd_list  exp; /* requests that have a timeout set, ordered by timeout */
+	struct fd_list 	srs; /* requests in the order they were sent (so, by hop-by-hop id) */
+	struct fd_list *hbh_tbl; /* hash table of the requests by hop-by-hop id, for fast retrieval of answered requests */
+	uint32_t	hbh_tbl_size; /* number of buckets in hbh_tbl, always a power of 2 */
 	long            cnt; /* number of requests in the srs list */
 	long		cnt_lost; /* number of requests that have not been answered in time. 
 				     It is decremented when an unexpected answer is received, so this may not be accurate. */
-	pthread_mutex_t	mtx; /* mutex to protect these lists */
-	pthread_cond_t  cnd; /* cond var used by the thread that handles timeouts */
-	pthread_t       thr; /* the thread that handles timeouts (expirecb called in separate forked threads) */
+	long		win; /* if PeerWindow is set, number of requests the peer is trusted with currently (AIMD between 1 and PeerWindow) */
+	long		win_acks; /* answers received since the window was last increased */
+	long		win_sent; /* requests sent since the window was last decreased */
+	long		resv; /* if PeerWindow is set, requests routed to the peer and not stored in the list yet (see fd_p_sr_reserve) */
+	pthread_mutex_t	mtx; /* mutex to protect these lists. The timeouts are handled in a timer wheel shared by all peers, see p_sr.c */
+};
+
+/* An additional connection to a peer, when config.pic_lanes > 1 (see p_lane.c). It shares p_tosend and p_sr with
+ the principal connection of the peer, and its received messages go to p_events as well. */
+struct fd_lane {
+	struct fd_peer	*peer;
+	int		 idx;		/* 1 to pic_lanes - 1, for the logs */
+	struct cnxctx	*cnx;
+	pthread_t	 outthr;	/* the out thread sending on this connection */
+	pthread_mutex_t	 sendlock;	/* held by outthr while sending */
 };
 
 /* Peers */
@@ -155,6 +202,7 @@ struct fd_peer { /* The "real" definition of the peer structure */
 	pthread_mutex_t  p_state_mtx;
 	
 	/* Chaining in peers sublists */
+	struct fd_list	 p_hash;	/* hash index of fd_g_peers by case-folded Diameter Identity, see peers.c */
 	struct fd_list	 p_actives;	/* list of peers in the STATE_OPEN state -- used by routing */
 	struct fd_list	 p_expiry; 	/* list of expiring peers, ordered by their timeout value */
 	struct timespec	 p_exp_timer;	/* Timestamp where the peer will expire; updated each time activity is seen on the peer (except DW) */
@@ -170,6 +218,8 @@ struct fd_peer { /* The "real" definition of the peer structure */
 		unsigned pf_cnx_pb	: 1;	/* The peer was disconnected because of watchdogs; must exchange 3 watchdogs before putting back to normal */
 		unsigned pf_reopen_cnt	: 2;	/* remaining DW to be exchanged after re-established connection */
 		
+		unsigned pf_initiator	: 1;	/* We sent the CER of the current connection, so we open its lanes */
+		
 	}		 p_flags;
 	
 	/* The events queue, peer state machine thread, timer for states timeouts */
@@ -181,13 +231,22 @@ struct fd_peer { /* The "real" definition of the peer structure */
 	struct fifo	*p_tosend;
 	pthread_t	 p_outthr;
 	
-	/* The next hop-by-hop id value for the link, only read & modified by p_outthr */
+	/* Serializes the sending between p_outthr and the callers of fd_out_send that send directly when the queue is idle */
+	pthread_mutex_t	 p_sendlock;
+	int		 p_tosend_cnt;	/* messages posted in p_tosend and not yet sent by p_outthr (atomic) */
+	
+	/* The next hop-by-hop id value for the link, allocated atomically by the out threads */
 	uint32_t	 p_hbh;
 	
-	/* Sent requests (for fallback), list of struct sentreq ordered by hbh */
+	/* Sent requests (for fallback), list of struct sentreq ordered by hbh, and hashed by hbh */
 	struct sr_list	 p_sr;
 	struct fifo	*p_tofailover;
 	
+	/* Received messages waiting for routing, when they are fair queued (see queues.c) */
+	struct fifo	*p_rtin;	/* created on first use */
+	struct fd_list	 p_rtin_li;	/* link in the round of the peers with a backlog */
+	long		 p_rtin_deficit;	/* bytes this peer may still get routed in the current round */
+	
 	/* Pending received requests not yet answered (count only) */
 	long		 p_reqin_count; /* We use p_state_mtx to protect this value */
 	
@@ -203,6 +262,12 @@ struct fd_peer { /* The "real" definition of the peer structure */
 	/* connection context: socket and related information */
 	struct cnxctx	*p_cnxctx;
 	
+	/* Additional connections to the peer, only changed by the PSM thread */
+	struct fd_lane	*p_lanes;	/* array of config.pic_lanes - 1 entries, allocated with the first lane */
+	int		 p_lanes_cnt;	/* number of lanes established */
+	pthread_t	 p_lanes_thr;	/* initiator side: the thread opening the lanes. Responder side: the one handshaking p_lane_cnx */
+	struct cnxctx	*p_lane_cnx;	/* responder side: the additional connection being handshaked */
+	
 	/* Callback for peer validation after the handshake */
 	int		(*p_cb2)(struct peer_info *);
 	
@@ -243,6 +308,9 @@ enum {
 	/* A connection attempt (initiator side) has failed */
 	,FDEVP_CNX_FAILED
 	
+	/* An additional connection to the peer has completed its capabilities exchange (event data is the cnxctx object) */
+	,FDEVP_LANE_ESTABLISHED
+	
 	/* The PSM state is expired */
 	,FDEVP_PSM_TIMEOUT
 	
@@ -261,6 +329,7 @@ const char * fd_pev_str(int event)			\
 		case_str(FDEVP_CNX_INCOMING);		\
 		case_str(FDEVP_CNX_ESTABLISHED);	\
 		case_str(FDEVP_CNX_FAILED);		\
+		case_str(FDEVP_LANE_ESTABLISHED);	\
 		case_str(FDEVP_PSM_TIMEOUT);		\
 	}						\
 	TRACE_DEBUG(FULL, "Unknown event : %d", event);	\
@@ -276,13 +345,17 @@ struct cnx_incoming {
 };
 
 /* Functions */
+int  fd_peer_init();
 int  fd_peer_fini();
 int  fd_peer_fini_force();
 int  fd_peer_alloc(struct fd_peer ** ptr);
 int  fd_peer_free(struct fd_peer ** ptr);
+void fd_peer_unindex(struct fd_peer * p);
 int fd_peer_handle_newCER( struct msg ** cer, struct cnxctx ** cnx );
 /* fd_peer_add declared in freeDiameter.h */
 int fd_peer_validate( struct fd_peer * peer );
+int fd_peer_known_addr_add(sSA * sa);
+int fd_peer_known_addr(sSA * sa);
 void fd_peer_failover_msg(struct fd_peer * peer);
 
 /* Peer expiry */
@@ -299,10 +372,23 @@ void fd_psm_next_timeout(struct fd_peer * peer, int add_random, int delay);
 int fd_psm_change_state(struct fd_peer * peer, int new_state);
 void fd_psm_cleanup(struct fd_peer * peer, int terminate);
 
+/* Fair queuing of the received messages */
+int fd_queues_post_in(struct fd_peer * peer, struct msg ** msg);
+int fd_queues_get_in(void * item, struct msg ** msg);
+void fd_queues_peer_fini(struct fd_peer * peer);
+
 /* Peer out */
 int fd_out_send(struct msg ** msg, struct cnxctx * cnx, struct fd_peer * peer, int update_reqin_cnt);
 int fd_out_start(struct fd_peer * peer);
 int fd_out_stop(struct fd_peer * peer);
+int fd_out_lane_start(struct fd_lane * lane);
+int fd_out_lane_stop(struct fd_lane * lane);
+
+/* Additional connections to a peer */
+int fd_lanes_start(struct fd_peer * peer);
+void fd_lanes_stop(struct fd_peer * peer);
+int fd_lanes_add(struct fd_peer * peer, struct cnxctx ** cnx);
+void fd_lanes_clear(struct fd_peer * peer);
 
 /* Initiating connections */
 int fd_p_cnx_init(struct fd_peer * peer);
@@ -313,14 +399,19 @@ int fd_p_sr_store(struct sr_list * srlist, struct msg **req, uint32_t *hbhloc, u
 int fd_p_sr_fetch(struct sr_list * srlist, uint32_t hbh, struct msg **req);
 int fd_p_sr_start(struct sr_list * srlist);
 int fd_p_sr_stop(struct sr_list * srlist);
+int fd_p_sr_fini(void);
 void fd_p_sr_failover(struct sr_list * srlist);
 void fd_p_sr_on_disconnect(struct sr_list * srlist);
+void fd_p_sr_window(struct sr_list * srlist, long * win, long * cnt);
+int fd_p_sr_reserve(struct sr_list * srlist);
+void fd_p_sr_unreserve(struct sr_list * srlist, struct msg * msg);
 
 /* Local Link messages (CER/CEA, DWR/DWA, DPR/DPA) */
 int fd_p_ce_msgrcv(struct msg ** msg, int req, struct fd_peer * peer);
 int fd_p_ce_handle_newCER(struct msg ** msg, struct fd_peer * peer, struct cnxctx ** cnx, int valid);
 int fd_p_ce_handle_newcnx(struct fd_peer * peer, struct cnxctx * initiator);
 int fd_p_ce_process_receiver(struct fd_peer * peer);
+int fd_p_ce_lane_open(struct fd_peer * peer, struct cnxctx * cnx);
 void fd_p_ce_clear_cnx(struct fd_peer * peer, struct cnxctx ** cnx_kept);
 int fd_p_dw_handle(struct msg ** msg, int req, struct fd_peer * peer);
 int fd_p_dw_timeout(struct fd_peer * peer);
@@ -333,6 +424,28 @@ int fd_p_dp_newdelay(struct fd_peer * peer);
 extern struct fd_list fd_g_activ_peers;
 extern pthread_rwlock_t fd_g_activ_peers_rw; /* protect the list */
 
+/* Entry of the realm routing table (RFC 6733 section 2.7), built from the realms and applications advertised in CER/CEA */
+struct fd_rt_realm {
+	DiamId_t		realm;
+	size_t			realmlen;
+	application_id_t	app;	/* AI_RELAY for the entry listing only the relays of the realm */
+	int			nb;
+	struct rtd_candidate  * c;	/* the peers of the realm advertising app, and its relays, ordered by diamid */
+};
+
+/* Immutable snapshot of the active peers for the routing, rebuilt when a peer enters or leaves the OPEN state */
+struct fd_actives {
+	int			refcnt;	/* atomic; one reference is held while this is the current snapshot */
+	int			nb;
+	struct rtd_candidate  * c;	/* all the active peers, ordered by diamid */
+	int			nrt;
+	struct fd_rt_realm    * rt;	/* the realm routing table, ordered by fd_rt_realm_cmp then app */
+	/* the arrays and the strings follow in the same allocation */
+};
+int  fd_psm_actives_get(struct fd_actives ** snap); /* *snap is NULL when there is no active peer */
+void fd_psm_actives_release(void * snap);
+int  fd_rt_realm_cmp(uint8_t * r1, size_t r1len, uint8_t * r2, size_t r2len);
+
 
 /* Server sockets */
 int  fd_servers_start();
@@ -341,18 +454,24 @@ int  fd_servers_stop();
 /* Connection contexts -- there are also definitions in cnxctx.h for the relevant files */
 struct cnxctx * fd_cnx_serv_tcp(uint16_t port, int family, struct fd_endpoint * ep);
 struct cnxctx * fd_cnx_serv_sctp(uint16_t port, struct fd_list * ep_list);
+struct cnxctx * fd_cnx_serv_local(char * path);
 int             fd_cnx_serv_listen(struct cnxctx * conn);
 struct cnxctx * fd_cnx_serv_accept(struct cnxctx * serv);
 struct cnxctx * fd_cnx_cli_connect_tcp(sSA * sa, socklen_t addrlen);
 struct cnxctx * fd_cnx_cli_connect_sctp(int no_ip6, uint16_t port, struct fd_list * list, struct fd_list * src_list);
+struct cnxctx * fd_cnx_cli_connect_local(char * path);
 int             fd_cnx_start_clear(struct cnxctx * conn, int loop);
 void		fd_cnx_sethostname(struct cnxctx * conn, DiamId_t hn);
 int		fd_cnx_proto_info(struct cnxctx * conn, char * buf, size_t len);
 #define ALGO_HANDSHAKE_DEFAULT	0 /* TLS for TCP, DTLS for SCTP */
 #define ALGO_HANDSHAKE_3436	1 /* For TLS for SCTP also */
 int             fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority, void * alt_creds);
+int             fd_cnx_handshake_nb(struct cnxctx * conn, int mode, int algo, char * priority, void * alt_creds);
+int             fd_cnx_handshake_step(struct cnxctx * conn);
+int             fd_cnx_tls_start(struct cnxctx * conn);
 char *          fd_cnx_getid(struct cnxctx * conn);
 int		fd_cnx_getproto(struct cnxctx * conn);
+int		fd_cnx_islocal(struct cnxctx * conn);
 int		fd_cnx_getTLS(struct cnxctx * conn);
 int		fd_cnx_is_unordered_delivery_supported(struct cnxctx * conn);
 int		fd_cnx_unordered_delivery(struct cnxctx * conn, int is_allowed);
@@ -360,11 +479,14 @@ int             fd_cnx_getcred(struct cnxctx * conn, const gnutls_datum_t **cert
 int 		fd_cnx_get_local_eps(struct fd_list * list);
 int             fd_cnx_getremoteeps(struct cnxctx * conn, struct fd_list * eps);
 char *          fd_cnx_getremoteid(struct cnxctx * conn);
-int             fd_cnx_receive(struct cnxctx * conn, struct timespec * timeout, unsigned char **buf, size_t * len);
+int             fd_cnx_receive(struct cnxctx * conn, struct timespec * timeout, unsigned char **buf, size_t * len); /* release *buf with fd_rcvbuf_free */
 int             fd_cnx_recv_setaltfifo(struct cnxctx * conn, struct fifo * alt_fifo); /* send FDEVP_CNX_MSG_RECV event to the fifo list */
 int             fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len);
+int             fd_cnx_sendv(struct cnxctx * conn, const struct iovec * iov, int iovcnt);
+int             fd_cnx_sendv_sess(struct cnxctx * conn, const struct iovec * iov, int iovcnt, uint32_t * sess); /* sess[i]: hash of the Session-Id, for the SCTP stream */
 void            fd_cnx_destroy(struct cnxctx * conn);
 int             fd_tls_verify_credentials_2(gnutls_session_t session);
+void            fd_tls_resume_fini(void);
 
 /* Internal calls of the hook mechanism */
 void   fd_hook_call(enum fd_hook_type type, struct msg * msg, struct fd_peer * peer, void * other, struct fd_msg_pmdl * pmdl);
@@ -106,21 +106,44 @@ struct peer_info fddpi;
 %token		NOSCTP
 %token		PREFERTCP
 %token		OLDTLS
+%token		KERNELTLS
+%token		NORESUME
 %token		NOTLS
 %token		SCTPSTREAMS
+%token		SCTPSESSSTREAMS
 %token		APPSERVTHREADS
 %token		ROUTINGINTHREADS
 %token		ROUTINGOUTTHREADS
+%token		APPSERVTHREADSMAX
+%token		ROUTINGINTHREADSMAX
+%token		ROUTINGOUTTHREADSMAX
+%token		FUSEDPIPELINE
+%token		IOENGINE
+%token		IOENGINETHREADS
 %token		QINLIMIT
 %token		QOUTLIMIT
 %token		QLOCALLIMIT
+%token		QPEERLIMIT
+%token		QPEERSHED
+%token		OVLCTRL
+%token		OVLDEPTH
+%token		OVLLATENCY
+%token		OVLVALIDITY
+%token		MAXRESIDENCE
+%token		PEERWINDOW
+%token		WEIGHT
+%token		LANES
+%token		CLEARLANES
 %token		LISTENON
+%token		LOCALSOCKET
 %token		THRPERSRV
 %token		PROCESSINGPEERSPATTERN
 %token		PROCESSINGPEERSMINIMUM
 %token		TCTIMER
 %token		TWTIMER
 %token		NORELAY
+%token		REALMROUTING
+%token		SESSIONAFFINITY
 %token		LOADEXT
 %token		CONNPEER
 %token		CONNTO
@@ -148,23 +171,41 @@ conffile:		/* Empty is OK -- for simplicity here, we reject in daemon later */
 			| conffile secport
 			| conffile sec3436
 			| conffile sctpstreams
+			| conffile sctpsessstreams
 			| conffile listenon
+			| conffile localsocket
 			| conffile thrpersrv
 			| conffile processingpeerspattern
 			| conffile processingpeersminimum
 			| conffile norelay
+			| conffile realmrouting
+			| conffile sessionaffinity
 			| conffile appservthreads
 			| conffile routinginthreads
 			| conffile routingoutthreads
+			| conffile threadsmax
+			| conffile fusedpipeline
+			| conffile ioengine
+			| conffile ioenginethreads
 			| conffile qinlimit
 			| conffile qoutlimit
 			| conffile qlocallimit
+			| conffile qpeerlimit
+			| conffile qpeershed
+			| conffile ovlctrl
+			| conffile ovldepth
+			| conffile ovllatency
+			| conffile ovlvalidity
+			| conffile maxresidence
+			| conffile peerwindow
 			| conffile noip
 			| conffile noip6
 			| conffile notcp
 			| conffile nosctp
 			| conffile prefertcp
 			| conffile oldtls
+			| conffile kerneltls
+			| conffile noresume
 			| conffile loadext
 			| conffile connpeer
 			| conffile tls_cred
@@ -245,6 +286,21 @@ sctpstreams:		SCTPSTREAMS '=' INTEGER ';'
 			}
 			;
 
+sctpsessstreams:	SCTPSESSSTREAMS ';'
+			{
+				conf->cnf_flags.sctp_sess = 1;
+			}
+			;
+
+localsocket:		LOCALSOCKET '=' QSTRING ';'
+			{
+				CHECK_PARAMS_DO( (strlen($3) > 0) && (strlen($3) < sizeof(((struct sockaddr_un *)0)->sun_path)),
+					{ yyerror (&yylloc, conf, "Invalid LocalSocket path"); free($3); YYERROR; } );
+				free(conf->cnf_local_path);
+				conf->cnf_local_path = $3;
+			}
+			;
+
 listenon:		LISTENON '=' QSTRING ';'
 			{
 				struct addrinfo hints, *ai;
@@ -313,6 +369,18 @@ norelay:		NORELAY ';'
 			}
 			;
 
+realmrouting:		REALMROUTING ';'
+			{
+				conf->cnf_flags.rt_realm = 1;
+			}
+			;
+
+sessionaffinity:	SESSIONAFFINITY ';'
+			{
+				conf->cnf_flags.sess_aff = 1;
+			}
+			;
+
 appservthreads:		APPSERVTHREADS '=' INTEGER ';'
 			{
 				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
@@ -337,6 +405,71 @@ routingoutthreads:		ROUTINGOUTTHREADS '=' INTEGER ';'
 			}
 			;
 
+threadsmax:		APPSERVTHREADSMAX '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_dispthr_max = (uint16_t)$3;
+			}
+			| ROUTINGINTHREADSMAX '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_rtinthr_max = (uint16_t)$3;
+			}
+			| ROUTINGOUTTHREADSMAX '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_rtoutthr_max = (uint16_t)$3;
+			}
+			;
+
+fusedpipeline:		FUSEDPIPELINE '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_fuse = (uint16_t)$3;
+			}
+			;
+
+ioengine:		IOENGINE '=' QSTRING ';'
+			{
+				if (!strcasecmp($3, "threads")) {
+					conf->cnf_io_engine = FD_IO_THREADS;
+				} else if (!strcasecmp($3, "epoll")) {
+#ifdef HAVE_EPOLL
+					conf->cnf_io_engine = FD_IO_EPOLL;
+#else /* HAVE_EPOLL */
+					yyerror (&yylloc, conf, "The epoll I/O engine is not available on this system");
+					free($3);
+					YYERROR;
+#endif /* HAVE_EPOLL */
+				} else if (!strcasecmp($3, "io_uring")) {
+#ifdef HAVE_IO_URING
+					conf->cnf_io_engine = FD_IO_URING;
+#else /* HAVE_IO_URING */
+					yyerror (&yylloc, conf, "The io_uring I/O engine was not built (see ENABLE_IO_URING)");
+					free($3);
+					YYERROR;
+#endif /* HAVE_IO_URING */
+				} else {
+					yyerror (&yylloc, conf, "Invalid value, expected \"threads\", \"epoll\" or \"io_uring\"");
+					free($3);
+					YYERROR;
+				}
+				free($3);
+			}
+			;
+
+ioenginethreads:	IOENGINETHREADS '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_io_thr = (uint16_t)$3;
+			}
+			;
+
 qinlimit:		QINLIMIT '=' INTEGER ';'
 			{
 				CHECK_PARAMS_DO( ($3 >= 0),
@@ -361,6 +494,66 @@ qlocallimit:		QLOCALLIMIT '=' INTEGER ';'
 			}
 			;
 
+qpeerlimit:		QPEERLIMIT '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_qpeer_limit = $3;
+			}
+			;
+
+qpeershed:		QPEERSHED ';'
+			{
+				conf->cnf_flags.qpeer_shed = 1;
+			}
+			;
+
+ovlctrl:		OVLCTRL ';'
+			{
+				conf->cnf_flags.doic = 1;
+			}
+			;
+
+ovldepth:		OVLDEPTH '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_doic_depth = $3;
+			}
+			;
+
+ovllatency:		OVLLATENCY '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_doic_latency = $3;
+			}
+			;
+
+ovlvalidity:		OVLVALIDITY '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 > 0) && ($3 <= 86400),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_doic_validity = (uint32_t)$3;
+			}
+			;
+
+maxresidence:		MAXRESIDENCE '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_max_residence = $3;
+			}
+			;
+
+peerwindow:		PEERWINDOW '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_peer_window = $3;
+			}
+			;
+
 noip:			NOIP ';'
 			{
 				if (got_peer_noipv6) { 
@@ -427,6 +620,18 @@ oldtls:			OLDTLS ';'
 			}
 			;
 
+kerneltls:		KERNELTLS ';'
+			{
+				conf->cnf_flags.ktls = 1;
+			}
+			;
+
+noresume:		NORESUME ';'
+			{
+				conf->cnf_flags.no_resume = 1;
+			}
+			;
+
 loadext:		LOADEXT '=' QSTRING extconf ';'
 			{
 				char * fname;
@@ -506,6 +711,7 @@ connpeer:		{
 				free(fddpi.pi_diamid);
 				free(fddpi.config.pic_realm);
 				free(fddpi.config.pic_priority);
+				free(fddpi.config.pic_local_path);
 				while (!FD_IS_LIST_EMPTY(&fddpi.pi_endpoints)) {
 					struct fd_list * li = fddpi.pi_endpoints.next;
 					fd_list_unlink(li);
@@ -593,10 +799,32 @@ peerparams:		/* empty */
 			{
 				fddpi.config.pic_twtimer = $4;
 			}
+			| peerparams WEIGHT '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($4 > 0) && ($4 < 1<<16),
+					{ yyerror (&yylloc, conf, "Invalid weight value"); YYERROR; } );
+				fddpi.config.pic_weight = (uint16_t)$4;
+			}
+			| peerparams LANES '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($4 > 0) && ($4 <= 16),
+					{ yyerror (&yylloc, conf, "Invalid lanes value, must be between 1 and 16"); YYERROR; } );
+				fddpi.config.pic_lanes = (uint16_t)$4;
+			}
+			| peerparams CLEARLANES ';'
+			{
+				fddpi.config.pic_flags.clrlanes = 1;
+			}
 			| peerparams TLS_PRIO '=' QSTRING ';'
 			{
 				fddpi.config.pic_priority = $4;
 			}
+			| peerparams LOCALSOCKET '=' QSTRING ';'
+			{
+				CHECK_PARAMS_DO( (strlen($4) > 0) && (strlen($4) < sizeof(((struct sockaddr_un *)0)->sun_path)),
+					{ yyerror (&yylloc, conf, "Invalid LocalSocket path"); free($4); YYERROR; } );
+				fddpi.config.pic_local_path = $4;
+			}
 			| peerparams CONNTO '=' QSTRING ';'
 			{
 				struct addrinfo hints, *ai;
@@ -65,6 +65,23 @@ int fd_stat_getstats(enum fd_stat_type stat, struct peer_hdr * peer,
 		}
 		break;
 
+		case STAT_P_INCOMING: {
+			CHECK_PARAMS( CHECK_PEER( peer ) );
+			if (!p->p_rtin) {
+				/* nothing was received yet, or the messages are not fair queued */
+				if (current_count) *current_count = 0;
+				if (limit_count) *limit_count = fd_g_config->cnf_qpeer_limit;
+				if (highest_count) *highest_count = 0;
+				if (total_count) *total_count = 0;
+				if (total) memset(total, 0, sizeof(struct timespec));
+				if (blocking) memset(blocking, 0, sizeof(struct timespec));
+				if (last) memset(last, 0, sizeof(struct timespec));
+				break;
+			}
+			CHECK_FCT( fd_fifo_getstats(p->p_rtin, current_count, limit_count, highest_count, total_count, total, blocking, last) );
+		}
+		break;
+
 		case STAT_P_TOSEND: {
 			CHECK_PARAMS( CHECK_PEER( peer ) );
 			CHECK_FCT( fd_fifo_getstats(p->p_tosend, current_count, limit_count, highest_count, total_count, total, blocking, last) );
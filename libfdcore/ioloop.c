@@ -0,0 +1,412 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* The epoll I/O engine.
+ *
+ * By default, each connection has its own receiver thread (see cnxctx.c). When IOEngine = "epoll" is configured, the
+ * TCP connections (clear or TLS) that are in the steady state are instead handed to a small pool of loop threads,
+ * each one waiting on its own epoll set. When a socket becomes readable, the loop thread reads all the available
+ * data without blocking, re-builds the messages (fd_cnx_rcv_nb) and posts them to the connection's target queue, as
+ * the receiver thread would do. Sending is not changed (the out thread of the peer writes directly).
+ *
+ * The loop thread never waits for room in a target queue, since this would stall all the connections of the loop.
+ * When the queue of a connection is full, its socket is removed from the epoll set and the delivery is retried
+ * when the consumer signals some room (fd_ioloop_room), or every IOLOOP_STALL_RETRY ms otherwise.
+ *
+ * The connections in non-loop mode (waiting for a single message) and the SCTP associations still use a receiver thread.
+ */
+
+#include "fdcore-internal.h"
+#include "cnxctx.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Max events processed per call to epoll_wait */
+#ifndef IOLOOP_MAX_EVENTS
+#define IOLOOP_MAX_EVENTS	64
+#endif /* IOLOOP_MAX_EVENTS */
+
+/* Max number of reads on a connection before serving the other ones */
+#ifndef IOLOOP_BUDGET
+#define IOLOOP_BUDGET		16
+#endif /* IOLOOP_BUDGET */
+
+/* How often we retry the delivery on the connections whose target queue is full */
+#ifndef IOLOOP_STALL_RETRY
+#define IOLOOP_STALL_RETRY	10	/* ms */
+#endif /* IOLOOP_STALL_RETRY */
+
+/* How long we wait for the end of a TLS session when the connection is closed, as the receiver thread would */
+#ifndef IOLOOP_CLOSE_WAIT
+#define IOLOOP_CLOSE_WAIT	200	/* ms */
+#endif /* IOLOOP_CLOSE_WAIT */
+
+/* A loop thread */
+struct ioloop {
+	int		epfd;	/* the epoll set */
+	int		evfd;	/* eventfd to wake up the thread */
+	pthread_t	thr;
+	pthread_mutex_t	mtx;	/* held by the thread while it processes events */
+	pthread_cond_t	cnd;	/* signaled when the reception ends on a connection */
+	struct fd_list	kick;	/* connections to process without waiting for an event */
+	struct fd_list	stalled;/* connections waiting for room in their target queue */
+	struct fd_list	dead;	/* entries removed, to be freed after the current round */
+};
+
+/* A connection handled by the engine */
+struct ioloop_ent {
+	struct fd_list		chain;	/* link in loop->kick, loop->stalled or loop->dead. o points to the entry */
+	struct ioloop *		loop;
+	struct cnxctx *		conn;	/* NULL once removed */
+	int			done;	/* the reception is over, the socket was removed from the epoll set */
+	int			stalled;/* the target queue is full, the socket is out of the epoll set meanwhile (atomic) */
+	struct fd_cnx_rcvstate	st;
+};
+
+static struct ioloop *	ioloops = NULL;
+static int		ioloops_nb = 0;
+static unsigned		ioloops_next = 0;
+static pthread_mutex_t	ioloops_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Receive the data of a connection. Called with loop->mtx locked */
+static void ioloop_process(struct ioloop * loop, struct ioloop_ent * ent)
+{
+	int ret = 0, i;
+
+	for (i = 0; i < IOLOOP_BUDGET; i++) {
+		ret = fd_cnx_rcv_nb(ent->conn, &ent->st);
+		if (ret)
+			break;
+	}
+
+	if (ent->stalled && ((ret == 0) || (ret == EAGAIN))) {
+		/* The consumer caught up, watch the socket again */
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = ent;
+		CHECK_SYS_DO( epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ent->conn->cc_socket, &ev), { ret = ENOTCONN; fd_cnx_markerror(ent->conn); } );
+		if (ret != ENOTCONN)
+			__atomic_store_n(&ent->stalled, 0, __ATOMIC_RELEASE);
+	}
+
+	switch (ret) {
+		case 0:
+			/* There may be more data, including in the TLS buffers where epoll cannot see it; come back after the other connections */
+			if (FD_IS_LIST_EMPTY(&ent->chain))
+				fd_list_insert_before(&loop->kick, &ent->chain);
+			break;
+
+		case EAGAIN:
+			/* Wait for the next event */
+			break;
+
+		case ENOBUFS:
+			/* The target queue is full. Stop watching the socket (it would stay readable) and retry later */
+			if (!ent->stalled) {
+				CHECK_SYS_DO( epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ent->conn->cc_socket, NULL), /* continue */ );
+				__atomic_store_n(&ent->stalled, 1, __ATOMIC_RELEASE);
+			}
+			if (FD_IS_LIST_EMPTY(&ent->chain))
+				fd_list_insert_before(&loop->stalled, &ent->chain);
+			break;
+
+		default:
+			/* The reception is over on this connection */
+			if (!ent->stalled)
+				CHECK_SYS_DO( epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ent->conn->cc_socket, NULL), /* continue */ );
+			fd_cnx_rcvstate_free(&ent->st);
+			ent->done = 1;
+			CHECK_POSIX_DO( pthread_cond_broadcast(&loop->cnd), /* continue */ );
+	}
+}
+
+/* The loop thread */
+static void * ioloop_th(void * arg)
+{
+	struct ioloop * loop = arg;
+	struct epoll_event evs[IOLOOP_MAX_EVENTS];
+	int again = 0, stalled = 0;
+
+	fd_log_threadname ( "I/O engine (epoll)" );
+
+	while (1) {
+		struct fd_list kicked = FD_LIST_INITIALIZER(kicked);
+		int n, i;
+
+		n = epoll_wait(loop->epfd, evs, IOLOOP_MAX_EVENTS, again ? 0 : (stalled ? IOLOOP_STALL_RETRY : -1));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			CHECK_SYS_DO( n, break );
+		}
+
+		CHECK_POSIX_DO( pthread_mutex_lock(&loop->mtx), break );
+		pthread_cleanup_push( fd_cleanup_mutex, &loop->mtx );
+
+		for (i = 0; i < n; i++) {
+			struct ioloop_ent * ent = evs[i].data.ptr;
+			if (!ent) {
+				uint64_t val;
+				/* We were woken up to process the kick list */
+				if (read(loop->evfd, &val, sizeof(val)) < 0) {
+					/* nothing to do */
+				}
+				continue;
+			}
+			if (ent->conn && !ent->done)
+				ioloop_process(loop, ent);
+		}
+
+		/* Process the connections that could not be completed, or that were just added, and retry the stalled ones */
+		fd_list_move_end(&kicked, &loop->kick);
+		fd_list_move_end(&kicked, &loop->stalled);
+		while (!FD_IS_LIST_EMPTY(&kicked)) {
+			struct ioloop_ent * ent = kicked.next->o;
+			fd_list_unlink(&ent->chain);
+			if (ent->conn && !ent->done)
+				ioloop_process(loop, ent);
+		}
+		again = !FD_IS_LIST_EMPTY(&loop->kick);
+		stalled = !FD_IS_LIST_EMPTY(&loop->stalled);
+
+		/* No pending event can reference the removed entries anymore */
+		while (!FD_IS_LIST_EMPTY(&loop->dead)) {
+			struct ioloop_ent * ent = loop->dead.next->o;
+			fd_list_unlink(&ent->chain);
+			free(ent);
+		}
+
+		pthread_cleanup_pop( 1 );
+	}
+
+	TRACE_DEBUG(INFO, "I/O engine thread terminated");
+	return NULL;
+}
+
+/* Create the loop threads, on first use. Called with ioloops_mtx locked */
+static int ioloop_start(void)
+{
+	int i;
+
+	CHECK_PARAMS( fd_g_config->cnf_io_thr > 0 );
+	CHECK_MALLOC( ioloops = calloc(fd_g_config->cnf_io_thr, sizeof(struct ioloop)) );
+
+	for (i = 0; i < fd_g_config->cnf_io_thr; i++) {
+		struct ioloop * loop = &ioloops[i];
+		struct epoll_event ev;
+
+		CHECK_SYS( loop->epfd = epoll_create1(EPOLL_CLOEXEC) );
+		CHECK_SYS( loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) );
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		CHECK_SYS( epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) );
+		CHECK_POSIX( pthread_mutex_init(&loop->mtx, NULL) );
+		CHECK_POSIX( pthread_cond_init(&loop->cnd, NULL) );
+		fd_list_init(&loop->kick, NULL);
+		fd_list_init(&loop->stalled, NULL);
+		fd_list_init(&loop->dead, NULL);
+		CHECK_POSIX( pthread_create(&loop->thr, NULL, ioloop_th, loop) );
+		ioloops_nb++;
+	}
+
+	return 0;
+}
+
+/* Hand the reception on a connection over to the engine */
+int fd_ioloop_add(struct cnxctx * conn)
+{
+	struct ioloop_ent * ent;
+	struct ioloop * loop;
+	struct epoll_event ev;
+	uint64_t val = 1;
+	int ret = 0;
+
+	TRACE_ENTRY("%p", conn);
+	CHECK_PARAMS( conn && (conn->cc_socket > 0) && (conn->cc_proto == IPPROTO_TCP) && !conn->cc_ioloop );
+
+	/* Pick the loop */
+	CHECK_POSIX( pthread_mutex_lock(&ioloops_mtx) );
+	if (!ioloops)
+		ret = ioloop_start();
+	loop = ioloops_nb ? &ioloops[(ioloops_next++) % ioloops_nb] : NULL;
+	CHECK_POSIX( pthread_mutex_unlock(&ioloops_mtx) );
+	if (ret)
+		return ret;
+	CHECK_PARAMS( loop );
+
+	CHECK_MALLOC( ent = calloc(1, sizeof(struct ioloop_ent)) );
+	fd_list_init(&ent->chain, ent);
+	ent->loop = loop;
+	ent->conn = conn;
+	ent->st.nowait = 1;
+	conn->cc_ioloop = ent;
+
+	CHECK_POSIX( pthread_mutex_lock(&loop->mtx) );
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = ent;
+	CHECK_SYS_DO( ret = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->cc_socket, &ev), ret = __ret__ );
+	if (!ret) {
+		/* Some data may already be buffered (TLS), so process the connection once right away */
+		fd_list_insert_before(&loop->kick, &ent->chain);
+	}
+	CHECK_POSIX( pthread_mutex_unlock(&loop->mtx) );
+
+	if (ret) {
+		conn->cc_ioloop = NULL;
+		free(ent);
+		return ret;
+	}
+
+	CHECK_SYS_DO( write(loop->evfd, &val, sizeof(val)), /* the connection will be processed at the next event anyway */ );
+	return 0;
+}
+
+/* Stop receiving on a connection. If graceful, wait (a little) until the peer closes its side first. */
+void fd_ioloop_del(struct cnxctx * conn, int graceful)
+{
+	struct ioloop_ent * ent;
+	struct ioloop * loop;
+
+	TRACE_ENTRY("%p %d", conn, graceful);
+	CHECK_PARAMS_DO( conn && conn->cc_ioloop, return );
+	ent = conn->cc_ioloop;
+	loop = ent->loop;
+
+	CHECK_POSIX_DO( pthread_mutex_lock(&loop->mtx), return );
+	pthread_cleanup_push( fd_cleanup_mutex, &loop->mtx );
+
+	if (graceful && !ent->done) {
+		struct timespec ts;
+		CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), goto remove );
+		ts.tv_nsec += (IOLOOP_CLOSE_WAIT % 1000) * 1000000L;
+		ts.tv_sec  += IOLOOP_CLOSE_WAIT / 1000 + ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		while (!ent->done) {
+			int ret = pthread_cond_timedwait(&loop->cnd, &loop->mtx, &ts);
+			if (ret == ETIMEDOUT)
+				break;
+			CHECK_POSIX_DO( ret, break );
+		}
+	}
+remove:
+	if (!ent->done) {
+		if (!ent->stalled)
+			CHECK_SYS_DO( epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->cc_socket, NULL), /* continue */ );
+		fd_cnx_rcvstate_free(&ent->st);
+		ent->done = 1;
+	}
+
+	/* An event for this entry may still be pending in the loop thread, it is freed after the current round */
+	ent->conn = NULL;
+	fd_list_unlink(&ent->chain);
+	fd_list_insert_before(&loop->dead, &ent->chain);
+	conn->cc_ioloop = NULL;
+
+	pthread_cleanup_pop( 1 );
+}
+
+/* The consumer of the target queue of the connection pulled an event: retry now if the reception was paused */
+void fd_ioloop_room(struct cnxctx * conn)
+{
+	struct ioloop_ent * ent = conn->cc_ioloop;
+	struct ioloop * loop;
+	uint64_t val = 1;
+
+	if (!ent || !__atomic_load_n(&ent->stalled, __ATOMIC_ACQUIRE))
+		return;
+	loop = ent->loop;
+
+	CHECK_POSIX_DO( pthread_mutex_lock(&loop->mtx), return );
+	if (ent->conn && !ent->done) {
+		fd_list_unlink(&ent->chain);
+		fd_list_insert_before(&loop->kick, &ent->chain);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&loop->mtx), /* continue */ );
+
+	CHECK_SYS_DO( write(loop->evfd, &val, sizeof(val)), /* the entry is retried after IOLOOP_STALL_RETRY anyway */ );
+}
+
+/* Terminate the loop threads. All the connections must have been destroyed already */
+void fd_ioloop_fini(void)
+{
+	int i;
+
+	CHECK_POSIX_DO( pthread_mutex_lock(&ioloops_mtx), return );
+	for (i = 0; i < ioloops_nb; i++) {
+		struct ioloop * loop = &ioloops[i];
+		CHECK_FCT_DO( fd_thr_term(&loop->thr), /* continue */ );
+		while (!FD_IS_LIST_EMPTY(&loop->dead)) {
+			struct ioloop_ent * ent = loop->dead.next->o;
+			fd_list_unlink(&ent->chain);
+			free(ent);
+		}
+		close(loop->evfd);
+		close(loop->epfd);
+		CHECK_POSIX_DO( pthread_cond_destroy(&loop->cnd), /* continue */ );
+		CHECK_POSIX_DO( pthread_mutex_destroy(&loop->mtx), /* continue */ );
+	}
+	free(ioloops);
+	ioloops = NULL;
+	ioloops_nb = 0;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&ioloops_mtx), /* continue */ );
+}
+
+#else /* HAVE_EPOLL */
+
+int fd_ioloop_add(struct cnxctx * conn)
+{
+	TRACE_DEBUG(INFO, "The epoll I/O engine is not available on this system");
+	return ENOTSUP;
+}
+
+void fd_ioloop_del(struct cnxctx * conn, int graceful)
+{
+	ASSERT(0);
+}
+
+void fd_ioloop_room(struct cnxctx * conn)
+{
+}
+
+void fd_ioloop_fini(void)
+{
+}
+
+#endif /* HAVE_EPOLL */
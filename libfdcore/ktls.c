@@ -0,0 +1,362 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Kernel TLS offload.
+ *
+ * When KernelTLS is configured, the keys negotiated by gnutls on a TCP connection are handed to the kernel right after
+ * the handshake (TCP_ULP "tls"). The records are then protected by the kernel, and the connection is used with plain
+ * socket calls: no copy and no encryption in user space, and the I/O engines can use the socket as a clear one.
+ * gnutls is still used for the handshake and the credentials, but must not write on the session anymore. With TLS 1.3,
+ * the received records stay in gnutls, which processes the post-handshake messages (session tickets, key updates).
+ *
+ * If the kernel module is not available, or the negotiated cipher is not supported by the kernel, the connection simply
+ * keeps using gnutls.
+ */
+
+#include "fdcore-internal.h"
+#include "cnxctx.h"
+
+#ifdef HAVE_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS		282
+#endif /* SOL_TLS */
+
+/* The TLS record content types */
+#define REC_ALERT	21
+#define REC_HANDSHAKE	22
+#define REC_DATA	23
+
+/* Log the unavailability of the kernel module only once */
+static int ktls_warned = 0;
+
+/* Hand the keys of one direction of the session over to the kernel */
+static int ktls_set(struct cnxctx * conn, gnutls_protocol_t version, gnutls_cipher_algorithm_t cipher, int read)
+{
+	gnutls_datum_t mac_key, iv, key;
+	unsigned char seq[8];
+	union {
+		struct tls12_crypto_info_aes_gcm_128		gcm128;
+		struct tls12_crypto_info_aes_gcm_256		gcm256;
+		struct tls12_crypto_info_chacha20_poly1305	chacha;
+	} ci;
+	socklen_t sz = 0;
+	int ret;
+
+	CHECK_GNUTLS_DO( gnutls_record_get_state(conn->cc_tls_para.session, read, &mac_key, &iv, &key, seq), return EINVAL );
+
+	memset(&ci, 0, sizeof(ci));
+	switch (cipher) {
+		case GNUTLS_CIPHER_AES_128_GCM:
+			CHECK_PARAMS( (key.size == TLS_CIPHER_AES_GCM_128_KEY_SIZE) && (iv.size >= TLS_CIPHER_AES_GCM_128_SALT_SIZE) );
+			ci.gcm128.info.version = (version == GNUTLS_TLS1_2) ? TLS_1_2_VERSION : TLS_1_3_VERSION;
+			ci.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+			if (version == GNUTLS_TLS1_2) {
+				/* The explicit part of the nonce */
+				memcpy(ci.gcm128.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+			} else {
+				CHECK_PARAMS( iv.size == TLS_CIPHER_AES_GCM_128_SALT_SIZE + TLS_CIPHER_AES_GCM_128_IV_SIZE );
+				memcpy(ci.gcm128.iv, iv.data + TLS_CIPHER_AES_GCM_128_SALT_SIZE, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+			}
+			memcpy(ci.gcm128.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+			memcpy(ci.gcm128.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+			memcpy(ci.gcm128.key, key.data, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+			sz = sizeof(ci.gcm128);
+			break;
+
+		case GNUTLS_CIPHER_AES_256_GCM:
+			CHECK_PARAMS( (key.size == TLS_CIPHER_AES_GCM_256_KEY_SIZE) && (iv.size >= TLS_CIPHER_AES_GCM_256_SALT_SIZE) );
+			ci.gcm256.info.version = (version == GNUTLS_TLS1_2) ? TLS_1_2_VERSION : TLS_1_3_VERSION;
+			ci.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+			if (version == GNUTLS_TLS1_2) {
+				memcpy(ci.gcm256.iv, seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+			} else {
+				CHECK_PARAMS( iv.size == TLS_CIPHER_AES_GCM_256_SALT_SIZE + TLS_CIPHER_AES_GCM_256_IV_SIZE );
+				memcpy(ci.gcm256.iv, iv.data + TLS_CIPHER_AES_GCM_256_SALT_SIZE, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+			}
+			memcpy(ci.gcm256.salt, iv.data, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+			memcpy(ci.gcm256.rec_seq, seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+			memcpy(ci.gcm256.key, key.data, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+			sz = sizeof(ci.gcm256);
+			break;
+
+		case GNUTLS_CIPHER_CHACHA20_POLY1305:
+			CHECK_PARAMS( (key.size == TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE) && (iv.size == TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE) );
+			ci.chacha.info.version = (version == GNUTLS_TLS1_2) ? TLS_1_2_VERSION : TLS_1_3_VERSION;
+			ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+			memcpy(ci.chacha.iv, iv.data, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+			memcpy(ci.chacha.rec_seq, seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+			memcpy(ci.chacha.key, key.data, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+			sz = sizeof(ci.chacha);
+			break;
+
+		default:
+			ASSERT(0);
+			return ENOTSUP;
+	}
+
+	ret = setsockopt(conn->cc_socket, SOL_TLS, read ? TLS_RX : TLS_TX, &ci, sz);
+	if (ret < 0)
+		ret = errno;
+	memset(&ci, 0, sizeof(ci));	/* do not leave the keys on the stack */
+	return ret;
+}
+
+/* Transport push function of a session whose transmit direction is offloaded */
+static ssize_t ktls_push_refused(gnutls_transport_ptr_t ptr, const giovec_t * iov, int iovcnt)
+{
+	struct cnxctx * conn = ptr;
+	LOG_E("gnutls tried to send a record on '%s' after the kernel TLS offload, closing the connection", conn->cc_id);
+	errno = EPERM;
+	return -1;
+}
+
+/* Try to offload the session of a TCP connection to the kernel, after the handshake. Returns ENOTSUP if the connection
+ * must keep using gnutls. Only the transmit direction is offloaded with TLS 1.3, or if the kernel refuses the other one. */
+int fd_ktls_enable(struct cnxctx * conn)
+{
+	gnutls_session_t session;
+	gnutls_protocol_t version;
+	gnutls_cipher_algorithm_t cipher;
+	int ret;
+
+	TRACE_ENTRY("%p", conn);
+	CHECK_PARAMS( conn && (conn->cc_proto == IPPROTO_TCP) && fd_cnx_teststate(conn, CC_STATUS_TLS) && !conn->cc_ktls );
+	session = conn->cc_tls_para.session;
+
+	version = gnutls_protocol_get_version(session);
+	cipher = gnutls_cipher_get(session);
+	if (((version != GNUTLS_TLS1_2) && (version != GNUTLS_TLS1_3))
+	    || ((cipher != GNUTLS_CIPHER_AES_128_GCM) && (cipher != GNUTLS_CIPHER_AES_256_GCM) && (cipher != GNUTLS_CIPHER_CHACHA20_POLY1305))) {
+		LOG_D("Kernel TLS not used on '%s': %s / %s not supported", conn->cc_id, gnutls_protocol_get_name(version), gnutls_cipher_get_name(cipher));
+		return ENOTSUP;
+	}
+
+	/* Some application data is already decrypted in the session, keep using gnutls */
+	if (gnutls_record_check_pending(session)) {
+		LOG_D("Kernel TLS not used on '%s': data pending in the session", conn->cc_id);
+		return ENOTSUP;
+	}
+
+	if (setsockopt(conn->cc_socket, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+		ret = errno;
+		if (!ktls_warned) {
+			LOG_N("Kernel TLS is not available (%s), the TLS records are protected by gnutls", strerror(ret));
+			ktls_warned = 1;
+		}
+		return ENOTSUP;
+	}
+
+	ret = ktls_set(conn, version, cipher, 0);
+	if (ret) {
+		LOG_D("Kernel TLS transmit offload refused on '%s': %s", conn->cc_id, strerror(ret));
+		return ENOTSUP;
+	}
+	conn->cc_ktls |= FD_KTLS_TX;
+
+	/* gnutls has no key for the records sent by the kernel from now on: fail if it tries to write (e.g. to answer a key update) */
+	GNUTLS_TRACE( gnutls_transport_set_vec_push_function(session, ktls_push_refused) );
+
+	/* With TLS 1.3, the peer sends handshake messages after the handshake: the session tickets needed to resume the
+	 * session, and the key updates. Only gnutls processes them, so the receive direction stays in gnutls. */
+	if (version == GNUTLS_TLS1_3) {
+		LOG_D("Kernel TLS receive offload not used on '%s': TLS 1.3 post-handshake messages", conn->cc_id);
+	} else {
+		ret = ktls_set(conn, version, cipher, 1);
+		if (ret) {
+			LOG_D("Kernel TLS receive offload refused on '%s': %s", conn->cc_id, strerror(ret));
+		} else {
+			conn->cc_ktls |= FD_KTLS_RX;
+		}
+	}
+
+	LOG_D("Kernel TLS enabled on '%s' (%s%s)", conn->cc_id, (conn->cc_ktls & FD_KTLS_RX) ? "RX+" : "", "TX");
+	return 0;
+}
+
+/* Send an alert record */
+static int ktls_send_alert(struct cnxctx * conn, uint8_t level, uint8_t desc)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	uint8_t data[2];
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct iovec iov;
+
+	data[0] = level;
+	data[1] = desc;
+	iov.iov_base = data;
+	iov.iov_len = sizeof(data);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg) = REC_ALERT;
+	msg.msg_controllen = cmsg->cmsg_len;
+
+	CHECK_SYS( sendmsg(conn->cc_socket, &msg, MSG_NOSIGNAL) );
+	return 0;
+}
+
+/* Close the session (sends close_notify), replaces gnutls_bye(GNUTLS_SHUT_WR) */
+int fd_ktls_bye(struct cnxctx * conn)
+{
+	TRACE_ENTRY("%p", conn);
+	CHECK_PARAMS( conn && (conn->cc_ktls & FD_KTLS_TX) );
+
+	if (conn->cc_ktls & FD_KTLS_BYE)
+		return 0;
+	conn->cc_ktls |= FD_KTLS_BYE;
+	CHECK_FCT( ktls_send_alert(conn, 1 /* warning */, 0 /* close_notify */) );
+	return 0;
+}
+
+/* Receive the decrypted data on a connection with the receive direction offloaded. Same convention as the stream_recv_fct
+ * functions: returns 0 when the peer closed the session (after replying to it), -1 on error (the connection is marked), or
+ * RCV_AGAIN if nonblock is set and no data is available. The alerts are handled here, other records close the connection. */
+ssize_t fd_ktls_recv(struct cnxctx * conn, void * buffer, size_t length, int nonblock)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct iovec iov;
+	ssize_t ret;
+	int timedout = 0;
+
+again:
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ret = recvmsg(conn->cc_socket, &msg, nonblock ? MSG_DONTWAIT : 0);
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto again;
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			if (nonblock)
+				return RCV_AGAIN;
+			/* Socket timeout, same handling as fd_cnx_s_recv */
+			pthread_testcancel();
+			if (! fd_cnx_teststate(conn, CC_STATUS_CLOSING ))
+				goto again;
+			if (!timedout) {
+				timedout ++;
+				goto again;
+			}
+		}
+		CHECK_SYS_DO(ret, /* continue, this is only used to log the error here */);
+		goto error;
+	}
+	if (ret == 0) {
+		/* The TCP connection was closed without close_notify */
+		TRACE_DEBUG(FULL, "Got 0 size while reading the socket, probably connection closed...");
+		goto error;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && (cmsg->cmsg_level == SOL_TLS) && (cmsg->cmsg_type == TLS_GET_RECORD_TYPE)) {
+		uint8_t * data = buffer;
+		switch (*CMSG_DATA(cmsg)) {
+			case REC_DATA:
+				break;
+
+			case REC_ALERT:
+				if ((ret >= 2) && (data[1] == 0)) {
+					/* close_notify: the peer closed the session, close our side as well */
+					if (conn->cc_ktls & FD_KTLS_TX) {
+						CHECK_FCT_DO( fd_ktls_bye(conn), /* continue */ );
+					}
+					fd_cnx_markerror(conn);
+					return 0;
+				}
+				LOG_E("Received TLS alert %d (level %d) from '%s'", (ret >= 2) ? data[1] : -1, data[0], conn->cc_remid);
+				goto error;
+
+			case REC_HANDSHAKE:
+				/* The receive direction is offloaded only with TLS 1.2, where this is a renegotiation request */
+				LOG_E("Received a TLS handshake record from '%s', renegotiation is not supported with kernel TLS", conn->cc_remid);
+				goto error;
+
+			default:
+				LOG_E("Received unexpected TLS record type %d from '%s'", *CMSG_DATA(cmsg), conn->cc_remid);
+				goto error;
+		}
+	}
+
+	return ret;
+
+error:
+	fd_cnx_markerror(conn);
+	return -1;
+}
+
+#else /* HAVE_KTLS */
+
+int fd_ktls_enable(struct cnxctx * conn)
+{
+	static int warned = 0;
+	if (!warned) {
+		LOG_N("Kernel TLS is not supported on this system, the TLS records are protected by gnutls");
+		warned = 1;
+	}
+	return ENOTSUP;
+}
+
+int fd_ktls_bye(struct cnxctx * conn)
+{
+	ASSERT(0);
+	return ENOTSUP;
+}
+
+ssize_t fd_ktls_recv(struct cnxctx * conn, void * buffer, size_t length, int nonblock)
+{
+	ASSERT(0);
+	return -1;
+}
+
+#endif /* HAVE_KTLS */
@@ -392,10 +392,17 @@ static int fd_msg_send_int( struct msg ** pmsg, void (*anscb)(void *, struct msg
 	 &&  (fd_msg_source_get(*pmsg, &diamid, NULL) == 0)
 	 &&  (diamid == NULL)) {
 		fd_hook_call(HOOK_MESSAGE_LOCAL, *pmsg, NULL, NULL, fd_msg_pmdl_get(*pmsg));
+		
+		/* The residence time in the daemon starts now */
+		if (fd_g_config->cnf_max_residence) {
+			struct timespec now;
+			CHECK_SYS( clock_gettime(CLOCK_REALTIME, &now) );
+			CHECK_FCT( fd_msg_arrival_set( *pmsg, &now ) );
+		}
 	}
 
 	/* Post the message in the outgoing queue */
-	CHECK_FCT( fd_fifo_post(fd_g_outgoing, pmsg) );
+	CHECK_FCT( fd_queues_post(fd_g_outgoing, pmsg) );
 
 	return 0;
 }
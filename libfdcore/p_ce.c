@@ -66,6 +66,9 @@ static int set_peer_cnx(struct fd_peer * peer, struct cnxctx **cnx)
 /* Delete the peer connection, and cleanup associated information */
 void fd_p_ce_clear_cnx(struct fd_peer * peer, struct cnxctx ** cnx_kept)
 {
+	/* The additional connections do not survive the principal one */
+	fd_lanes_clear(peer);
+	
 	peer->p_hdr.info.runtime.pir_cert_list = NULL;
 	peer->p_hdr.info.runtime.pir_cert_list_size = 0;
 	peer->p_hdr.info.runtime.pir_proto = 0;
@@ -609,8 +612,8 @@ static int create_CER(struct fd_peer * peer, struct cnxctx * cnx, struct msg **
 	/* Find CER dictionary object and create an instance */
 	CHECK_FCT( fd_msg_new ( fd_dict_cmd_CER, MSGFL_ALLOC_ETEID, cer ) );
 	
-	/* Do we need Inband-Security-Id AVPs ? If we're already using TLS, we don't... */
-	if (!fd_cnx_getTLS(cnx)) {
+	/* Do we need Inband-Security-Id AVPs ? If we're already using TLS, or a local socket, we don't... */
+	if (!fd_cnx_getTLS(cnx) && !fd_cnx_islocal(cnx)) {
 		isi_none = peer->p_hdr.info.config.pic_flags.sec & PI_SEC_NONE; /* we add it even if the peer does not use the old mechanism, it is impossible to distinguish */
 
 		if (peer->p_hdr.info.config.pic_flags.sec & PI_SEC_TLS_OLD) {
@@ -803,6 +806,15 @@ int fd_p_ce_msgrcv(struct msg ** msg, int req, struct fd_peer * peer)
 		/* Special case: if the peer did not send a ISI AVP */
 		if (peer->p_hdr.info.runtime.pir_isi == 0)
 			todo = peer->p_hdr.info.config.pic_flags.sec;
+		/* No TLS with a co-located peer, the local socket is protected by its file permissions */
+		if (fd_cnx_islocal(peer->p_cnxctx)) {
+			if (!peer->p_hdr.info.config.pic_local_path) {
+				LOG_E("Peer '%s' answered on a local socket but is not configured with LocalSocket, giving up.", peer->p_hdr.info.pi_diamid);
+				fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, peer, "Local connection with a peer not configured with LocalSocket", NULL);
+				goto cleanup;
+			}
+			todo = PI_SEC_NONE;
+		}
 		
 		if (todo == PI_SEC_NONE) {
 			/* Ok for clear connection */
@@ -828,6 +840,9 @@ int fd_p_ce_msgrcv(struct msg ** msg, int req, struct fd_peer * peer)
 		}
 	}
 	
+	/* We will open the additional connections if any */
+	peer->p_flags.pf_initiator = 1;
+	
 	/* Move to next state */
 	if (peer->p_flags.pf_cnx_pb) {
 		fd_psm_change_state(peer, STATE_REOPEN );
@@ -886,6 +901,7 @@ int fd_p_ce_process_receiver(struct fd_peer * peer)
 		} );
 	msg = peer->p_cer;
 	peer->p_cer = NULL;
+	peer->p_flags.pf_initiator = 0;
 	
 	memset(&pei, 0, sizeof(pei));
 	
@@ -942,7 +958,18 @@ int fd_p_ce_process_receiver(struct fd_peer * peer)
 	}
 	
 	/* Do we agree on ISI ? */
-	if ( ! fd_cnx_getTLS(peer->p_cnxctx) ) {
+	if (fd_cnx_islocal(peer->p_cnxctx)) {
+		/* A co-located peer, the connection stays in clear. Only the peers configured with LocalSocket are trusted there,
+		 so that any process allowed on the socket cannot impersonate a peer that must use TLS */
+		if (!peer->p_hdr.info.config.pic_local_path) {
+			TRACE_DEBUG(INFO, "Peer '%s' connected on the local socket but is not configured with LocalSocket, sending DIAMETER_NO_COMMON_SECURITY", peer->p_hdr.info.pi_diamid);
+			pei.pei_errcode = "DIAMETER_NO_COMMON_SECURITY";
+			fatal = 1;
+			goto error_abort;
+		}
+		isi = 0;
+		
+	} else if ( ! fd_cnx_getTLS(peer->p_cnxctx) ) {
 		
 		/* In case of responder, the validate callback must have set the config.pic_flags.sec value already */
 	
@@ -1089,6 +1116,252 @@ cleanup:
 	return 0;
 }
 
+/* Read the values that identify an additional connection in a CER or CEA: the remote peer must be the same instance
+ (Origin-Host and Origin-State-Id) as on the principal connection. The peer information is not modified. */
+static int lane_CE_info(struct msg * msg, struct fd_peer * peer, uint32_t * rc, uint32_t * orstate)
+{
+	struct avp * avp = NULL;
+	
+	*orstate = 0;
+	CHECK_FCT( fd_msg_browse( msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+	while (avp) {
+		struct avp_hdr * hdr;
+		
+		CHECK_FCT(  fd_msg_avp_hdr( avp, &hdr )  );
+		if (!(hdr->avp_flags & AVP_FLAG_VENDOR) && hdr->avp_value) {
+			switch (hdr->avp_code) {
+				case AC_RESULT_CODE:
+					if (rc)
+						*rc = hdr->avp_value->u32;
+					break;
+				
+				case AC_ORIGIN_HOST:
+					if (fd_os_almostcasesrch(hdr->avp_value->os.data, hdr->avp_value->os.len, 
+								peer->p_hdr.info.pi_diamid, peer->p_hdr.info.pi_diamidlen, NULL)) {
+						TRACE_DEBUG(INFO, "Received a message with Origin-Host set to '%.*s' while expecting '%s'", 
+								(int)hdr->avp_value->os.len, hdr->avp_value->os.data, peer->p_hdr.info.pi_diamid);
+						return EINVAL;
+					}
+					break;
+				
+				case AC_ORIGIN_STATE_ID:
+					*orstate = hdr->avp_value->u32;
+					break;
+			}
+		}
+		CHECK_FCT( fd_msg_browse( avp, MSG_BRW_NEXT, &avp, NULL) );
+	}
+	
+	return 0;
+}
+
+/* An additional connection must be protected by the same certificate as the principal one: the CER / CEA on it only
+ carries the Origin-State-Id of the peer, which does not authenticate it. */
+static int lane_check_cred(struct fd_peer * peer, struct cnxctx * cnx)
+{
+	const gnutls_datum_t * certs = NULL;
+	unsigned int certs_sz = 0;
+	const gnutls_datum_t * principal = peer->p_hdr.info.runtime.pir_cert_list;
+	
+	if (!fd_cnx_getTLS(peer->p_cnxctx))
+		return 0;
+	
+	CHECK_PARAMS( fd_cnx_getTLS(cnx) );
+	CHECK_FCT( fd_cnx_getcred(cnx, &certs, &certs_sz) );
+	
+	if (!principal || !peer->p_hdr.info.runtime.pir_cert_list_size || !certs_sz
+			|| (certs[0].size != principal[0].size) || memcmp(certs[0].data, principal[0].data, certs[0].size)) {
+		LOG_E("%s: the certificate of the additional connection '%s' differs from the principal connection one, closing it", 
+				peer->p_hdr.info.pi_diamid, fd_cnx_getid(cnx));
+		return EACCES;
+	}
+	
+	return 0;
+}
+
+/* Initiator side of an additional connection to an open peer: exchange CER / CEA on it, and start the reception toward
+ the PSM of the peer. This is called from the thread opening the lanes, the PSM adds the connection to the peer afterwards. */
+int fd_p_ce_lane_open(struct fd_peer * peer, struct cnxctx * cnx)
+{
+	struct msg * cer = NULL, * cea = NULL;
+	struct msg_hdr * hdr;
+	uint32_t hbh, rc = 0, orstate = 0;
+	uint8_t * buf = NULL;
+	size_t sz;
+	struct timespec ts;
+	int ret;
+	
+	TRACE_ENTRY("%p %p", peer, cnx);
+	
+	/* TLS on connection: check who we are talking to before anything else */
+	if (fd_cnx_getTLS(cnx)) {
+		CHECK_FCT( lane_check_cred(peer, cnx) );
+	}
+	
+	/* Send the CER directly on the connection, the peer is open so fd_out_send would queue it */
+	CHECK_FCT( create_CER(peer, cnx, &cer) );
+	CHECK_FCT_DO( ret = fd_msg_hdr(cer, &hdr), goto out );
+	hbh = hdr->msg_hbhid = __atomic_fetch_add(&peer->p_hbh, 1, __ATOMIC_RELAXED);
+	CHECK_FCT_DO( ret = fd_msg_bufferize(cer, &buf, &sz), goto out );
+	fd_hook_call(HOOK_MESSAGE_SENT, cer, peer, NULL, fd_msg_pmdl_get(cer));
+	CHECK_FCT_DO( ret = fd_cnx_send(cnx, buf, sz), goto out );
+	
+	/* Wait for the CEA */
+	CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), { ret = __ret__; goto out; } );
+	ts.tv_sec += CEA_TIMEOUT;
+	free(buf);
+	buf = NULL;
+	CHECK_FCT_DO( ret = fd_cnx_receive(cnx, &ts, &buf, &sz), goto out );
+	CHECK_FCT_DO( ret = fd_msg_parse_buffer(&buf, sz, &cea), { fd_rcvbuf_free(buf); buf = NULL; goto out; } );
+	CHECK_FCT_DO( fd_msg_rawbuffer_setfree(cea, fd_rcvbuf_free), /* cannot fail */ );
+	CHECK_FCT_DO( ret = fd_msg_parse_dict(cea, fd_g_config->cnf_dict, NULL), goto out );
+	fd_hook_call(HOOK_MESSAGE_RECEIVED, cea, peer, NULL, fd_msg_pmdl_get(cea));
+	
+	CHECK_FCT_DO( ret = fd_msg_hdr(cea, &hdr), goto out );
+	if ((hdr->msg_code != CC_CAPABILITIES_EXCHANGE) || (hdr->msg_flags & CMD_FLAG_REQUEST) || (hdr->msg_hbhid != hbh)) {
+		ret = EBADMSG;
+		goto out;
+	}
+	CHECK_FCT_DO( ret = lane_CE_info(cea, peer, &rc, &orstate), goto out );
+	if ((rc != ER_DIAMETER_SUCCESS) || (orstate != peer->p_hdr.info.runtime.pir_orstate)) {
+		LOG_N("%s: additional connection refused by the peer (Result-Code %u)", peer->p_hdr.info.pi_diamid, rc);
+		ret = ECONNREFUSED;
+		goto out;
+	}
+	
+	/* Same protection as the principal connection. The messages received from now on go to the PSM */
+	if (fd_cnx_getTLS(peer->p_cnxctx) && !fd_cnx_getTLS(cnx)) {
+		CHECK_FCT_DO( ret = fd_cnx_handshake(cnx, GNUTLS_CLIENT, ALGO_HANDSHAKE_3436, peer->p_hdr.info.config.pic_priority, NULL), goto out );
+		CHECK_FCT_DO( ret = lane_check_cred(peer, cnx), goto out );
+		CHECK_FCT_DO( ret = fd_cnx_recv_setaltfifo(cnx, peer->p_events), goto out );
+	} else if (!fd_cnx_getTLS(cnx)) {
+		CHECK_FCT_DO( ret = fd_cnx_recv_setaltfifo(cnx, peer->p_events), goto out );
+		CHECK_FCT_DO( ret = fd_cnx_start_clear(cnx, 1), goto out );
+	} else {
+		CHECK_FCT_DO( ret = fd_cnx_recv_setaltfifo(cnx, peer->p_events), goto out );
+	}
+	
+out:
+	free(buf);
+	if (cer) {
+		CHECK_FCT_DO( fd_msg_free(cer), /* continue */ );
+	}
+	if (cea) {
+		CHECK_FCT_DO( fd_msg_free(cea), /* continue */ );
+	}
+	return ret;
+}
+
+/* Responder side, TLS handshake of an accepted additional connection (p_lane_cnx) out of the PSM thread.
+ The PSM adds the connection to the peer when it receives FDEVP_LANE_ESTABLISHED, with NULL if it failed. */
+static void lane_cleanup_cnx(void * arg)
+{
+	struct cnxctx ** cnx = arg;
+	if (*cnx) {
+		fd_cnx_destroy(*cnx);
+		*cnx = NULL;
+	}
+}
+
+static void * lane_accept_thr(void * arg)
+{
+	struct fd_peer * peer = arg;
+	int ret = 0;
+	
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "Lane:%s", peer->p_hdr.info.pi_diamid);
+		fd_log_threadname ( buf );
+	}
+	
+	pthread_cleanup_push(lane_cleanup_cnx, &peer->p_lane_cnx);
+	
+	CHECK_FCT_DO( ret = fd_cnx_handshake(peer->p_lane_cnx, GNUTLS_SERVER, ALGO_HANDSHAKE_3436, peer->p_hdr.info.config.pic_priority, NULL), );
+	if (!ret) {
+		CHECK_FCT_DO( ret = lane_check_cred(peer, peer->p_lane_cnx), );
+	}
+	if (!ret) {
+		CHECK_FCT_DO( ret = fd_cnx_recv_setaltfifo(peer->p_lane_cnx, peer->p_events), );
+	}
+	if (ret) {
+		fd_cnx_destroy(peer->p_lane_cnx);
+		peer->p_lane_cnx = NULL;
+	}
+	
+	/* On success, the PSM owns the connection. Otherwise it is destroyed below */
+	CHECK_FCT_DO( fd_event_send(peer->p_events, FDEVP_LANE_ESTABLISHED, 0, peer->p_lane_cnx), goto out );
+	peer->p_lane_cnx = NULL;
+out:
+	
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* Responder side: a CER received on a new connection from an open peer is accepted as an additional connection
+ if both sides configured lanes for this peer, and the CER comes from the same instance of the peer, with the same
+ certificate. Since the Origin-State-Id alone does not authenticate it, a lane to a peer whose principal connection
+ is not protected by TLS is only accepted if configured (Clear_Lanes). */
+static int lane_accept(struct msg ** cer, struct fd_peer * peer, struct cnxctx ** cnx, int * accepted)
+{
+	uint32_t orstate = 0;
+	int isi_tls;
+	
+	*accepted = 0;
+	if ((peer->p_hdr.info.config.pic_lanes < 2) || peer->p_flags.pf_initiator
+			|| (peer->p_lanes_cnt >= peer->p_hdr.info.config.pic_lanes - 1)
+			|| (fd_cnx_getproto(*cnx) != IPPROTO_TCP) || (fd_cnx_getproto(peer->p_cnxctx) != IPPROTO_TCP)
+			|| fd_cnx_islocal(*cnx) || fd_cnx_islocal(peer->p_cnxctx))
+		return 0;
+	
+	if (!fd_cnx_getTLS(peer->p_cnxctx) && !peer->p_hdr.info.config.pic_flags.clrlanes) {
+		LOG_N("%s: additional connection refused, the principal connection is not protected by TLS (see Clear_Lanes)", peer->p_hdr.info.pi_diamid);
+		return 0;
+	}
+	
+	/* One connection is handshaking at a time */
+	if (peer->p_lanes_thr != (pthread_t)NULL)
+		return 0;
+	
+	CHECK_FCT_DO( lane_CE_info(*cer, peer, NULL, &orstate), return 0 );
+	if ((orstate == 0) || (orstate != peer->p_hdr.info.runtime.pir_orstate))
+		return 0;
+	
+	/* TLS on connection: the handshake is already done */
+	if (fd_cnx_getTLS(*cnx) && lane_check_cred(peer, *cnx))
+		return 0;
+	*accepted = 1;
+	
+	/* Reply a CEA, with the same protection as the principal connection */
+	isi_tls = fd_cnx_getTLS(peer->p_cnxctx) && !fd_cnx_getTLS(*cnx);
+	CHECK_FCT( fd_msg_new_answer_from_req ( fd_g_config->cnf_dict, cer, 0 ) );
+	CHECK_FCT( fd_msg_rescode_set(*cer, "DIAMETER_SUCCESS", NULL, NULL, 0 ) );
+	CHECK_FCT( add_CE_info(*cer, *cnx, isi_tls, 0) );
+	CHECK_FCT( fd_out_send(cer, *cnx, NULL, 0) );
+	
+	/* The handshake may take long, the PSM does not wait for it */
+	if (isi_tls) {
+		peer->p_lane_cnx = *cnx;
+		*cnx = NULL;
+		CHECK_POSIX_DO( pthread_create(&peer->p_lanes_thr, NULL, lane_accept_thr, peer),
+			{
+				*cnx = peer->p_lane_cnx;
+				peer->p_lane_cnx = NULL;
+				return __ret__;
+			} );
+		return 0;
+	}
+	
+	/* The messages received from now on go to the PSM */
+	CHECK_FCT( fd_cnx_recv_setaltfifo(*cnx, peer->p_events) );
+	if (!fd_cnx_getTLS(*cnx)) {
+		CHECK_FCT( fd_cnx_start_clear(*cnx, 1) );
+	}
+	
+	CHECK_FCT( fd_lanes_add(peer, cnx) );
+	return 0;
+}
+
 /* We have received a CER on a new connection for this peer */
 int fd_p_ce_handle_newCER(struct msg ** msg, struct fd_peer * peer, struct cnxctx ** cnx, int valid)
 {
@@ -1137,6 +1410,14 @@ int fd_p_ce_handle_newCER(struct msg ** msg, struct fd_peer * peer, struct cnxct
 				receiver_reject(cnx, msg, &pei);
 			}
 			break;
+		
+		case STATE_OPEN: {
+			int accepted = 0;
+			CHECK_FCT_DO( lane_accept(msg, peer, cnx, &accepted), /* the connection is destroyed by the caller */ );
+			if (accepted)
+				break;
+		}
+		/* fallthrough */
 
 		default:
 			pei.pei_errcode = "DIAMETER_UNABLE_TO_COMPLY"; /* INVALID COMMAND? in case of Capabilities-Updates? */
@@ -47,6 +47,7 @@ struct next_conn {
 		sSS	ss;	/* The address, only for TCP */
 		sSA4	sin;
 		sSA6	sin6;
+		struct sockaddr_un sun; /* or the path of the unix socket of a co-located peer */
 	};
 	uint16_t	port;	/* The port, for SCTP (included in ss for TCP) */
 	int		dotls;	/* Handshake TLS after connection ? */
@@ -80,6 +81,23 @@ static int prepare_connection_list(struct fd_peer * peer)
 	int count = 0;
 	
 	TRACE_ENTRY("%p", peer);
+	
+	/* A co-located peer is reached only through its unix socket, in clear */
+	if (peer->p_hdr.info.config.pic_local_path) {
+		empty_connection_list(peer);
+		
+		CHECK_MALLOC( new = malloc(sizeof(struct next_conn)) );
+		memset(new, 0, sizeof(struct next_conn));
+		fd_list_init(&new->chain, new);
+		
+		new->proto = IPPROTO_TCP;
+		new->sun.sun_family = AF_UNIX;
+		snprintf(new->sun.sun_path, sizeof(new->sun.sun_path), "%s", peer->p_hdr.info.config.pic_local_path);
+		fd_list_insert_after(&peer->p_connparams, &new->chain);
+		
+		LOG_D("Prepared the local socket %s to connect to peer %s", new->sun.sun_path, peer->p_hdr.info.pi_diamid);
+		return 0;
+	}
 	 
 	/* Resolve peer address(es) if needed */
 	if (FD_IS_LIST_EMPTY(&peer->p_hdr.info.pi_endpoints)) {
@@ -98,6 +116,7 @@ static int prepare_connection_list(struct fd_peer * peer)
 		
 		for (aip = ai; aip != NULL; aip = aip->ai_next) {
 			CHECK_FCT( fd_ep_add_merge( &peer->p_hdr.info.pi_endpoints, aip->ai_addr, aip->ai_addrlen, EP_FL_DISC ) );
+			CHECK_FCT_DO( fd_peer_known_addr_add( aip->ai_addr ), /* continue */ );
 		}
 		freeaddrinfo(ai);
 	}
@@ -261,6 +280,10 @@ static void * connect_thr(void * arg)
 		
 		switch (nc->proto) {
 			case IPPROTO_TCP:
+				if (nc->ss.ss_family == AF_UNIX) {
+					cnx = fd_cnx_cli_connect_local(nc->sun.sun_path);
+					break;
+				}
 /* TODO: use no_bind and first of cnf_endpoints of nc->ss.sa_family ? */
 				cnx = fd_cnx_cli_connect_tcp((sSA *)&nc->ss, sSAlen(&nc->ss));
 				break;
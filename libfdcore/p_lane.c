@@ -0,0 +1,197 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+
+#include "fdcore-internal.h"
+#include "cnxctx.h"
+
+/* This file contains the additional connections (lanes) to an open peer. All the lanes share the queue of messages to send
+ and the list of sent requests of the peer; each lane has its own out thread, the received messages are posted to the PSM. */
+
+/* Cleanup the connection being opened when the lanes thread is cancelled */
+static void lane_cleanup_cnx(void * arg)
+{
+	struct cnxctx ** cnx = arg;
+	if (*cnx)
+		fd_cnx_destroy(*cnx);
+}
+
+/* Initiator side: open the missing lanes one after the other, to the same address as the principal connection */
+static void * lanes_thr(void * arg)
+{
+	struct fd_peer * peer = arg;
+	struct cnxctx * cnx = NULL;
+	sSS ss;
+	socklen_t sl = sizeof(ss);
+	int dotls, i;
+	
+	TRACE_ENTRY("%p", arg);
+	CHECK_PARAMS_DO( CHECK_PEER(peer), return NULL );
+	
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "Lanes:%s", peer->p_hdr.info.pi_diamid);
+		fd_log_threadname ( buf );
+	}
+	
+	memset(&ss, 0, sizeof(ss));
+	CHECK_SYS_DO( getpeername(peer->p_cnxctx->cc_socket, (sSA *)&ss, &sl), return NULL );
+	
+	/* Same rule as the principal connection for TLS on connection */
+	dotls = (peer->p_hdr.info.config.pic_flags.sec == PI_SEC_DEFAULT) && !fd_g_config->cnf_flags.tls_alg;
+	
+	pthread_cleanup_push(lane_cleanup_cnx, &cnx);
+	
+	for (i = peer->p_lanes_cnt; i < peer->p_hdr.info.config.pic_lanes - 1; i++) {
+		cnx = fd_cnx_cli_connect_tcp((sSA *)&ss, sSAlen(&ss));
+		if (!cnx)
+			break;
+		
+		fd_cnx_sethostname(cnx, peer->p_hdr.info.pi_diamid);
+		if (dotls) {
+			CHECK_FCT_DO( fd_cnx_handshake(cnx, GNUTLS_CLIENT, ALGO_HANDSHAKE_3436, peer->p_hdr.info.config.pic_priority, NULL), break );
+		} else {
+			CHECK_FCT_DO( fd_cnx_start_clear(cnx, 0), break );
+		}
+		
+		CHECK_FCT_DO( fd_p_ce_lane_open(peer, cnx), break );
+		
+		/* The PSM adds the connection to the peer */
+		CHECK_FCT_DO( fd_event_send(peer->p_events, FDEVP_LANE_ESTABLISHED, 0, cnx), break );
+		cnx = NULL;
+	}
+	
+	if (i < peer->p_hdr.info.config.pic_lanes - 1) {
+		LOG_N("%s: only %d of %d connections could be opened, continuing with these", 
+				peer->p_hdr.info.pi_diamid, i + 1, peer->p_hdr.info.config.pic_lanes);
+	}
+	
+	pthread_cleanup_pop(1);
+	cnx = NULL;
+	
+	return NULL;
+}
+
+/* Called when the peer enters the OPEN state */
+int fd_lanes_start(struct fd_peer * peer)
+{
+	int i;
+	
+	TRACE_ENTRY("%p", peer);
+	CHECK_PARAMS( CHECK_PEER(peer) );
+	
+	/* Lanes kept from a previous OPEN state (e.g. after REOPEN) */
+	for (i = 0; i < peer->p_lanes_cnt; i++) {
+		CHECK_FCT( fd_out_lane_start(&peer->p_lanes[i]) );
+	}
+	
+	if (peer->p_flags.pf_initiator && (peer->p_hdr.info.config.pic_lanes > 1) 
+			&& (peer->p_lanes_cnt < peer->p_hdr.info.config.pic_lanes - 1)
+			&& (fd_cnx_getproto(peer->p_cnxctx) == IPPROTO_TCP) && !fd_cnx_islocal(peer->p_cnxctx)
+			&& (fd_cnx_getTLS(peer->p_cnxctx) || peer->p_hdr.info.config.pic_flags.clrlanes)
+			&& (peer->p_lanes_thr == (pthread_t)NULL)) {
+		CHECK_POSIX( pthread_create(&peer->p_lanes_thr, NULL, lanes_thr, peer) );
+	}
+	
+	return 0;
+}
+
+/* Called when the peer leaves the OPEN state: the connections are kept */
+void fd_lanes_stop(struct fd_peer * peer)
+{
+	int i;
+	
+	TRACE_ENTRY("%p", peer);
+	CHECK_PARAMS_DO( CHECK_PEER(peer), return );
+	
+	CHECK_FCT_DO( fd_thr_term(&peer->p_lanes_thr), /* continue */ );
+	for (i = 0; i < peer->p_lanes_cnt; i++) {
+		CHECK_FCT_DO( fd_out_lane_stop(&peer->p_lanes[i]), /* continue */ );
+	}
+}
+
+/* Add an established connection (CER / CEA done, reception started toward p_events) to an open peer. *cnx is set to NULL on success. */
+int fd_lanes_add(struct fd_peer * peer, struct cnxctx ** cnx)
+{
+	struct fd_lane * lane;
+	
+	TRACE_ENTRY("%p %p", peer, cnx);
+	CHECK_PARAMS( CHECK_PEER(peer) && cnx && *cnx );
+	
+	if (peer->p_lanes_cnt >= peer->p_hdr.info.config.pic_lanes - 1)
+		return ENOSPC;
+	
+	if (!peer->p_lanes) {
+		CHECK_MALLOC( peer->p_lanes = calloc(peer->p_hdr.info.config.pic_lanes - 1, sizeof(struct fd_lane)) );
+	}
+	
+	lane = &peer->p_lanes[peer->p_lanes_cnt];
+	memset(lane, 0, sizeof(struct fd_lane));
+	lane->peer = peer;
+	lane->idx = peer->p_lanes_cnt + 1;
+	lane->cnx = *cnx;
+	CHECK_POSIX( pthread_mutex_init(&lane->sendlock, NULL) );
+	
+	CHECK_FCT_DO( fd_out_lane_start(lane), goto error );
+	
+	peer->p_lanes_cnt++;
+	*cnx = NULL;
+	
+	LOG_N("%s: additional connection %d established ('%s')", peer->p_hdr.info.pi_diamid, lane->idx, fd_cnx_getid(lane->cnx));
+	return 0;
+	
+error:
+	CHECK_POSIX_DO( pthread_mutex_destroy(&lane->sendlock), /* continue */ );
+	return EINVAL;
+}
+
+/* Close all the lanes, when the principal connection is closed */
+void fd_lanes_clear(struct fd_peer * peer)
+{
+	int i;
+	
+	TRACE_ENTRY("%p", peer);
+	CHECK_PARAMS_DO( CHECK_PEER(peer), return );
+	
+	fd_lanes_stop(peer);
+	for (i = 0; i < peer->p_lanes_cnt; i++) {
+		fd_cnx_destroy(peer->p_lanes[i].cnx);
+		CHECK_POSIX_DO( pthread_mutex_destroy(&peer->p_lanes[i].sendlock), /* continue */ );
+	}
+	peer->p_lanes_cnt = 0;
+	free(peer->p_lanes);
+	peer->p_lanes = NULL;
+}
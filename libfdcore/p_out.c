@@ -34,19 +34,15 @@
 *********************************************************************************************************/
 
 #include "fdcore-internal.h"
+#include "cnxctx.h"
 
-/* Alloc a new hbh for requests, bufferize the message and send on the connection, save in sentreq if provided */
-static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struct fd_peer * peer)
+/* Alloc a new hbh for requests, bufferize the message and save in sentreq if provided. *msg is NULL after a request was saved. */
+static int prepare_send(struct msg ** msg, uint32_t * hbh, struct fd_peer * peer, uint8_t ** buf, size_t * sz)
 {
 	struct msg_hdr * hdr;
 	int msg_is_a_req;
-	uint8_t * buf;
-	size_t sz;
 	int ret;
 	uint32_t bkp_hbh = 0;
-	struct msg *cpy_for_logs_only;
-	
-	TRACE_ENTRY("%p %p %p %p", msg, cnx, hbh, peer);
 	
 	/* Retrieve the message header */
 	CHECK_FCT( fd_msg_hdr(*msg, &hdr) );
@@ -54,22 +50,68 @@ static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struc
 	msg_is_a_req = (hdr->msg_flags & CMD_FLAG_REQUEST);
 	if (msg_is_a_req) {
 		CHECK_PARAMS(hbh && peer);
-		/* Alloc the hop-by-hop id and increment the value for next message */
+		/* Alloc the hop-by-hop id and increment the value for next message (the lanes of the peer allocate concurrently) */
 		bkp_hbh = hdr->msg_hbhid;
-		hdr->msg_hbhid = *hbh;
-		*hbh = hdr->msg_hbhid + 1;
+		hdr->msg_hbhid = __atomic_fetch_add(hbh, 1, __ATOMIC_RELAXED);
 	}
 	
 	/* Create the message buffer */
-	CHECK_FCT(fd_msg_bufferize( *msg, &buf, &sz ));
-	pthread_cleanup_push( free, buf );
-	
-	cpy_for_logs_only = *msg;
+	CHECK_FCT(fd_msg_bufferize( *msg, buf, sz ));
 	
 	/* Save a request before sending so that there is no race condition with the answer */
 	if (msg_is_a_req) {
-		CHECK_FCT_DO( ret = fd_p_sr_store(&peer->p_sr, msg, &hdr->msg_hbhid, bkp_hbh), goto out );
+		CHECK_FCT_DO( ret = fd_p_sr_store(&peer->p_sr, msg, &hdr->msg_hbhid, bkp_hbh), 
+			{
+				free(*buf);
+				*buf = NULL;
+				return ret;
+			} );
+	}
+	
+	return 0;
+}
+
+/* With SCTP_session_streams, the hash of the Session-Id of a message selects its SCTP stream. 0 if the message has no session. */
+static uint32_t sess_stream(struct msg * msg, struct cnxctx * cnx)
+{
+#ifndef DISABLE_SCTP
+	struct avp * avp = NULL;
+	
+	if (!fd_g_config->cnf_flags.sctp_sess || (fd_cnx_getproto(cnx) != IPPROTO_SCTP))
+		return 0;
+	
+	/* The Session-Id is normally the first AVP, but it is not required in relayed messages */
+	CHECK_FCT_DO( fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL), return 0 );
+	while (avp) {
+		struct avp_hdr * hdr;
+		
+		CHECK_FCT_DO( fd_msg_avp_hdr(avp, &hdr), return 0 );
+		if ((hdr->avp_code == AC_SESSION_ID) && !(hdr->avp_flags & AVP_FLAG_VENDOR) && hdr->avp_value)
+			return fd_os_hash(hdr->avp_value->os.data, hdr->avp_value->os.len) ?: 1;
+		CHECK_FCT_DO( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL), return 0 );
 	}
+#endif /* DISABLE_SCTP */
+	
+	return 0;
+}
+
+/* Alloc a new hbh for requests, bufferize the message and send on the connection, save in sentreq if provided */
+static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struct fd_peer * peer)
+{
+	uint8_t * buf;
+	size_t sz;
+	int ret;
+	struct msg *cpy_for_logs_only;
+	struct iovec iov;
+	uint32_t sess;
+	
+	TRACE_ENTRY("%p %p %p %p", msg, cnx, hbh, peer);
+	
+	cpy_for_logs_only = *msg;
+	sess = sess_stream(*msg, cnx);
+	
+	CHECK_FCT( prepare_send(msg, hbh, peer, &buf, &sz) );
+	pthread_cleanup_push( free, buf );
 	
 	/* Log the message */
 	fd_hook_call(HOOK_MESSAGE_SENT, cpy_for_logs_only, peer, NULL, fd_msg_pmdl_get(cpy_for_logs_only));
@@ -77,12 +119,11 @@ static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struc
 	pthread_cleanup_push((void *)fd_msg_free, *msg /* might be NULL, no problem */);
 	
 	/* Send the message */
-	CHECK_FCT_DO( ret = fd_cnx_send(cnx, buf, sz), );
+	iov.iov_base = buf;
+	iov.iov_len  = sz;
+	CHECK_FCT_DO( ret = fd_cnx_sendv_sess(cnx, &iov, 1, &sess), );
 	
 	pthread_cleanup_pop(0);
-	
-out:
-	;	
 	pthread_cleanup_pop(1);
 	
 	if (ret)
@@ -97,40 +138,162 @@ out:
 	return 0;
 }
 
-/* The code of the "out" thread */
-static void * out_thr(void * arg)
+/* The messages prepared by the out thread and sent together */
+struct out_batch {
+	struct iovec	 iov[OUT_BATCH_MAX_MSG];	/* the message buffers */
+	struct msg	*ans[OUT_BATCH_MAX_MSG];	/* the answers, freed once sent. NULL for requests, saved in p_sr */
+	uint32_t	 sess[OUT_BATCH_MAX_MSG];	/* the SCTP stream hints, see sess_stream */
+	int		 cnt;
+	size_t		 bytes;
+	int		 taken;				/* messages retrieved from p_tosend for this batch */
+	struct msg	*shed[OUT_BATCH_MAX_MSG];	/* the requests to shed (fd_rtdisp_shed) once sendlock is released */
+	int		 nshed;
+	struct fd_peer	*peer;
+	struct cnxctx	*cnx;
+};
+
+/* Free the buffers and answers of a batch, once sent or on cancellation */
+static void out_batch_cleanup(void * arg)
+{
+	struct out_batch * b = arg;
+	int i;
+	for (i = 0; i < b->cnt; i++) {
+		free(b->iov[i].iov_base);
+		if (b->ans[i]) {
+			CHECK_FCT_DO( fd_msg_free(b->ans[i]), /* continue */ );
+		}
+	}
+	b->cnt = 0;
+	b->bytes = 0;
+	
+	/* Only left here on cancellation */
+	for (i = 0; i < b->nshed; i++) {
+		fd_p_sr_unreserve(&b->peer->p_sr, b->shed[i]);
+		fd_hook_call(HOOK_MESSAGE_DROPPED, b->shed[i], NULL, "Request shed while the out thread was canceled", fd_msg_pmdl_get(b->shed[i]));
+		CHECK_FCT_DO( fd_msg_free(b->shed[i]), /* continue */ );
+	}
+	b->nshed = 0;
+	
+	/* Direct sends are possible again once all the queued messages are processed */
+	__atomic_sub_fetch(&b->peer->p_tosend_cnt, b->taken, __ATOMIC_RELEASE);
+	b->taken = 0;
+}
+
+/* Add a message in the batch. On error, the message is left in *msg */
+static int out_batch_add(struct out_batch * b, struct msg ** msg, struct fd_peer * peer)
+{
+	struct msg *cpy_for_logs_only = *msg;
+	uint8_t * buf;
+	size_t sz;
+	uint32_t sess = sess_stream(*msg, b->cnx);
+	
+	CHECK_FCT( prepare_send(msg, &peer->p_hbh, peer, &buf, &sz) );
+	
+	b->sess[b->cnt] = sess;
+	b->iov[b->cnt].iov_base = buf;
+	b->iov[b->cnt].iov_len  = sz;
+	b->ans[b->cnt] = *msg;
+	b->cnt++;
+	b->bytes += sz;
+	*msg = NULL;
+	
+	/* Log the message */
+	fd_hook_call(HOOK_MESSAGE_SENT, cpy_for_logs_only, peer, NULL, fd_msg_pmdl_get(cpy_for_logs_only));
+	
+	return 0;
+}
+
+/* The loop of the "out" threads: pick the messages in p_tosend and send them on cnx. sendlock is held while sending. */
+static void out_loop(struct fd_peer * peer, struct cnxctx * cnx, pthread_mutex_t * sendlock)
 {
-	struct fd_peer * peer = arg;
 	int stop = 0;
 	struct msg * msg;
-	ASSERT( CHECK_PEER(peer) );
+	struct out_batch batch;
 	
-	/* Set the thread name */
-	{
-		char buf[48];
-		snprintf(buf, sizeof(buf), "OUT/%s", peer->p_hdr.info.pi_diamid);
-		fd_log_threadname ( buf );
-	}
+	batch.cnt = 0;
+	batch.bytes = 0;
+	batch.taken = 0;
+	batch.nshed = 0;
+	batch.peer = peer;
+	batch.cnx = cnx;
 	
 	/* Loop until cancellation */
 	while (!stop) {
-		int ret;
+		int ret, due, i, nshed;
+		struct msg * shed[OUT_BATCH_MAX_MSG];
 		
 		/* Retrieve next message to send */
 		CHECK_FCT_DO( fd_fifo_get(peer->p_tosend, &msg), goto error );
 		
-		/* Send the message, log any error */
-		CHECK_FCT_DO( ret = do_send(&msg, peer->p_cnxctx, &peer->p_hbh, peer),
-			{
-				if (msg) {
+		/* Do not interleave with a direct send from fd_out_send */
+		CHECK_POSIX_DO( pthread_mutex_lock(sendlock), goto error );
+		pthread_cleanup_push( fd_cleanup_mutex, sendlock );
+		pthread_cleanup_push( out_batch_cleanup, &batch );
+		
+		/* Prepare this message and the ones already waiting in the queue, within the budget, to send them all at once.
+		 The hop-by-hop ids are allocated and the requests saved in p_sr in the queue order. */
+		do {
+			batch.taken++;
+			
+			/* Do not send a request that its sender already gave up on. Its error answer is queued once sendlock is released */
+			CHECK_FCT_DO( fd_rtdisp_shed_due(msg, &due), due = 0 /* send it anyway */ );
+			if (due) {
+				batch.shed[batch.nshed++] = msg;
+				continue;
+			}
+			
+			CHECK_FCT_DO( ret = out_batch_add(&batch, &msg, peer),
+				{
 					char buf[256];
 					snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
+					fd_p_sr_unreserve(&peer->p_sr, msg);
 					fd_hook_call(HOOK_MESSAGE_DROPPED, msg, NULL, buf, fd_msg_pmdl_get(msg));
 					fd_msg_free(msg);
-				}
-				stop = 1;
-			} );
-			
+					stop = 1;
+					break;
+				} );
+		} while ((batch.cnt + batch.nshed < OUT_BATCH_MAX_MSG) && (batch.bytes < OUT_BATCH_MAX_BYTES) 
+				&& (fd_fifo_tryget(peer->p_tosend, &msg) == 0));
+		
+		/* Send the messages, log any error */
+		if (batch.cnt) {
+			CHECK_FCT_DO( ret = fd_cnx_sendv_sess(cnx, batch.iov, batch.cnt, batch.sess),
+				{
+					int i;
+					char buf[256];
+					snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
+					for (i = 0; i < batch.cnt; i++) {
+						if (batch.ans[i]) {
+							fd_hook_call(HOOK_MESSAGE_DROPPED, batch.ans[i], NULL, buf, fd_msg_pmdl_get(batch.ans[i]));
+							fd_msg_free(batch.ans[i]);
+							batch.ans[i] = NULL;
+						}
+					}
+					stop = 1;
+				} );
+		}
+		
+		/* The shed requests are processed below, without the lock */
+		nshed = batch.nshed;
+		memcpy(shed, batch.shed, nshed * sizeof(struct msg *));
+		batch.nshed = 0;
+		
+		pthread_cleanup_pop(1);
+		pthread_cleanup_pop(1);
+		
+		for (i = 0; i < nshed; i++) {
+			fd_p_sr_unreserve(&peer->p_sr, shed[i]);
+			CHECK_FCT_DO( fd_rtdisp_shed(&shed[i]), /* send it anyway */ );
+			if (shed[i]) {
+				__atomic_add_fetch(&peer->p_tosend_cnt, 1, __ATOMIC_RELAXED);
+				CHECK_FCT_DO( fd_fifo_post_noblock(peer->p_tosend, (void *)&shed[i]),
+					{
+						__atomic_sub_fetch(&peer->p_tosend_cnt, 1, __ATOMIC_RELAXED);
+						fd_hook_call(HOOK_MESSAGE_DROPPED, shed[i], NULL, "Internal error: unable to requeue this message", fd_msg_pmdl_get(shed[i]));
+						CHECK_FCT_DO( fd_msg_free(shed[i]), /* continue */ );
+					} );
+			}
+		}
 	}
 	
 	/* If we're here it means there was an error on the socket. We need to continue to purge the fifo & until we are canceled */
@@ -138,6 +301,8 @@ static void * out_thr(void * arg)
 	
 	/* Requeue all routable messages in the global "out" queue, until we are canceled once the PSM deals with the CNX_ERROR sent above */
 	while ( fd_fifo_get(peer->p_tosend, &msg) == 0 ) {
+		__atomic_sub_fetch(&peer->p_tosend_cnt, 1, __ATOMIC_RELEASE);
+		fd_p_sr_unreserve(&peer->p_sr, msg);
 		if (fd_msg_is_routable(msg)) {
 			CHECK_FCT_DO(fd_fifo_post_noblock(peer->p_tofailover, (void *)&msg), 
 				{
@@ -155,6 +320,39 @@ static void * out_thr(void * arg)
 error:
 	/* It is not really a connection error, but the effect is the same, we are not able to send anymore message */
 	CHECK_FCT_DO( fd_event_send(peer->p_events, FDEVP_CNX_ERROR, 0, NULL), /* What do we do if it fails? */ );
+}
+
+/* The code of the "out" thread of the peer */
+static void * out_thr(void * arg)
+{
+	struct fd_peer * peer = arg;
+	ASSERT( CHECK_PEER(peer) );
+	
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "OUT/%s", peer->p_hdr.info.pi_diamid);
+		fd_log_threadname ( buf );
+	}
+	
+	out_loop(peer, peer->p_cnxctx, &peer->p_sendlock);
+	return NULL;
+}
+
+/* The "out" thread of an additional connection, it competes with the one of the peer for the messages to send */
+static void * lane_out_thr(void * arg)
+{
+	struct fd_lane * lane = arg;
+	ASSERT( CHECK_PEER(lane->peer) );
+	
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "OUT%d/%s", lane->idx, lane->peer->p_hdr.info.pi_diamid);
+		fd_log_threadname ( buf );
+	}
+	
+	out_loop(lane->peer, lane->cnx, &lane->sendlock);
 	return NULL;
 }
 
@@ -179,8 +377,45 @@ int fd_out_send(struct msg ** msg, struct cnxctx * cnx, struct fd_peer * peer, i
 	}
 	
 	if (fd_peer_getstate(peer) == STATE_OPEN) {
-		/* Normal case: just queue for the out thread to pick it up */
-		CHECK_FCT( fd_fifo_post(peer->p_tosend, msg) );
+		/* Fast path: when nothing is waiting for the out thread and it is not sending, send from this thread to save the wake up.
+		 The order of the messages is kept since the out thread has no message left to send before this one.
+		 After a connection error, the messages are queued and the out thread deals with the failover. */
+		if ((__atomic_load_n(&peer->p_tosend_cnt, __ATOMIC_ACQUIRE) == 0) && !fd_cnx_teststate(peer->p_cnxctx, CC_STATUS_ERROR)
+				&& (pthread_mutex_trylock(&peer->p_sendlock) == 0)) {
+			int ret = 0, direct = 0;
+			
+			pthread_cleanup_push( fd_cleanup_mutex, &peer->p_sendlock );
+			if (__atomic_load_n(&peer->p_tosend_cnt, __ATOMIC_ACQUIRE) == 0) {
+				direct = 1;
+				CHECK_FCT_DO( ret = do_send(msg, peer->p_cnxctx, &peer->p_hbh, peer), 
+					{
+						if (*msg) {
+							char buf[256];
+							snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
+							fd_p_sr_unreserve(&peer->p_sr, *msg);
+							fd_hook_call(HOOK_MESSAGE_DROPPED, *msg, NULL, buf, fd_msg_pmdl_get(*msg));
+							fd_msg_free(*msg);
+							*msg = NULL;
+						}
+					} );
+			}
+			pthread_cleanup_pop(1);
+			
+			if (direct) {
+				if (ret) {
+					CHECK_FCT_DO( fd_event_send(peer->p_events, FDEVP_CNX_ERROR, 0, NULL), /* continue */ );
+				}
+				return 0;
+			}
+		}
+		
+		/* Normal case: just queue for the out thread to pick it up, the base protocol messages go first */
+		__atomic_add_fetch(&peer->p_tosend_cnt, 1, __ATOMIC_RELAXED);
+		CHECK_FCT_DO( fd_queues_post(peer->p_tosend, msg), 
+			{
+				__atomic_sub_fetch(&peer->p_tosend_cnt, 1, __ATOMIC_RELAXED);
+				return __ret__;
+			} );
 		
 	} else {
 		int ret;
@@ -199,6 +434,8 @@ int fd_out_send(struct msg ** msg, struct cnxctx * cnx, struct fd_peer * peer, i
 				if (msg) {
 					char buf[256];
 					snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
+					if (peer)
+						fd_p_sr_unreserve(&peer->p_sr, *msg);
 					fd_hook_call(HOOK_MESSAGE_DROPPED, *msg, NULL, buf, fd_msg_pmdl_get(*msg));
 					fd_msg_free(*msg);
 					*msg = NULL;
@@ -234,4 +471,25 @@ int fd_out_stop(struct fd_peer * peer)
 	
 	return 0;
 }
+
+/* Same for the additional connections of the peer */
+int fd_out_lane_start(struct fd_lane * lane)
+{
+	TRACE_ENTRY("%p", lane);
+	CHECK_PARAMS( lane && CHECK_PEER(lane->peer) && lane->cnx && (lane->outthr == (pthread_t)NULL) );
+	
+	CHECK_POSIX( pthread_create(&lane->outthr, NULL, lane_out_thr, lane) );
+	
+	return 0;
+}
+
+int fd_out_lane_stop(struct fd_lane * lane)
+{
+	TRACE_ENTRY("%p", lane);
+	CHECK_PARAMS( lane );
+	
+	CHECK_FCT( fd_thr_term(&lane->outthr) );
+	
+	return 0;
+}
 		
@@ -155,10 +155,227 @@ int fd_psm_start()
 /*                 Manage the list of active peers                      */
 /************************************************************************/
 
+/* The current snapshot of the active peers, protected by fd_g_activ_peers_rw */
+static struct fd_actives * actives_snap = NULL;
+
+/* Get a reference on the current snapshot */
+int fd_psm_actives_get(struct fd_actives ** snap)
+{
+	CHECK_PARAMS( snap );
+	CHECK_POSIX( pthread_rwlock_rdlock(&fd_g_activ_peers_rw) );
+	*snap = actives_snap;
+	if (*snap)
+		__atomic_add_fetch(&(*snap)->refcnt, 1, __ATOMIC_RELAXED);
+	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
+	return 0;
+}
+
+/* Release a reference obtained above (this can be passed as callback to fd_rtd_candidate_set) */
+void fd_psm_actives_release(void * snap)
+{
+	struct fd_actives * a = snap;
+	if (a && (__atomic_sub_fetch(&a->refcnt, 1, __ATOMIC_ACQ_REL) == 0))
+		free(a);
+}
+
+/* Order of the realms in the routing table: by length, then by bytes ignoring the ASCII case */
+int fd_rt_realm_cmp(uint8_t * r1, size_t r1len, uint8_t * r2, size_t r2len)
+{
+	size_t i;
+	if (r1len != r2len)
+		return (r1len < r2len) ? -1 : 1;
+	for (i = 0; i < r1len; i++) {
+		uint8_t c1 = r1[i], c2 = r2[i];
+		if ((c1 >= 'A') && (c1 <= 'Z'))
+			c1 += 32;
+		if ((c2 >= 'A') && (c2 <= 'Z'))
+			c2 += 32;
+		if (c1 != c2)
+			return (c1 < c2) ? -1 : 1;
+	}
+	return 0;
+}
+
+/* A (peer, application) pair while building the realm routing table */
+struct rt_pair {
+	struct fd_peer * 	peer;
+	int			idx;	/* of the peer in the snapshot, i.e. in diamid order */
+	application_id_t	app;
+};
+
+static int rt_pair_cmp(const void * a, const void * b)
+{
+	const struct rt_pair * p1 = a, * p2 = b;
+	int cmp = fd_rt_realm_cmp((uint8_t *)p1->peer->p_hdr.info.runtime.pir_realm, p1->peer->p_hdr.info.runtime.pir_realmlen,
+				  (uint8_t *)p2->peer->p_hdr.info.runtime.pir_realm, p2->peer->p_hdr.info.runtime.pir_realmlen);
+	if (cmp)
+		return cmp;
+	if (p1->app != p2->app)
+		return (p1->app < p2->app) ? -1 : 1;
+	return p1->idx - p2->idx;
+}
+
+/* Same entry of the routing table: same realm and application */
+static int rt_pair_same_entry(struct rt_pair * p1, struct rt_pair * p2)
+{
+	return (p1->app == p2->app) && !fd_rt_realm_cmp((uint8_t *)p1->peer->p_hdr.info.runtime.pir_realm, p1->peer->p_hdr.info.runtime.pir_realmlen,
+				(uint8_t *)p2->peer->p_hdr.info.runtime.pir_realm, p2->peer->p_hdr.info.runtime.pir_realmlen);
+}
+
+/* Append a pair, growing the array as needed */
+static int rt_pair_add(struct rt_pair ** pairs, int * n, int * alloc, struct fd_peer * peer, int idx, application_id_t app)
+{
+	if (*n == *alloc) {
+		struct rt_pair * p;
+		int new_alloc = *alloc ? *alloc * 2 : 64;
+		CHECK_MALLOC( p = realloc(*pairs, new_alloc * sizeof(struct rt_pair)) );
+		*pairs = p;
+		*alloc = new_alloc;
+	}
+	(*pairs)[*n].peer = peer;
+	(*pairs)[*n].idx = idx;
+	(*pairs)[*n].app = app;
+	(*n)++;
+	return 0;
+}
+
+/* List the (peer, application) pairs of the realm routing table, sorted. The relays of a realm are listed with AI_RELAY,
+ and with each application advertised by the other peers of their realm. */
+static int rt_pairs_build(struct fd_peer ** peers, int nb, struct rt_pair ** pairs, int * npairs)
+{
+	int n = 0, alloc = 0, i, j, k, r, nsorted;
+	
+	*pairs = NULL;
+	for (i = 0; i < nb; i++) {
+		struct fd_list * li;
+		if (!peers[i]->p_hdr.info.runtime.pir_realm)
+			continue;
+		if (peers[i]->p_hdr.info.runtime.pir_relay) {
+			CHECK_FCT( rt_pair_add(pairs, &n, &alloc, peers[i], i, AI_RELAY) );
+			continue;
+		}
+		for (li = peers[i]->p_hdr.info.runtime.pir_apps.next; li != &peers[i]->p_hdr.info.runtime.pir_apps; li = li->next) {
+			CHECK_FCT( rt_pair_add(pairs, &n, &alloc, peers[i], i, ((struct fd_app *)li)->appid) );
+		}
+	}
+	if (n)
+		qsort(*pairs, n, sizeof(struct rt_pair), rt_pair_cmp);
+	
+	/* Add the relays to the applications of their realm; in each realm, the AI_RELAY pairs come last */
+	nsorted = n;
+	for (i = 0; i < nsorted; i = j) {
+		struct rt_pair * p = *pairs;
+		/* [i, j) is one realm */
+		for (j = i + 1; (j < nsorted) && !fd_rt_realm_cmp((uint8_t *)p[j].peer->p_hdr.info.runtime.pir_realm, p[j].peer->p_hdr.info.runtime.pir_realmlen,
+						(uint8_t *)p[i].peer->p_hdr.info.runtime.pir_realm, p[i].peer->p_hdr.info.runtime.pir_realmlen); j++)
+			/* nothing */;
+		for (k = i; (k < j) && ((*pairs)[k].app != AI_RELAY); k++) {
+			if ((k > i) && ((*pairs)[k].app == (*pairs)[k - 1].app))
+				continue;
+			for (r = j - 1; (r >= i) && ((*pairs)[r].app == AI_RELAY); r--) {
+				CHECK_FCT( rt_pair_add(pairs, &n, &alloc, (*pairs)[r].peer, (*pairs)[r].idx, (*pairs)[k].app) );
+			}
+		}
+	}
+	if (n > nsorted)
+		qsort(*pairs, n, sizeof(struct rt_pair), rt_pair_cmp);
+	
+	*npairs = n;
+	return 0;
+}
+
+/* Rebuild the snapshot and the realm routing table from fd_g_activ_peers. Called with fd_g_activ_peers_rw write-locked */
+static int actives_rebuild(void)
+{
+	struct fd_list * li;
+	struct fd_actives * new = NULL;
+	struct fd_peer ** peers = NULL;
+	struct rt_pair * pairs = NULL;
+	struct rtd_candidate * rc;
+	size_t sz;
+	int nb = 0, npairs = 0, nrt = 0, i, ret = 0;
+	char * str;
+	
+	for (li = fd_g_activ_peers.next; li != &fd_g_activ_peers; li = li->next)
+		nb++;
+	if (!nb)
+		goto out;
+	
+	CHECK_MALLOC( peers = malloc(nb * sizeof(struct fd_peer *)) );
+	sz = sizeof(struct fd_actives) + nb * sizeof(struct rtd_candidate);
+	i = 0;
+	for (li = fd_g_activ_peers.next; li != &fd_g_activ_peers; li = li->next) {
+		struct fd_peer * p = (struct fd_peer *)li->o;
+		peers[i++] = p;
+		sz += p->p_hdr.info.pi_diamidlen + 1;
+		if (p->p_hdr.info.runtime.pir_realm)
+			sz += p->p_hdr.info.runtime.pir_realmlen + 1;
+	}
+	
+	CHECK_FCT_DO( ret = rt_pairs_build(peers, nb, &pairs, &npairs), goto out );
+	for (i = 0; i < npairs; i++) {
+		if ((i == 0) || !rt_pair_same_entry(&pairs[i], &pairs[i - 1]))
+			nrt++;
+	}
+	sz += nrt * sizeof(struct fd_rt_realm) + npairs * sizeof(struct rtd_candidate);
+	
+	CHECK_MALLOC_DO( new = malloc(sz), { ret = ENOMEM; goto out; } );
+	memset(new, 0, sz);
+	new->refcnt = 1;
+	new->nb = nb;
+	new->c = (struct rtd_candidate *)(new + 1);
+	new->nrt = nrt;
+	new->rt = (struct fd_rt_realm *)(new->c + nb);
+	rc = (struct rtd_candidate *)(new->rt + nrt);
+	str = (char *)(rc + npairs);
+	
+	for (i = 0; i < nb; i++) {
+		struct fd_peer * p = peers[i];
+		memcpy(str, p->p_hdr.info.pi_diamid, p->p_hdr.info.pi_diamidlen);
+		new->c[i].diamid = str;
+		new->c[i].diamidlen = p->p_hdr.info.pi_diamidlen;
+		str += p->p_hdr.info.pi_diamidlen + 1;
+		if (p->p_hdr.info.runtime.pir_realm) {
+			memcpy(str, p->p_hdr.info.runtime.pir_realm, p->p_hdr.info.runtime.pir_realmlen);
+			new->c[i].realm = str;
+			new->c[i].realmlen = p->p_hdr.info.runtime.pir_realmlen;
+			str += p->p_hdr.info.runtime.pir_realmlen + 1;
+		}
+	}
+	
+	/* The entries of the routing table point to the strings above */
+	nrt = 0;
+	for (i = 0; i < npairs; i++) {
+		struct fd_rt_realm * e = &new->rt[nrt ? nrt - 1 : 0];
+		
+		if ((i == 0) || !rt_pair_same_entry(&pairs[i], &pairs[i - 1])) {
+			e = &new->rt[nrt++];
+			e->realm = new->c[pairs[i].idx].realm;
+			e->realmlen = new->c[pairs[i].idx].realmlen;
+			e->app = pairs[i].app;
+			e->c = rc;
+		}
+		*rc++ = new->c[pairs[i].idx];
+		e->nb++;
+	}
+	
+out:
+	free(pairs);
+	free(peers);
+	if (ret)
+		return ret;
+	
+	/* The messages being routed keep the previous snapshot until they are freed */
+	fd_psm_actives_release(actives_snap);
+	actives_snap = new;
+	return 0;
+}
+
 /* Enter/leave OPEN state */
 static int enter_open_state(struct fd_peer * peer)
 {
 	struct fd_list * li;
+	int ret;
 	CHECK_PARAMS( FD_IS_LIST_EMPTY(&peer->p_actives) );
 
 	/* Callback registered by the credential validator (fd_peer_validate_register) */
@@ -182,7 +399,10 @@ static int enter_open_state(struct fd_peer * peer)
 			break;
 	}
 	fd_list_insert_before(li, &peer->p_actives);
+	CHECK_FCT_DO( ret = actives_rebuild(), fd_list_unlink(&peer->p_actives) );
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
+	if (ret)
+		return ret;
 
 	/* Callback registered when the peer was added, by fd_peer_add */
 	if (peer->p_cb) {
@@ -194,6 +414,9 @@ static int enter_open_state(struct fd_peer * peer)
 
 	/* Start the thread to handle outgoing messages */
 	CHECK_FCT( fd_out_start(peer) );
+	
+	/* And the additional connections if any */
+	CHECK_FCT( fd_lanes_start(peer) );
 
 	/* Update the expiry timer now */
 	CHECK_FCT( fd_p_expi_update(peer) );
@@ -205,9 +428,11 @@ static int leave_open_state(struct fd_peer * peer, int skip_failover)
 	/* Remove from active peers list */
 	CHECK_POSIX( pthread_rwlock_wrlock(&fd_g_activ_peers_rw) );
 	fd_list_unlink( &peer->p_actives );
+	CHECK_FCT_DO( actives_rebuild(), /* the previous snapshot is kept; the routing checks the peer state anyway */ );
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
 
-	/* Stop the "out" thread */
+	/* Stop the "out" threads */
+	fd_lanes_stop(peer);
 	CHECK_FCT( fd_out_stop(peer) );
 
 	/* Failover the messages */
@@ -230,8 +455,10 @@ void fd_psm_events_free(struct fd_peer * peer)
 	/* Purge all events, and free the associated data if any */
 	while (fd_fifo_tryget( peer->p_events, &ev ) == 0) {
 		switch (ev->code) {
-			case FDEVP_CNX_ESTABLISHED: {
-				fd_cnx_destroy(ev->data);
+			case FDEVP_CNX_ESTABLISHED:
+			case FDEVP_LANE_ESTABLISHED: {
+				if (ev->data) /* NULL for a lane that failed its handshake */
+					fd_cnx_destroy(ev->data);
 			}
 			break;
 
@@ -239,6 +466,10 @@ void fd_psm_events_free(struct fd_peer * peer)
 				/* Do not free the string since it is a constant */
 			break;
 
+			case FDEVP_CNX_MSG_RECV:
+				fd_rcvbuf_free(ev->data);
+			break;
+
 			case FDEVP_CNX_INCOMING: {
 				struct cnx_incoming * evd = ev->data;
 				fd_hook_call(HOOK_MESSAGE_DROPPED, evd->cer, NULL, "Message discarded while cleaning peer state machine queue.", fd_msg_pmdl_get(evd->cer));
@@ -487,6 +718,7 @@ psm_loop:
 		struct msg_hdr * hdr;
 		struct fd_cnx_rcvdata rcv_data;
 		struct fd_msg_pmdl * pmdl = NULL;
+		int ret;
 
 		rcv_data.buffer = ev_data;
 		rcv_data.length = ev_sz;
@@ -496,13 +728,19 @@ psm_loop:
 		CHECK_FCT_DO( fd_msg_parse_buffer( (void *)&ev_data, ev_sz, &msg),
 			{
 				fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, NULL, peer, &rcv_data, pmdl );
-				free(ev_data);
+				fd_rcvbuf_free(ev_data);
 				CHECK_FCT_DO( fd_event_send(peer->p_events, FDEVP_CNX_ERROR, 0, NULL), goto psm_reset );
 				goto psm_loop;
 			} );
 
+		CHECK_FCT_DO( fd_msg_rawbuffer_setfree(msg, fd_rcvbuf_free), /* cannot fail */ );
 		fd_hook_associate(msg, pmdl);
 		CHECK_FCT_DO( fd_msg_source_set( msg, peer->p_hdr.info.pi_diamid, peer->p_hdr.info.pi_diamidlen), goto psm_end);
+		if (fd_g_config->cnf_max_residence) {
+			struct timespec now;
+			CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &now), goto psm_end );
+			CHECK_FCT_DO( fd_msg_arrival_set( msg, &now ), /* cannot fail */ );
+		}
 
 		/* If the current state does not allow receiving messages, just drop it */
 		if (cur_state == STATE_CLOSED) {
@@ -566,8 +804,16 @@ psm_loop:
 						CHECK_POSIX_DO( pthread_mutex_unlock(&peer->p_state_mtx), goto psm_end  );
 					}
 
-					/* Requeue to the global incoming queue */
-					CHECK_FCT_DO(fd_fifo_post(fd_g_incoming, &msg), goto psm_end );
+					/* Requeue to the global incoming queue, or to the queue of this peer */
+					CHECK_FCT_DO( ret = fd_queues_post_in(peer, &msg),
+						{
+							if (ret != EBUSY)
+								goto psm_end;
+							/* The peer has too many messages waiting, reject this request */
+							CHECK_FCT_DO( fd_msg_new_answer_from_req(fd_g_config->cnf_dict, &msg, MSGFL_ANSW_ERROR), goto psm_end );
+							CHECK_FCT_DO( fd_msg_rescode_set(msg, "DIAMETER_TOO_BUSY", NULL, NULL, 1), goto psm_end );
+							CHECK_FCT_DO( fd_out_send(&msg, NULL, peer, 1), goto psm_end );
+						} );
 
 					/* Update the peer timer (only in OPEN state) */
 					if ((cur_state == STATE_OPEN) && (!peer->p_flags.pf_dw_pending)) {
@@ -809,6 +1055,26 @@ psm_loop:
 		goto psm_loop;
 	}
 
+	/* An additional connection has been established with the remote peer */
+	if (event == FDEVP_LANE_ESTABLISHED) {
+		struct cnxctx * cnx = ev_data;
+		
+		/* Responder side, the handshaking thread is done (cnx is NULL if it failed) */
+		if (!peer->p_flags.pf_initiator) {
+			CHECK_FCT_DO( fd_thr_term(&peer->p_lanes_thr), /* continue */ );
+		}
+		
+		if (cnx && (cur_state == STATE_OPEN)) {
+			CHECK_FCT_DO( fd_lanes_add(peer, &cnx), /* the connection is closed below */ );
+		}
+		if (cnx) {
+			TRACE_DEBUG(FULL, "Additional connection not used in state %s, closing...", STATE_STR(cur_state));
+			fd_cnx_destroy(cnx);
+		}
+		
+		goto psm_loop;
+	}
+
 	/* A new connection has not been established with the remote peer */
 	if (event == FDEVP_CNX_FAILED) {
 
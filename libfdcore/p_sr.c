@@ -37,44 +37,117 @@
 
 /* Structure to store a sent request */
 struct sentreq {
-	struct fd_list	chain; 	/* the "o" field points directly to the (new) hop-by-hop of the request (uint32_t *)  */
+	struct fd_list	chain; 	/* link in srlist->srs. The "o" field points directly to the (new) hop-by-hop of the request (uint32_t *)  */
+	struct fd_list	hash;	/* link in the hash table bucket of the hop-by-hop id, "o" points to the sentreq */
+	struct sr_list *srlist;	/* the list this request was stored in */
 	struct msg	*req;	/* A request that was sent and not yet answered. */
 	uint32_t	prevhbh;/* The value to set back in the hbh header when the message is retrieved */
-	struct fd_list  expire; /* the list of expiring requests */
+	int		armed;	/* The request has a timeout, it was added in the timer wheel */
+	struct fd_list  expire; /* link in the timer wheel, "o" points to the sentreq */
 	struct timespec timeout; /* Cache the expire date of the request so that the timeout thread does not need to get it each time. */
 	struct timespec added_on; /* the time the request was added */
+	DiamId_t	sentto;	/* copy of the Diameter Id of the peer once the request expired, since the peer may be freed before expirecb is called */
+	size_t		senttolen;
 };
 
-/* Find an element in the hbh list, or the following one */
-static struct fd_list * find_or_next(struct fd_list * srlist, uint32_t hbh, int * match)
+/* Initial number of buckets in the hash table (must be a power of 2) */
+#define SR_HASH_INIT_SIZE	64
+/* The table is doubled when the average number of requests per bucket exceeds this value */
+#define SR_HASH_MAX_LOAD	2
+
+/* The answer timeouts of the requests sent to all peers are handled by a single thread, using a hashed timer wheel:
+ the requests are stored in the slot of their expiry tick, modulo the number of slots. Arming and cancelling a timer
+ is O(1); a slot may contain requests expiring in a later round, they are skipped until their time comes. */
+#define SR_WHEEL_SLOTS	1024	/* number of slots in the wheel, must be a power of 2 */
+#define SR_WHEEL_TICK	10	/* duration of a slot, in milliseconds */
+#define SR_WHEEL_TPS	(1000 / SR_WHEEL_TICK) /* ticks per second */
+
+/* Lock ordering: sr_wheel.mtx must be taken before any srlist->mtx */
+static struct {
+	struct fd_list	slots[SR_WHEEL_SLOTS];	/* requests linked by their "expire" field */
+	uint64_t	cur;	/* the last tick processed by the thread (only completely elapsed ticks are processed) */
+	uint64_t	next;	/* the tick where the thread will wake up next, when it is sleeping with requests armed */
+	long		cnt;	/* number of armed requests in all the slots */
+	int		init;	/* the slots have been initialized */
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cnd;
+	pthread_t	thr;	/* the thread that handles timeouts (expirecb are called in this thread). Started when needed */
+} sr_wheel = { .mtx = PTHREAD_MUTEX_INITIALIZER, .cnd = PTHREAD_COND_INITIALIZER };
+
+static inline uint64_t sr_tick(struct timespec * ts)
+{
+	return (uint64_t)ts->tv_sec * SR_WHEEL_TPS + ts->tv_nsec / (SR_WHEEL_TICK * 1000000);
+}
+
+static inline struct fd_list * sr_slot(uint64_t tick)
 {
+	return &sr_wheel.slots[tick & (SR_WHEEL_SLOTS - 1)];
+}
+
+/* The hop-by-hop ids we allocate are sequential, so the low bits are enough to spread the requests */
+static inline struct fd_list * sr_bucket(struct fd_list * tbl, uint32_t size, uint32_t hbh)
+{
+	return &tbl[hbh & (size - 1)];
+}
+
+/* Allocate a table of empty buckets */
+static int sr_hash_alloc(struct fd_list ** tbl, uint32_t size)
+{
+	uint32_t i;
+	CHECK_MALLOC( *tbl = malloc(size * sizeof(struct fd_list)) );
+	for (i = 0; i < size; i++)
+		fd_list_init(&(*tbl)[i], NULL);
+	return 0;
+}
+
+/* Double the size of the hash table. On allocation failure, we just keep the current (slower) table */
+static void sr_hash_grow(struct sr_list * srlist)
+{
+	struct fd_list * newtbl = NULL;
+	uint32_t newsize = srlist->hbh_tbl_size * 2;
 	struct fd_list * li;
-	*match = 0;
-	for (li = srlist->next; li != srlist; li = li->next) {
-		uint32_t * nexthbh = li->o;
-		if (*nexthbh < hbh)
-			continue;
-		if (*nexthbh == hbh)
-			*match = 1;
-		break;
+	
+	CHECK_FCT_DO( sr_hash_alloc(&newtbl, newsize), return );
+	
+	for (li = srlist->srs.next; li != &srlist->srs; li = li->next) {
+		struct sentreq * sr = (struct sentreq *)li;
+		fd_list_unlink(&sr->hash);
+		fd_list_insert_before(sr_bucket(newtbl, newsize, *(uint32_t *)sr->chain.o), &sr->hash);
 	}
-	return li;
+	
+	free(srlist->hbh_tbl);
+	srlist->hbh_tbl = newtbl;
+	srlist->hbh_tbl_size = newsize;
 }
 
-/* Similar but start from the end, since we add requests in growing hbh order usually */
-static struct fd_list * find_or_prev(struct fd_list * srlist, uint32_t hbh, int * match)
+/* Find an element by its hbh in the hash table */
+static struct sentreq * sr_find(struct sr_list * srlist, uint32_t hbh)
 {
+	struct fd_list * bucket = sr_bucket(srlist->hbh_tbl, srlist->hbh_tbl_size, hbh);
 	struct fd_list * li;
-	*match = 0;
-	for (li = srlist->prev; li != srlist; li = li->prev) {
-		uint32_t * prevhbh = li->o;
-		if (*prevhbh > hbh)
-			continue;
-		if (*prevhbh == hbh)
-			*match = 1;
-		break;
+	for (li = bucket->next; li != bucket; li = li->next) {
+		struct sentreq * sr = li->o;
+		if (*(uint32_t *)sr->chain.o == hbh)
+			return sr;
+	}
+	return NULL;
+}
+
+/* Remove a request from the srlist, srlist->mtx must be held. The caller becomes the owner of the sentreq. */
+static void sr_unlink(struct sr_list * srlist, struct sentreq * sr)
+{
+	fd_list_unlink(&sr->chain);
+	fd_list_unlink(&sr->hash);
+	srlist->cnt--;
+}
+
+/* Remove a request from the timer wheel, sr_wheel.mtx must be held */
+static void sr_disarm(struct sentreq * sr)
+{
+	if (!FD_IS_LIST_EMPTY(&sr->expire)) {
+		fd_list_unlink(&sr->expire);
+		sr_wheel.cnt--;
 	}
-	return li;
 }
 
 static void srl_dump(const char * text, struct fd_list * srlist)
@@ -96,53 +169,106 @@ static void srl_dump(const char * text, struct fd_list * srlist)
 	}
 }
 
-/* thread that handles messages expiring. The thread is started only when needed */
+/* Multiplicative decrease of the in-flight window when a request was not answered in time, at most once
+ per window of requests sent so that a burst of timeouts only counts once. Called with srlist->mtx held. */
+static void sr_window_loss(struct sr_list * srlist)
+{
+	if (!srlist->win || (srlist->win_sent < srlist->win))
+		return;
+	
+	srlist->win = (srlist->win > 1) ? srlist->win / 2 : 1;
+	srlist->win_acks = 0;
+	srlist->win_sent = 0;
+}
+
+/* Move the requests of one slot that are expired at "now" into the "expired" list, sr_wheel.mtx is held */
+static void sr_wheel_expire_slot(struct fd_list * slot, struct timespec * now, struct fd_list * expired)
+{
+	struct fd_list * li, * next;
+	
+	for (li = slot->next; li != slot; li = next) {
+		struct sentreq * sr = li->o;
+		struct sr_list * srlist = sr->srlist;
+		next = li->next;
+		
+		if (TS_IS_INFERIOR( now, &sr->timeout ))
+			continue; /* this one expires in a later round */
+		
+		sr_disarm(sr);
+		
+		CHECK_POSIX_DO( pthread_mutex_lock(&srlist->mtx), { ASSERT(0); continue; } );
+		if (!FD_IS_LIST_EMPTY(&sr->chain)) {
+			TRACE_DEBUG(FULL, "Request %x was not answered by %s within the timer delay", *((uint32_t *)sr->chain.o), ((struct fd_peer *)srlist->srs.o)->p_hdr.info.pi_diamid);
+			
+			/* Restore the hbhid */
+			*((uint32_t *)sr->chain.o) = sr->prevhbh; 
+			
+			sr_unlink(srlist, sr);
+			srlist->cnt_lost++; /* We are not waiting for this answer anymore, but the remote peer may still be processing it. */
+			sr_window_loss(srlist);
+			
+			sr->senttolen = ((struct fd_peer *)srlist->srs.o)->p_hdr.info.pi_diamidlen;
+			CHECK_MALLOC_DO( sr->sentto = os0dup(((struct fd_peer *)srlist->srs.o)->p_hdr.info.pi_diamid, sr->senttolen), sr->senttolen = 0 );
+			fd_list_insert_before(expired, &sr->expire);
+		} /* else, the answer is being processed in fd_p_sr_fetch, which will free the sentreq */
+		CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* continue */ );
+	}
+}
+
+/* thread that handles the requests expiring for all peers. The thread is started only when needed */
 static void * sr_expiry_th(void * arg) {
-	struct sr_list * srlist = arg;
 	
 	TRACE_ENTRY("%p", arg);
-	CHECK_PARAMS_DO( arg, return NULL );
 	
 	/* Set the thread name */
-	{
-		char buf[48];
-		snprintf(buf, sizeof(buf), "ReqExp/%s", ((struct fd_peer *)(srlist->exp.o))->p_hdr.info.pi_diamid);
-		fd_log_threadname ( buf );
-	}
+	fd_log_threadname ( "ReqExp" );
 	
 	do {
 		struct timespec	now;
-		struct sentreq * first;
-		struct msg * request;
-		struct fd_peer * sentto;
-		void (*expirecb)(void *, DiamId_t, size_t, struct msg **);
-		void * data;
+		struct fd_list expired = FD_LIST_INITIALIZER(expired);
+		uint64_t nowtick, t;
 		int no_error;
 
-		CHECK_POSIX_DO( pthread_mutex_lock(&srlist->mtx),  return NULL );
-		pthread_cleanup_push( fd_cleanup_mutex, &srlist->mtx );
+		CHECK_POSIX_DO( pthread_mutex_lock(&sr_wheel.mtx),  return NULL );
+		pthread_cleanup_push( fd_cleanup_mutex, &sr_wheel.mtx );
 
 loop:	
 		no_error = 0;
 
 		/* Check if there are expiring requests available */
-		if (FD_IS_LIST_EMPTY(&srlist->exp)) {
+		if (sr_wheel.cnt == 0) {
 			/* Just wait for a change or cancellation */
-			CHECK_POSIX_DO( pthread_cond_wait( &srlist->cnd, &srlist->mtx ), goto unlock );
+			sr_wheel.next = 0;
+			CHECK_POSIX_DO( pthread_cond_wait( &sr_wheel.cnd, &sr_wheel.mtx ), goto unlock );
 			/* Restart the loop on wakeup */
 			goto loop;
 		}
 		
-		/* Get the pointer to the request that expires first */
-		first = (struct sentreq *)(srlist->exp.next->o);
-		
 		/* Get the current time */
 		CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now),  goto unlock  );
-
-		/* If first request is not expired, we just wait until it happens */
-		if ( TS_IS_INFERIOR( &now, &first->timeout ) ) {
+		nowtick = sr_tick(&now);
+		
+		/* Process all the ticks completely elapsed since the last run (one round at most) */
+		for (t = sr_wheel.cur + 1; (t < nowtick) && (t <= sr_wheel.cur + SR_WHEEL_SLOTS); t++)
+			sr_wheel_expire_slot(sr_slot(t), &now, &expired);
+		if (nowtick > sr_wheel.cur + 1)
+			sr_wheel.cur = nowtick - 1;
+		
+		if (FD_IS_LIST_EMPTY(&expired)) {
+			struct timespec wakeup;
 			
-			CHECK_POSIX_DO2(  pthread_cond_timedwait( &srlist->cnd, &srlist->mtx, &first->timeout ),  
+			if (sr_wheel.cnt == 0)
+				goto loop;
+			
+			/* Sleep until the end of the next tick that has requests in its slot */
+			for (t = sr_wheel.cur + 1; t < sr_wheel.cur + SR_WHEEL_SLOTS; t++)
+				if (!FD_IS_LIST_EMPTY(sr_slot(t)))
+					break;
+			sr_wheel.next = t;
+			wakeup.tv_sec  = (t + 1) / SR_WHEEL_TPS;
+			wakeup.tv_nsec = ((t + 1) % SR_WHEEL_TPS) * SR_WHEEL_TICK * 1000000;
+			
+			CHECK_POSIX_DO2(  pthread_cond_timedwait( &sr_wheel.cnd, &sr_wheel.mtx, &wakeup ),  
 					ETIMEDOUT, /* ETIMEDOUT is a normal return value, continue */,
 					/* on other error, */ goto unlock );
 	
@@ -150,22 +276,6 @@ loop:
 			goto loop;
 		}
 		
-		/* Now, the first request in the list is expired; remove it and call the expirecb for it */
-		request = first->req;
-		sentto = first->chain.head->o;
-		
-		TRACE_DEBUG(FULL, "Request %x was not answered by %s within the timer delay", *((uint32_t *)first->chain.o), sentto->p_hdr.info.pi_diamid);
-		
-		/* Restore the hbhid */
-		*((uint32_t *)first->chain.o) = first->prevhbh; 
-		
-		/* Free the sentreq information */
-		fd_list_unlink(&first->chain);
-		srlist->cnt--;
-		srlist->cnt_lost++; /* We are not waiting for this answer anymore, but the remote peer may still be processing it. */
-		fd_list_unlink(&first->expire);
-		free(first);
-		
 		no_error = 1;
 unlock:
 		; /* pthread_cleanup_pop sometimes expands as "} ..." and the label before this cause some compilers to complain... */
@@ -173,21 +283,34 @@ unlock:
 		if (!no_error)
 			break;
 
+		/* Now call the expirecb of the expired requests, without holding any lock */
+		while (!FD_IS_LIST_EMPTY(&expired)) {
+			struct sentreq * sr = expired.next->o;
+			struct msg * request = sr->req;
+			DiamId_t sentto = sr->sentto;
+			size_t senttolen = sr->senttolen;
+			void (*expirecb)(void *, DiamId_t, size_t, struct msg **);
+			void * data;
+			
+			fd_list_unlink(&sr->expire);
+			free(sr);
+			
+			/* Retrieve callback in the message */
+			CHECK_FCT_DO( fd_msg_anscb_get( request, NULL, &expirecb, &data ), { ASSERT(0); free(sentto); continue; } );
+			ASSERT(expirecb);
 		
-		/* Retrieve callback in the message */
-		CHECK_FCT_DO( fd_msg_anscb_get( request, NULL, &expirecb, &data ), break);
-		ASSERT(expirecb);
-	
-		/* Clean up this expirecb from the message */
-		CHECK_FCT_DO( fd_msg_anscb_reset( request, 0, 1 ), break);
+			/* Clean up this expirecb from the message */
+			CHECK_FCT_DO( fd_msg_anscb_reset( request, 0, 1 ), { ASSERT(0); free(sentto); continue; } );
 
-		/* Call it */
-		(*expirecb)(data, sentto->p_hdr.info.pi_diamid, sentto->p_hdr.info.pi_diamidlen, &request);
-	
-		/* If the callback did not dispose of the message, do it now */
-		if (request) {
-			fd_hook_call(HOOK_MESSAGE_DROPPED, request, NULL, "Expiration period completed without an answer, and the expiry callback did not dispose of the message.", fd_msg_pmdl_get(request));
-			CHECK_FCT_DO( fd_msg_free(request), /* ignore */ );
+			/* Call it */
+			(*expirecb)(data, sentto, senttolen, &request);
+			free(sentto);
+		
+			/* If the callback did not dispose of the message, do it now */
+			if (request) {
+				fd_hook_call(HOOK_MESSAGE_DROPPED, request, NULL, "Expiration period completed without an answer, and the expiry callback did not dispose of the message.", fd_msg_pmdl_get(request));
+				CHECK_FCT_DO( fd_msg_free(request), /* ignore */ );
+			}
 		}
 	
 	} while (1);
@@ -196,13 +319,128 @@ unlock:
 	return NULL;
 }
 
+/* Add a request in the timer wheel, sr_wheel.mtx must be held */
+static void sr_arm(struct sentreq * sr)
+{
+	uint64_t tick = sr_tick(&sr->timeout);
+	
+	if (!sr_wheel.init) {
+		int i;
+		for (i = 0; i < SR_WHEEL_SLOTS; i++)
+			fd_list_init(&sr_wheel.slots[i], NULL);
+		sr_wheel.init = 1;
+	}
+	
+	if (tick <= sr_wheel.cur)
+		tick = sr_wheel.cur + 1; /* already expired, handle on next tick */
+	
+	fd_list_insert_before(sr_slot(tick), &sr->expire);
+	sr->armed = 1;
+	sr_wheel.cnt++;
+	
+	/* if the thread does not exist yet, create it */
+	if (sr_wheel.thr == (pthread_t)NULL) {
+		CHECK_POSIX_DO( pthread_create(&sr_wheel.thr, NULL, sr_expiry_th, NULL), /* continue anyway */);
+	} else {
+		/* or, if the thread is sleeping past this tick, wake it up to update the sleep time */
+		if ((sr_wheel.next == 0) || (tick < sr_wheel.next)) {
+			sr_wheel.next = tick;
+			CHECK_POSIX_DO( pthread_cond_signal(&sr_wheel.cnd), /* continue anyway */);
+		}
+	}
+}
+
+
+/* Current window and number of requests in flight or on their way to the peer, without locking (for the routing decisions only) */
+void fd_p_sr_window(struct sr_list * srlist, long * win, long * cnt)
+{
+	if (win)
+		*win = __atomic_load_n(&srlist->win, __ATOMIC_RELAXED);
+	if (cnt)
+		*cnt = __atomic_load_n(&srlist->cnt, __ATOMIC_RELAXED) + __atomic_load_n(&srlist->resv, __ATOMIC_RELAXED);
+}
+
+/* Take a slot of PeerWindow for a request routed to this peer. The slot is kept until the request is saved by
+ fd_p_sr_store, then until its answer is received or it expires. If the request is dropped or failed over before it
+ is sent, the slot must be released with fd_p_sr_unreserve. Returns EBUSY if PeerWindow is reached. */
+int fd_p_sr_reserve(struct sr_list * srlist)
+{
+	int ret = 0;
+	
+	if (!fd_g_config->cnf_peer_window)
+		return 0;
+	
+	CHECK_POSIX( pthread_mutex_lock(&srlist->mtx) );
+	if (srlist->cnt + srlist->resv >= fd_g_config->cnf_peer_window)
+		ret = EBUSY;
+	else
+		srlist->resv++;
+	CHECK_POSIX( pthread_mutex_unlock(&srlist->mtx) );
+	
+	return ret;
+}
+
+/* Give back the slot of a routed request that leaves the peer without being sent. Other messages are ignored. */
+void fd_p_sr_unreserve(struct sr_list * srlist, struct msg * msg)
+{
+	struct msg_hdr * hdr;
+	
+	if (!fd_g_config->cnf_peer_window || !msg)
+		return;
+	
+	CHECK_FCT_DO( fd_msg_hdr(msg, &hdr), return );
+	if (!(hdr->msg_flags & CMD_FLAG_REQUEST) || !fd_msg_is_routable(msg))
+		return;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&srlist->mtx), return );
+	if (srlist->resv > 0)
+		srlist->resv--;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* continue */ );
+}
+
+/* Initialize the hash table of a sent requests list (the lists and mutex are initialized by the caller) */
+int fd_p_sr_start(struct sr_list * srlist)
+{
+	TRACE_ENTRY("%p", srlist);
+	CHECK_PARAMS(srlist && !srlist->hbh_tbl);
+	
+	CHECK_FCT( sr_hash_alloc(&srlist->hbh_tbl, SR_HASH_INIT_SIZE) );
+	srlist->hbh_tbl_size = SR_HASH_INIT_SIZE;
+	
+	/* The window starts full, it is reduced if the peer does not keep up */
+	srlist->win = fd_g_config->cnf_peer_window;
+	srlist->win_acks = 0;
+	srlist->win_sent = 0;
+	
+	return 0;
+}
+
+/* Release the hash table, the list must be empty */
+int fd_p_sr_stop(struct sr_list * srlist)
+{
+	TRACE_ENTRY("%p", srlist);
+	CHECK_PARAMS(srlist);
+	
+	ASSERT( FD_IS_LIST_EMPTY(&srlist->srs) );
+	free(srlist->hbh_tbl);
+	srlist->hbh_tbl = NULL;
+	srlist->hbh_tbl_size = 0;
+	
+	return 0;
+}
+
+/* Terminate the timeouts thread, once all peers are gone */
+int fd_p_sr_fini(void)
+{
+	TRACE_ENTRY();
+	CHECK_FCT_DO( fd_thr_term(&sr_wheel.thr), /* ignore error */ );
+	return 0;
+}
 
 /* Store a new sent request */
 int fd_p_sr_store(struct sr_list * srlist, struct msg **req, uint32_t *hbhloc, uint32_t hbh_restore)
 {
 	struct sentreq * sr;
-	struct fd_list * prev;
-	int match;
 	struct timespec * ts;
 	
 	TRACE_ENTRY("%p %p %p %x", srlist, req, hbhloc, hbh_restore);
@@ -211,71 +449,70 @@ int fd_p_sr_store(struct sr_list * srlist, struct msg **req, uint32_t *hbhloc, u
 	CHECK_MALLOC( sr = malloc(sizeof(struct sentreq)) );
 	memset(sr, 0, sizeof(struct sentreq));
 	fd_list_init(&sr->chain, hbhloc);
+	fd_list_init(&sr->hash, sr);
+	sr->srlist = srlist;
 	sr->req = *req;
 	sr->prevhbh = hbh_restore;
 	fd_list_init(&sr->expire, sr);
 	CHECK_SYS( clock_gettime(CLOCK_REALTIME, &sr->added_on) );
 	
-	/* Search the place in the list */
-	CHECK_POSIX( pthread_mutex_lock(&srlist->mtx) );
-	prev = find_or_prev(&srlist->srs, *hbhloc, &match);
-	if (match) {
+	/* In case of request with a timeout, we also need the wheel lock, to be taken first */
+	ts = fd_msg_anscb_gettimeout( sr->req );
+	if (ts) {
+		memcpy(&sr->timeout, ts, sizeof(struct timespec));
+		CHECK_POSIX_DO( pthread_mutex_lock(&sr_wheel.mtx), { free(sr); return __ret__; } );
+	}
+	
+	/* Check this hbh is not already in use */
+	CHECK_POSIX_DO( pthread_mutex_lock(&srlist->mtx), goto error );
+	if (sr_find(srlist, *hbhloc)) {
 		TRACE_DEBUG(INFO, "A request with the same hop-by-hop Id (0x%x) was already sent: error", *hbhloc);
-		free(sr);
 		srl_dump("Current list of SR: ", &srlist->srs);
 		CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* ignore */ );
-		return EINVAL;
+		goto error;
 	}
 	
-	/* Save in the list */
+	/* Save in the list (in sending order) and the hash table */
 	*req = NULL;
-	fd_list_insert_after(prev, &sr->chain);
+	fd_list_insert_before(&srlist->srs, &sr->chain);
+	fd_list_insert_before(sr_bucket(srlist->hbh_tbl, srlist->hbh_tbl_size, *hbhloc), &sr->hash);
 	srlist->cnt++;
+	srlist->win_sent++;
+	if (srlist->resv && fd_msg_is_routable(sr->req))
+		srlist->resv--; /* the slot taken by fd_p_sr_reserve is now counted in cnt */
+	if (srlist->cnt > (long)srlist->hbh_tbl_size * SR_HASH_MAX_LOAD)
+		sr_hash_grow(srlist);
 	
-	/* In case of request with a timeout, also store in the timeout list */
-	ts = fd_msg_anscb_gettimeout( sr->req );
-	if (ts) {
-		struct fd_list * li;
-		
-		memcpy(&sr->timeout, ts, sizeof(struct timespec));
-		
-		/* browse srlist->exp from the end */
-		for (li = srlist->exp.prev; li != &srlist->exp; li = li->prev) {
-			struct sentreq * s = (struct sentreq *)(li->o);
-			if (TS_IS_INFERIOR(&s->timeout, ts))
-				break;
-		}
-		
-		fd_list_insert_after(li, &sr->expire);
+	/* In case of request with a timeout, also store in the timer wheel */
+	if (ts)
+		sr_arm(sr);
 	
-		/* if the thread does not exist yet, create it */
-		if (srlist->thr == (pthread_t)NULL) {
-			CHECK_POSIX_DO( pthread_create(&srlist->thr, NULL, sr_expiry_th, srlist), /* continue anyway */);
-		} else {
-			/* or, if added in first position, signal the condvar to update the sleep time of the thread */
-			if (li == &srlist->exp) {
-				CHECK_POSIX_DO( pthread_cond_signal(&srlist->cnd), /* continue anyway */);
-			}
-		}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* continue */ );
+	if (ts) {
+		CHECK_POSIX( pthread_mutex_unlock(&sr_wheel.mtx) );
 	}
-	
-	CHECK_POSIX( pthread_mutex_unlock(&srlist->mtx) );
 	return 0;
+	
+error:
+	if (ts) {
+		CHECK_POSIX_DO( pthread_mutex_unlock(&sr_wheel.mtx), /* ignore */ );
+	}
+	free(sr);
+	return EINVAL;
 }
 
 /* Fetch a request by hbh */
 int fd_p_sr_fetch(struct sr_list * srlist, uint32_t hbh, struct msg **req)
 {
 	struct sentreq * sr;
-	int match;
 	
 	TRACE_ENTRY("%p %x %p", srlist, hbh, req);
 	CHECK_PARAMS(srlist && req);
 	
 	/* Search the request in the list */
 	CHECK_POSIX( pthread_mutex_lock(&srlist->mtx) );
-	sr = (struct sentreq *)find_or_next(&srlist->srs, hbh, &match);
-	if (!match) {
+	sr = sr_find(srlist, hbh);
+	if (!sr) {
 		TRACE_DEBUG(INFO, "There is no saved request with this hop-by-hop id (%x)", hbh);
 		srl_dump("Current list of SR: ", &srlist->srs);
 		*req = NULL;
@@ -286,29 +523,69 @@ int fd_p_sr_fetch(struct sr_list * srlist, uint32_t hbh, struct msg **req)
 		/* Restore hop-by-hop id */
 		*((uint32_t *)sr->chain.o) = sr->prevhbh;
 		/* Unlink */
-		fd_list_unlink(&sr->chain);
-		srlist->cnt--;
-		fd_list_unlink(&sr->expire);
+		sr_unlink(srlist, sr);
 		*req = sr->req;
-		free(sr);
+		
+		/* Additive increase: one more request in flight after each full window answered */
+		if (srlist->win && (++srlist->win_acks >= srlist->win)) {
+			srlist->win_acks = 0;
+			if (srlist->win < fd_g_config->cnf_peer_window)
+				srlist->win++;
+		}
 	}
 	CHECK_POSIX( pthread_mutex_unlock(&srlist->mtx) );
 	
-	/* do not stop the expire thread here, it might cause creating/destroying it very often otherwise */
+	/* Cancel the timer, now that we own the sentreq. This only takes the wheel lock. */
+	if (sr) {
+		if (sr->armed) {
+			CHECK_POSIX( pthread_mutex_lock(&sr_wheel.mtx) );
+			sr_disarm(sr);
+			CHECK_POSIX( pthread_mutex_unlock(&sr_wheel.mtx) );
+		}
+		free(sr);
+	}
 
 	/* Done */
 	return 0;
 }
 
+/* Remove all the requests (or only the non-routable ones) from srlist and the timer wheel, into the "out" list linked by their "chain" */
+static void sr_detach(struct sr_list * srlist, struct fd_list * out, int nonroutable_only)
+{
+	struct fd_list * li, * next;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&sr_wheel.mtx), /* continue anyway */ );
+	CHECK_POSIX_DO( pthread_mutex_lock(&srlist->mtx), /* continue anyway */ );
+	for (li = srlist->srs.next; li != &srlist->srs; li = next) {
+		struct sentreq * sr = (struct sentreq *)li;
+		next = li->next;
+		if (nonroutable_only && fd_msg_is_routable(sr->req))
+			continue;
+		sr_unlink(srlist, sr);
+		sr_disarm(sr);
+		fd_list_insert_before(out, &sr->chain);
+	}
+	if (!nonroutable_only) {
+		/* The next connection starts with the full window again */
+		srlist->win = fd_g_config->cnf_peer_window;
+		srlist->win_acks = 0;
+		srlist->win_sent = 0;
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* continue anyway */ );
+	CHECK_POSIX_DO( pthread_mutex_unlock(&sr_wheel.mtx), /* continue anyway */ );
+}
+
 /* Failover requests (free or requeue routables) */
 void fd_p_sr_failover(struct sr_list * srlist)
 {
-	CHECK_POSIX_DO( pthread_mutex_lock(&srlist->mtx), /* continue anyway */ );
-	while (!FD_IS_LIST_EMPTY(&srlist->srs)) {
-		struct sentreq * sr = (struct sentreq *)(srlist->srs.next);
+	struct fd_list failed = FD_LIST_INITIALIZER(failed);
+	
+	sr_detach(srlist, &failed, 0);
+	ASSERT( srlist->cnt == 0 ); /* debug the counter management if needed */
+	
+	while (!FD_IS_LIST_EMPTY(&failed)) {
+		struct sentreq * sr = (struct sentreq *)(failed.next);
 		fd_list_unlink(&sr->chain);
-		srlist->cnt--;
-		fd_list_unlink(&sr->expire);
 		if (fd_msg_is_routable(sr->req)) {
 			struct msg_hdr * hdr = NULL;
 			int ret;
@@ -338,35 +615,20 @@ void fd_p_sr_failover(struct sr_list * srlist)
 		}
 		free(sr);
 	}
-	/* The list of expiring requests must be empty now */
-	ASSERT( FD_IS_LIST_EMPTY(&srlist->exp) );
-	ASSERT( srlist->cnt == 0 ); /* debug the counter management if needed */
-	
-	CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* continue anyway */ );
-	
-	/* Terminate the expiry thread (must be done when the lock can be taken) */
-	CHECK_FCT_DO( fd_thr_term(&srlist->thr), /* ignore error */ );
 }
 
 
 /* free non-routable messages when connection is lost */
 void fd_p_sr_on_disconnect(struct sr_list * srlist)
 {
-	CHECK_POSIX_DO( pthread_mutex_lock(&srlist->mtx), /* continue anyway */ );
-	struct fd_list * l = &srlist->srs;
-	while (l->next != &srlist->srs) {
-		struct sentreq * n = (struct sentreq *)(l->next);
-		if (fd_msg_is_routable(n->req)) {
-			// advance
-			l = (struct fd_list*)n;
-			continue;
-		}
-		// unlink and free the next
+	struct fd_list purge = FD_LIST_INITIALIZER(purge);
+	
+	sr_detach(srlist, &purge, 1);
+	
+	while (!FD_IS_LIST_EMPTY(&purge)) {
+		struct sentreq * n = (struct sentreq *)(purge.next);
 		fd_list_unlink(&n->chain);
-		srlist->cnt--;
-		fd_list_unlink(&n->expire);
 		CHECK_FCT_DO(fd_msg_free(n->req), /* Ignore */);
 		free(n);
 	}
-	CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* continue anyway */ );
 }
@@ -45,6 +45,130 @@ pthread_rwlock_t fd_g_activ_peers_rw = PTHREAD_RWLOCK_INITIALIZER;
 
 /* List of validation callbacks (registered with fd_peer_validate_register) */
 static struct fd_list validators = FD_LIST_INITIALIZER(validators);	/* list items are simple fd_list with "o" pointing to the callback */
+
+/* Hash index of the peers in fd_g_peers by case-folded Diameter Identity, so that fd_peer_getbyid does not walk the list.
+ Entries are added and removed with fd_g_peers_rw write-locked, then the bucket lock; lookups only take the bucket lock. */
+#ifndef PEER_HASH_SIZE
+#define PEER_HASH_SIZE	10
+#endif /* PEER_HASH_SIZE */
+static struct {
+	struct fd_list	 sentinel;	/* the peers in this bucket, linked by p_hash */
+	pthread_rwlock_t lock;
+} peer_hash [ 1 << PEER_HASH_SIZE ];
+#define PH_MASK( _hash ) ((_hash) & (( 1 << PEER_HASH_SIZE ) - 1))
+#define PH_LIST( _hash ) (&(peer_hash[PH_MASK(_hash)].sentinel))
+#define PH_LOCK( _hash ) (&(peer_hash[PH_MASK(_hash)].lock    ))
+
+/* FNV-1a over the identity folded to ASCII lowercase (as fd_os_almostcasesrch), so that ids differing only by case share a bucket */
+static uint32_t peer_hash_id(DiamId_t diamid, size_t diamidlen)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+	for (i = 0; i < diamidlen; i++) {
+		uint8_t c = (uint8_t)diamid[i];
+		if ((c >= 'A') && (c <= 'Z'))
+			c += 32;
+		h ^= c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* Add a peer in the index. Called with fd_g_peers_rw write-locked */
+static int peer_index(struct fd_peer * p)
+{
+	uint32_t h = peer_hash_id(p->p_hdr.info.pi_diamid, p->p_hdr.info.pi_diamidlen);
+	CHECK_POSIX( pthread_rwlock_wrlock(PH_LOCK(h)) );
+	fd_list_insert_before(PH_LIST(h), &p->p_hash);
+	CHECK_POSIX( pthread_rwlock_unlock(PH_LOCK(h)) );
+	return 0;
+}
+
+/* Remove a peer from the index, if it was there. Called with fd_g_peers_rw write-locked, or when the peer is not in fd_g_peers anymore */
+void fd_peer_unindex(struct fd_peer * p)
+{
+	uint32_t h;
+	if (FD_IS_LIST_EMPTY(&p->p_hash))
+		return;
+	h = peer_hash_id(p->p_hdr.info.pi_diamid, p->p_hdr.info.pi_diamidlen);
+	CHECK_POSIX_DO( pthread_rwlock_wrlock(PH_LOCK(h)), return );
+	fd_list_unlink(&p->p_hash);
+	CHECK_POSIX_DO( pthread_rwlock_unlock(PH_LOCK(h)), /* continue */ );
+}
+
+/* Initialize the peers module */
+int fd_peer_init()
+{
+	int i;
+	TRACE_ENTRY();
+	for (i = 0; i < sizeof(peer_hash) / sizeof(peer_hash[0]); i++) {
+		fd_list_init( &peer_hash[i].sentinel, NULL );
+		CHECK_POSIX( pthread_rwlock_init(&peer_hash[i].lock, NULL) );
+	}
+	return 0;
+}
+
+/* The addresses (without port) of the configured peers, known or resolved. It is a separate copy because pi_endpoints
+ belongs to the thread of each peer; the servers use it to give priority to these addresses when many connections are pending. */
+static struct fd_list   known_addrs = FD_LIST_INITIALIZER(known_addrs);
+static pthread_rwlock_t known_addrs_rw = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Copy an address into ss, with the port set to 0 */
+static int addr_noport(sSA * sa, sSS * ss)
+{
+	memset(ss, 0, sizeof(sSS));
+	switch (sa->sa_family) {
+		case AF_INET:
+			memcpy(ss, sa, sizeof(sSA4));
+			((sSA4 *)ss)->sin_port = 0;
+			return sizeof(sSA4);
+		case AF_INET6:
+			memcpy(ss, sa, sizeof(sSA6));
+			((sSA6 *)ss)->sin6_port = 0;
+			((sSA6 *)ss)->sin6_flowinfo = 0;
+			return sizeof(sSA6);
+	}
+	return 0;
+}
+
+/* Remember the address of a configured peer */
+int fd_peer_known_addr_add(sSA * sa)
+{
+	sSS ss;
+	socklen_t sl;
+	int ret;
+	
+	CHECK_PARAMS( sa );
+	if ((sl = addr_noport(sa, &ss)) == 0)
+		return 0;
+	
+	CHECK_POSIX( pthread_rwlock_wrlock(&known_addrs_rw) );
+	ret = fd_ep_add_merge( &known_addrs, (sSA *)&ss, sl, EP_FL_CONF | EP_ACCEPTALL );
+	CHECK_POSIX( pthread_rwlock_unlock(&known_addrs_rw) );
+	return ret;
+}
+
+/* Is this the address of a configured peer? */
+int fd_peer_known_addr(sSA * sa)
+{
+	struct fd_list * li;
+	sSS ss;
+	int found = 0;
+	
+	if (addr_noport(sa, &ss) == 0)
+		return 0;
+	
+	CHECK_POSIX_DO( pthread_rwlock_rdlock(&known_addrs_rw), return 0 );
+	for (li = known_addrs.next; li != &known_addrs; li = li->next) {
+		struct fd_endpoint * ep = (struct fd_endpoint *)li;
+		if (!memcmp(&ss, &ep->ss, sizeof(sSS))) {
+			found = 1;
+			break;
+		}
+	}
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&known_addrs_rw), /* continue */ );
+	return found;
+}
 static pthread_rwlock_t validators_rw = PTHREAD_RWLOCK_INITIALIZER;
 
 
@@ -74,16 +198,18 @@ int fd_peer_alloc(struct fd_peer ** ptr)
 	p->p_eyec = EYEC_PEER;
 	CHECK_POSIX( pthread_mutex_init(&p->p_state_mtx, NULL) );
 	
+	fd_list_init(&p->p_hash, p);
 	fd_list_init(&p->p_actives, p);
 	fd_list_init(&p->p_expiry, p);
-	CHECK_FCT( fd_fifo_new(&p->p_tosend, 5) );
+	fd_list_init(&p->p_rtin_li, p);
+	CHECK_FCT( fd_fifo_new(&p->p_tosend, OUT_BATCH_MAX_MSG) );
 	CHECK_FCT( fd_fifo_new(&p->p_tofailover, 0) );
+	CHECK_POSIX( pthread_mutex_init(&p->p_sendlock, NULL) );
 	p->p_hbh = lrand48();
 	
 	fd_list_init(&p->p_sr.srs, p);
-	fd_list_init(&p->p_sr.exp, p);
 	CHECK_POSIX( pthread_mutex_init(&p->p_sr.mtx, NULL) );
-	CHECK_POSIX( pthread_cond_init(&p->p_sr.cnd, NULL) );
+	CHECK_FCT( fd_p_sr_start(&p->p_sr) );
 	
 	fd_list_init(&p->p_connparams, p);
 	
@@ -123,6 +249,9 @@ int fd_peer_add ( struct peer_info * info, const char * orig_dbg, void (*cb)(str
 	if (info->config.pic_priority) {
 		CHECK_MALLOC( p->p_hdr.info.config.pic_priority = strdup(info->config.pic_priority) );
 	}
+	if (info->config.pic_local_path) {
+		CHECK_MALLOC( p->p_hdr.info.config.pic_local_path = strdup(info->config.pic_local_path) );
+	}
 	
 	/* Move the list of endpoints into the peer */
 	if (info->pi_endpoints.next)
@@ -130,6 +259,7 @@ int fd_peer_add ( struct peer_info * info, const char * orig_dbg, void (*cb)(str
 			li = info->pi_endpoints.next;
 			fd_list_unlink(li);
 			fd_list_insert_before(&p->p_hdr.info.pi_endpoints, li);
+			CHECK_FCT_DO( fd_peer_known_addr_add((sSA *)&((struct fd_endpoint *)li)->ss), /* continue */ );
 		}
 	
 	/* The internal data */
@@ -169,6 +299,7 @@ int fd_peer_add ( struct peer_info * info, const char * orig_dbg, void (*cb)(str
 
 			/* Insert the new element in the list */
 			fd_list_insert_after( li_inf, &p->p_hdr.chain );
+			CHECK_FCT_DO( ret = peer_index( p ), { fd_list_unlink(&p->p_hdr.chain); break; } );
 		} while (0);
 
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_peers_rw) );
@@ -184,37 +315,28 @@ int fd_peer_add ( struct peer_info * info, const char * orig_dbg, void (*cb)(str
 int fd_peer_getbyid( DiamId_t diamid, size_t diamidlen, int igncase, struct peer_hdr ** peer )
 {
 	struct fd_list * li;
+	uint32_t h;
 	TRACE_ENTRY("%p %zd %d %p", diamid, diamidlen, igncase, peer);
 	CHECK_PARAMS( diamid && diamidlen && peer );
 	
 	*peer = NULL;
 	
-	/* Search in the list */
-	CHECK_POSIX( pthread_rwlock_rdlock(&fd_g_peers_rw) );
-	if (igncase) {
-		for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next) {
-			struct fd_peer * next = (struct fd_peer *)li;
-			int cmp, cont;
+	/* Search in the hash bucket */
+	h = peer_hash_id(diamid, diamidlen);
+	CHECK_POSIX( pthread_rwlock_rdlock(PH_LOCK(h)) );
+	for (li = PH_LIST(h)->next; li != PH_LIST(h); li = li->next) {
+		struct fd_peer * next = (struct fd_peer *)li->o;
+		int cmp, cont;
+		if (igncase)
 			cmp = fd_os_almostcasesrch( diamid, diamidlen, next->p_hdr.info.pi_diamid, next->p_hdr.info.pi_diamidlen, &cont );
-			if (cmp == 0) {
-				*peer = &next->p_hdr;
-				break;
-			}
-			if (!cont)
-				break;
-		}
-	} else {
-		for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next) {
-			struct fd_peer * next = (struct fd_peer *)li;
-			int cmp = fd_os_cmp( diamid, diamidlen, next->p_hdr.info.pi_diamid, next->p_hdr.info.pi_diamidlen );
-			if (cmp > 0)
-				continue;
-			if (cmp == 0)
-				*peer = &next->p_hdr;
+		else
+			cmp = fd_os_cmp( diamid, diamidlen, next->p_hdr.info.pi_diamid, next->p_hdr.info.pi_diamidlen );
+		if (cmp == 0) {
+			*peer = &next->p_hdr;
 			break;
 		}
 	}
-	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_peers_rw) );
+	CHECK_POSIX( pthread_rwlock_unlock(PH_LOCK(h)) );
 	
 	return 0;
 }
@@ -242,6 +364,8 @@ void fd_peer_failover_msg(struct fd_peer * peer)
 	
 	/* Requeue all messages in the "out" queue */
 	while ( fd_fifo_tryget(peer->p_tosend, &m) == 0 ) {
+		__atomic_sub_fetch(&peer->p_tosend_cnt, 1, __ATOMIC_RELAXED);
+		fd_p_sr_unreserve(&peer->p_sr, m);
 		/* but only if they are routable */
 		if (fd_msg_is_routable(m)) {
 			fd_hook_call(HOOK_MESSAGE_FAILOVER, m, peer, NULL, fd_msg_pmdl_get(m));
@@ -315,6 +439,23 @@ int fd_peer_get_load_pending(struct peer_hdr *peer, long * to_receive, long * to
 	return 0;
 }
 
+/* Return the in-flight window of the peer and srlist->cnt */
+int fd_peer_get_window(struct peer_hdr *peer, long * window, long * in_flight)
+{
+	struct fd_peer * p = (struct fd_peer *)peer;
+	TRACE_ENTRY("%p %p %p", peer, window, in_flight);
+	CHECK_PARAMS(CHECK_PEER(peer));
+	
+	CHECK_POSIX( pthread_mutex_lock(&p->p_sr.mtx) );
+	if (window)
+		*window = p->p_sr.win;
+	if (in_flight)
+		*in_flight = p->p_sr.cnt;
+	CHECK_POSIX( pthread_mutex_unlock(&p->p_sr.mtx) );
+	
+	return 0;
+}
+
 
 /* Destroy a structure once cleanups have been performed (fd_psm_abord, ...) */
 int fd_peer_free(struct fd_peer ** ptr)
@@ -329,10 +470,13 @@ int fd_peer_free(struct fd_peer ** ptr)
 	
 	CHECK_PARAMS( FD_IS_LIST_EMPTY(&p->p_hdr.chain) );
 	
+	fd_peer_unindex(p);
 	free_null(p->p_hdr.info.pi_diamid);
 	
 	free_null(p->p_hdr.info.config.pic_realm); 
 	free_null(p->p_hdr.info.config.pic_priority); 
+	free_null(p->p_hdr.info.config.pic_local_path);
+	free_null(p->p_lanes);
 	
 	free_null(p->p_hdr.info.runtime.pir_realm);
 	free_null(p->p_hdr.info.runtime.pir_prodname);
@@ -345,11 +489,13 @@ int fd_peer_free(struct fd_peer ** ptr)
 	fd_list_unlink(&p->p_expiry);
 	fd_list_unlink(&p->p_actives);
 	
+	fd_queues_peer_fini(p);
 	CHECK_FCT_DO( fd_fifo_del(&p->p_tosend), /* continue */ );
 	CHECK_FCT_DO( fd_fifo_del(&p->p_tofailover), /* continue */ );
+	CHECK_POSIX_DO( pthread_mutex_destroy(&p->p_sendlock), /* continue */);
 	CHECK_POSIX_DO( pthread_mutex_destroy(&p->p_state_mtx), /* continue */);
+	CHECK_FCT_DO( fd_p_sr_stop(&p->p_sr), /* continue */);
 	CHECK_POSIX_DO( pthread_mutex_destroy(&p->p_sr.mtx), /* continue */);
-	CHECK_POSIX_DO( pthread_cond_destroy(&p->p_sr.cnd), /* continue */);
 	
 	/* If the callback is still around... */
 	if (p->p_cb)
@@ -383,6 +529,7 @@ int fd_peer_fini()
 		} else {
 			li = li->prev; /* to avoid breaking the loop */
 			fd_list_unlink(&peer->p_hdr.chain);
+			fd_peer_unindex(peer);
 			fd_list_insert_before(&purge, &peer->p_hdr.chain);
 		}
 	}
@@ -409,6 +556,7 @@ int fd_peer_fini()
 			if (fd_peer_getstate(peer) == STATE_ZOMBIE) {
 				li = li->prev; /* to avoid breaking the loop */
 				fd_list_unlink(&peer->p_hdr.chain);
+				fd_peer_unindex(peer);
 				fd_list_insert_before(&purge, &peer->p_hdr.chain);
 			}
 		}
@@ -425,6 +573,9 @@ int fd_peer_fini()
 		fd_list_unlink(&peer->p_hdr.chain);
 		fd_peer_free(&peer);
 	}
+	
+	/* All sent requests are gone, stop the timeouts thread */
+	CHECK_FCT_DO( fd_p_sr_fini(), /* continue */ );
 
 	/* Now empty the validators list */
 	CHECK_FCT_DO( pthread_rwlock_wrlock(&validators_rw), /* continue */ );
@@ -455,6 +606,7 @@ int fd_peer_fini_force()
 			struct fd_peer * peer = (struct fd_peer *)(fd_g_peers.next->o);
 			fd_psm_abord(peer);
 			fd_list_unlink(&peer->p_hdr.chain);
+			fd_peer_unindex(peer);
 			fd_list_insert_before(&purge, &peer->p_hdr.chain);
 		}
 		CHECK_FCT_DO( pthread_rwlock_unlock(&fd_g_peers_rw), /* continue */ );
@@ -466,6 +618,10 @@ int fd_peer_fini_force()
 		fd_list_unlink(&peer->p_hdr.chain);
 		fd_peer_free(&peer);
 	}
+	
+	CHECK_FCT_DO( pthread_rwlock_wrlock(&known_addrs_rw), /* continue */ );
+	free_list( &known_addrs );
+	CHECK_FCT_DO( pthread_rwlock_unlock(&known_addrs_rw), /* continue */ );
 
 	return 0;
 }
@@ -483,6 +639,9 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_peer_dump, struct peer_hdr * p, int details)
 		struct fd_peer * peer = (struct fd_peer *)p;
 		
 		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "%s [%s, cnt:%ldsr,%ldpa]", peer->p_hdr.info.pi_diamid, STATE_STR(fd_peer_getstate(peer)), peer->p_sr.cnt, peer->p_reqin_count), return NULL);
+		if (peer->p_lanes_cnt) {
+			CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, " lanes:%d", peer->p_lanes_cnt + 1), return NULL);
+		}
 		if (details > 0) {
 			CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, " rlm:%s", peer->p_hdr.info.runtime.pir_realm ?: "<unknown>"), return NULL);
 			if (peer->p_hdr.info.runtime.pir_prodname) {
@@ -622,6 +781,7 @@ int fd_peer_handle_newCER( struct msg ** cer, struct cnxctx ** cnx )
 		
 		/* Insert the new peer in the list (the PSM will take care of setting the expiry after validation) */
 		fd_list_insert_after( li_inf, &peer->p_hdr.chain );
+		CHECK_FCT_DO( ret = peer_index( peer ), { fd_list_unlink(&peer->p_hdr.chain); goto out; } );
 		
 		/* Start the PSM, which will receive the event below */
 		CHECK_FCT_DO( ret = fd_psm_begin(peer), goto out );
@@ -60,6 +60,127 @@ int fd_queues_init_after_conf(void)
 	return 0;
 }
 
+/* Post a message in a queue, ahead of the messages of a lower priority class (fd_msg_prio_get) */
+int fd_queues_post(struct fifo * queue, struct msg ** msg)
+{
+	int prio;
+	
+	TRACE_ENTRY("%p %p", queue, msg);
+	
+	CHECK_FCT( fd_msg_prio_get(*msg, &prio) );
+	return fd_fifo_post_prio(queue, (void **)msg, prio);
+}
+
+/* Fair queuing of the incoming messages (cnf_qpeer_limit).
+ Each peer has its own queue (p_rtin), limited so that only the receiver of a peer that floods us blocks.
+ For each message queued there, a token is posted in fd_g_incoming, so that the routing-in threads, the
+ thresholds and the statistics of that queue work as before. A thread that gets a token takes the next message
+ among the peers with a backlog by deficit round-robin: each peer in turn gets routed up to its weight times
+ WFQ_QUANTUM bytes. */
+
+#ifndef WFQ_QUANTUM
+#define WFQ_QUANTUM	1024
+#endif /* WFQ_QUANTUM */
+
+static struct fd_list wfq_round = FD_LIST_INITIALIZER(wfq_round);	/* peers with a backlog, by p_rtin_li; the first one is served */
+static pthread_mutex_t wfq_lock = PTHREAD_MUTEX_INITIALIZER;
+static char wfq_token;
+
+/* Queue a message received from a peer for routing */
+int fd_queues_post_in(struct fd_peer * peer, struct msg ** msg)
+{
+	void * token = &wfq_token;
+	
+	TRACE_ENTRY("%p %p", peer, msg);
+	
+	if (!fd_g_config->cnf_qpeer_limit)
+		return fd_queues_post(fd_g_incoming, msg);
+	
+	/* Only the PSM thread of the peer posts here */
+	if (!peer->p_rtin) {
+		CHECK_FCT( fd_fifo_new(&peer->p_rtin, fd_g_config->cnf_qpeer_limit) );
+	}
+	
+	if (fd_g_config->cnf_flags.qpeer_shed && (fd_fifo_length(peer->p_rtin) >= fd_g_config->cnf_qpeer_limit)) {
+		struct msg_hdr * hdr;
+		CHECK_FCT( fd_msg_hdr(*msg, &hdr) );
+		if (hdr->msg_flags & CMD_FLAG_REQUEST)
+			return EBUSY; /* the caller answers the request */
+	}
+	
+	/* This blocks if the peer has too many messages waiting */
+	CHECK_FCT( fd_queues_post(peer->p_rtin, msg) );
+	
+	CHECK_POSIX( pthread_mutex_lock(&wfq_lock) );
+	if (FD_IS_LIST_EMPTY(&peer->p_rtin_li))
+		fd_list_insert_before(&wfq_round, &peer->p_rtin_li);
+	CHECK_POSIX( pthread_mutex_unlock(&wfq_lock) );
+	
+	/* The limit applies to the peers queues */
+	CHECK_FCT( fd_fifo_post_noblock(fd_g_incoming, &token) );
+	
+	return 0;
+}
+
+/* Resolve an item received from fd_g_incoming: either a message, or a token for the next message of the peers queues.
+ *msg is NULL if there is no message (the peer was deleted meanwhile) */
+int fd_queues_get_in(void * item, struct msg ** msg)
+{
+	struct fd_peer * peer;
+	struct msg_hdr * hdr;
+	
+	if (item != &wfq_token) {
+		*msg = item;
+		return 0;
+	}
+	
+	*msg = NULL;
+	CHECK_POSIX( pthread_mutex_lock(&wfq_lock) );
+	while (!FD_IS_LIST_EMPTY(&wfq_round)) {
+		peer = wfq_round.next->o;
+		
+		if (peer->p_rtin_deficit <= 0) {
+			/* Its turn is over, give it the credit for the next one */
+			peer->p_rtin_deficit += (long)WFQ_QUANTUM * (peer->p_hdr.info.config.pic_weight ?: 1);
+			fd_list_unlink(&peer->p_rtin_li);
+			fd_list_insert_before(&wfq_round, &peer->p_rtin_li);
+			continue;
+		}
+		
+		if (fd_fifo_tryget(peer->p_rtin, msg) == EWOULDBLOCK) {
+			fd_list_unlink(&peer->p_rtin_li);
+			peer->p_rtin_deficit = 0;
+			continue;
+		}
+		
+		CHECK_FCT_DO( fd_msg_hdr(*msg, &hdr), break );
+		peer->p_rtin_deficit -= hdr->msg_length;
+		break;
+	}
+	CHECK_POSIX( pthread_mutex_unlock(&wfq_lock) );
+	
+	return 0;
+}
+
+/* The peer is being destroyed, drop its backlog */
+void fd_queues_peer_fini(struct fd_peer * peer)
+{
+	struct msg * msg;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&wfq_lock), );
+	fd_list_unlink(&peer->p_rtin_li);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&wfq_lock), );
+	
+	if (!peer->p_rtin)
+		return;
+	
+	while (fd_fifo_tryget(peer->p_rtin, &msg) == 0) {
+		fd_hook_call(HOOK_MESSAGE_DROPPED, msg, NULL, "Message lost because the peer was deleted.", fd_msg_pmdl_get(msg));
+		fd_msg_free(msg);
+	}
+	CHECK_FCT_DO( fd_fifo_del(&peer->p_rtin), );
+}
+
 /* Destroy a queue after emptying it (and dumping the content) */
 int fd_queues_fini(struct fifo ** queue)
 {
@@ -81,6 +202,8 @@ int fd_queues_fini(struct fifo ** queue)
 		if (ret == EWOULDBLOCK)
 			break;
 		CHECK_FCT(ret);
+		if ((void *)msg == &wfq_token)
+			continue; /* the peers queues are emptied with the peers */
 		
 		/* We got one! */
 		fd_hook_call(HOOK_MESSAGE_DROPPED, msg, NULL, "Message lost because framework is terminating.", fd_msg_pmdl_get(msg));
@@ -0,0 +1,248 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+#include "fdcore-internal.h"
+
+/* Pool of buffers for the received messages.
+ *
+ * The receiver threads allocate one buffer per message (fd_cnx_alloc_msg_buffer), which is released once the message
+ * is parsed or freed, usually by another thread (routing, dispatch). Instead of going back to malloc each time, the
+ * buffers are recycled by size class. Each thread keeps a small cache of free buffers per class. When a cache is full,
+ * its content is pushed in a single operation on a global lock-free stack for the class; a thread whose cache is empty
+ * takes the whole global stack at once. Since these stacks are never popped one element at a time, the usual ABA
+ * problem of lock-free stacks does not arise.
+ */
+
+/* The size classes (including the room for the struct fd_msg_pmdl). Larger buffers are not pooled. */
+static const size_t rcvbuf_classes[] = { 512, 2048, 8192, 66560 /* jumbo: up to 64KiB messages */ };
+#define RCVBUF_NB_CLASSES	(sizeof(rcvbuf_classes) / sizeof(rcvbuf_classes[0]))
+#define RCVBUF_NOPOOL		RCVBUF_NB_CLASSES
+
+/* Memory kept in the cache of each thread, per class */
+#ifndef RCVBUF_CACHE_MEM
+#define RCVBUF_CACHE_MEM	(256 * 1024)	/* in bytes */
+#endif /* RCVBUF_CACHE_MEM */
+
+/* Memory kept in the global stack, per class. Buffers released above this limit are freed. */
+#ifndef RCVBUF_GLOBAL_MEM
+#define RCVBUF_GLOBAL_MEM	(8 * 1024 * 1024)	/* in bytes */
+#endif /* RCVBUF_GLOBAL_MEM */
+
+/* The header stored in front of each buffer */
+struct rcvbuf_hdr {
+	struct rcvbuf_hdr * next;	/* link in a list of free buffers */
+	size_t		    cls;	/* index of the size class, or RCVBUF_NOPOOL */
+};
+
+/* The free buffers kept by a thread */
+struct rcvbuf_cache {
+	struct rcvbuf_hdr * head[RCVBUF_NB_CLASSES];
+	struct rcvbuf_hdr * tail[RCVBUF_NB_CLASSES];
+	size_t		    cnt[RCVBUF_NB_CLASSES];
+};
+
+static struct rcvbuf_hdr * rcvbuf_global[RCVBUF_NB_CLASSES];	/* the global stacks */
+static long		   rcvbuf_global_cnt[RCVBUF_NB_CLASSES];	/* approximate number of buffers in each stack */
+
+static pthread_key_t  rcvbuf_key;
+static pthread_once_t rcvbuf_once = PTHREAD_ONCE_INIT;
+static int	      rcvbuf_key_ok = 0;
+
+/* Max number of buffers in a thread cache and in the global stack */
+static size_t rcvbuf_cache_max(size_t cls)
+{
+	return (RCVBUF_CACHE_MEM / rcvbuf_classes[cls]) ?: 1;
+}
+static long rcvbuf_global_max(size_t cls)
+{
+	return (RCVBUF_GLOBAL_MEM / rcvbuf_classes[cls]) ?: 1;
+}
+
+/* Give the buffers of a thread cache back to the global stack (or to the system if it is already full) */
+static void rcvbuf_flush(struct rcvbuf_cache * c, size_t cls)
+{
+	struct rcvbuf_hdr * head;
+
+	if (!c->head[cls])
+		return;
+
+	if (__atomic_load_n(&rcvbuf_global_cnt[cls], __ATOMIC_RELAXED) + (long)c->cnt[cls] > rcvbuf_global_max(cls)) {
+		while (c->head[cls]) {
+			struct rcvbuf_hdr * h = c->head[cls];
+			c->head[cls] = h->next;
+			free(h);
+		}
+	} else {
+		head = __atomic_load_n(&rcvbuf_global[cls], __ATOMIC_RELAXED);
+		do {
+			c->tail[cls]->next = head;
+		} while (!__atomic_compare_exchange_n(&rcvbuf_global[cls], &head, c->head[cls], 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		__atomic_fetch_add(&rcvbuf_global_cnt[cls], (long)c->cnt[cls], __ATOMIC_RELAXED);
+	}
+
+	c->head[cls] = c->tail[cls] = NULL;
+	c->cnt[cls] = 0;
+}
+
+/* Destructor of the thread caches */
+static void rcvbuf_cache_free(void * arg)
+{
+	struct rcvbuf_cache * c = arg;
+	size_t cls;
+
+	for (cls = 0; cls < RCVBUF_NB_CLASSES; cls++)
+		rcvbuf_flush(c, cls);
+	free(c);
+}
+
+static void rcvbuf_init(void)
+{
+	CHECK_POSIX_DO( pthread_key_create(&rcvbuf_key, rcvbuf_cache_free), return );
+	rcvbuf_key_ok = 1;
+}
+
+/* Get the cache of the calling thread, create it if needed. Returns NULL if it cannot be created, the pool is then bypassed. */
+static struct rcvbuf_cache * rcvbuf_cache_get(void)
+{
+	struct rcvbuf_cache * c;
+
+	CHECK_POSIX_DO( pthread_once(&rcvbuf_once, rcvbuf_init), return NULL );
+	if (!rcvbuf_key_ok)
+		return NULL;
+
+	c = pthread_getspecific(rcvbuf_key);
+	if (!c) {
+		CHECK_MALLOC_DO( c = calloc(1, sizeof(struct rcvbuf_cache)), return NULL );
+		CHECK_POSIX_DO( pthread_setspecific(rcvbuf_key, c), { free(c); return NULL; } );
+	}
+	return c;
+}
+
+/* Allocate a buffer of at least size bytes */
+uint8_t * fd_rcvbuf_alloc(size_t size)
+{
+	struct rcvbuf_cache * c;
+	struct rcvbuf_hdr * h;
+	size_t cls;
+
+	for (cls = 0; cls < RCVBUF_NB_CLASSES; cls++) {
+		if (size <= rcvbuf_classes[cls])
+			break;
+	}
+
+	if ((cls != RCVBUF_NOPOOL) && ((c = rcvbuf_cache_get()) != NULL)) {
+		if (!c->head[cls]) {
+			/* Take all the buffers that were released by other threads */
+			h = __atomic_exchange_n(&rcvbuf_global[cls], NULL, __ATOMIC_ACQUIRE);
+			if (h) {
+				size_t n = 1;
+				c->head[cls] = h;
+				while (h->next) {
+					h = h->next;
+					n++;
+				}
+				c->tail[cls] = h;
+				c->cnt[cls] = n;
+				__atomic_fetch_sub(&rcvbuf_global_cnt[cls], (long)n, __ATOMIC_RELAXED);
+			}
+		}
+
+		h = c->head[cls];
+		if (h) {
+			c->head[cls] = h->next;
+			if (!c->head[cls])
+				c->tail[cls] = NULL;
+			c->cnt[cls]--;
+			return (uint8_t *)(h + 1);
+		}
+	}
+
+	CHECK_MALLOC_DO( h = malloc(sizeof(struct rcvbuf_hdr) + ((cls == RCVBUF_NOPOOL) ? size : rcvbuf_classes[cls])), return NULL );
+	h->cls = cls;
+	return (uint8_t *)(h + 1);
+}
+
+/* Release a buffer obtained with fd_rcvbuf_alloc. NULL is accepted. */
+void fd_rcvbuf_free(void * buf)
+{
+	struct rcvbuf_cache * c;
+	struct rcvbuf_hdr * h;
+	size_t cls;
+
+	if (!buf)
+		return;
+
+	h = (struct rcvbuf_hdr *)buf - 1;
+	cls = h->cls;
+
+	if ((cls == RCVBUF_NOPOOL) || ((c = rcvbuf_cache_get()) == NULL)) {
+		free(h);
+		return;
+	}
+
+	h->next = c->head[cls];
+	if (!c->head[cls])
+		c->tail[cls] = h;
+	c->head[cls] = h;
+	c->cnt[cls]++;
+
+	if (c->cnt[cls] > rcvbuf_cache_max(cls))
+		rcvbuf_flush(c, cls);
+}
+
+/* Free the buffers kept in the global stacks and in the cache of the calling thread */
+void fd_rcvbuf_fini(void)
+{
+	struct rcvbuf_cache * c = NULL;
+	size_t cls;
+
+	if (rcvbuf_key_ok)
+		c = pthread_getspecific(rcvbuf_key);
+
+	for (cls = 0; cls < RCVBUF_NB_CLASSES; cls++) {
+		struct rcvbuf_hdr * h;
+
+		if (c)
+			rcvbuf_flush(c, cls);
+
+		h = __atomic_exchange_n(&rcvbuf_global[cls], NULL, __ATOMIC_ACQUIRE);
+		while (h) {
+			struct rcvbuf_hdr * next = h->next;
+			free(h);
+			__atomic_fetch_sub(&rcvbuf_global_cnt[cls], 1, __ATOMIC_RELAXED);
+			h = next;
+		}
+	}
+}
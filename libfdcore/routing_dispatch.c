@@ -300,6 +300,88 @@ static int score_destination_avp(void * cbdata, struct msg ** pmsg, struct fd_li
 /*                        Helper functions                                      */
 /********************************************************************************/
 
+/* Find the entry of the realm routing table for a request. *c and *nb are unchanged if there is none. */
+static int rt_realm_lookup(struct msg * msg, struct msg_hdr * hdr, struct fd_actives * snap, struct rtd_candidate ** c, int * nb)
+{
+	struct avp * avp;
+	union avp_value *dh = NULL, *dr = NULL;
+	struct fd_rt_realm * e = NULL;
+	application_id_t app;
+	int i;
+	
+	/* The base protocol requests are not in the table */
+	if ((hdr->msg_appl == 0) || (snap->nrt == 0))
+		return 0;
+	
+	/* Search the Destination-Host and Destination-Realm AVPs */
+	CHECK_FCT(  fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+	while (avp) {
+		struct avp_hdr * ahdr;
+		CHECK_FCT(  fd_msg_avp_hdr( avp, &ahdr ) );
+
+		if (! (ahdr->avp_flags & AVP_FLAG_VENDOR)) {
+			switch (ahdr->avp_code) {
+				case AC_DESTINATION_HOST:
+					CHECK_FCT( fd_msg_parse_dict ( avp, fd_g_config->cnf_dict, NULL ) );
+					ASSERT( ahdr->avp_value );
+					dh = ahdr->avp_value;
+					break;
+
+				case AC_DESTINATION_REALM:
+					CHECK_FCT( fd_msg_parse_dict ( avp, fd_g_config->cnf_dict, NULL ) );
+					ASSERT( ahdr->avp_value );
+					dr = ahdr->avp_value;
+					break;
+			}
+		}
+
+		if (dh && dr)
+			break;
+
+		CHECK_FCT(  fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL) );
+	}
+	if (!dr)
+		return 0;
+	
+	/* Search the entry of the application in this realm, otherwise the relays of the realm */
+	for (app = hdr->msg_appl; !e; app = AI_RELAY) {
+		int lo = 0, hi = snap->nrt - 1;
+		while (lo <= hi) {
+			int mid = (lo + hi) / 2;
+			struct fd_rt_realm * m = &snap->rt[mid];
+			int cmp = fd_rt_realm_cmp(dr->os.data, dr->os.len, (uint8_t *)m->realm, m->realmlen);
+			if (!cmp)
+				cmp = (app == m->app) ? 0 : ((app < m->app) ? -1 : 1);
+			if (!cmp) {
+				e = m;
+				break;
+			}
+			if (cmp < 0)
+				hi = mid - 1;
+			else
+				lo = mid + 1;
+		}
+		if (app == AI_RELAY)
+			break;
+	}
+	if (!e)
+		return 0;
+	
+	/* The Destination-Host must be one of these peers, otherwise let the routing consider all of them */
+	if (dh) {
+		for (i = 0; i < e->nb; i++) {
+			if (!fd_os_almostcasesrch(dh->os.data, dh->os.len, e->c[i].diamid, e->c[i].diamidlen, NULL))
+				break;
+		}
+		if (i == e->nb)
+			return 0;
+	}
+	
+	*c = e->c;
+	*nb = e->nb;
+	return 0;
+}
+
 /* Find (first) '!' and '@' positions in a UTF-8 encoded string (User-Name AVP value) */
 static void nai_get_indexes(union avp_value * un, int * excl_idx, int * at_idx)
 {
@@ -381,8 +463,9 @@ static int process_decorated_NAI(int * was_nai, union avp_value * un, union avp_
 }
 
 
-/* Function to return an error to an incoming request */
-static int return_error(struct msg ** pmsg, char * error_code, char * error_message, struct avp * failedavp)
+/* Function to return an error to an incoming request. With noblock, the answer is queued without waiting for room in
+ the queues (fd_g_incoming for a local request, fd_g_outgoing otherwise), so that it can be used from the out threads. */
+static int return_error_int(struct msg ** pmsg, char * error_code, char * error_message, struct avp * failedavp, int noblock)
 {
 	struct fd_peer * peer;
 	int is_loc = 0;
@@ -418,8 +501,10 @@ static int return_error(struct msg ** pmsg, char * error_code, char * error_mess
 	CHECK_FCT( fd_msg_rescode_set(*pmsg, error_code, error_message, failedavp, 1 ) );
 
 	/* Send the answer */
-	if (is_loc) {
-		CHECK_FCT( fd_fifo_post(fd_g_incoming, pmsg) );
+	if (noblock) {
+		CHECK_FCT( fd_fifo_post_noblock(is_loc ? fd_g_incoming : fd_g_outgoing, (void *)pmsg) );
+	} else if (is_loc) {
+		CHECK_FCT( fd_queues_post(fd_g_incoming, pmsg) );
 	} else {
 		CHECK_FCT( fd_out_send(pmsg, NULL, peer, 1) );
 	}
@@ -428,11 +513,162 @@ static int return_error(struct msg ** pmsg, char * error_code, char * error_mess
 	return 0;
 }
 
+static int return_error(struct msg ** pmsg, char * error_code, char * error_message, struct avp * failedavp)
+{
+	return return_error_int(pmsg, error_code, error_message, failedavp, 0);
+}
+
+/* Requests shed because they waited too long in the queues (see fd_rtdisp_shed) */
+static long long shed_timeout = 0;
+static long long shed_residence = 0;
+
+#define SHED_TIMEOUT	1	/* the answer timeout of a local request is passed */
+#define SHED_RESIDENCE	2	/* the request is older than MaxResidence */
+
+/* Tell if a request is not worth processing anymore, and why (0 if it must be processed) */
+static int shed_reason(struct msg * msg, int * reason)
+{
+	struct msg_hdr * hdr;
+	struct timespec * to, arrival, now;
+	
+	*reason = 0;
+	
+	CHECK_FCT( fd_msg_hdr(msg, &hdr) );
+	if (!(hdr->msg_flags & CMD_FLAG_REQUEST))
+		return 0;
+	
+	to = fd_msg_anscb_gettimeout(msg);
+	if (!to && !fd_g_config->cnf_max_residence)
+		return 0;
+	
+	CHECK_SYS( clock_gettime(CLOCK_REALTIME, &now) );
+	
+	if (to && TS_IS_INFERIOR(to, &now)) {
+		*reason = SHED_TIMEOUT;
+		return 0;
+	}
+	
+	if (!fd_g_config->cnf_max_residence)
+		return 0;
+	
+	CHECK_FCT( fd_msg_arrival_get(msg, &arrival) );
+	if (!arrival.tv_sec && !arrival.tv_nsec)
+		return 0; /* not recorded, e.g. MaxResidence was not set when it arrived */
+	
+	arrival.tv_sec  += fd_g_config->cnf_max_residence / 1000;
+	arrival.tv_nsec += (fd_g_config->cnf_max_residence % 1000) * 1000000;
+	if (arrival.tv_nsec >= 1000000000) {
+		arrival.tv_sec++;
+		arrival.tv_nsec -= 1000000000;
+	}
+	if (!TS_IS_INFERIOR(&now, &arrival))
+		*reason = SHED_RESIDENCE;
+	
+	return 0;
+}
+
+/* Check if fd_rtdisp_shed would drop this request, without touching it */
+int fd_rtdisp_shed_due(struct msg * msg, int * due)
+{
+	CHECK_FCT( shed_reason(msg, due) );
+	return 0;
+}
+
+/* Answer a request that is not worth processing anymore: its sender stopped waiting for the answer.
+ On return, *pmsg is NULL if the request was shed. Answers are never shed. The error answer is queued without
+ blocking, so this can be called from any thread that does not hold a lock. */
+int fd_rtdisp_shed(struct msg ** pmsg)
+{
+	int reason;
+	
+	CHECK_FCT( shed_reason(*pmsg, &reason) );
+	
+	switch (reason) {
+		case SHED_TIMEOUT:
+			/* The expiry callback is reserved to the requests that were sent (it receives the peer), so the answer
+			 callback gets an error instead, as for a request that could not be routed */
+			__atomic_add_fetch(&shed_timeout, 1, __ATOMIC_RELAXED);
+			CHECK_FCT( return_error_int( pmsg, "DIAMETER_UNABLE_TO_DELIVER", "Answer timeout expired while the request was queued", NULL, 1) );
+			break;
+			
+		case SHED_RESIDENCE:
+			/* The local requests get this error through their answer callback */
+			__atomic_add_fetch(&shed_residence, 1, __ATOMIC_RELAXED);
+			CHECK_FCT( return_error_int( pmsg, "DIAMETER_TOO_BUSY", "Request waited too long in the queues", NULL, 1) );
+			break;
+	}
+	
+	return 0;
+}
+
+/* Number of requests shed so far */
+int fd_stat_getshed(long long * timeout, long long * residence)
+{
+	TRACE_ENTRY( "%p %p", timeout, residence);
+	
+	if (timeout)
+		*timeout = __atomic_load_n(&shed_timeout, __ATOMIC_RELAXED);
+	if (residence)
+		*residence = __atomic_load_n(&shed_residence, __ATOMIC_RELAXED);
+	return 0;
+}
+
 
 /****************************************************************************/
 /*         Second part : threads moving messages in the daemon              */
 /****************************************************************************/
 
+/* Threads report their status */
+enum thread_state { NOTRUNNING = 0, RUNNING = 1 };
+
+/* Each global queue is served by a pool of threads, that grows and shrinks between min and max
+ following the thresholds of the queue (see fd_fifo_setthrhd). */
+struct pool_thr {
+	pthread_t		 thr;	/* NULL when the slot is free */
+	enum thread_state	 state;
+	struct rtdisp_pool *	 pool;
+};
+struct rtdisp_pool {
+	char *		 name;		/* for the logs */
+	char *		 thname;	/* system name of the threads */
+	int		(*action_cb)(struct msg * msg);
+	struct fifo *	 queue;		/* the queue this pool serves */
+	int		 min;
+	int		 max;
+	int		 level;		/* number of threshold steps the queue is above its base. Protected by order_state_lock */
+	int		 target;	/* number of threads wanted: min + level, up to max. Protected by order_state_lock */
+	int		 running;	/* number of threads running. Protected by order_state_lock */
+	struct pool_thr * thr;		/* array of max slots */
+	void		(*idle_cb)(struct rtdisp_pool * pool);	/* if not NULL, called when the queue is found empty after a message */
+};
+
+/* When the pipeline is fused (cnf_fuse), a thread that has processed a message runs the next stage itself,
+ as long as the budget for this message is not exhausted and its own queue is not backlogged. */
+struct fuse_state {
+	struct rtdisp_pool * pool;	/* the pool of this thread */
+	int	      budget;	/* remaining inline stages for the current message */
+};
+static pthread_key_t fuse_key;
+static int fuse_key_ok = 0;
+
+/* Pass the message to the next stage: run it inline, or post it to the queue of that stage */
+static int stage_next(struct msg ** pmsg, struct fifo * queue, int (*action_cb)(struct msg * msg))
+{
+	struct fuse_state * fs = fuse_key_ok ? pthread_getspecific(fuse_key) : NULL;
+	
+	if (fs && (fs->budget > 0) && fs->pool->queue && (fd_fifo_length(fs->pool->queue) < fs->pool->running)) {
+		struct msg * msg = *pmsg;
+		*pmsg = NULL;
+		fs->budget--;
+		return (*action_cb)(msg);
+	}
+	
+	return fd_queues_post(queue, pmsg);
+}
+
+static int msg_rt_out(struct msg * msg);
+static int local_deliver(struct msg ** pmsg);
+
 /* The DISPATCH message processing */
 static int msg_dispatch(struct msg * msg)
 {
@@ -450,6 +686,11 @@ static int msg_dispatch(struct msg * msg)
 	CHECK_FCT( fd_msg_hdr(msg, &hdr) );
 	is_req = hdr->msg_flags & CMD_FLAG_REQUEST;
 	
+	/* Do not process a request that its sender already gave up on */
+	CHECK_FCT( fd_rtdisp_shed(&msgptr) );
+	if (!msgptr)
+		return 0;
+	
 	/* Note: if the message is for local delivery, we should test for duplicate
 	  (draft-asveren-dime-dupcons-00). This may conflict with path validation decisions, no clear answer yet */
 
@@ -464,7 +705,7 @@ static int msg_dispatch(struct msg * msg)
 				if (!msgptr) {
 					fd_hook_call(HOOK_MESSAGE_PARSING_ERROR2, error, NULL, NULL, fd_msg_pmdl_get(error));
 					/* error now contains the answer message to send back */
-					CHECK_FCT( fd_fifo_post(fd_g_outgoing, &error) );
+					CHECK_FCT( stage_next(&error, fd_g_outgoing, msg_rt_out) );
 				} else if (!error) {
 					/* We have received an invalid answer to our query */
 					fd_hook_call(HOOK_MESSAGE_DROPPED, msgptr, NULL, "Received answer failed the dictionary / rules parsing", fd_msg_pmdl_get(msgptr));
@@ -522,7 +763,7 @@ static int msg_dispatch(struct msg * msg)
 				if ((!fd_g_config->cnf_flags.no_fwd) && (is_req || qry_src)) {
 					/* requeue to fd_g_outgoing */
 					fd_hook_call(HOOK_MESSAGE_ROUTING_FORWARD, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-					CHECK_FCT( fd_fifo_post(fd_g_outgoing, &msgptr) );
+					CHECK_FCT( stage_next(&msgptr, fd_g_outgoing, msg_rt_out) );
 					break;
 				}
 				/* We don't relay => reply error */
@@ -547,7 +788,7 @@ static int msg_dispatch(struct msg * msg)
 				
 			case DISP_ACT_SEND:
 				/* Now, send the message */
-				CHECK_FCT( fd_fifo_post(fd_g_outgoing, &msgptr) );
+				CHECK_FCT( stage_next(&msgptr, fd_g_outgoing, msg_rt_out) );
 		}
 	} else if (em) {
 		fd_hook_call(HOOK_MESSAGE_DROPPED, error, NULL, em, fd_msg_pmdl_get(error));
@@ -579,6 +820,11 @@ static int msg_rt_in(struct msg * msg)
 		return 0;
 	}
 	
+	/* Do not process a request that its sender already gave up on */
+	CHECK_FCT( fd_rtdisp_shed(&msgptr) );
+	if (!msgptr)
+		return 0;
+	
 	/* If it is a request, we must analyze its content to decide what we do with it */
 	if (is_req) {
 		struct avp * avp, *un = NULL;
@@ -733,7 +979,7 @@ static int msg_rt_in(struct msg * msg)
 			if (is_local_app == YES) {
 				/* Ok, give the message to the dispatch thread */
 				fd_hook_call(HOOK_MESSAGE_ROUTING_LOCAL, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-				CHECK_FCT( fd_fifo_post(fd_g_local, &msgptr) );
+				CHECK_FCT( local_deliver(&msgptr) );
 			} else {
 				/* We don't support the application, reply an error */
 				fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, msgptr, NULL, "Application unsupported", fd_msg_pmdl_get(msgptr));
@@ -774,14 +1020,14 @@ static int msg_rt_in(struct msg * msg)
 				
 			if (is_nai) {
 				/* We have transformed the AVP, now submit it again in the queue */
-				CHECK_FCT(fd_fifo_post(fd_g_incoming, &msgptr) );
+				CHECK_FCT(fd_queues_post(fd_g_incoming, &msgptr) );
 				return 0;
 			}
 
 			if (is_local_app == YES) {
 				/* Handle locally since we are able to */
 				fd_hook_call(HOOK_MESSAGE_ROUTING_LOCAL, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-				CHECK_FCT(fd_fifo_post(fd_g_local, &msgptr) );
+				CHECK_FCT(local_deliver(&msgptr) );
 				return 0;
 			}
 
@@ -803,10 +1049,15 @@ static int msg_rt_in(struct msg * msg)
 		CHECK_FCT( fd_msg_answ_getq( msgptr, &qry ) );
 		CHECK_FCT( fd_msg_source_get( qry, &qry_src, NULL ) );
 
+		/* Save the overload report if any */
+		if (fd_g_config->cnf_flags.doic) {
+			CHECK_FCT_DO( fd_doic_answer_in(msgptr), /* continue */ );
+		}
+
 		if ((!qry_src) && (!is_err)) {
 			/* The message is a normal answer to a request issued locally, we do not call the callbacks chain on it. */
 			fd_hook_call(HOOK_MESSAGE_ROUTING_LOCAL, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-			CHECK_FCT(fd_fifo_post(fd_g_local, &msgptr) );
+			CHECK_FCT(local_deliver(&msgptr) );
 			return 0;
 		}
 		
@@ -855,10 +1106,10 @@ static int msg_rt_in(struct msg * msg)
 	/* Now pass the message to the next step: either forward to another peer, or dispatch to local extensions */
 	if (is_req || qry_src) {
 		fd_hook_call(HOOK_MESSAGE_ROUTING_FORWARD, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-		CHECK_FCT(fd_fifo_post(fd_g_outgoing, &msgptr) );
+		CHECK_FCT(stage_next(&msgptr, fd_g_outgoing, msg_rt_out) );
 	} else {
 		fd_hook_call(HOOK_MESSAGE_ROUTING_LOCAL, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-		CHECK_FCT(fd_fifo_post(fd_g_local, &msgptr) );
+		CHECK_FCT(local_deliver(&msgptr) );
 	}
 
 	/* We're done with this message */
@@ -866,6 +1117,18 @@ static int msg_rt_in(struct msg * msg)
 }
 		
 
+/* The items of fd_g_incoming are either messages, or tokens of the fair queuing of the peers (see queues.c) */
+static int msg_rt_in_fair(struct msg * item)
+{
+	struct msg * msg;
+	
+	CHECK_FCT( fd_queues_get_in(item, &msg) );
+	if (!msg)
+		return 0;
+	
+	return msg_rt_in(msg);
+}
+
 /* The ROUTING-OUT message processing */
 static int msg_rt_out(struct msg * msg)
 {
@@ -879,6 +1142,10 @@ static int msg_rt_out(struct msg * msg)
 	struct msg *msgptr = msg;
 	DiamId_t qry_src = NULL;
 	size_t qry_src_len = 0;
+	int first = 0;
+	struct fd_peer * held = NULL;	/* the best candidate that has a full window */
+	int held_score = 0;
+	int busy = 0;			/* some candidates were skipped because they reached PeerWindow */
 	
 	/* Read the message header */
 	CHECK_FCT( fd_msg_hdr(msgptr, &hdr) );
@@ -911,6 +1178,11 @@ static int msg_rt_out(struct msg * msg)
 		CHECK_FCT( fd_msg_hdr(qry, &qry_hdr) );
 		hdr->msg_hbhid = qry_hdr->msg_hbhid;
 
+		/* Report our overload if the requester supports it */
+		if (fd_g_config->cnf_doic_depth || fd_g_config->cnf_doic_latency) {
+			CHECK_FCT_DO( fd_doic_answer_out(msgptr, qry), /* continue */ );
+		}
+
 		/* Push the message into this peer */
 		CHECK_FCT( fd_out_send(&msgptr, NULL, peer, 1) );
 
@@ -919,6 +1191,9 @@ static int msg_rt_out(struct msg * msg)
 	}
 	
 	/* From that point, the message is a request */
+	CHECK_FCT( fd_rtdisp_shed(&msgptr) );
+	if (!msgptr)
+		return 0;
 	CHECK_FCT( fd_msg_source_get( msgptr, &qry_src, &qry_src_len ) );
 	/* if qry_src != NULL, this message is relayed, otherwise it is locally issued */
 
@@ -927,20 +1202,24 @@ static int msg_rt_out(struct msg * msg)
 
 	/* If there is no routing data already, let's create it */
 	if (rtd == NULL) {
+		first = 1;
 		CHECK_FCT( fd_rtd_init(&rtd) );
 
-		/* Add all peers currently in OPEN state */
-		CHECK_FCT( pthread_rwlock_rdlock(&fd_g_activ_peers_rw) );
-		for (li = fd_g_activ_peers.next; li != &fd_g_activ_peers; li = li->next) {
-			struct fd_peer * p = (struct fd_peer *)li->o;
-			CHECK_FCT_DO( ret = fd_rtd_candidate_add(rtd, 
-							p->p_hdr.info.pi_diamid, 
-							p->p_hdr.info.pi_diamidlen, 
-							p->p_hdr.info.runtime.pir_realm,
-							p->p_hdr.info.runtime.pir_realmlen), 
-				{ CHECK_FCT_DO( pthread_rwlock_unlock(&fd_g_activ_peers_rw), ); return ret; } );
+		/* Add all peers currently in OPEN state, or those of the realm routing table entry, from the snapshot that the routing data references until it is freed */
+		{
+			struct fd_actives * snap;
+			CHECK_FCT( fd_psm_actives_get(&snap) );
+			if (snap) {
+				struct rtd_candidate * c = snap->c;
+				int nb = snap->nb;
+				if (fd_g_config->cnf_flags.rt_realm) {
+					CHECK_FCT_DO( ret = rt_realm_lookup(msgptr, hdr, snap, &c, &nb), 
+						{ fd_psm_actives_release(snap); return ret; } );
+				}
+				CHECK_FCT_DO( ret = fd_rtd_candidate_set(rtd, c, nb, fd_psm_actives_release, snap), 
+					{ fd_psm_actives_release(snap); return ret; } );
+			}
 		}
-		CHECK_FCT( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
 
 		/* Now let's remove all peers from the Route-Records */
 		CHECK_FCT(  fd_msg_browse(msgptr, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
@@ -1009,6 +1288,11 @@ static int msg_rt_out(struct msg * msg)
 		}
 	}
 	
+	/* Overload control: the reports received may exclude some or all of the candidates (not again on retransmissions) */
+	if (first && fd_g_config->cnf_flags.doic) {
+		CHECK_FCT( fd_doic_request(msgptr, candidates) );
+	}
+	
 	/* Order the candidate peers by score attributed by the callbacks */
 	CHECK_FCT( fd_rtd_candidate_reorder(candidates) );
 
@@ -1021,18 +1305,59 @@ static int msg_rt_out(struct msg * msg)
 		/* Stop when we have reached the end of valid candidates */
 		if (c->score < 0)
 			break;
+		
+		/* A peer with a full window is only used when no other peer with the same score can take the message */
+		if (held && (c->score < held_score))
+			break;
 
 		/* Search for the peer */
 		CHECK_FCT( fd_peer_getbyid( c->diamid, c->diamidlen, 0, (void *)&peer ) );
 
 		if (fd_peer_getstate(peer) == STATE_OPEN) {
+			if (fd_g_config->cnf_peer_window) {
+				long win, cnt;
+				fd_p_sr_window(&peer->p_sr, &win, &cnt);
+				if (cnt >= fd_g_config->cnf_peer_window) {
+					busy = 1;
+					continue;
+				}
+				if (cnt >= win) {
+					if (!held) {
+						held = peer;
+						held_score = c->score;
+					}
+					continue;
+				}
+				if (fd_p_sr_reserve(&peer->p_sr)) {
+					busy = 1;
+					continue;
+				}
+			}
+			
 			/* Send to this one */
-			CHECK_FCT_DO( fd_out_send(&msgptr, NULL, peer, 1), continue );
+			CHECK_FCT_DO( fd_out_send(&msgptr, NULL, peer, 1), 
+				{
+					fd_p_sr_unreserve(&peer->p_sr, msgptr);
+					continue;
+				} );
 			
 			/* If the sending was successful */
 			break;
 		}
 	}
+	if (msgptr && held) {
+		if (fd_p_sr_reserve(&held->p_sr)) {
+			busy = 1;
+		} else {
+			CHECK_FCT_DO( fd_out_send(&msgptr, NULL, held, 1), fd_p_sr_unreserve(&held->p_sr, msgptr) /* error below */ );
+		}
+	}
+	
+	/* All the candidates have reached their maximum number of requests in flight */
+	if (msgptr && busy) {
+		fd_hook_call(HOOK_MESSAGE_ROUTING_ERROR, msgptr, NULL, "All the candidates have reached PeerWindow", fd_msg_pmdl_get(msgptr));
+		return_error( &msgptr, "DIAMETER_TOO_BUSY", "No candidate can take more requests", NULL);
+	}
 
 	/* If the message has not been sent, return an error */
 	if (msgptr) {
@@ -1050,45 +1375,62 @@ static int msg_rt_out(struct msg * msg)
 /*                     Management of the threads                                */
 /********************************************************************************/
 
-/* Note: in the first version, we only create one thread of each kind.
- We could improve the scalability by using the threshold feature of the queues
- to create additional threads if a queue is filling up, or at least giving a configurable
- number of threads of each kind.
- */
+/* Each stage starts with its configured number of threads (AppServThreads, RoutingInThreads, RoutingOutThreads).
+ If a maximum is configured above it, the high threshold callback of the queue adds one thread each time
+ the queue grows by another step, and the low threshold callback lowers the target again when it drains.
+ The extra threads only terminate after being idle for a full wait period, so that the pool does not
+ oscillate on bursts. */
+
+/* Default threshold step when the queue has no limit */
+#ifndef RTDISP_THRHD_STEP
+#define RTDISP_THRHD_STEP	10
+#endif /* RTDISP_THRHD_STEP */
 
 /* Control of the threads */
 static enum { RUN = 0, STOP = 1 } order_val = RUN;
 static pthread_mutex_t order_state_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Threads report their status */
-enum thread_state { NOTRUNNING = 0, RUNNING = 1 };
-static void cleanup_state(void * state_loc)
+static void cleanup_state(void * arg)
 {
+	struct pool_thr * slot = arg;
 	CHECK_POSIX_DO( pthread_mutex_lock(&order_state_lock), );
-	*(enum thread_state *)state_loc = NOTRUNNING;
+	if (slot->state == RUNNING) {
+		slot->state = NOTRUNNING;
+		slot->pool->running--;
+	}
 	CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), );
 }
 
 /* This is the common thread code (same for routing and dispatching) */
-static void * process_thr(void * arg, int (*action_cb)(struct msg * msg), struct fifo * queue, char * action_name)
+static void * process_thr(void * arg)
 {
-	TRACE_ENTRY("%p %p %p %p", arg, action_cb, queue, action_name);
+	struct pool_thr * slot = arg;
+	struct rtdisp_pool * pool;
+	struct fifo * queue;
+	struct fuse_state fs;
+	int retired = 0;
+	
+	TRACE_ENTRY("%p", arg);
+	
+	/* The thread reports its status when canceled */
+	CHECK_PARAMS_DO(slot && slot->pool, return NULL);
+	pool = slot->pool;
+	queue = pool->queue;
+	fs.pool = pool;
+	fs.budget = 0;
 	
 	/* Set the thread name */
 	{
 		char buf[48];
-		snprintf(buf, sizeof(buf), "%s (%p)", action_name, arg);
+		snprintf(buf, sizeof(buf), "%s (%p)", pool->name, slot);
 		fd_log_threadname ( buf );
 	}
 	
-	/* The thread reports its status when canceled */
-	CHECK_PARAMS_DO(arg, return NULL);
-	pthread_cleanup_push( cleanup_state, arg );
+	pthread_cleanup_push( cleanup_state, slot );
 	
-	/* Mark the thread running */
-	CHECK_POSIX_DO( pthread_mutex_lock(&order_state_lock), );
-	*(enum thread_state *)arg = RUNNING;
-	CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), );
+	if (fuse_key_ok) {
+		CHECK_POSIX_DO( pthread_setspecific(fuse_key, &fs), );
+	}
 	
 	do {
 		struct msg * msg;
@@ -1103,14 +1445,25 @@ static void * process_thr(void * arg, int (*action_cb)(struct msg * msg), struct
 			
 			ret = fd_fifo_timedget ( queue, &msg, &ts );
 			if (ret == ETIMEDOUT) {
-				/* Test the current order */
+				/* Test the current order, and if this thread is in excess in the pool */
 				{
 					int must_stop;
 					CHECK_POSIX_DO( pthread_mutex_lock(&order_state_lock), { ASSERT(0); } ); /* we lock to flush the caches */
 					must_stop = (order_val == STOP);
+					if (!must_stop && (pool->running > pool->target)) {
+						slot->state = NOTRUNNING;
+						slot->thr = (pthread_t)NULL;
+						pool->running--;
+						retired = 1;
+					}
 					CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), { ASSERT(0); } );
 					if (must_stop)
 						goto end;
+					if (retired) {
+						TRACE_DEBUG(FULL, "%s thread is idle, the pool shrinks", pool->name);
+						CHECK_POSIX_DO( pthread_detach(pthread_self()), );
+						goto end;
+					}
 
 					pthread_testcancel();
 				}
@@ -1125,42 +1478,109 @@ static void * process_thr(void * arg, int (*action_cb)(struct msg * msg), struct
 			CHECK_FCT_DO( ret, goto fatal_error );
 		}
 		
-		LOG_A("%s: Picked next message", action_name);
+		LOG_A("%s: Picked next message", pool->name);
 
 		/* Now process the message */
-		CHECK_FCT_DO( (*action_cb)(msg), goto fatal_error);
+		fs.budget = fd_g_config->cnf_fuse;
+		CHECK_FCT_DO( (*pool->action_cb)(msg), goto fatal_error);
 
 		/* We're done with this message */
+		if (pool->idle_cb && (fd_fifo_length(queue) == 0))
+			(*pool->idle_cb)(pool);
 	
 	} while (1);
 	
 fatal_error:
-	TRACE_DEBUG(INFO, "An unrecoverable error occurred, %s thread is terminating...", action_name);
+	TRACE_DEBUG(INFO, "An unrecoverable error occurred, %s thread is terminating...", pool->name);
 	CHECK_FCT_DO(fd_core_shutdown(), );
 	
 end:	
 	; /* noop so that we get rid of "label at end of compound statement" warning */
-	/* Mark the thread as terminated */
-	pthread_cleanup_pop(1);
+	/* Mark the thread as terminated, unless the slot was already released */
+	pthread_cleanup_pop(!retired);
 	return NULL;
 }
 
-/* The dispatch thread */
-static void * dispatch_thr(void * arg)
+/* Start one more thread in the pool, in a free slot. Called with order_state_lock held. */
+static int pool_grow(struct rtdisp_pool * pool)
+{
+	int i;
+	
+	for (i = 0; i < pool->max; i++) {
+		struct pool_thr * slot = &pool->thr[i];
+		if ((slot->state == NOTRUNNING) && (slot->thr == (pthread_t)NULL))
+			break;
+	}
+	if (i == pool->max)
+		return ENOSPC; /* the threads that terminated are not joined yet */
+	
+	pool->thr[i].pool = pool;
+	pool->thr[i].state = RUNNING;
+	pool->running++;
+	CHECK_POSIX_DO( pthread_create( &pool->thr[i].thr, NULL, process_thr, &pool->thr[i] ),
+		{
+			pool->thr[i].state = NOTRUNNING;
+			pool->running--;
+			return ENOMEM;
+		} );
+#ifdef linux
+	pthread_setname_np(pool->thr[i].thr, pool->thname);
+#endif
+	return 0;
+}
+
+static struct rtdisp_pool disp_pool   = { "Dispatch",    "fd-dispatch",    msg_dispatch };
+static struct rtdisp_pool rt_in_pool  = { "Routing-IN",  "fd-routing-in",  msg_rt_in_fair };
+static struct rtdisp_pool rt_out_pool = { "Routing-OUT", "fd-routing-out", msg_rt_out };
+
+/* The pool that serves a queue, NULL once the queue is being destroyed. (The data pointer of the queue is
+ not used, since the queue cannot be deleted while it is set) */
+static struct rtdisp_pool * pool_of(struct fifo * queue)
 {
-	return process_thr(arg, msg_dispatch, fd_g_local, "Dispatch");
+	if (queue == disp_pool.queue)
+		return &disp_pool;
+	if (queue == rt_in_pool.queue)
+		return &rt_in_pool;
+	if (queue == rt_out_pool.queue)
+		return &rt_out_pool;
+	return NULL;
 }
 
-/* The (routing-in) thread -- see description in freeDiameter.h */
-static void * routing_in_thr(void * arg)
+/* The queue of the pool is filling up */
+static void pool_thrhd_high(struct fifo * queue, void ** data)
 {
-	return process_thr(arg, msg_rt_in, fd_g_incoming, "Routing-IN");
+	struct rtdisp_pool * pool;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&order_state_lock), return );
+	pool = pool_of(queue);
+	if (!pool) {
+		CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), );
+		return;
+	}
+	pool->level++;
+	if ((order_val == RUN) && (pool->target < pool->max)) {
+		pool->target++;
+		/* The threads in excess that did not terminate yet are simply kept */
+		if (pool->running < pool->target) {
+			CHECK_FCT_DO( pool_grow(pool), /* we will try again at next threshold */ );
+		}
+		TRACE_DEBUG(INFO, "%s queue is filling up (%d), now %d threads", pool->name, fd_fifo_length(queue), pool->running);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), );
 }
 
-/* The (routing-out) thread -- see description in freeDiameter.h */
-static void * routing_out_thr(void * arg)
+/* The queue of the pool is draining; the extra threads terminate when they become idle */
+static void pool_thrhd_low(struct fifo * queue, void ** data)
 {
-	return process_thr(arg, msg_rt_out, fd_g_outgoing, "Routing-OUT");
+	struct rtdisp_pool * pool;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&order_state_lock), return );
+	pool = pool_of(queue);
+	if (pool && (pool->level > 0))
+		pool->level--;
+	if (pool && (pool->target > pool->min + pool->level))
+		pool->target = pool->min + pool->level;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), );
 }
 
 
@@ -1168,49 +1588,229 @@ static void * routing_out_thr(void * arg)
 /*                     The functions for the other files                        */
 /********************************************************************************/
 
-static pthread_t * dispatch = NULL;
-static enum thread_state * disp_state = NULL;
+/* Create the threads of a pool and set its queue thresholds */
+static int pool_init(struct rtdisp_pool * pool, struct fifo * queue, int min, int max, int limit)
+{
+	int i;
+	
+	pool->queue = queue;
+	pool->min = pool->target = min;
+	pool->max = (max > min) ? max : min;
+	pool->running = 0;
+	pool->level = 0;
+	CHECK_MALLOC( pool->thr = calloc(pool->max, sizeof(struct pool_thr)) );
+	
+	CHECK_POSIX( pthread_mutex_lock(&order_state_lock) );
+	for (i = 0; i < min; i++) {
+		CHECK_FCT_DO( pool_grow(pool), 
+			{
+				CHECK_POSIX( pthread_mutex_unlock(&order_state_lock) );
+				return ENOMEM;
+			} );
+	}
+	CHECK_POSIX( pthread_mutex_unlock(&order_state_lock) );
+	
+	if (pool->max > min) {
+		/* Spread the steps so that the max is reached before the queue blocks */
+		int high = limit ? (limit / (pool->max - min + 1)) : RTDISP_THRHD_STEP;
+		if (high < 2)
+			high = 2;
+		CHECK_FCT( fd_fifo_setthrhd(queue, NULL, (uint16_t)high, pool_thrhd_high, (uint16_t)(high / 2), pool_thrhd_low) );
+	}
+	
+	return 0;
+}
 
-static pthread_t * rt_out = NULL;
-static enum thread_state * out_state = NULL;
+/* When SessionAffinity is set, the local queue is split in one queue per dispatch thread (shard). The messages are
+ mapped to a shard by the hash of their Session-Id, through a table of buckets, so that the messages of a session are
+ dispatched in order by the same thread. A shard that becomes idle takes over some recently active buckets of the most loaded shard,
+ among those that have no message in flight, which keeps the order. */
+
+/* Number of buckets of sessions */
+#ifndef DISP_SHARD_BUCKETS
+#define DISP_SHARD_BUCKETS	1024
+#endif /* DISP_SHARD_BUCKETS */
+
+/* Queue length of the most loaded shard from which the idle shards steal buckets, and how many they take at once */
+#ifndef DISP_SHARD_STEAL_MIN
+#define DISP_SHARD_STEAL_MIN	4
+#endif /* DISP_SHARD_STEAL_MIN */
+#ifndef DISP_SHARD_STEAL
+#define DISP_SHARD_STEAL	8
+#endif /* DISP_SHARD_STEAL */
+
+static struct rtdisp_pool * shards = NULL;
+static int nshards = 0;
+static struct {
+	int	shard;		/* the shard processing the sessions of this bucket */
+	int	inflight;	/* number of messages of the bucket queued or being dispatched */
+	int	hits;		/* messages received recently, the idle buckets are not worth stealing */
+} shard_bkt[DISP_SHARD_BUCKETS];
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int shard_rr = 0;	/* for the messages without session */
+
+/* The bucket of a message, -1 if it has no session */
+static int shard_bucket(struct msg * msg)
+{
+	struct session * sess = NULL;
+	os0_t sid;
+	size_t sidlen;
+	
+	CHECK_FCT_DO( fd_msg_sess_get(fd_g_config->cnf_dict, msg, &sess, NULL), return -1 );
+	if (!sess)
+		return -1;
+	CHECK_FCT_DO( fd_sess_getsid(sess, &sid, &sidlen), return -1 );
+	
+	return fd_os_hash(sid, sidlen) % DISP_SHARD_BUCKETS;
+}
 
-static pthread_t * rt_in  = NULL;
-static enum thread_state * in_state = NULL;
+/* Deliver a message to the local extensions */
+static int local_deliver(struct msg ** pmsg)
+{
+	int b, shard, ret;
+	
+	if (!shards)
+		return stage_next(pmsg, fd_g_local, msg_dispatch);
+	
+	b = shard_bucket(*pmsg);
+	if (b < 0)
+		return fd_queues_post(shards[__atomic_fetch_add(&shard_rr, 1, __ATOMIC_RELAXED) % nshards].queue, pmsg);
+	
+	CHECK_POSIX( pthread_mutex_lock(&shard_lock) );
+	shard = shard_bkt[b].shard;
+	shard_bkt[b].inflight++;
+	shard_bkt[b].hits++;
+	CHECK_POSIX( pthread_mutex_unlock(&shard_lock) );
+	
+	ret = fd_queues_post(shards[shard].queue, pmsg);
+	if (ret) {
+		CHECK_POSIX_DO( pthread_mutex_lock(&shard_lock), );
+		shard_bkt[b].inflight--;
+		CHECK_POSIX_DO( pthread_mutex_unlock(&shard_lock), );
+	}
+	return ret;
+}
 
-/* Initialize the routing and dispatch threads */
-int fd_rtdisp_init(void)
+/* The processing of the shards: dispatch, then release the bucket */
+static int msg_dispatch_shard(struct msg * msg)
+{
+	int b = shard_bucket(msg);
+	int ret;
+	
+	ret = msg_dispatch(msg);
+	
+	if (b >= 0) {
+		CHECK_POSIX( pthread_mutex_lock(&shard_lock) );
+		shard_bkt[b].inflight--;
+		CHECK_POSIX( pthread_mutex_unlock(&shard_lock) );
+	}
+	return ret;
+}
+
+/* A shard has emptied its queue, take over some active buckets of the most loaded shard that have no message in flight */
+static void shard_steal(struct rtdisp_pool * pool)
+{
+	int me = pool - shards;
+	int i, victim = -1, len, max = DISP_SHARD_STEAL_MIN - 1, stolen = 0;
+	
+	for (i = 0; i < nshards; i++) {
+		if (i == me)
+			continue;
+		len = fd_fifo_length(shards[i].queue);
+		if (len > max) {
+			max = len;
+			victim = i;
+		}
+	}
+	if (victim < 0)
+		return;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&shard_lock), return );
+	for (i = 0; (i < DISP_SHARD_BUCKETS) && (stolen < DISP_SHARD_STEAL); i++) {
+		if (shard_bkt[i].shard != victim)
+			continue;
+		if ((shard_bkt[i].inflight == 0) && (shard_bkt[i].hits > 0)) {
+			shard_bkt[i].shard = me;
+			stolen++;
+		}
+		shard_bkt[i].hits /= 2;
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&shard_lock), );
+	
+	TRACE_DEBUG(FULL, "Dispatch shard %d took %d session buckets from shard %d (%d queued)", me, stolen, victim, max);
+}
+
+/* Create the shards and their threads */
+static int shards_init(void)
 {
 	int i;
 	
-	/* Prepare the array for threads */
-	CHECK_MALLOC( disp_state = calloc(fd_g_config->cnf_dispthr, sizeof(enum thread_state)) );
-	CHECK_MALLOC( dispatch = calloc(fd_g_config->cnf_dispthr, sizeof(pthread_t)) );
-	CHECK_MALLOC( out_state = calloc(fd_g_config->cnf_rtoutthr, sizeof(enum thread_state)) );
-	CHECK_MALLOC( rt_out = calloc(fd_g_config->cnf_rtoutthr, sizeof(pthread_t)) );
-	CHECK_MALLOC( in_state = calloc(fd_g_config->cnf_rtinthr, sizeof(enum thread_state)) );
-	CHECK_MALLOC( rt_in = calloc(fd_g_config->cnf_rtinthr, sizeof(pthread_t)) );
+	nshards = fd_g_config->cnf_dispthr;
+	CHECK_MALLOC( shards = calloc(nshards, sizeof(struct rtdisp_pool)) );
+	for (i = 0; i < DISP_SHARD_BUCKETS; i++) {
+		shard_bkt[i].shard = i % nshards;
+		shard_bkt[i].inflight = 0;
+		shard_bkt[i].hits = 0;
+	}
+	for (i = 0; i < nshards; i++) {
+		struct fifo * q = NULL;
+		shards[i].name = "Dispatch";
+		shards[i].thname = "fd-dispatch";
+		shards[i].action_cb = msg_dispatch_shard;
+		shards[i].idle_cb = shard_steal;
+		CHECK_FCT( fd_fifo_new(&q, fd_g_config->cnf_qlocal_limit) );
+		CHECK_FCT( pool_init(&shards[i], q, 1, 1, 0) );
+	}
 	
-	/* Create the threads */
-	for (i=0; i < fd_g_config->cnf_dispthr; i++) {
-		CHECK_POSIX( pthread_create( &dispatch[i], NULL, dispatch_thr, &disp_state[i] ) );
-#ifdef linux
-		pthread_setname_np(dispatch[i], "fd-dispatch");
-#endif
+	return 0;
+}
+
+/* Sum the statistics of the queues of the messages waiting to be routed or dispatched */
+int fd_rtdisp_backlog(int * current_count, long long * total_count, struct timespec * total)
+{
+	struct fifo * q[2] = { fd_g_incoming, fd_g_local };
+	int i, cur;
+	long long cnt;
+	struct timespec tot;
+	
+	*current_count = 0;
+	*total_count = 0;
+	memset(total, 0, sizeof(struct timespec));
+	
+	for (i = 0; i < 2 + nshards; i++) {
+		CHECK_FCT( fd_fifo_getstats(i < 2 ? q[i] : shards[i - 2].queue, &cur, NULL, NULL, &cnt, &tot, NULL, NULL) );
+		*current_count += cur;
+		*total_count += cnt;
+		total->tv_sec += tot.tv_sec;
+		total->tv_nsec += tot.tv_nsec;
+		if (total->tv_nsec >= 1000000000) {
+			total->tv_nsec -= 1000000000;
+			total->tv_sec++;
+		}
 	}
-	for (i=0; i < fd_g_config->cnf_rtoutthr; i++) {
-		CHECK_POSIX( pthread_create( &rt_out[i], NULL, routing_out_thr, &out_state[i] ) );
-#ifdef linux
-		pthread_setname_np(rt_out[i], "fd-routing-out");
-#endif
+	
+	return 0;
+}
+
+/* Initialize the routing and dispatch threads */
+int fd_rtdisp_init(void)
+{
+	/* The threads find their fused pipeline state here */
+	if (fd_g_config->cnf_fuse && !fuse_key_ok) {
+		CHECK_POSIX( pthread_key_create(&fuse_key, NULL) );
+		fuse_key_ok = 1;
 	}
-	for (i=0; i < fd_g_config->cnf_rtinthr; i++) {
-		CHECK_POSIX( pthread_create( &rt_in[i], NULL, routing_in_thr, &in_state[i] ) );
-#ifdef linux
-		pthread_setname_np(rt_in[i], "fd-routing-in");
-#endif
+	
+	/* Create the threads */
+	if (fd_g_config->cnf_flags.sess_aff) {
+		CHECK_FCT( shards_init() );
+	} else {
+		CHECK_FCT( pool_init(&disp_pool, fd_g_local, fd_g_config->cnf_dispthr, fd_g_config->cnf_dispthr_max, fd_g_config->cnf_qlocal_limit) );
 	}
+	CHECK_FCT( pool_init(&rt_out_pool, fd_g_outgoing, fd_g_config->cnf_rtoutthr, fd_g_config->cnf_rtoutthr_max, fd_g_config->cnf_qout_limit) );
+	CHECK_FCT( pool_init(&rt_in_pool, fd_g_incoming, fd_g_config->cnf_rtinthr, fd_g_config->cnf_rtinthr_max, fd_g_config->cnf_qin_limit) );
 	
-	/* Later: TODO("Set the thresholds for the queues to create more threads as needed"); */
+	CHECK_FCT( fd_doic_init() );
 	
 	/* Register the built-in callbacks */
 	CHECK_FCT( fd_rt_out_register( dont_send_if_no_common_app, NULL, 10, NULL ) );
@@ -1270,59 +1870,89 @@ static void stop_thread_delayed(enum thread_state *st, pthread_t * thr, char * t
 	
 }
 
-/* Stop the thread after up to one second of wait */
-int fd_rtdisp_fini(void)
+/* Destroy the queue of a pool and stop its threads */
+static void pool_fini(struct rtdisp_pool * pool, struct fifo ** queue, char * th_name)
 {
 	int i;
 	
-	/* Destroy the incoming queue */
-	CHECK_FCT_DO( fd_queues_fini(&fd_g_incoming), /* ignore */);
+	/* Destroy the queue */
+	CHECK_POSIX_DO( pthread_mutex_lock(&order_state_lock), );
+	pool->queue = NULL;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), );
+	CHECK_FCT_DO( fd_queues_fini(queue), /* ignore */);
 	
-	/* Stop the routing IN thread */
-	if (rt_in != NULL) {
-		for (i=0; i < fd_g_config->cnf_rtinthr; i++) {
-			stop_thread_delayed(&in_state[i], &rt_in[i], "IN routing");
+	/* Stop the threads */
+	if (pool->thr != NULL) {
+		for (i=0; i < pool->max; i++) {
+			stop_thread_delayed(&pool->thr[i].state, &pool->thr[i].thr, th_name);
 		}
-		free(rt_in);
-		rt_in = NULL;
-	}
-	if (in_state != NULL) {
-		free(in_state);
-		in_state = NULL;
+		free(pool->thr);
+		pool->thr = NULL;
 	}
-	
-	/* Destroy the outgoing queue */
-	CHECK_FCT_DO( fd_queues_fini(&fd_g_outgoing), /* ignore */);
-	
-	/* Stop the routing OUT thread */
-	if (rt_out != NULL) {
-		for (i=0; i < fd_g_config->cnf_rtinthr; i++) {
-			stop_thread_delayed(&out_state[i], &rt_out[i], "OUT routing");
+}
+
+/* Stop the thread after up to one second of wait */
+int fd_rtdisp_fini(void)
+{
+	/* No thread is created or retired after this point */
+	CHECK_FCT_DO( fd_rtdisp_cleanstop(), );
+	
+	pool_fini(&rt_in_pool, &fd_g_incoming, "IN routing");
+	pool_fini(&rt_out_pool, &fd_g_outgoing, "OUT routing");
+	pool_fini(&disp_pool, &fd_g_local, "Dispatching");
+	if (shards) {
+		int i;
+		for (i = 0; i < nshards; i++) {
+			struct fifo * q = shards[i].queue;
+			pool_fini(&shards[i], &q, "Dispatching");
 		}
-		free(rt_out);
-		rt_out = NULL;
-	}
-	if (out_state != NULL) {
-		free(out_state);
-		out_state = NULL;
+		free(shards);
+		shards = NULL;
 	}
 	
-	/* Destroy the local queue */
-	CHECK_FCT_DO( fd_queues_fini(&fd_g_local), /* ignore */);
-	
-	/* Stop the Dispatch threads */
-	if (dispatch != NULL) {
-		for (i=0; i < fd_g_config->cnf_dispthr; i++) {
-			stop_thread_delayed(&disp_state[i], &dispatch[i], "Dispatching");
-		}
-		free(dispatch);
-		dispatch = NULL;
-	}
-	if (disp_state != NULL) {
-		free(disp_state);
-		disp_state = NULL;
+	return 0;
+}
+
+/* Current size of the thread pools */
+int fd_stat_getthreads(enum fd_stat_type stat, int * current, int * min, int * max)
+{
+	struct rtdisp_pool * pool;
+	
+	TRACE_ENTRY( "%d %p %p %p", stat, current, min, max);
+	
+	switch (stat) {
+		case STAT_G_LOCAL:
+			if (shards) {
+				/* one thread per shard */
+				if (current)
+					*current = nshards;
+				if (min)
+					*min = nshards;
+				if (max)
+					*max = nshards;
+				return 0;
+			}
+			pool = &disp_pool;
+			break;
+		case STAT_G_INCOMING:
+			pool = &rt_in_pool;
+			break;
+		case STAT_G_OUTGOING:
+			pool = &rt_out_pool;
+			break;
+		default:
+			return EINVAL;
 	}
 	
+	CHECK_POSIX( pthread_mutex_lock(&order_state_lock) );
+	if (current)
+		*current = pool->running;
+	if (min)
+		*min = pool->min;
+	if (max)
+		*max = pool->max;
+	CHECK_POSIX( pthread_mutex_unlock(&order_state_lock) );
+	
 	return 0;
 }
 
@@ -1338,6 +1968,8 @@ int fd_rtdisp_cleanup(void)
 	}
 	
 	fd_disp_unregister_all(); /* destroy remaining handlers */
+	
+	fd_doic_fini();
 
 	return 0;
 }
@@ -34,6 +34,12 @@
 *********************************************************************************************************/
 
 #include "fdcore-internal.h"
+#include "cnxctx.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif /* HAVE_EPOLL */
 
 /* Server (listening) part of the framework */
 
@@ -127,61 +133,10 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_servers_dump, int details)
 }
 
 
-/* The thread in the pool for handling new clients connecting to a server */
-static void * client_worker(void * arg)
+/* Receive the first message on a new connection. On failure, the reason is reported with HOOK_PEER_CONNECT_FAILED */
+static int receive_first(struct cnxctx * c, struct timespec * ts, struct fd_cnx_rcvdata * rcv_data)
 {
-	struct pool_workers * pw = arg;
-	struct server * s = pw->s;
-	struct cnxctx * c = NULL;
-	int fatal = 0;
-	struct timespec ts;
-	struct fd_cnx_rcvdata rcv_data;
-	struct fd_msg_pmdl * pmdl = NULL;
-	struct msg    * msg = NULL;
-	struct msg_hdr *hdr = NULL;
-	struct fd_pei pei;
-	
-	TRACE_ENTRY("%p", arg);
-	
-	/* Set the thread name */
-	{
-		char buf[48];
-		snprintf(buf, sizeof(buf), "Worker#%d[%s%s]", pw->id, IPPROTO_NAME(s->proto), s->secur?", Sec" : "");
-		fd_log_threadname ( buf );
-	}
-	
-	/* Loop until canceled / error */
-next_client:
-	LOG_A("Ready to process next incoming connection");
-
-	memset(&rcv_data, 0, sizeof(rcv_data));
-	
-	/* Get the next connection */
-	CHECK_FCT_DO( fd_fifo_get( s->pending, &c ), { fatal = 1; goto cleanup; } );
-
-	/* Handshake if we are a secure server port, or start clear otherwise */
-	if (s->secur) {
-		LOG_D("Starting handshake with %s", fd_cnx_getid(c));
-
-		int ret = fd_cnx_handshake(c, GNUTLS_SERVER, (s->secur == 1) ? ALGO_HANDSHAKE_DEFAULT : ALGO_HANDSHAKE_3436, NULL, NULL);
-		if (ret != 0) {
-			char buf[1024];
-			snprintf(buf, sizeof(buf), "TLS handshake failed for connection '%s', connection closed.", fd_cnx_getid(c));
-
-			fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
-
-			goto cleanup;
-		}
-	} else {
-		CHECK_FCT_DO( fd_cnx_start_clear(c, 0), goto cleanup );
-	}
-	
-	/* Set the timeout to receive the first message */
-	CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), { fatal = 1; goto cleanup; } );
-	ts.tv_sec += INCNX_TIMEOUT;
-	
-	/* Receive the first Diameter message on the connection -- cleanup in case of timeout */
-	CHECK_FCT_DO( fd_cnx_receive(c, &ts, &rcv_data.buffer, &rcv_data.length), 
+	CHECK_FCT_DO( fd_cnx_receive(c, ts, &rcv_data->buffer, &rcv_data->length), 
 		{
 			char buf[1024];
 			
@@ -200,21 +155,35 @@ next_client:
 				snprintf(buf, sizeof(buf), "Connection from '%s': unspecified error, connection aborted.", fd_cnx_getid(c));
 				fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
 			}
-			goto cleanup;
+			return __ret__;
 		} );
+	return 0;
+}
+
+/* Check that the first message received on a connection is a CER, and pass it to the peers module that takes the
+ * connection over. Otherwise the connection is destroyed. The received buffer is consumed in all cases.
+ * Returns an error only if the caller should stop processing connections. */
+static int handle_cer(struct cnxctx * c, struct fd_cnx_rcvdata * rcv_data)
+{
+	int fatal = 0;
+	struct fd_msg_pmdl * pmdl = NULL;
+	struct msg    * msg = NULL;
+	struct msg_hdr *hdr = NULL;
+	struct fd_pei pei;
 	
-	TRACE_DEBUG(FULL, "Received %zdb from new client '%s'", rcv_data.length, fd_cnx_getid(c));
+	TRACE_DEBUG(FULL, "Received %zdb from new client '%s'", rcv_data->length, fd_cnx_getid(c));
 	
-	pmdl = fd_msg_pmdl_get_inbuf(rcv_data.buffer, rcv_data.length);
+	pmdl = fd_msg_pmdl_get_inbuf(rcv_data->buffer, rcv_data->length);
 	
 	/* Try parsing this message */
-	CHECK_FCT_DO( fd_msg_parse_buffer( &rcv_data.buffer, rcv_data.length, &msg ), 
+	CHECK_FCT_DO( fd_msg_parse_buffer( &rcv_data->buffer, rcv_data->length, &msg ), 
 		{ 	/* Parsing failed */ 
-			fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, NULL, NULL, &rcv_data, pmdl );
+			fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, NULL, NULL, rcv_data, pmdl );
 			goto cleanup;
 		} );
 	
 	/* Log incoming message */
+	CHECK_FCT_DO( fd_msg_rawbuffer_setfree(msg, fd_rcvbuf_free), /* cannot fail */ );
 	fd_hook_associate(msg, pmdl);
 	fd_hook_call(HOOK_MESSAGE_RECEIVED, msg, NULL, fd_cnx_getid(c), fd_msg_pmdl_get(msg));
 	
@@ -262,7 +231,75 @@ cleanup:
 	}
 	
 	/* Cleanup the received buffer if any */
-	free(rcv_data.buffer);
+	fd_rcvbuf_free(rcv_data->buffer);
+	rcv_data->buffer = NULL;
+	
+	return fatal;
+}
+
+/* The thread in the pool for handling new clients connecting to a server */
+static void * client_worker(void * arg)
+{
+	struct pool_workers * pw = arg;
+	struct server * s = pw->s;
+	struct cnxctx * c = NULL;
+	int fatal = 0;
+	struct timespec ts;
+	struct fd_cnx_rcvdata rcv_data;
+	
+	TRACE_ENTRY("%p", arg);
+	
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "Worker#%d[%s%s]", pw->id, IPPROTO_NAME(s->proto), s->secur?", Sec" : "");
+		fd_log_threadname ( buf );
+	}
+	
+	/* Loop until canceled / error */
+next_client:
+	LOG_A("Ready to process next incoming connection");
+
+	memset(&rcv_data, 0, sizeof(rcv_data));
+	
+	/* Get the next connection */
+	CHECK_FCT_DO( fd_fifo_get( s->pending, &c ), { fatal = 1; goto cleanup; } );
+
+	/* Handshake if we are a secure server port, or start clear otherwise */
+	if (s->secur) {
+		LOG_D("Starting handshake with %s", fd_cnx_getid(c));
+
+		int ret = fd_cnx_handshake(c, GNUTLS_SERVER, (s->secur == 1) ? ALGO_HANDSHAKE_DEFAULT : ALGO_HANDSHAKE_3436, NULL, NULL);
+		if (ret != 0) {
+			char buf[1024];
+			snprintf(buf, sizeof(buf), "TLS handshake failed for connection '%s', connection closed.", fd_cnx_getid(c));
+
+			fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
+
+			goto cleanup;
+		}
+	} else {
+		CHECK_FCT_DO( fd_cnx_start_clear(c, 0), goto cleanup );
+	}
+	
+	/* Set the timeout to receive the first message */
+	CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), { fatal = 1; goto cleanup; } );
+	ts.tv_sec += INCNX_TIMEOUT;
+	
+	/* Receive the first Diameter message on the connection -- cleanup in case of timeout */
+	if (receive_first(c, &ts, &rcv_data))
+		goto cleanup;
+	
+	/* The connection is passed to the peers module, or destroyed */
+	fatal = handle_cer(c, &rcv_data);
+	c = NULL;
+
+cleanup:
+	/* Close the connection if needed */
+	if (c != NULL) {
+		fd_cnx_destroy(c);
+		c = NULL;
+	}
 	
 	
 	if (!fatal)
@@ -272,6 +309,365 @@ cleanup:
 	return NULL;
 }	
 
+#ifdef HAVE_EPOLL
+/* The TCP servers do not use the worker threads. Instead, the TLS handshakes and the wait for the CER of all the incoming
+ * TCP connections are run without blocking by a few threads (ThreadsPerServer, shared by all the TCP servers), each one
+ * waiting on its own epoll set. So slow or malicious clients do not hold a thread each. Each step (handshake, then CER)
+ * must complete within INCNX_TIMEOUT, otherwise the connection is closed.
+ * The number of pending connections is limited, and the last slots are kept for the addresses of the configured peers,
+ * so that they can come back even when many other clients are connecting. */
+
+/* Max number of incoming TCP connections in TLS handshake or waiting for their CER, for all servers */
+#ifndef HS_MAX_PENDING
+#define HS_MAX_PENDING		1024
+#endif /* HS_MAX_PENDING */
+
+/* The number of these kept for the addresses of the configured peers */
+#ifndef HS_RESERVED
+#define HS_RESERVED		(HS_MAX_PENDING / 4)
+#endif /* HS_RESERVED */
+
+/* Max events processed per call to epoll_wait */
+#ifndef HS_MAX_EVENTS
+#define HS_MAX_EVENTS		64
+#endif /* HS_MAX_EVENTS */
+
+/* A handshake thread */
+struct hs_loop {
+	int		epfd;	/* the epoll set */
+	int		evfd;	/* eventfd to wake up the thread when a first deadline is set */
+	pthread_t	thr;
+	pthread_mutex_t	mtx;	/* held by the thread while it processes events, protects the lists */
+	struct fd_list	tls;	/* connections in TLS handshake, by deadline */
+	struct fd_list	cer;	/* connections waiting for their first message, by deadline */
+};
+
+/* A pending connection */
+struct hs_ent {
+	struct fd_list		chain;		/* link in loop->tls or loop->cer. o points to the entry */
+	struct cnxctx *		conn;
+	int			handshake;	/* the TLS handshake is not complete */
+	struct timespec		deadline;	/* CLOCK_MONOTONIC */
+	struct fd_cnx_rcvstate	st;		/* reception of the first message */
+};
+
+static struct hs_loop *	hs_loops = NULL;
+static int		hs_loops_nb = 0;
+static unsigned		hs_next = 0;
+static pthread_mutex_t	hs_mtx = PTHREAD_MUTEX_INITIALIZER;	/* protects the above */
+static int		hs_pending = 0;				/* entries in all the loops (atomic) */
+
+/* Set the deadline of an entry for its current step */
+static void hs_set_deadline(struct hs_ent * ent)
+{
+	CHECK_SYS_DO( clock_gettime(CLOCK_MONOTONIC, &ent->deadline), /* expires at once */ );
+	ent->deadline.tv_sec += INCNX_TIMEOUT;
+}
+
+/* Remove an entry and close its connection if any. Called with loop->mtx locked */
+static void hs_free(struct hs_loop * loop, struct hs_ent * ent)
+{
+	fd_list_unlink(&ent->chain);
+	fd_cnx_rcvstate_free(&ent->st);
+	if (ent->conn) {
+		CHECK_SYS_DO( epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ent->conn->cc_socket, NULL), /* continue */ );
+		fd_cnx_destroy(ent->conn);
+	}
+	free(ent);
+	__atomic_fetch_sub(&hs_pending, 1, __ATOMIC_RELAXED);
+}
+
+/* Make progress on a connection that has data available. Called with loop->mtx locked */
+static void hs_process(struct hs_loop * loop, struct hs_ent * ent)
+{
+	struct fd_cnx_rcvdata rcv_data;
+	struct cnxctx * c;
+	int ret;
+	
+	if (ent->handshake) {
+		ret = fd_cnx_handshake_step(ent->conn);
+		if (ret == EAGAIN)
+			return;
+		if (ret) {
+			char buf[1024];
+			snprintf(buf, sizeof(buf), "TLS handshake failed for connection '%s', connection closed.", fd_cnx_getid(ent->conn));
+			fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
+			hs_free(loop, ent);
+			return;
+		}
+		
+		/* Now wait for the CER, which may have been received with the end of the handshake already */
+		ent->handshake = 0;
+		hs_set_deadline(ent);
+		fd_list_unlink(&ent->chain);
+		fd_list_insert_before(&loop->cer, &ent->chain);
+	}
+	
+	memset(&rcv_data, 0, sizeof(rcv_data));
+	ret = fd_cnx_rcv_first_nb(ent->conn, &ent->st, &rcv_data.buffer, &rcv_data.length);
+	if (ret == EAGAIN)
+		return;
+	
+	/* This connection leaves the loop */
+	c = ent->conn;
+	CHECK_SYS_DO( epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->cc_socket, NULL), /* continue */ );
+	ent->conn = NULL;
+	hs_free(loop, ent);
+	
+	if (ret) {
+		char buf[1024];
+		snprintf(buf, sizeof(buf), "Connection from '%s' in error before CER was received.", fd_cnx_getid(c));
+		fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
+		fd_cnx_destroy(c);
+		return;
+	}
+	
+	/* The reception continues as after a blocking handshake */
+	if (fd_cnx_getTLS(c)) {
+		CHECK_FCT_DO( fd_cnx_tls_start(c),
+			{
+				fd_rcvbuf_free(rcv_data.buffer);
+				fd_cnx_destroy(c);
+				return;
+			} );
+	}
+	
+	(void) handle_cer(c, &rcv_data);
+}
+
+/* Close the connections that did not complete their step in time. Called with loop->mtx locked */
+static void hs_expire(struct hs_loop * loop)
+{
+	struct timespec now;
+	
+	CHECK_SYS_DO( clock_gettime(CLOCK_MONOTONIC, &now), return );
+	
+	while (!FD_IS_LIST_EMPTY(&loop->tls)) {
+		struct hs_ent * ent = loop->tls.next->o;
+		char buf[1024];
+		if (TS_IS_INFERIOR(&now, &ent->deadline))
+			break;
+		snprintf(buf, sizeof(buf), "TLS handshake with '%s' not completed within %ds, connection closed.", fd_cnx_getid(ent->conn), INCNX_TIMEOUT);
+		fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
+		hs_free(loop, ent);
+	}
+	
+	while (!FD_IS_LIST_EMPTY(&loop->cer)) {
+		struct hs_ent * ent = loop->cer.next->o;
+		char buf[1024];
+		if (TS_IS_INFERIOR(&now, &ent->deadline))
+			break;
+		snprintf(buf, sizeof(buf), "Client '%s' did not send CER within %ds, connection aborted.", fd_cnx_getid(ent->conn), INCNX_TIMEOUT);
+		fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
+		hs_free(loop, ent);
+	}
+}
+
+/* Time until the next deadline, in ms for epoll_wait (-1: none). Called with loop->mtx locked */
+static int hs_timeout(struct hs_loop * loop)
+{
+	struct timespec now, * next = NULL;
+	long long ms;
+	
+	if (!FD_IS_LIST_EMPTY(&loop->tls))
+		next = &((struct hs_ent *)loop->tls.next->o)->deadline;
+	if (!FD_IS_LIST_EMPTY(&loop->cer)) {
+		struct timespec * d = &((struct hs_ent *)loop->cer.next->o)->deadline;
+		if (!next || TS_IS_INFERIOR(d, next))
+			next = d;
+	}
+	if (!next)
+		return -1;
+	
+	CHECK_SYS_DO( clock_gettime(CLOCK_MONOTONIC, &now), return 0 );
+	ms = (long long)(next->tv_sec - now.tv_sec) * 1000 + (next->tv_nsec - now.tv_nsec) / 1000000 + 1;
+	return (ms < 0) ? 0 : (int)ms;
+}
+
+/* The handshake thread */
+static void * hs_loop_th(void * arg)
+{
+	struct hs_loop * loop = arg;
+	struct epoll_event evs[HS_MAX_EVENTS];
+	
+	fd_log_threadname ( "Incoming connections" );
+	
+	while (1) {
+		int n, i, ms;
+		
+		CHECK_POSIX_DO( pthread_mutex_lock(&loop->mtx), break );
+		ms = hs_timeout(loop);
+		CHECK_POSIX_DO( pthread_mutex_unlock(&loop->mtx), break );
+		
+		n = epoll_wait(loop->epfd, evs, HS_MAX_EVENTS, ms);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			CHECK_SYS_DO( n, break );
+		}
+		
+		CHECK_POSIX_DO( pthread_mutex_lock(&loop->mtx), break );
+		pthread_cleanup_push( fd_cleanup_mutex, &loop->mtx );
+		
+		for (i = 0; i < n; i++) {
+			struct hs_ent * ent = evs[i].data.ptr;
+			if (!ent) {
+				uint64_t val;
+				/* We were woken up to take a new deadline into account */
+				if (read(loop->evfd, &val, sizeof(val)) < 0) {
+					/* nothing to do */
+				}
+				continue;
+			}
+			hs_process(loop, ent);
+		}
+		
+		hs_expire(loop);
+		
+		pthread_cleanup_pop( 1 );
+	}
+	
+	TRACE_DEBUG(INFO, "Incoming connections thread terminated");
+	return NULL;
+}
+
+/* Create the handshake threads, on first use. Called with hs_mtx locked */
+static int hs_start(void)
+{
+	int i;
+	
+	CHECK_PARAMS( fd_g_config->cnf_thr_srv > 0 );
+	CHECK_MALLOC( hs_loops = calloc(fd_g_config->cnf_thr_srv, sizeof(struct hs_loop)) );
+	
+	for (i = 0; i < fd_g_config->cnf_thr_srv; i++) {
+		struct hs_loop * loop = &hs_loops[i];
+		struct epoll_event ev;
+		
+		CHECK_SYS( loop->epfd = epoll_create1(EPOLL_CLOEXEC) );
+		CHECK_SYS( loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) );
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		CHECK_SYS( epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) );
+		CHECK_POSIX( pthread_mutex_init(&loop->mtx, NULL) );
+		fd_list_init(&loop->tls, NULL);
+		fd_list_init(&loop->cer, NULL);
+		CHECK_POSIX( pthread_create(&loop->thr, NULL, hs_loop_th, loop) );
+		hs_loops_nb++;
+	}
+	
+	return 0;
+}
+
+/* Admit a new connection on a TCP server, if possible. The connection is closed otherwise. */
+static int hs_add(struct server * s, struct cnxctx * conn)
+{
+	struct hs_ent * ent;
+	struct hs_loop * loop;
+	struct epoll_event ev;
+	int pending, wake = 0, ret = 0;
+	uint64_t val = 1;
+	
+	/* Admission control: under load, keep the last slots for the configured peers */
+	pending = __atomic_fetch_add(&hs_pending, 1, __ATOMIC_RELAXED);
+	if (pending >= HS_MAX_PENDING - HS_RESERVED) {
+		sSS ss;
+		socklen_t sl = sizeof(ss);
+		int known = 0;
+		
+		if (fd_tcp_get_remote_ep(conn->cc_socket, &ss, &sl) == 0)
+			known = fd_peer_known_addr((sSA *)&ss);
+		
+		if ((!known) || (pending >= HS_MAX_PENDING)) {
+			char buf[1024];
+			snprintf(buf, sizeof(buf), "Too many incoming connections pending (%d), connection '%s' refused.", pending, fd_cnx_getid(conn));
+			fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
+			__atomic_fetch_sub(&hs_pending, 1, __ATOMIC_RELAXED);
+			fd_cnx_destroy(conn);
+			return 0;
+		}
+	}
+	
+	if (s->secur) {
+		LOG_D("Starting handshake with %s", fd_cnx_getid(conn));
+		CHECK_FCT_DO( ret = fd_cnx_handshake_nb(conn, GNUTLS_SERVER, (s->secur == 1) ? ALGO_HANDSHAKE_DEFAULT : ALGO_HANDSHAKE_3436, NULL, NULL),
+			{
+				char buf[1024];
+				snprintf(buf, sizeof(buf), "TLS handshake failed for connection '%s', connection closed.", fd_cnx_getid(conn));
+				fd_hook_call(HOOK_PEER_CONNECT_FAILED, NULL, NULL, buf, NULL);
+				__atomic_fetch_sub(&hs_pending, 1, __ATOMIC_RELAXED);
+				fd_cnx_destroy(conn);
+				return 0;
+			} );
+	}
+	
+	/* Pick the loop */
+	CHECK_POSIX_DO( ret = pthread_mutex_lock(&hs_mtx), goto error );
+	if (!hs_loops)
+		ret = hs_start();
+	loop = hs_loops_nb ? &hs_loops[(hs_next++) % hs_loops_nb] : NULL;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&hs_mtx), /* continue */ );
+	if (ret)
+		goto error;
+	CHECK_PARAMS_DO( loop, { ret = EINVAL; goto error; } );
+	
+	CHECK_MALLOC_DO( ent = calloc(1, sizeof(struct hs_ent)), { ret = ENOMEM; goto error; } );
+	fd_list_init(&ent->chain, ent);
+	ent->conn = conn;
+	ent->handshake = s->secur;
+	hs_set_deadline(ent);
+	
+	CHECK_POSIX_DO( ret = pthread_mutex_lock(&loop->mtx), { free(ent); goto error; } );
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = ent;
+	CHECK_SYS_DO( ret = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->cc_socket, &ev), ret = __ret__ );
+	if (!ret) {
+		/* Entries are appended, so the lists stay ordered by deadline; wake the thread if it has no deadline yet */
+		wake = FD_IS_LIST_EMPTY(&loop->tls) && FD_IS_LIST_EMPTY(&loop->cer);
+		fd_list_insert_before(ent->handshake ? &loop->tls : &loop->cer, &ent->chain);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&loop->mtx), /* continue */ );
+	if (ret) {
+		free(ent);
+		goto error;
+	}
+	
+	if (wake) {
+		CHECK_SYS_DO( write(loop->evfd, &val, sizeof(val)), /* the deadline is checked at the next event anyway */ );
+	}
+	return 0;
+	
+error:
+	__atomic_fetch_sub(&hs_pending, 1, __ATOMIC_RELAXED);
+	fd_cnx_destroy(conn);
+	return ret;
+}
+
+/* Terminate the handshake threads and close the pending connections. The servers are already stopped. */
+static void hs_fini(void)
+{
+	int i;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&hs_mtx), return );
+	for (i = 0; i < hs_loops_nb; i++) {
+		struct hs_loop * loop = &hs_loops[i];
+		CHECK_FCT_DO( fd_thr_term(&loop->thr), /* continue */ );
+		while (!FD_IS_LIST_EMPTY(&loop->tls))
+			hs_free(loop, loop->tls.next->o);
+		while (!FD_IS_LIST_EMPTY(&loop->cer))
+			hs_free(loop, loop->cer.next->o);
+		close(loop->evfd);
+		close(loop->epfd);
+		CHECK_POSIX_DO( pthread_mutex_destroy(&loop->mtx), /* continue */ );
+	}
+	free(hs_loops);
+	hs_loops = NULL;
+	hs_loops_nb = 0;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&hs_mtx), /* continue */ );
+}
+#endif /* HAVE_EPOLL */
+
 /* The thread managing a server */
 static void * serv_th(void * arg)
 {
@@ -291,6 +687,16 @@ static void * serv_th(void * arg)
 		/* Wait for a new client or cancel */
 		CHECK_MALLOC_DO( conn = fd_cnx_serv_accept(s->conn), break );
 		
+#ifdef HAVE_EPOLL
+		/* The TCP connections are handled by the handshake threads */
+		if (s->proto == IPPROTO_TCP) {
+			pthread_cleanup_push((void *)fd_cnx_destroy, conn);
+			CHECK_FCT_DO( hs_add(s, conn), break );
+			pthread_cleanup_pop(0);
+			continue;
+		}
+#endif /* HAVE_EPOLL */
+		
 		/* Store this connection in the fifo for processing by the worker pool. Will block when the fifo is full */
 		pthread_cleanup_push((void *)fd_cnx_destroy, conn);
 		CHECK_FCT_DO( fd_fifo_post( s->pending, &conn ), break );
@@ -324,6 +730,13 @@ static struct server * new_serv( int proto, int secur )
 	new->secur = secur;
 	
 	CHECK_FCT_DO( fd_fifo_new(&new->pending, 5), return NULL);
+	
+#ifdef HAVE_EPOLL
+	/* No worker is needed for TCP */
+	if (proto == IPPROTO_TCP)
+		return new;
+#endif /* HAVE_EPOLL */
+	
 	CHECK_MALLOC_DO( new->workers = calloc( fd_g_config->cnf_thr_srv, sizeof(struct pool_workers) ), return NULL );
 	
 	for (i = 0; i < fd_g_config->cnf_thr_srv; i++) {
@@ -445,6 +858,14 @@ int fd_servers_start()
 		}
 	}
 	
+	/* Unix socket for the co-located peers, always in clear: the file permissions protect it */
+	if (fd_g_config->cnf_local_path) {
+		CHECK_MALLOC( s = new_serv(IPPROTO_TCP, 0) );
+		CHECK_MALLOC( s->conn = fd_cnx_serv_local(fd_g_config->cnf_local_path) );
+		fd_list_insert_before( &FD_SERVERS, &s->chain );
+		CHECK_POSIX( pthread_create( &s->thr, NULL, serv_th, s ) );
+	}
+	
 	/* Now, if we had an empty list of local addresses (no address configured), try to read the real addresses from the kernel */
 	if (empty_conf_ep) {
 		CHECK_FCT(fd_cnx_get_local_eps(&fd_g_config->cnf_endpoints));
@@ -483,11 +904,13 @@ int fd_servers_stop()
 		/* cancel thread */
 		CHECK_FCT_DO( fd_thr_term(&s->thr), /* continue */);
 		
-		/* destroy server connection context */
+		/* destroy server connection context, and remove the unix socket */
+		if (fd_cnx_islocal(s->conn))
+			(void) unlink(fd_g_config->cnf_local_path);
 		fd_cnx_destroy(s->conn);
 		
 		/* cancel and destroy all worker threads */
-		for (i = 0; i < fd_g_config->cnf_thr_srv; i++) {
+		for (i = 0; s->workers && (i < fd_g_config->cnf_thr_srv); i++) {
 			/* Destroy worker thread */
 			CHECK_FCT_DO( fd_thr_term(&s->workers[i].worker), /* continue */);
 		}
@@ -504,6 +927,11 @@ int fd_servers_stop()
 		free(s);
 	}
 	
+#ifdef HAVE_EPOLL
+	/* Close the connections still in handshake or waiting for their CER */
+	hs_fini();
+#endif /* HAVE_EPOLL */
+	
 	/* We're done! */
 	return 0;
 }
@@ -39,6 +39,7 @@
 #include <netinet/tcp.h>
 #include <netinet/ip6.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 /* Set the socket options for TCP sockets, before bind is called */
 static int fd_tcp_setsockopt(int family, int sk)
@@ -46,6 +47,10 @@ static int fd_tcp_setsockopt(int family, int sk)
 	int ret = 0;
 	int opt;
 	
+	/* The unix sockets have none of these options */
+	if (family == AF_UNIX)
+		return 0;
+	
 	/* Clear the NODELAY option in case it was set, as requested by rfc3539#section-3.2 */
 	/* Note that this is supposed to be the default, so we could probably remove this call ... */
 	opt = 0;
@@ -90,6 +95,25 @@ static int fd_tcp_setsockopt(int family, int sk)
 	return 0;
 }
 
+/* Remove a unix socket left by a previous run, bind would fail otherwise. Only a socket that nobody listens on anymore
+ is removed: another file at this path, or the socket of a running daemon, is left alone and bind reports the error. */
+static void unlink_stale_socket( struct sockaddr_un * sun, socklen_t salen )
+{
+	struct stat st;
+	int sk, ret;
+	
+	if (lstat(sun->sun_path, &st) || !S_ISSOCK(st.st_mode))
+		return;
+	
+	CHECK_SYS_DO( sk = socket(AF_UNIX, SOCK_STREAM, 0), return );
+	ret = connect(sk, (sSA *)sun, salen);
+	if (ret && (errno == ECONNREFUSED)) {
+		TRACE_DEBUG(INFO, "Removing the stale socket '%s'", sun->sun_path);
+		CHECK_SYS_DO( unlink(sun->sun_path), /* bind will fail */ );
+	}
+	close(sk);
+}
+
 /* Create a socket server and bind it */
 int fd_tcp_create_bind_server( int * sock, sSA * sa, socklen_t salen )
 {
@@ -98,7 +122,10 @@ int fd_tcp_create_bind_server( int * sock, sSA * sa, socklen_t salen )
 	CHECK_PARAMS(  sock && sa  );
 	
 	/* Create the socket */
-	CHECK_SYS(  *sock = socket(sa->sa_family, SOCK_STREAM, IPPROTO_TCP)  );
+	CHECK_SYS(  *sock = socket(sa->sa_family, SOCK_STREAM, (sa->sa_family == AF_UNIX) ? 0 : IPPROTO_TCP)  );
+	
+	if (sa->sa_family == AF_UNIX)
+		unlink_stale_socket((struct sockaddr_un *)sa, salen);
 
 	/* Set the socket options */
 	CHECK_FCT(  fd_tcp_setsockopt(sa->sa_family, *sock)  );
@@ -128,7 +155,7 @@ int fd_tcp_client( int *sock, sSA * sa, socklen_t salen )
 	CHECK_PARAMS( sock && (*sock <= 0) && sa && salen );
 	
 	/* Create the socket */
-	CHECK_SYS(  s = socket(sa->sa_family, SOCK_STREAM, IPPROTO_TCP)  );
+	CHECK_SYS(  s = socket(sa->sa_family, SOCK_STREAM, (sa->sa_family == AF_UNIX) ? 0 : IPPROTO_TCP)  );
 	
 	/* Set the socket options */
 	CHECK_FCT(  fd_tcp_setsockopt(sa->sa_family, s)  );
@@ -0,0 +1,953 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* The io_uring I/O engine.
+ *
+ * It works as the epoll engine (see ioloop.c): when IOEngine = "io_uring" is configured, the TCP connections in the steady
+ * state are served by a small pool of loop threads, each one with its own io_uring instance. The differences are:
+ *  - on the clear connections, a multishot receive request stays armed on the socket, and the kernel picks the buffers in a
+ *    ring shared by all the connections of the loop. The data is passed to fd_cnx_rcv_chunk and the buffer is given back
+ *    right away, so an idle connection does not hold any buffer.
+ *  - on the TLS connections, gnutls must do the reads itself, so a multishot poll request is armed instead, and the data is
+ *    received as in the epoll engine (fd_cnx_rcv_nb).
+ *  - when several messages are sent at once on a clear connection (fd_cnx_sendv), they are submitted as a chain of linked
+ *    send requests on a small ring owned by the sending thread, and the whole chain is completed with one system call.
+ *
+ * The rings are used through the raw system calls, liburing is not required. If io_uring cannot be used at runtime (kernel
+ * older than 6.0, disabled by the administrator...), fd_uring_add fails and the connections are handed to the epoll engine.
+ */
+
+#include "fdcore-internal.h"
+#include "cnxctx.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+/* Size of the submission queue of a loop thread. The completion queue is 4 times larger, for the multishot requests */
+#ifndef URING_ENTRIES
+#define URING_ENTRIES		256
+#endif /* URING_ENTRIES */
+
+/* The receive buffers shared by the clear connections of a loop thread */
+#ifndef URING_BUF_NB
+#define URING_BUF_NB		128	/* must be a power of 2 */
+#endif /* URING_BUF_NB */
+#ifndef URING_BUF_SIZE
+#define URING_BUF_SIZE		16384
+#endif /* URING_BUF_SIZE */
+
+/* Max number of messages sent in one chain of linked requests */
+#ifndef URING_SEND_MAX
+#define URING_SEND_MAX		64
+#endif /* URING_SEND_MAX */
+
+/* Max number of reads on a TLS connection before serving the other ones */
+#ifndef URING_BUDGET
+#define URING_BUDGET		16
+#endif /* URING_BUDGET */
+
+/* How long we wait for the end of a TLS session when the connection is closed, as the receiver thread would */
+#ifndef URING_CLOSE_WAIT
+#define URING_CLOSE_WAIT	200	/* ms */
+#endif /* URING_CLOSE_WAIT */
+
+/* The buffer group id of the receive buffers */
+#define URING_BGID	0
+
+/* The user_data of the requests: an entry pointer (aligned) or'ed with a tag */
+#define TAG_ENT		0	/* the receive or poll request of an entry */
+#define TAG_WAKEUP	1	/* the poll request on the eventfd of the loop */
+#define TAG_IGNORE	2	/* the cancel requests */
+#define TAG_MASK	3
+
+/* An io_uring instance mapped in our memory */
+struct ring {
+	int			fd;
+	unsigned		sq_entries;
+	unsigned *		sq_head;
+	unsigned *		sq_tail;
+	unsigned *		sq_mask;
+	unsigned *		sq_array;
+	struct io_uring_sqe *	sqes;
+	unsigned		sq_local;	/* our tail, published to the kernel in ring_enter */
+	unsigned		sq_pending;	/* number of entries not submitted yet */
+	unsigned *		cq_head;
+	unsigned *		cq_tail;
+	unsigned *		cq_mask;
+	struct io_uring_cqe *	cqes;
+	void *			sq_ptr;
+	size_t			sq_sz;
+	void *			cq_ptr;
+	size_t			cq_sz;
+	size_t			sqes_sz;
+};
+
+/* A loop thread */
+struct uring_loop {
+	struct ring		ring;	/* the submission queue is used with mtx held */
+	int			evfd;	/* eventfd to wake up the thread */
+	pthread_t		thr;
+	pthread_mutex_t		mtx;	/* held by the thread while it processes the completions */
+	pthread_cond_t		cnd;	/* signaled when the reception ends on a connection */
+	struct fd_list		kick;	/* TLS connections to process without waiting for an event */
+	struct fd_list		dead;	/* entries removed, to be freed when no request references them anymore */
+	struct io_uring_buf_ring *br;	/* the ring of receive buffers, shared with the kernel */
+	uint8_t *		bufs;	/* URING_BUF_NB buffers of URING_BUF_SIZE bytes */
+	uint16_t		br_tail;
+};
+
+/* A connection handled by the engine */
+struct uring_ent {
+	struct fd_list		chain;	/* link in loop->kick or loop->dead. o points to the entry */
+	struct uring_loop *	loop;
+	struct cnxctx *		conn;	/* NULL once removed */
+	int			poll;	/* a poll request is used instead of the multishot receive (TLS) */
+	int			armed;	/* the request is pending in the kernel */
+	int			done;	/* the reception is over */
+	struct fd_cnx_rcvstate	st;
+};
+
+static struct uring_loop *	uloops = NULL;
+static int			uloops_nb = 0;
+static int			uloops_tried = 0;	/* the engine was started, or failed to start */
+static unsigned			uloops_next = 0;
+static pthread_mutex_t		uloops_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* The rings of the sending threads */
+static pthread_key_t		send_ring_key;
+static pthread_once_t		send_ring_once = PTHREAD_ONCE_INIT;
+static int			send_ring_key_ok = 0;
+static struct ring		send_ring_none;	/* marks the threads where no ring can be created */
+
+/* Activity counters, see fd_uring_stats */
+static long long		stat_rcv = 0;	/* completions of the reception requests */
+static long long		stat_snd = 0;	/* send requests completed with some data */
+
+/****************************************************************/
+/*            Minimal access to the io_uring interface          */
+/****************************************************************/
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params * p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void * arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_exit(struct ring * r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->cq_ptr && (r->cq_ptr != r->sq_ptr))
+		munmap(r->cq_ptr, r->cq_sz);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_sz);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(struct ring));
+	r->fd = -1;
+}
+
+/* Create an io_uring instance. cq_entries may be 0 for the default size */
+static int ring_init(struct ring * r, unsigned entries, unsigned cq_entries)
+{
+	struct io_uring_params p;
+	void * ptr;
+	int ret;
+
+	memset(r, 0, sizeof(struct ring));
+	memset(&p, 0, sizeof(p));
+	if (cq_entries) {
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = cq_entries;
+	}
+
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return errno;
+
+	/* We need the timeout in io_uring_enter (5.11), which also implies the single mmap of the rings */
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring_exit(r);
+		return ENOTSUP;
+	}
+
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (r->cq_sz > r->sq_sz)
+		r->sq_sz = r->cq_sz;
+	r->cq_sz = r->sq_sz;
+
+	ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto error;
+	r->sq_ptr = r->cq_ptr = ptr;
+
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto error;
+	r->sqes = ptr;
+
+	r->sq_entries = p.sq_entries;
+	r->sq_head  = (unsigned *)((uint8_t *)r->sq_ptr + p.sq_off.head);
+	r->sq_tail  = (unsigned *)((uint8_t *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask  = (unsigned *)((uint8_t *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((uint8_t *)r->sq_ptr + p.sq_off.array);
+	r->cq_head  = (unsigned *)((uint8_t *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail  = (unsigned *)((uint8_t *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask  = (unsigned *)((uint8_t *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe *)((uint8_t *)r->cq_ptr + p.cq_off.cqes);
+	r->sq_local = *r->sq_tail;
+	return 0;
+
+error:
+	ret = errno;
+	ring_exit(r);
+	return ret;
+}
+
+/* Publish the prepared entries and enter the kernel, waiting for min_complete completions (with a timeout if ts is set) */
+static int ring_enter(struct ring * r, unsigned min_complete, struct __kernel_timespec * ts)
+{
+	struct io_uring_getevents_arg arg;
+	unsigned flags = 0;
+	void * parg = NULL;
+	size_t argsz = 0;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+
+	if (min_complete)
+		flags |= IORING_ENTER_GETEVENTS;
+	if (ts) {
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uintptr_t)ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		parg = &arg;
+		argsz = sizeof(arg);
+	}
+
+	ret = sys_io_uring_enter(r->fd, r->sq_pending, min_complete, flags, parg, argsz);
+	if (ret < 0)
+		return errno;
+	r->sq_pending -= (unsigned)ret;
+	return 0;
+}
+
+/* Get a free submission entry, or NULL if the queue is full */
+static struct io_uring_sqe * ring_get_sqe(struct ring * r)
+{
+	struct io_uring_sqe * sqe;
+	unsigned idx;
+
+	if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		/* Submit what we have, this frees the entries */
+		if (ring_enter(r, 0, NULL)
+		    || (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries))
+			return NULL;
+	}
+
+	idx = r->sq_local & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	r->sq_array[idx] = idx;
+	r->sq_local++;
+	r->sq_pending++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/* Get the next completion, if any. The caller calls ring_cqe_seen when done with it */
+static struct io_uring_cqe * ring_peek_cqe(struct ring * r)
+{
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static void ring_cqe_seen(struct ring * r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* The poll events field is word-reversed on big endian hosts */
+static __inline__ uint32_t poll_mask(uint32_t events)
+{
+#ifdef HOST_BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif /* HOST_BIG_ENDIAN */
+	return events;
+}
+
+/****************************************************************/
+/*                         Reception                            */
+/****************************************************************/
+
+/* Give a receive buffer (back) to the kernel */
+static void loop_buf_put(struct uring_loop * loop, uint16_t bid)
+{
+	struct io_uring_buf * buf = &loop->br->bufs[loop->br_tail & (URING_BUF_NB - 1)];
+	buf->addr = (uintptr_t)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len  = URING_BUF_SIZE;
+	buf->bid  = bid;
+	loop->br_tail++;
+	__atomic_store_n(&loop->br->tail, loop->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Arm the (multishot) poll request on the eventfd of the loop. Called with loop->mtx locked */
+static int loop_arm_wakeup(struct uring_loop * loop)
+{
+	struct io_uring_sqe * sqe;
+
+	CHECK_PARAMS_DO( sqe = ring_get_sqe(&loop->ring), return EBUSY );
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->evfd;
+	sqe->poll32_events = poll_mask(POLLIN);
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = TAG_WAKEUP;
+	CHECK_FCT_DO( ring_enter(&loop->ring, 0, NULL), /* the request is submitted later by the loop thread */ );
+	return 0;
+}
+
+/* Arm the request that receives the data of an entry. Called with loop->mtx locked */
+static int ent_arm(struct uring_ent * ent)
+{
+	struct uring_loop * loop = ent->loop;
+	struct io_uring_sqe * sqe;
+
+	CHECK_PARAMS_DO( sqe = ring_get_sqe(&loop->ring), return EBUSY );
+	sqe->fd = ent->conn->cc_socket;
+	sqe->user_data = (uintptr_t)ent | TAG_ENT;
+	if (ent->poll) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = poll_mask(POLLIN | POLLRDHUP);
+		sqe->len = IORING_POLL_ADD_MULTI;
+	} else {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+	}
+	ent->armed = 1;
+	CHECK_FCT_DO( ring_enter(&loop->ring, 0, NULL), /* the request is submitted later by the loop thread */ );
+	return 0;
+}
+
+/* The reception is over on this entry. Called with loop->mtx locked */
+static void ent_done(struct uring_ent * ent)
+{
+	struct uring_loop * loop = ent->loop;
+
+	if (ent->armed) {
+		struct io_uring_sqe * sqe;
+		/* The final completion of the request will clear ent->armed */
+		CHECK_PARAMS_DO( sqe = ring_get_sqe(&loop->ring), goto out );
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t)ent | TAG_ENT;
+		sqe->user_data = TAG_IGNORE;
+		CHECK_FCT_DO( ring_enter(&loop->ring, 0, NULL), /* continue */ );
+	}
+out:
+	fd_cnx_rcvstate_free(&ent->st);
+	ent->done = 1;
+	CHECK_POSIX_DO( pthread_cond_broadcast(&loop->cnd), /* continue */ );
+}
+
+/* Receive the data of a TLS connection. Called with loop->mtx locked */
+static void ent_process(struct uring_ent * ent)
+{
+	int ret = 0, i;
+
+	for (i = 0; i < URING_BUDGET; i++) {
+		ret = fd_cnx_rcv_nb(ent->conn, &ent->st);
+		if (ret)
+			break;
+	}
+
+	switch (ret) {
+		case 0:
+			/* There may be more data, including in the TLS buffers; come back after the other connections */
+			if (FD_IS_LIST_EMPTY(&ent->chain))
+				fd_list_insert_before(&ent->loop->kick, &ent->chain);
+			break;
+
+		case EAGAIN:
+			/* Wait for the next event */
+			break;
+
+		default:
+			ent_done(ent);
+	}
+}
+
+/* Handle a completion. Called with loop->mtx locked */
+static void loop_cqe(struct uring_loop * loop, struct io_uring_cqe * cqe)
+{
+	struct uring_ent * ent;
+
+	switch (cqe->user_data & TAG_MASK) {
+		case TAG_WAKEUP: {
+			uint64_t val;
+			if (read(loop->evfd, &val, sizeof(val)) < 0) {
+				/* nothing to do */
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				CHECK_FCT_DO( loop_arm_wakeup(loop), /* continue */ );
+			return;
+		}
+
+		case TAG_IGNORE:
+			return;
+	}
+
+	ent = (struct uring_ent *)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+	__atomic_add_fetch(&stat_rcv, 1, __ATOMIC_RELAXED);
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ent->armed = 0;
+
+	if (ent->poll) {
+		if (ent->conn && !ent->done)
+			ent_process(ent);
+	} else {
+		uint8_t * data = NULL;
+		uint16_t bid = 0;
+
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			data = loop->bufs + (size_t)bid * URING_BUF_SIZE;
+		}
+
+		if (ent->conn && !ent->done) {
+			switch (cqe->res) {
+				case -ENOBUFS:
+					/* All the buffers were in use, they are given back now; the request is re-armed below */
+					break;
+
+				case -EINVAL:
+					/* Multishot receive is not supported by this kernel, read the data on events instead */
+					TRACE_DEBUG(INFO, "Multishot receive not supported on '%s', using poll requests", fd_cnx_getid(ent->conn));
+					ent->poll = 1;
+					break;
+
+				default:
+					if (fd_cnx_rcv_chunk(ent->conn, &ent->st, data, cqe->res) != EAGAIN)
+						ent_done(ent);
+			}
+		}
+
+		if (data)
+			loop_buf_put(loop, bid);
+	}
+
+	if (!ent->armed && ent->conn && !ent->done) {
+		CHECK_FCT_DO( ent_arm(ent),
+			{
+				fd_cnx_markerror(ent->conn);
+				ent_done(ent);
+			} );
+	}
+}
+
+/* The loop thread */
+static void * uring_th(void * arg)
+{
+	struct uring_loop * loop = arg;
+	int again = 0;
+
+	fd_log_threadname ( "I/O engine (io_uring)" );
+
+	while (1) {
+		struct fd_list kicked = FD_LIST_INITIALIZER(kicked);
+		struct io_uring_cqe * cqe;
+
+		if (!again) {
+			/* Wait for a completion. This is not a cancellation point, so fd_uring_fini also wakes us up through the eventfd */
+			if ((sys_io_uring_enter(loop->ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) && (errno != EINTR)) {
+				CHECK_SYS_DO( -1, break );
+			}
+		}
+		pthread_testcancel();
+
+		CHECK_POSIX_DO( pthread_mutex_lock(&loop->mtx), break );
+		pthread_cleanup_push( fd_cleanup_mutex, &loop->mtx );
+
+		while ((cqe = ring_peek_cqe(&loop->ring)) != NULL) {
+			struct io_uring_cqe c = *cqe;
+			/* Free the slot first, the processing may generate new completions */
+			ring_cqe_seen(&loop->ring);
+			loop_cqe(loop, &c);
+		}
+
+		/* Process the TLS connections that could not be completed, or that were just added */
+		fd_list_move_end(&kicked, &loop->kick);
+		while (!FD_IS_LIST_EMPTY(&kicked)) {
+			struct uring_ent * ent = kicked.next->o;
+			fd_list_unlink(&ent->chain);
+			if (ent->conn && !ent->done)
+				ent_process(ent);
+		}
+		again = !FD_IS_LIST_EMPTY(&loop->kick);
+
+		/* Retry the submissions that failed, if any */
+		if (loop->ring.sq_pending) {
+			CHECK_FCT_DO( ring_enter(&loop->ring, 0, NULL), /* continue */ );
+		}
+
+		/* Free the removed entries once their request has completed */
+		{
+			struct fd_list * li, * next;
+			for (li = loop->dead.next; li != &loop->dead; li = next) {
+				struct uring_ent * ent = li->o;
+				next = li->next;
+				if (ent->armed)
+					continue;
+				fd_list_unlink(&ent->chain);
+				free(ent);
+			}
+		}
+
+		pthread_cleanup_pop( 1 );
+	}
+
+	TRACE_DEBUG(INFO, "I/O engine thread terminated");
+	return NULL;
+}
+
+/* Release the resources of a loop (the thread is already terminated) */
+static void loop_destroy(struct uring_loop * loop)
+{
+	while (!FD_IS_LIST_EMPTY(&loop->dead)) {
+		struct uring_ent * ent = loop->dead.next->o;
+		fd_list_unlink(&ent->chain);
+		free(ent);
+	}
+	ring_exit(&loop->ring);	/* also unregisters the buffers ring */
+	if (loop->evfd >= 0)
+		close(loop->evfd);
+	free(loop->br);
+	free(loop->bufs);
+	CHECK_POSIX_DO( pthread_cond_destroy(&loop->cnd), /* continue */ );
+	CHECK_POSIX_DO( pthread_mutex_destroy(&loop->mtx), /* continue */ );
+}
+
+/* Create the io_uring instance and the receive buffers of a loop, without starting the thread */
+static int loop_init(struct uring_loop * loop)
+{
+	struct io_uring_buf_reg reg;
+	size_t sz = URING_BUF_NB * sizeof(struct io_uring_buf);
+	int ret, i;
+
+	loop->evfd = -1;
+	loop->ring.fd = -1;
+	CHECK_POSIX( pthread_mutex_init(&loop->mtx, NULL) );
+	CHECK_POSIX( pthread_cond_init(&loop->cnd, NULL) );
+	fd_list_init(&loop->kick, NULL);
+	fd_list_init(&loop->dead, NULL);
+
+	ret = ring_init(&loop->ring, URING_ENTRIES, 4 * URING_ENTRIES);
+	if (ret)
+		return ret;
+
+	/* The ring of buffers must be page-aligned */
+	CHECK_POSIX( posix_memalign((void **)&loop->br, sysconf(_SC_PAGESIZE), sz) );
+	memset(loop->br, 0, sz);
+	CHECK_MALLOC( loop->bufs = malloc((size_t)URING_BUF_NB * URING_BUF_SIZE) );
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)loop->br;
+	reg.ring_entries = URING_BUF_NB;
+	reg.bgid = URING_BGID;
+	if (sys_io_uring_register(loop->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return errno;	/* Linux < 5.19 */
+	for (i = 0; i < URING_BUF_NB; i++)
+		loop_buf_put(loop, i);
+
+	CHECK_SYS( loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) );
+	CHECK_FCT( loop_arm_wakeup(loop) );
+	return 0;
+}
+
+/* Terminate the thread of a loop */
+static void loop_stop(struct uring_loop * loop)
+{
+	uint64_t val = 1;
+
+	/* The thread checks the cancellation after each wake up */
+	(void) pthread_cancel(loop->thr);
+	CHECK_SYS_DO( write(loop->evfd, &val, sizeof(val)), /* continue */ );
+	CHECK_FCT_DO( fd_thr_term(&loop->thr), /* continue */ );
+}
+
+/* Create the loops on first use. Called with uloops_mtx locked */
+static int uring_start(void)
+{
+	int nb = fd_g_config->cnf_io_thr;
+	int i, ret = 0;
+
+	CHECK_PARAMS( nb > 0 );
+	CHECK_MALLOC( uloops = calloc(nb, sizeof(struct uring_loop)) );
+
+	for (i = 0; i < nb; i++) {
+		ret = loop_init(&uloops[i]);
+		if (ret) {
+			loop_destroy(&uloops[i]);
+			goto undo;
+		}
+	}
+
+	for (uloops_nb = 0; uloops_nb < nb; uloops_nb++) {
+		CHECK_POSIX_DO( ret = pthread_create(&uloops[uloops_nb].thr, NULL, uring_th, &uloops[uloops_nb]), goto undo );
+	}
+	return 0;
+
+undo:
+	while (i-- > 0) {
+		if (i < uloops_nb)
+			loop_stop(&uloops[i]);
+		loop_destroy(&uloops[i]);
+	}
+	free(uloops);
+	uloops = NULL;
+	uloops_nb = 0;
+	return ret;
+}
+
+/* Hand the reception on a connection over to the engine. Fails with ENOTSUP if io_uring cannot be used on this system */
+int fd_uring_add(struct cnxctx * conn)
+{
+	struct uring_ent * ent;
+	struct uring_loop * loop;
+	int ret = 0;
+
+	TRACE_ENTRY("%p", conn);
+	CHECK_PARAMS( conn && (conn->cc_socket > 0) && (conn->cc_proto == IPPROTO_TCP) && !conn->cc_uring && !conn->cc_ioloop );
+
+	/* Pick the loop */
+	CHECK_POSIX( pthread_mutex_lock(&uloops_mtx) );
+	if (!uloops_tried) {
+		uloops_tried = 1;
+		ret = uring_start();
+		if (ret) {
+			LOG_N("The io_uring I/O engine cannot be used on this system (%s), using epoll instead", strerror(ret));
+		}
+	}
+	loop = uloops_nb ? &uloops[(uloops_next++) % uloops_nb] : NULL;
+	CHECK_POSIX( pthread_mutex_unlock(&uloops_mtx) );
+	if (!loop)
+		return ENOTSUP;
+
+	CHECK_MALLOC( ent = calloc(1, sizeof(struct uring_ent)) );
+	fd_list_init(&ent->chain, ent);
+	ent->loop = loop;
+	ent->conn = conn;
+	ent->poll = fd_cnx_teststate(conn, CC_STATUS_TLS);
+	conn->cc_uring = ent;
+
+	CHECK_POSIX( pthread_mutex_lock(&loop->mtx) );
+	ret = ent_arm(ent);
+	if (!ret && ent->poll) {
+		/* Some data may already be buffered in the TLS session, so process the connection once right away */
+		uint64_t val = 1;
+		fd_list_insert_before(&loop->kick, &ent->chain);
+		CHECK_SYS_DO( write(loop->evfd, &val, sizeof(val)), /* the connection will be processed at the next event anyway */ );
+	}
+	CHECK_POSIX( pthread_mutex_unlock(&loop->mtx) );
+
+	if (ret) {
+		conn->cc_uring = NULL;
+		free(ent);
+		return ret;
+	}
+
+	return 0;
+}
+
+/* Stop receiving on a connection. If graceful, wait (a little) until the peer closes its side first. */
+void fd_uring_del(struct cnxctx * conn, int graceful)
+{
+	struct uring_ent * ent;
+	struct uring_loop * loop;
+
+	TRACE_ENTRY("%p %d", conn, graceful);
+	CHECK_PARAMS_DO( conn && conn->cc_uring, return );
+	ent = conn->cc_uring;
+	loop = ent->loop;
+
+	CHECK_POSIX_DO( pthread_mutex_lock(&loop->mtx), return );
+	pthread_cleanup_push( fd_cleanup_mutex, &loop->mtx );
+
+	if (graceful && !ent->done) {
+		struct timespec ts;
+		CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), goto remove );
+		ts.tv_nsec += (URING_CLOSE_WAIT % 1000) * 1000000L;
+		ts.tv_sec  += URING_CLOSE_WAIT / 1000 + ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		while (!ent->done) {
+			int ret = pthread_cond_timedwait(&loop->cnd, &loop->mtx, &ts);
+			if (ret == ETIMEDOUT)
+				break;
+			CHECK_POSIX_DO( ret, break );
+		}
+	}
+remove:
+	if (!ent->done)
+		ent_done(ent);
+
+	/* The request may still be pending in the kernel, the loop thread frees the entry after its last completion */
+	ent->conn = NULL;
+	fd_list_unlink(&ent->chain);
+	fd_list_insert_before(&loop->dead, &ent->chain);
+	conn->cc_uring = NULL;
+
+	pthread_cleanup_pop( 1 );
+}
+
+/* Terminate the loop threads. All the connections must have been destroyed already */
+void fd_uring_fini(void)
+{
+	int i;
+
+	CHECK_POSIX_DO( pthread_mutex_lock(&uloops_mtx), return );
+	for (i = 0; i < uloops_nb; i++) {
+		loop_stop(&uloops[i]);
+		loop_destroy(&uloops[i]);
+	}
+	free(uloops);
+	uloops = NULL;
+	uloops_nb = 0;
+	uloops_tried = 0;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&uloops_mtx), /* continue */ );
+}
+
+/****************************************************************/
+/*                          Sending                             */
+/****************************************************************/
+
+static void send_ring_free(void * arg)
+{
+	struct ring * r = arg;
+	if (r != &send_ring_none) {
+		ring_exit(r);
+		free(r);
+	}
+}
+
+static void send_ring_key_init(void)
+{
+	CHECK_POSIX_DO( pthread_key_create(&send_ring_key, send_ring_free), return );
+	send_ring_key_ok = 1;
+}
+
+/* The ring of the calling thread, created on first use; NULL if it cannot be created */
+static struct ring * send_ring_get(void)
+{
+	struct ring * r;
+
+	CHECK_POSIX_DO( pthread_once(&send_ring_once, send_ring_key_init), return NULL );
+	if (!send_ring_key_ok)
+		return NULL;
+
+	r = pthread_getspecific(send_ring_key);
+	if (!r) {
+		int ret;
+		CHECK_MALLOC_DO( r = malloc(sizeof(struct ring)), return NULL );
+		ret = ring_init(r, URING_SEND_MAX, 0);
+		if (ret) {
+			TRACE_DEBUG(INFO, "Unable to create an io_uring instance for sending (%s), using writev", strerror(ret));
+			free(r);
+			r = &send_ring_none;
+		}
+		CHECK_POSIX_DO( pthread_setspecific(send_ring_key, r), { send_ring_free(r); return NULL; } );
+	}
+
+	return (r == &send_ring_none) ? NULL : r;
+}
+
+/* Send up to URING_SEND_MAX buffers on a clear TCP connection, as a chain of linked send requests.
+ * On return, *sent is the number of bytes written (the chain stops at the first incomplete send), or -1 if the connection
+ * failed (it is marked in error). Returns ENOTSUP if io_uring cannot be used in this thread, the caller uses writev then. */
+int fd_uring_sendv(struct cnxctx * conn, const struct iovec * iov, int iovcnt, ssize_t * sent)
+{
+	struct ring * r;
+	int32_t res[URING_SEND_MAX];
+	unsigned n, expected, completed = 0, i;
+	struct io_uring_sqe * sqe;
+	struct timespec ts, now;
+	int canceled = 0, ret;
+
+	TRACE_ENTRY("%p %p %d %p", conn, iov, iovcnt, sent);
+	CHECK_PARAMS( conn && iov && (iovcnt > 0) && sent );
+
+	r = send_ring_get();
+	if (!r)
+		return ENOTSUP;
+
+	n = (iovcnt > URING_SEND_MAX) ? URING_SEND_MAX : iovcnt;
+	for (i = 0; i < n; i++) {
+		sqe = ring_get_sqe(r);
+		ASSERT(sqe); /* the ring is empty between two calls */
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->cc_socket;
+		sqe->addr = (uintptr_t)iov[i].iov_base;
+		sqe->len = iov[i].iov_len;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;	/* the kernel retries the short sends */
+		if (i < n - 1)
+			sqe->flags = IOSQE_IO_LINK;	/* a failed send cancels the next ones */
+		sqe->user_data = i;
+		res[i] = -ECANCELED;
+	}
+	expected = n;
+
+	CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &ts), /* continue */ );
+	while (completed < expected) {
+		struct __kernel_timespec to;
+		struct io_uring_cqe * cqe;
+
+		/* Wait by steps of 100ms, to react to head-of-the-line blocking as the socket timeout does for writev */
+		to.tv_sec = 0;
+		to.tv_nsec = 100000000L;
+		ret = ring_enter(r, 1, &to);
+		if (ret && (r->sq_pending == expected)) {
+			/* Nothing was submitted, forget about the chain and use writev */
+			r->sq_local -= r->sq_pending;
+			r->sq_pending = 0;
+			__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+			TRACE_DEBUG(INFO, "io_uring submission failed (%s), using writev", strerror(ret));
+			return ENOTSUP;
+		}
+
+		while ((cqe = ring_peek_cqe(r)) != NULL) {
+			if (cqe->user_data < n)
+				res[cqe->user_data] = cqe->res;
+			completed++;
+			ring_cqe_seen(r);
+		}
+
+		if ((completed < expected) && !canceled) {
+			CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now), now = ts );
+			if ( ((now.tv_sec - ts.tv_sec) * 1000 + ((now.tv_nsec - ts.tv_nsec) / 1000000L)) > MAX_HOTL_BLOCKING_TIME) {
+				LOG_D("Unable to send any data for %dms, closing the connection", MAX_HOTL_BLOCKING_TIME);
+			} else if (! fd_cnx_teststate(conn, CC_STATUS_CLOSING )) {
+				continue;
+			}
+
+			/* Abort the chain; we must still wait for all the completions since the kernel uses the buffers */
+			sqe = ring_get_sqe(r);
+			if (sqe) {
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->fd = -1;
+				sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+				sqe->user_data = URING_SEND_MAX;
+				expected++;
+			}
+			canceled = 1;
+		}
+	}
+
+	*sent = 0;
+	for (i = 0; i < n; i++) {
+		if (res[i] > 0) {
+			*sent += res[i];
+			__atomic_add_fetch(&stat_snd, 1, __ATOMIC_RELAXED);
+		}
+		if (res[i] != (int32_t)iov[i].iov_len)
+			break;
+	}
+
+	if (canceled || (*sent == 0)) {
+		if (!canceled && (i < n) && (res[i] < 0)) {
+			errno = -res[i];
+			CHECK_SYS_DO( -1, /* continue, this is only used to log the error here */ );
+		}
+		*sent = -1;
+		fd_cnx_markerror(conn);
+	}
+
+	return 0;
+}
+
+/* Number of reception completions and of send requests processed by the engine since the start, to check it is in use */
+void fd_uring_stats(long long * rcv, long long * snd)
+{
+	if (rcv)
+		*rcv = __atomic_load_n(&stat_rcv, __ATOMIC_RELAXED);
+	if (snd)
+		*snd = __atomic_load_n(&stat_snd, __ATOMIC_RELAXED);
+}
+
+#else /* HAVE_IO_URING */
+
+int fd_uring_add(struct cnxctx * conn)
+{
+	return ENOTSUP;
+}
+
+void fd_uring_del(struct cnxctx * conn, int graceful)
+{
+	ASSERT(0);
+}
+
+int fd_uring_sendv(struct cnxctx * conn, const struct iovec * iov, int iovcnt, ssize_t * sent)
+{
+	return ENOTSUP;
+}
+
+void fd_uring_fini(void)
+{
+}
+
+void fd_uring_stats(long long * rcv, long long * snd)
+{
+	if (rcv)
+		*rcv = 0;
+	if (snd)
+		*snd = 0;
+}
+
+#endif /* HAVE_IO_URING */
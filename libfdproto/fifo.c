@@ -61,6 +61,7 @@ struct fifo {
 
 	int 		max;	/* maximum number of items to accept if not 0 */
 	int		thrs_push; /* number of threads waitnig to push an item */
+	int		thrs_push_prio; /* how many of them post prioritized items */
 
 	uint16_t	high;	/* High level threshold (see libfreeDiameter.h for details) */
 	uint16_t	low;	/* Low level threshold */
@@ -80,6 +81,7 @@ struct fifo {
 struct fifo_item {
 	struct fd_list   item;
 	struct timespec  posted_on;
+	int		 prio;	/* items with a higher value are delivered first; the list is kept sorted by decreasing prio */
 };
 
 /* The eye catcher value */
@@ -88,6 +90,9 @@ struct fifo_item {
 /* Macro to check a pointer */
 #define CHECK_FIFO( _queue ) (( (_queue) != NULL) && ( (_queue)->eyec == FIFO_EYEC) )
 
+/* Room reserved above the maximum for the prioritized items: they overtake the normal traffic of a full queue, but stay bounded */
+#define FIFO_PRIO_ROOM( _max ) ( (_max) / 4 + 1 )
+
 
 /* Create a new queue, with max number of items -- use 0 for no max */
 int fd_fifo_new ( struct fifo ** queue, int max )
@@ -395,12 +400,32 @@ static void fifo_cleanup_push(void * queue)
 	return;
 }
 
+/* Same, for a thread posting a prioritized item */
+static void fifo_cleanup_push_prio(void * queue)
+{
+	((struct fifo *)queue)->thrs_push_prio--;
+	fifo_cleanup_push(queue);
+}
 
-/* Post a new item in the queue */
-int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
+/* Wake up a thread waiting for room in the queue. Called with the queue locked */
+static void fifo_wake_push(struct fifo * queue)
+{
+	if (queue->thrs_push_prio > 0) {
+		/* The waiters do not all have the same limit, a single wakeup could go to one that still cannot post */
+		CHECK_POSIX_DO(  pthread_cond_broadcast(&queue->cond_push),  );
+	} else if (queue->thrs_push > 0) {
+		CHECK_POSIX_DO(  pthread_cond_signal(&queue->cond_push),  );
+	}
+}
+
+
+/* Post a new item in the queue. skip_max: 0 waits for room in the queue, 1 ignores its maximum, -1 returns EWOULDBLOCK when it is full.
+ The prioritized items (prio > 0) may use FIFO_PRIO_ROOM more places than the maximum. */
+int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max, int prio )
 {
 	struct fifo_item * new;
 	int call_cb = 0;
+	int limit;
 	struct timespec posted_on, queued_on;
 
 	/* Get the timing of this call */
@@ -409,16 +434,30 @@ int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 	/* lock the queue */
 	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
 
-	if ((!skip_max) && (queue->max)) {
-		while (queue->count >= queue->max) {
+	limit = queue->max;
+	if (limit && (prio > 0))
+		limit += FIFO_PRIO_ROOM(limit);
+
+	if ((skip_max < 0) && (limit) && (queue->count >= limit)) {
+		/* The caller does not want to wait for room */
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+		return EWOULDBLOCK;
+	}
+
+	if ((!skip_max) && (limit)) {
+		while (queue->count >= limit) {
 			int ret = 0;
 
 			/* We have to wait for an item to be pulled */
 			queue->thrs_push++ ;
-			pthread_cleanup_push( fifo_cleanup_push, queue);
+			if (prio > 0)
+				queue->thrs_push_prio++ ;
+			pthread_cleanup_push( (prio > 0) ? fifo_cleanup_push_prio : fifo_cleanup_push, queue);
 			ret = pthread_cond_wait( &queue->cond_push, &queue->mtx );
 			pthread_cleanup_pop(0);
 			queue->thrs_push-- ;
+			if (prio > 0)
+				queue->thrs_push_prio-- ;
 
 #ifdef NDEBUG
 			(void)ret;
@@ -434,10 +473,22 @@ int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 		} );
 
 	fd_list_init(&new->item, *item);
+	new->prio = prio;
 	*item = NULL;
 
-	/* Add the new item at the end */
-	fd_list_insert_before( &queue->list, &new->item);
+	if (prio > 0) {
+		/* Add the new item after the last one of the same or higher priority. Prioritized items are few and
+		 all at the head of the list, so this walk stays short. */
+		struct fd_list * li;
+		for (li = queue->list.next; li != &queue->list; li = li->next) {
+			if (((struct fifo_item *)li)->prio < prio)
+				break;
+		}
+		fd_list_insert_before( li, &new->item);
+	} else {
+		/* Add the new item at the end */
+		fd_list_insert_before( &queue->list, &new->item);
+	}
 	queue->count++;
 	if (queue->highest_ever < queue->count)
 		queue->highest_ever = queue->count;
@@ -464,10 +515,8 @@ int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 	if (queue->thrs > 0) {
 		CHECK_POSIX(  pthread_cond_signal(&queue->cond_pull)  );
 	}
-	if (queue->thrs_push > 0) {
-		/* cascade */
-		CHECK_POSIX(  pthread_cond_signal(&queue->cond_push)  );
-	}
+	/* cascade */
+	fifo_wake_push(queue);
 
 	/* Unlock */
 	CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
@@ -488,7 +537,7 @@ int fd_fifo_post_int ( struct fifo * queue, void ** item )
 	/* Check the parameters */
 	CHECK_PARAMS( CHECK_FIFO( queue ) && item && *item );
 
-	return fd_fifo_post_internal ( queue,item, 0 );
+	return fd_fifo_post_internal ( queue,item, 0, 0 );
 
 }
 
@@ -500,7 +549,31 @@ int fd_fifo_post_noblock ( struct fifo * queue, void ** item )
 	/* Check the parameters */
 	CHECK_PARAMS( CHECK_FIFO( queue ) && item && *item );
 
-	return fd_fifo_post_internal ( queue,item, 1 );
+	return fd_fifo_post_internal ( queue,item, 1, 0 );
+
+}
+
+/* Post a new item in the queue, ahead of the items of lower priority */
+int fd_fifo_post_prio ( struct fifo * queue, void ** item, int prio )
+{
+	TRACE_ENTRY( "%p %p %d", queue, item, prio );
+
+	/* Check the parameters */
+	CHECK_PARAMS( CHECK_FIFO( queue ) && item && *item && (prio >= 0) );
+
+	/* Prioritized items have some reserved room above the maximum, so they are not stuck behind the traffic they must overtake */
+	return fd_fifo_post_internal ( queue,item, 0, prio );
+}
+
+/* Same, but fail instead of waiting for room in the queue */
+int fd_fifo_trypost ( struct fifo * queue, void ** item, int prio )
+{
+	TRACE_ENTRY( "%p %p %d", queue, item, prio );
+
+	/* Check the parameters */
+	CHECK_PARAMS( CHECK_FIFO( queue ) && item && *item && (prio >= 0) );
+
+	return fd_fifo_post_internal ( queue,item, -1, prio );
 
 }
 
@@ -535,9 +608,7 @@ static void * mq_pop(struct fifo * queue)
 skip_timing:
 	free(fi);
 
-	if (queue->thrs_push) {
-		CHECK_POSIX_DO( pthread_cond_signal( &queue->cond_push ), );
-	}
+	fifo_wake_push(queue);
 
 	return ret;
 }
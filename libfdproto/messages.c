@@ -123,6 +123,7 @@ struct msg {
 	struct msg_hdr		 msg_public;		/* Message data that can be managed by extensions. */
 	
 	uint8_t			*msg_rawbuffer;		/* data buffer that was received, saved during fd_msg_parse_buffer and freed in fd_msg_parse_dict */
+	void			(*msg_rawfree)(void *);	/* function to release msg_rawbuffer, free if NULL */
 	int			 msg_routable;		/* Is this a routable message? (0: undef, 1: routable, 2: non routable) */
 	struct msg		*msg_query;		/* the associated query if the message is a received answer */
 	int			 msg_associated;	/* and the counter part information in the query, to avoid double free */
@@ -137,6 +138,8 @@ struct msg {
 	DiamId_t		 msg_src_id;		/* Diameter Id of the peer this message was received from. This string is malloc'd and must be freed */
 	size_t			 msg_src_id_len;	/* cached length of this string */
 	struct fd_msg_pmdl	 msg_pmdl;		/* list of permessagedata structures. */
+	int			 msg_prio;		/* priority class set by fd_msg_prio_set, MSG_PRIO_NORMAL by default */
+	struct timespec		 msg_arrival;		/* when the message entered the daemon, 0 if not recorded */
 };
 
 /* Macro to compute the message header size */
@@ -354,6 +357,7 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 	ans->msg_public.msg_appl = qry->msg_public.msg_appl;
 	ans->msg_public.msg_eteid = qry->msg_public.msg_eteid;
 	ans->msg_public.msg_hbhid = qry->msg_public.msg_hbhid;
+	ans->msg_prio = qry->msg_prio;
 	
 	/* Add the Session-Id AVP if session is known */
 	if (sess && dict) {
@@ -667,7 +671,7 @@ static int destroy_obj (struct msg_avp_chain * obj )
 		free(_A(obj)->avp_rawdata);
 	}
 	if ((obj->type == MSG_MSG) && (_M(obj)->msg_rawbuffer != NULL)) {
-		free(_M(obj)->msg_rawbuffer);
+		(*(_M(obj)->msg_rawfree ?: free))(_M(obj)->msg_rawbuffer);
 	}
 	
 	if ((obj->type == MSG_MSG) && (_M(obj)->msg_src_id != NULL)) {
@@ -1465,6 +1469,57 @@ int fd_msg_source_get( struct msg * msg, DiamId_t* diamid, size_t * diamidlen )
 	return 0;
 }
 
+/* Set the priority class of a message */
+int fd_msg_prio_set( struct msg * msg, int prio )
+{
+	TRACE_ENTRY( "%p %d", msg, prio);
+	
+	/* Check we received valid parameters, MSG_PRIO_CONTROL is reserved for the base protocol */
+	CHECK_PARAMS( CHECK_MSG(msg) );
+	CHECK_PARAMS( (prio >= MSG_PRIO_NORMAL) && (prio < MSG_PRIO_CONTROL) );
+	
+	msg->msg_prio = prio;
+	return 0;
+}
+
+int fd_msg_prio_get( struct msg * msg, int * prio )
+{
+	TRACE_ENTRY( "%p %p", msg, prio);
+	
+	/* Check we received valid parameters */
+	CHECK_PARAMS( CHECK_MSG(msg) && prio );
+	
+	/* Local link messages (CER, DWR, DPR and their answers) always overtake the application traffic */
+	if (!fd_msg_is_routable(msg))
+		*prio = MSG_PRIO_CONTROL;
+	else
+		*prio = msg->msg_prio;
+	
+	return 0;
+}
+
+int fd_msg_arrival_set( struct msg * msg, const struct timespec * ts )
+{
+	TRACE_ENTRY( "%p %p", msg, ts);
+	
+	/* Check we received valid parameters */
+	CHECK_PARAMS( CHECK_MSG(msg) && ts );
+	
+	memcpy(&msg->msg_arrival, ts, sizeof(struct timespec));
+	return 0;
+}
+
+int fd_msg_arrival_get( struct msg * msg, struct timespec * ts )
+{
+	TRACE_ENTRY( "%p %p", msg, ts);
+	
+	/* Check we received valid parameters */
+	CHECK_PARAMS( CHECK_MSG(msg) && ts );
+	
+	memcpy(ts, &msg->msg_arrival, sizeof(struct timespec));
+	return 0;
+}
+
 /* Associate a session with a message, use only when the session was just created */
 int fd_msg_sess_set(struct msg * msg, struct session * session)
 {
@@ -1535,6 +1590,14 @@ int fd_msg_sess_get(struct dictionary * dict, struct msg * msg, struct session *
 	return 0;
 }
 
+/* Set the function that releases the buffer passed to fd_msg_parse_buffer */
+int fd_msg_rawbuffer_setfree(struct msg * msg, void (*rawfree)(void *))
+{
+	CHECK_PARAMS( CHECK_MSG(msg) );
+	msg->msg_rawfree = rawfree;
+	return 0;
+}
+
 /* Retrieve the location of the pmd list for the message; return NULL if failed */
 struct fd_msg_pmdl * fd_msg_pmdl_get(struct msg * msg)
 {
@@ -2378,7 +2441,7 @@ chain:
 
 		/* Free the raw buffer if any */
 		if ((ret == 0) && (msg->msg_rawbuffer != NULL)) {
-			free(msg->msg_rawbuffer);
+			(*(msg->msg_rawfree ?: free))(msg->msg_rawbuffer);
 			msg->msg_rawbuffer=NULL;
 		}
 	}
@@ -45,8 +45,23 @@ struct rt_data {
 	int		extracted;	/* if 0, candidates is ordered by diamid, otherwise the order is unspecified. This also counts the number of times the message was (re-)sent, as a side effect */
 	struct fd_list	candidates;	/* All the candidates. Items are struct rtd_candidate. */
 	struct fd_list	errors;		/* All errors received from other peers for this message */
+	
+	struct rtd_candidate *cands;	/* the candidates set by fd_rtd_candidate_set, allocated at once. Their strings are not owned. */
+	int		ncands;
+	void		(*release)(void *); /* called with ref when the strings of cands are not used anymore */
+	void		*ref;
 };
 
+/* Free a candidate, unless it is part of the array set by fd_rtd_candidate_set */
+static void rtd_candidate_free(struct rt_data * rtd, struct rtd_candidate * c)
+{
+	if (rtd->cands && (c >= rtd->cands) && (c < rtd->cands + rtd->ncands))
+		return;
+	free(c->diamid);
+	free(c->realm);
+	free(c);
+}
+
 /* Items of the errors list */
 struct rtd_error {
 	struct fd_list	chain;	/* link in the list, ordered by nexthop (fd_os_cmp) */
@@ -89,10 +104,11 @@ void fd_rtd_free(struct rt_data ** rtd)
 		struct rtd_candidate * c = (struct rtd_candidate *) old->candidates.next;
 		
 		fd_list_unlink(&c->chain);
-		free(c->diamid);
-		free(c->realm);
-		free(c);
+		rtd_candidate_free(old, c);
 	}
+	free(old->cands);
+	if (old->release)
+		(*old->release)(old->ref);
 	
 	while (!FD_IS_LIST_EMPTY(&old->errors)) {
 		struct rtd_error * c = (struct rtd_error *) old->errors.next;
@@ -145,6 +161,34 @@ int  fd_rtd_candidate_add(struct rt_data * rtd, DiamId_t peerid, size_t peeridle
 	return 0;
 }
 
+/* Set all the candidates at once. The source is our snapshot of the active peers, already ordered. */
+int  fd_rtd_candidate_set(struct rt_data * rtd, struct rtd_candidate * src, int nb, void (*release)(void *), void * ref)
+{
+	int i;
+	
+	TRACE_ENTRY("%p %p %d %p %p", rtd, src, nb, release, ref);
+	CHECK_PARAMS( rtd && FD_IS_LIST_EMPTY(&rtd->candidates) && !rtd->cands && !rtd->release && (src || !nb) && (nb >= 0) );
+	
+	if (nb) {
+		CHECK_MALLOC( rtd->cands = malloc(nb * sizeof(struct rtd_candidate)) );
+		memset(rtd->cands, 0, nb * sizeof(struct rtd_candidate));
+		rtd->ncands = nb;
+		for (i = 0; i < nb; i++) {
+			struct rtd_candidate * c = &rtd->cands[i];
+			fd_list_init(&c->chain, c);
+			c->diamid = src[i].diamid;
+			c->diamidlen = src[i].diamidlen;
+			c->realm = src[i].realm;
+			c->realmlen = src[i].realmlen;
+			fd_list_insert_before(&rtd->candidates, &c->chain);
+		}
+	}
+	rtd->release = release;
+	rtd->ref = ref;
+	
+	return 0;
+}
+
 /* Remove a peer from the candidates (if it is found). Case insensitive search since the names are received from other peers */
 void fd_rtd_candidate_del(struct rt_data * rtd, uint8_t * id, size_t idsz)
 {
@@ -165,9 +209,7 @@ void fd_rtd_candidate_del(struct rt_data * rtd, uint8_t * id, size_t idsz)
 		if (!cmp) {
 			/* Found it! Remove it */
 			fd_list_unlink(&c->chain);
-			free(c->diamid);
-			free(c->realm);
-			free(c);
+			rtd_candidate_free(rtd, c);
 			break;
 		}
 		
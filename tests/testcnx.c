@@ -34,6 +34,14 @@
 *********************************************************************************************************/
 
 #include "tests.h"
+#include <sys/resource.h>
+
+#include <cnxctx.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif /* HAVE_IO_URING */
 
 #ifndef TEST_PORT
 #define TEST_PORT	3868
@@ -692,6 +700,7 @@ struct handshake_flags {
 	struct cnxctx * cnx;
 	gnutls_certificate_credentials_t	creds;
 	int algo;
+	char * prio;
 	int ret;
 };
 
@@ -700,7 +709,7 @@ static void * handshake_thr(void * arg)
 {
 	struct handshake_flags * hf = arg;
 	fd_log_threadname ( "testcnx:handshake" );
-	hf->ret = fd_cnx_handshake(hf->cnx, GNUTLS_CLIENT, hf->algo, NULL, hf->creds);
+	hf->ret = fd_cnx_handshake(hf->cnx, GNUTLS_CLIENT, hf->algo, hf->prio, hf->creds);
 	return NULL;
 }
 
@@ -713,6 +722,161 @@ static void * destroy_thr(void * arg)
 	return NULL;
 }
 	
+/* Initiator's side of an additional connection to an open peer */
+struct lane_flags {
+	struct fd_peer * peer;
+	struct cnxctx * cnx;
+	int ret;
+};
+
+static void * lane_open_thr(void * arg)
+{
+	struct lane_flags * lf = arg;
+	struct fd_endpoint * ep = (struct fd_endpoint *)(eps.next);
+	
+	fd_log_threadname ( "testcnx:lane" );
+	
+	lf->cnx = fd_cnx_cli_connect_tcp( &ep->sa, sSAlen(&ep->ss) );
+	CHECK( 1, lf->cnx ? 1 : 0 );
+	CHECK( 0, fd_cnx_start_clear(lf->cnx, 0) );
+	lf->ret = fd_p_ce_lane_open(lf->peer, lf->cnx);
+	return NULL;
+}
+
+/* Open an additional connection from ini to rsp, the responder's side handles the CER as the PSM does */
+static void lane_attempt(struct cnxctx * listener, struct fd_peer * ini, struct fd_peer * rsp, struct lane_flags * lf)
+{
+	struct cnxctx * cnx;
+	struct msg * cer = NULL;
+	uint8_t * buf = NULL;
+	size_t sz;
+	pthread_t thr;
+	
+	memset(lf, 0, sizeof(struct lane_flags));
+	lf->peer = ini;
+	CHECK( 0, pthread_create(&thr, NULL, lane_open_thr, lf) );
+	
+	cnx = fd_cnx_serv_accept(listener);
+	CHECK( 1, cnx ? 1 : 0 );
+	CHECK( 0, fd_cnx_start_clear(cnx, 0) );
+	CHECK( 0, fd_cnx_receive(cnx, NULL, &buf, &sz) );
+	CHECK( 0, fd_msg_parse_buffer(&buf, sz, &cer) );
+	CHECK( 0, fd_msg_rawbuffer_setfree(cer, fd_rcvbuf_free) );
+	CHECK( 0, fd_msg_parse_dict(cer, fd_g_config->cnf_dict, NULL) );
+	CHECK( 0, fd_p_ce_handle_newCER(&cer, rsp, &cnx, 1) );
+	CHECK( 0, cnx ? 1 : 0 );
+	CHECK( 0, cer ? 1 : 0 );
+	
+	CHECK( 0, pthread_join(thr, NULL) );
+}
+
+/* Wait for the end of the responder's handshake of an additional connection, return the connection or NULL */
+static struct cnxctx * lane_established(struct fd_peer * rsp)
+{
+	int code;
+	size_t sz;
+	void * data;
+	
+	do {
+		CHECK( 0, fd_event_get(rsp->p_events, &code, &sz, &data) );
+	} while (code != FDEVP_LANE_ESTABLISHED);
+	CHECK( 0, fd_thr_term(&rsp->p_lanes_thr) );
+	return data;
+}
+
+/* Send several messages in one call from a separate thread */
+struct sendv_flags {
+	struct cnxctx * cnx;
+	struct iovec *	iov;
+	int		cnt;
+	int		ret;
+};
+
+static void * sendv_thr(void * arg)
+{
+	struct sendv_flags * sf = arg;
+	fd_log_threadname ( "testcnx:sendv" );
+	sf->ret = fd_cnx_sendv(sf->cnx, sf->iov, sf->cnt);
+	return NULL;
+}
+
+/* Number of messages sent in the throughput benchmark of the I/O engines, by batches of BENCH_BATCH */
+#define NB_BENCH	20000
+#define BENCH_BATCH	40
+
+struct bench_flags {
+	struct cnxctx * cnx;
+	uint8_t *	buf;
+	size_t		sz;
+	int		ret;
+};
+
+/* Sender's side of the benchmark */
+static void * bench_send_thr(void * arg)
+{
+	struct bench_flags * bf = arg;
+	struct iovec iov[BENCH_BATCH];
+	int i, j;
+	
+	fd_log_threadname ( "testcnx:bench" );
+	
+	for (i = 0; i < NB_BENCH; i += BENCH_BATCH) {
+		for (j = 0; j < BENCH_BATCH; j++) {
+			iov[j].iov_base = bf->buf;
+			iov[j].iov_len  = bf->sz;
+		}
+		bf->ret = fd_cnx_sendv(bf->cnx, iov, BENCH_BATCH);
+		if (bf->ret)
+			break;
+	}
+	return NULL;
+}
+
+static void display_result(int nr, struct timespec * start, struct timespec * end, char * engine)
+{
+	long double dur = (long double)end->tv_sec + (long double)end->tv_nsec/1000000000;
+	dur -= (long double)start->tv_sec + (long double)start->tv_nsec/1000000000;
+	printf("I/O engine %-8s: %d messages received in %.6LFs (%.1LFmsg/s)\n", engine, nr, dur, (long double)nr / dur);
+}
+
+static void display_cpu(int nr, struct rusage * start, struct rusage * end, char * label)
+{
+	long double cpu = (long double)(end->ru_utime.tv_sec + end->ru_stime.tv_sec - start->ru_utime.tv_sec - start->ru_stime.tv_sec) * 1000000;
+	cpu += (long double)(end->ru_utime.tv_usec + end->ru_stime.tv_usec - start->ru_utime.tv_usec - start->ru_stime.tv_usec);
+	printf("TLS records by %-6s: %d messages, %.3LFus of CPU per message\n", label, nr, cpu / nr);
+}
+
+/* Release received buffers from another thread */
+#define NB_RCVBUF	1000
+static void * rcvbuf_free_thr(void * arg)
+{
+	uint8_t ** bufs = arg;
+	int i;
+	fd_log_threadname ( "testcnx:rcvbuf" );
+	for (i = 0; i < NB_RCVBUF; i++)
+		fd_rcvbuf_free(bufs[i]);
+	return NULL;
+}
+
+#ifdef HAVE_EPOLL
+/* Can the io_uring engine run on this system? Checked independently of the engine, with the same requirements */
+static int uring_usable(void)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_params p;
+	int fd;
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, 8, &p);
+	if (fd < 0)
+		return 0;
+	close(fd);
+	return (p.features & IORING_FEAT_EXT_ARG) && (p.features & IORING_FEAT_SINGLE_MMAP);
+#else /* HAVE_IO_URING */
+	return 0;
+#endif /* HAVE_IO_URING */
+}
+#endif /* HAVE_EPOLL */
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -791,6 +955,53 @@ int main(int argc, char *argv[])
 	CHECK( GNUTLS_E_SUCCESS, ret );
 	
 	
+	/* Test the pool of buffers for received messages */
+	{
+		static uint8_t * bufs[NB_RCVBUF], * again[NB_RCVBUF];
+		uint8_t * b1, * b2;
+		int j, found = 0;
+		
+		/* A released buffer is reused for the next allocation in the same size class */
+		b1 = fd_rcvbuf_alloc(100);
+		CHECK( 1, b1 ? 1 : 0 );
+		memset(b1, 0xaa, 100);
+		fd_rcvbuf_free(b1);
+		b2 = fd_rcvbuf_alloc(200);
+		CHECK( 1, (b1 == b2) ? 1 : 0 );
+		fd_rcvbuf_free(b2);
+		
+		/* Buffers bigger than the largest class are simply malloc'd */
+		b1 = fd_rcvbuf_alloc(200000);
+		CHECK( 1, b1 ? 1 : 0 );
+		memset(b1, 0x55, 200000);
+		fd_rcvbuf_free(b1);
+		fd_rcvbuf_free(NULL);
+		
+		/* Buffers released in another thread come back to the allocating thread */
+		for (i = 0; i < NB_RCVBUF; i++) {
+			bufs[i] = fd_rcvbuf_alloc(300 + i);
+			CHECK( 1, bufs[i] ? 1 : 0 );
+			memset(bufs[i], i & 0xff, 300 + i);
+		}
+		CHECK( 0, pthread_create(&thr, NULL, rcvbuf_free_thr, bufs) );
+		CHECK( 0, pthread_join(thr, NULL) );
+		for (i = 0; i < NB_RCVBUF; i++) {
+			again[i] = fd_rcvbuf_alloc(300 + i);
+			CHECK( 1, again[i] ? 1 : 0 );
+			for (j = 0; j < NB_RCVBUF; j++) {
+				if (bufs[j] == again[i]) {
+					found++;
+					bufs[j] = NULL;
+					break;
+				}
+			}
+		}
+		CHECK( NB_RCVBUF, found );
+		for (i = 0; i < NB_RCVBUF; i++)
+			fd_rcvbuf_free(again[i]);
+		fd_rcvbuf_fini();
+	}
+	
 	/* Initialize the server address (this should give a safe loopback address + port, even on non-standard configs) */
 	{
 		struct addrinfo hints, *ai, *aip;
@@ -888,19 +1099,187 @@ int main(int argc, char *argv[])
 		CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* Do it in the other direction */
 		CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* Now close the connections */
 		fd_cnx_destroy(client_side);
 		fd_cnx_destroy(server_side);
 	}
+	
+	/* TCP client / server test sending several messages at once (no TLS) */
+	{
+		struct connect_flags cf;
+		struct iovec iov[NB_STREAMS];
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		/* Start the client thread */
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+
+		/* Accept the connection of the client */
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+		
+		/* Retrieve the client connection object */
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(client_side, 1) );
+		
+		/* Send the messages in one call, and receive them separately */
+		for (i = 0; i < NB_STREAMS; i++) {
+			iov[i].iov_base = cer_buf;
+			iov[i].iov_len  = cer_sz;
+		}
+		CHECK( 0, fd_cnx_sendv(server_side, iov, NB_STREAMS));
+		for (i = 0; i < NB_STREAMS; i++) {
+			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			fd_rcvbuf_free(rcv_buf);
+		}
+		
+		/* Now close the connections */
+		fd_cnx_destroy(client_side);
+		fd_cnx_destroy(server_side);
+	}
+	
+	/* Same, with small socket buffers and a receiver that does not read at first: the writev is partial */
+	{
+		struct connect_flags cf;
+		struct sendv_flags sf;
+		struct iovec iov[NB_STREAMS], saved[NB_STREAMS];
+		int sz = 4096;
+		size_t len = 60000;
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		CHECK( 0, setsockopt(server_side->cc_socket, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz)) );
+		CHECK( 0, setsockopt(client_side->cc_socket, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz)) );
+		
+		/* Messages of 60000 bytes, with a distinct content */
+		for (i = 0; i < NB_STREAMS; i++) {
+			uint8_t * buf = malloc(len);
+			CHECK( 1, buf ? 1 : 0 );
+			memset(buf, i, len);
+			buf[0] = 1;
+			buf[1] = (len >> 16) & 0xff;
+			buf[2] = (len >> 8) & 0xff;
+			buf[3] = len & 0xff;
+			iov[i].iov_base = buf;
+			iov[i].iov_len  = len;
+		}
+		memcpy(saved, iov, sizeof(iov));
+		
+		memset(&sf, 0, sizeof(sf));
+		sf.cnx = server_side;
+		sf.iov = iov;
+		sf.cnt = NB_STREAMS;
+		CHECK( 0, pthread_create(&thr, NULL, sendv_thr, &sf) );
+		
+		/* The socket timeout (100ms) expires in writev before we start reading */
+		usleep(300000);
+		CHECK( 0, fd_cnx_start_clear(client_side, 1) );
+		for (i = 0; i < NB_STREAMS; i++) {
+			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( len, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, saved[i].iov_base, len ) );
+			fd_rcvbuf_free(rcv_buf);
+		}
+		CHECK( 0, pthread_join(thr, NULL) );
+		CHECK( 0, sf.ret );
+		
+		/* The array of the caller is untouched, its buffers can be freed */
+		CHECK( 0, memcmp( iov, saved, sizeof(iov) ) );
+		for (i = 0; i < NB_STREAMS; i++)
+			free(iov[i].iov_base);
+		
+		fd_cnx_destroy(client_side);
+		fd_cnx_destroy(server_side);
+	}
+	
+	/* Unix domain socket client / server test, for co-located peers */
+	{
+		struct cnxctx * local_listener = NULL;
+		char path[64];
+		
+		snprintf(path, sizeof(path), "/tmp/testcnx.%d.sock", (int)getpid());
+		
+		/* Start the server */
+		local_listener = fd_cnx_serv_local(path);
+		CHECK( 1, local_listener ? 1 : 0 );
+		CHECK( 1, fd_cnx_islocal(local_listener) );
+		CHECK( 0, fd_cnx_serv_listen(local_listener) );
+		
+		/* The socket of a running server is not taken over. The probe connection is then closed */
+		CHECK( NULL, fd_cnx_serv_local(path) );
+		server_side = fd_cnx_serv_accept(local_listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		fd_cnx_destroy(server_side);
+		
+		/* The connection completes in the backlog, no need for a separate thread */
+		client_side = fd_cnx_cli_connect_local(path);
+		CHECK( 1, client_side ? 1 : 0 );
+		server_side = fd_cnx_serv_accept(local_listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 1, fd_cnx_islocal(client_side) );
+		CHECK( 1, fd_cnx_islocal(server_side) );
+		CHECK( IPPROTO_TCP, fd_cnx_getproto(server_side) );
+		CHECK( 0, fd_cnx_start_clear(server_side, 0) );
+		CHECK( 0, fd_cnx_start_clear(client_side, 0) );
+		
+		/* Send a message and receive it */
+		CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+		CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+		CHECK( cer_sz, rcv_sz );
+		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+		fd_rcvbuf_free(rcv_buf);
+		
+		/* Do it in the other direction */
+		CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+		CHECK( cer_sz, rcv_sz );
+		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+		fd_rcvbuf_free(rcv_buf);
+		
+		/* Now close the connections and the server */
+		fd_cnx_destroy(client_side);
+		fd_cnx_destroy(server_side);
+		fd_cnx_destroy(local_listener);
+		
+		/* The socket left by a stopped server is replaced */
+		local_listener = fd_cnx_serv_local(path);
+		CHECK( 1, local_listener ? 1 : 0 );
+		fd_cnx_destroy(local_listener);
+		unlink(path);
+		
+		/* Another file at this path is not removed */
+		{
+			FILE * f = fopen(path, "w");
+			CHECK( 1, f ? 1 : 0 );
+			fclose(f);
+		}
+		CHECK( NULL, fd_cnx_serv_local(path) );
+		CHECK( 0, access(path, F_OK) );
+		unlink(path);
+		
+		/* The TCP server is not a local one */
+		CHECK( 0, fd_cnx_islocal(listener) );
+	}
 		
 #ifndef DISABLE_SCTP
 	/* Simple SCTP client / server test (no TLS) */
@@ -930,21 +1309,21 @@ int main(int argc, char *argv[])
 		CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* Do it in the other direction */
 		CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* Do it one more time to use another stream */
 		CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* Now close the connection */
 		fd_cnx_destroy(client_side);
@@ -994,14 +1373,14 @@ int main(int argc, char *argv[])
 		CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* And the supposed reply */
 		CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* At this point in legacy Diameter we start the handshake */
 		CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
@@ -1015,13 +1394,13 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		}
 		
 		
@@ -1080,14 +1459,14 @@ int main(int argc, char *argv[])
 		CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* And the supposed reply */
 		CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 		CHECK( cer_sz, rcv_sz );
 		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-		free(rcv_buf);
+		fd_rcvbuf_free(rcv_buf);
 		
 		/* At this point in legacy Diameter we start the handshake */
 		CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
@@ -1101,13 +1480,13 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		}
 		
 		
@@ -1167,13 +1546,29 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
+		}
+		
+		/* Send several messages in one call, they are packed in TLS records */
+		{
+			struct iovec iov[2 * NB_STREAMS];
+			for (i = 0; i < 2 * NB_STREAMS; i++) {
+				iov[i].iov_base = cer_buf;
+				iov[i].iov_len  = cer_sz;
+			}
+			CHECK( 0, fd_cnx_sendv(server_side, iov, 2 * NB_STREAMS));
+			for (i = 0; i < 2 * NB_STREAMS; i++) {
+				CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+			}
 		}
 		
 		/* Now close the connection */
@@ -1187,6 +1582,414 @@ int main(int argc, char *argv[])
 		gnutls_certificate_free_credentials(hf.creds);
 	}
 	
+	/* TLS session resumption, with TLS 1.3 (tickets sent after the handshake) and TLS 1.2 (tickets in the handshake),
+	  with the records protected by gnutls then by the kernel if it is available */
+	{
+		char * prios[] = { NULL, "NORMAL:-VERS-TLS1.3" };
+		int p, c;
+		
+		for (p = 0; p < 2 * sizeof(prios) / sizeof(prios[0]); p++) {
+			struct handshake_flags hf;
+			
+			/* Start each round with a full handshake */
+			fd_tls_resume_fini();
+			fd_g_config->cnf_flags.ktls = (p >= sizeof(prios) / sizeof(prios[0]));
+			
+			memset(&hf, 0, sizeof(hf));
+			hf.prio = prios[p % (sizeof(prios) / sizeof(prios[0]))];
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_allocate_credentials (&hf.creds), );
+			CHECK( GNUTLS_E_SUCCESS, ret );
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_trust_mem( hf.creds, &ca, GNUTLS_X509_FMT_PEM), );
+			CHECK( 1, ret );
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_key_mem( hf.creds, &client_cert, &client_priv, GNUTLS_X509_FMT_PEM), );
+			CHECK( GNUTLS_E_SUCCESS, ret );
+			
+			/* 0: full handshake, 1: resumed, 2: full because resumption is disabled, 3: resumed again */
+			for (c = 0; c < 4; c++) {
+				struct connect_flags cf;
+				long long full_before, resumed_before, full, resumed;
+				const gnutls_datum_t *cert_list;
+				unsigned int cert_list_size;
+				
+				fd_g_config->cnf_flags.no_resume = (c == 2);
+				CHECK( 0, fd_stat_tls_handshakes(&full_before, &resumed_before) );
+				
+				memset(&cf, 0, sizeof(cf));
+				cf.proto = IPPROTO_TCP;
+				CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+				server_side = fd_cnx_serv_accept(listener);
+				CHECK( 1, server_side ? 1 : 0 );
+				CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+				CHECK( 1, client_side ? 1 : 0 );
+				
+				/* The saved sessions are indexed by the remote identity */
+				fd_cnx_sethostname(client_side, "server.test");
+				hf.cnx = client_side;
+				CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
+				CHECK( 0, fd_cnx_handshake(server_side, GNUTLS_SERVER, ALGO_HANDSHAKE_DEFAULT, NULL, NULL) );
+				CHECK( 0, pthread_join(thr, NULL) );
+				CHECK( 0, hf.ret );
+				
+				/* Both sides are counted */
+				CHECK( 0, fd_stat_tls_handshakes(&full, &resumed) );
+				CHECK( ((c == 1) || (c == 3)) ? 0 : 2, full - full_before );
+				CHECK( ((c == 1) || (c == 3)) ? 2 : 0, resumed - resumed_before );
+				
+				/* The credentials of the client are still available to the server */
+				CHECK( 0, fd_cnx_getcred(server_side, &cert_list, &cert_list_size) );
+				CHECK( 1, cert_list_size ? 1 : 0 );
+				
+				/* The client receives the TLS 1.3 ticket with the first message */
+				CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+				CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+				
+				CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+				CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+				
+				CHECK( 0, pthread_create(&thr, NULL, destroy_thr, client_side) );
+				fd_cnx_destroy(server_side);
+				CHECK( 0, pthread_join(thr, NULL) );
+			}
+			
+			gnutls_certificate_free_keys(hf.creds);
+			gnutls_certificate_free_cas(hf.creds);
+			gnutls_certificate_free_credentials(hf.creds);
+		}
+		
+		fd_g_config->cnf_flags.no_resume = 0;
+		fd_g_config->cnf_flags.ktls = 0;
+	}
+	
+#ifdef HAVE_EPOLL
+	/* Same tests with the connections served by the I/O engines */
+	{
+		int engines[] = { FD_IO_EPOLL, FD_IO_URING };
+		int e;
+		
+		for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+			struct connect_flags cf;
+			struct handshake_flags hf;
+			struct iovec iov[2 * NB_STREAMS];
+			int uring = (engines[e] == FD_IO_URING) && uring_usable();
+			long long rcv0, snd0, rcv1, snd1;
+			
+			/* Without io_uring, FD_IO_URING falls back to epoll */
+			fd_g_config->cnf_io_engine = engines[e];
+			
+			for (i = 0; i < 2 * NB_STREAMS; i++) {
+				iov[i].iov_base = cer_buf;
+				iov[i].iov_len  = cer_sz;
+			}
+			
+			/* Clear TCP */
+			memset(&cf, 0, sizeof(cf));
+			cf.proto = IPPROTO_TCP;
+			CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+			server_side = fd_cnx_serv_accept(listener);
+			CHECK( 1, server_side ? 1 : 0 );
+			CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+			CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+			CHECK( 1, client_side ? 1 : 0 );
+			CHECK( 0, fd_cnx_start_clear(client_side, 1) );
+			
+			/* The connections are served by the requested engine, not by the fallback */
+			CHECK( uring, server_side->cc_uring ? 1 : 0 );
+			CHECK( uring, client_side->cc_uring ? 1 : 0 );
+			CHECK( !uring, server_side->cc_ioloop ? 1 : 0 );
+			CHECK( !uring, client_side->cc_ioloop ? 1 : 0 );
+			fd_uring_stats(&rcv0, &snd0);
+			
+			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			fd_rcvbuf_free(rcv_buf);
+			
+			CHECK( 0, fd_cnx_sendv(server_side, iov, 2 * NB_STREAMS));
+			for (i = 0; i < 2 * NB_STREAMS; i++) {
+				CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+			}
+			
+			/* ... and the traffic went through io_uring: the sends were submitted to the rings and the data came in completions */
+			fd_uring_stats(&rcv1, &snd1);
+			if (uring) {
+				CHECK( 1, snd1 - snd0 >= 2 * NB_STREAMS ? 1 : 0 );
+				CHECK( 1, rcv1 > rcv0 ? 1 : 0 );
+			} else {
+				CHECK( 1, (snd1 == snd0) && (rcv1 == rcv0) ? 1 : 0 );
+			}
+			
+			/* The disconnection is detected */
+			fd_cnx_destroy(client_side);
+			CHECK( ENOTCONN, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+			fd_cnx_destroy(server_side);
+			
+			/* A connection whose queue is full does not stall the other connections of the same loop thread */
+			if (engines[e] == FD_IO_EPOLL) {
+				struct cnxctx * full_srv, * full_cli;
+				struct iovec many[4 * NB_STREAMS];
+				struct timespec ts;
+				uint16_t io_thr = fd_g_config->cnf_io_thr;
+				
+				fd_ioloop_fini();
+				fd_g_config->cnf_io_thr = 1;
+				
+				CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+				full_srv = fd_cnx_serv_accept(listener);
+				CHECK( 1, full_srv ? 1 : 0 );
+				CHECK( 0, fd_cnx_start_clear(full_srv, 1) );
+				CHECK( 0, pthread_join( thr, (void *)&full_cli ) );
+				CHECK( 1, full_cli ? 1 : 0 );
+				
+				CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+				server_side = fd_cnx_serv_accept(listener);
+				CHECK( 1, server_side ? 1 : 0 );
+				CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+				CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+				CHECK( 1, client_side ? 1 : 0 );
+				
+				/* Many more messages than the incoming queue holds, and nobody reads them yet */
+				for (i = 0; i < 4 * NB_STREAMS; i++) {
+					many[i].iov_base = cer_buf;
+					many[i].iov_len  = cer_sz;
+				}
+				CHECK( 0, fd_cnx_sendv(full_cli, many, 4 * NB_STREAMS));
+				
+				/* The other connection is still served */
+				CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+				CHECK( 0, clock_gettime(CLOCK_REALTIME, &ts) );
+				ts.tv_sec += 5;
+				CHECK( 0, fd_cnx_receive(server_side, &ts, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				fd_rcvbuf_free(rcv_buf);
+				
+				/* And all the messages of the first one are delivered once we read them */
+				for (i = 0; i < 4 * NB_STREAMS; i++) {
+					CHECK( 0, fd_cnx_receive(full_srv, &ts, &rcv_buf, &rcv_sz));
+					CHECK( cer_sz, rcv_sz );
+					CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+					fd_rcvbuf_free(rcv_buf);
+				}
+				
+				/* A stalled connection can also be destroyed */
+				CHECK( 0, fd_cnx_sendv(full_cli, many, 4 * NB_STREAMS));
+				fd_cnx_destroy(full_srv);
+				fd_cnx_destroy(full_cli);
+				fd_cnx_destroy(client_side);
+				fd_cnx_destroy(server_side);
+				
+				fd_ioloop_fini();
+				fd_g_config->cnf_io_thr = io_thr;
+			}
+			
+			/* TLS */
+			memset(&hf, 0, sizeof(hf));
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_allocate_credentials (&hf.creds), );
+			CHECK( GNUTLS_E_SUCCESS, ret );
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_trust_mem( hf.creds, &ca, GNUTLS_X509_FMT_PEM), );
+			CHECK( 1, ret );
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_key_mem( hf.creds, &client_cert, &client_priv, GNUTLS_X509_FMT_PEM), );
+			CHECK( GNUTLS_E_SUCCESS, ret );
+			
+			CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+			server_side = fd_cnx_serv_accept(listener);
+			CHECK( 1, server_side ? 1 : 0 );
+			CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+			CHECK( 1, client_side ? 1 : 0 );
+			hf.cnx = client_side;
+			CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
+			CHECK( 0, fd_cnx_handshake(server_side, GNUTLS_SERVER, ALGO_HANDSHAKE_DEFAULT, NULL, NULL) );
+			CHECK( 0, pthread_join(thr, NULL) );
+			CHECK( 0, hf.ret );
+			CHECK( uring, server_side->cc_uring ? 1 : 0 );
+			CHECK( uring, client_side->cc_uring ? 1 : 0 );
+			fd_uring_stats(&rcv0, &snd0);
+			
+			for (i = 0; i < NB_STREAMS; i++) {
+				CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+				CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+
+				CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+				CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+			}
+			
+			CHECK( 0, fd_cnx_sendv(client_side, iov, 2 * NB_STREAMS));
+			for (i = 0; i < 2 * NB_STREAMS; i++) {
+				CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+			}
+			
+			/* The TLS records are read on the completions of the poll requests (several per completion possibly); the sends go through gnutls, not the rings */
+			fd_uring_stats(&rcv1, NULL);
+			CHECK( uring, rcv1 > rcv0 ? 1 : 0 );
+			
+			CHECK( 0, pthread_create(&thr, NULL, destroy_thr, client_side) );
+			fd_cnx_destroy(server_side);
+			CHECK( 0, pthread_join(thr, NULL) );
+			
+			gnutls_certificate_free_keys(hf.creds);
+			gnutls_certificate_free_cas(hf.creds);
+			gnutls_certificate_free_credentials(hf.creds);
+			
+		}
+		
+		/* Back to the default engine for the next tests */
+		fd_g_config->cnf_io_engine = FD_IO_THREADS;
+		fd_ioloop_fini();
+		fd_uring_fini();
+	}
+	
+	/* Loopback throughput of the I/O engines, on a clear TCP connection */
+	{
+		int engines[] = { FD_IO_THREADS, FD_IO_EPOLL, FD_IO_URING };
+		char * names[] = { "threads", "epoll", "io_uring" };
+		int e;
+		
+		for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+			struct connect_flags cf;
+			struct bench_flags bf;
+			struct timespec start, end;
+			
+			fd_g_config->cnf_io_engine = engines[e];
+			
+			memset(&cf, 0, sizeof(cf));
+			cf.proto = IPPROTO_TCP;
+			CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+			server_side = fd_cnx_serv_accept(listener);
+			CHECK( 1, server_side ? 1 : 0 );
+			CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+			CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+			CHECK( 1, client_side ? 1 : 0 );
+			CHECK( 0, fd_cnx_start_clear(client_side, 1) );
+			
+			memset(&bf, 0, sizeof(bf));
+			bf.cnx = client_side;
+			bf.buf = cer_buf;
+			bf.sz  = cer_sz;
+			
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+			CHECK( 0, pthread_create(&thr, NULL, bench_send_thr, &bf) );
+			for (i = 0; i < NB_BENCH; i++) {
+				CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				fd_rcvbuf_free(rcv_buf);
+			}
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+			CHECK( 0, pthread_join(thr, NULL) );
+			CHECK( 0, bf.ret );
+			display_result(NB_BENCH, &start, &end, names[e]);
+			
+			fd_cnx_destroy(client_side);
+			fd_cnx_destroy(server_side);
+		}
+		
+		fd_g_config->cnf_io_engine = FD_IO_THREADS;
+		fd_ioloop_fini();
+		fd_uring_fini();
+	}
+#endif /* HAVE_EPOLL */
+	
+	/* TLS with the records protected by gnutls, then by the kernel if it is available. Both sides use the same setting. */
+	{
+		int ktls;
+		
+		for (ktls = 0; ktls < 2; ktls++) {
+			struct connect_flags cf;
+			struct handshake_flags hf;
+			struct bench_flags bf;
+			struct rusage start, end;
+			char info[64];
+			
+			fd_g_config->cnf_flags.ktls = ktls;
+			
+			memset(&hf, 0, sizeof(hf));
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_allocate_credentials (&hf.creds), );
+			CHECK( GNUTLS_E_SUCCESS, ret );
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_trust_mem( hf.creds, &ca, GNUTLS_X509_FMT_PEM), );
+			CHECK( 1, ret );
+			CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_key_mem( hf.creds, &client_cert, &client_priv, GNUTLS_X509_FMT_PEM), );
+			CHECK( GNUTLS_E_SUCCESS, ret );
+			
+			memset(&cf, 0, sizeof(cf));
+			cf.proto = IPPROTO_TCP;
+			CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+			server_side = fd_cnx_serv_accept(listener);
+			CHECK( 1, server_side ? 1 : 0 );
+			CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+			CHECK( 1, client_side ? 1 : 0 );
+			hf.cnx = client_side;
+			CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
+			CHECK( 0, fd_cnx_handshake(server_side, GNUTLS_SERVER, ALGO_HANDSHAKE_DEFAULT, NULL, NULL) );
+			CHECK( 0, pthread_join(thr, NULL) );
+			CHECK( 0, hf.ret );
+			
+			/* Without kernel support, the sessions stay in gnutls */
+			CHECK( 0, fd_cnx_proto_info(server_side, info, sizeof(info)) );
+			if (!ktls) {
+				CHECK( 0, strstr(info, "kTLS") ? 1 : 0 );
+			}
+			
+			/* Exchange some messages in both directions */
+			for (i = 0; i < NB_STREAMS; i++) {
+				CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+				CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+				
+				CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+				CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				fd_rcvbuf_free(rcv_buf);
+			}
+			
+			/* Measure the CPU used per message (both sides are in this process) */
+			memset(&bf, 0, sizeof(bf));
+			bf.cnx = client_side;
+			bf.buf = cer_buf;
+			bf.sz  = cer_sz;
+			CHECK( 0, getrusage(RUSAGE_SELF, &start) );
+			CHECK( 0, pthread_create(&thr, NULL, bench_send_thr, &bf) );
+			for (i = 0; i < NB_BENCH; i++) {
+				CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				fd_rcvbuf_free(rcv_buf);
+			}
+			CHECK( 0, pthread_join(thr, NULL) );
+			CHECK( 0, getrusage(RUSAGE_SELF, &end) );
+			CHECK( 0, bf.ret );
+			display_cpu(NB_BENCH, &start, &end, strstr(info, "kTLS") ? "kernel" : "gnutls");
+			
+			CHECK( 0, pthread_create(&thr, NULL, destroy_thr, client_side) );
+			fd_cnx_destroy(server_side);
+			CHECK( 0, pthread_join(thr, NULL) );
+			
+			gnutls_certificate_free_keys(hf.creds);
+			gnutls_certificate_free_cas(hf.creds);
+			gnutls_certificate_free_credentials(hf.creds);
+		}
+		
+		fd_g_config->cnf_flags.ktls = 0;
+	}
+	
 #ifndef DISABLE_SCTP
 	
 	
@@ -1236,13 +2039,13 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		}
 		
 		
@@ -1302,13 +2105,13 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		}
 		
 		
@@ -1373,13 +2176,13 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		}
 		
 		/* Now close the connection */
@@ -1412,13 +2215,13 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		}
 		
 		/* Now close the connection */
@@ -1479,13 +2282,13 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		}
 		
 		/* Now close the connection */
@@ -1518,13 +2321,13 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 
 			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
 			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
 			CHECK( cer_sz, rcv_sz );
 			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		}
 		
 		/* Now close the connection */
@@ -1900,7 +2703,7 @@ int main(int argc, char *argv[])
 		CHECK( 0, clock_gettime(CLOCK_REALTIME, &now) );
 		do {
 			CHECK( 0, fd_event_timedget(myfifo, &now, ETIMEDOUT, &ev_code, NULL, (void *)&rcv_buf) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		} while (ev_code != FDEVP_CNX_MSG_RECV);
 		
 		/* Now close the connection */
@@ -1995,7 +2798,7 @@ int main(int argc, char *argv[])
 		CHECK( 0, clock_gettime(CLOCK_REALTIME, &now) );
 		do {
 			CHECK( 0, fd_event_timedget(myfifo, &now, ETIMEDOUT, &ev_code, NULL, (void *)&rcv_buf) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		} while (ev_code != FDEVP_CNX_MSG_RECV);
 		
 		/* Now close the connection */
@@ -2088,7 +2891,7 @@ int main(int argc, char *argv[])
 		CHECK( 0, clock_gettime(CLOCK_REALTIME, &now) );
 		do {
 			CHECK( 0, fd_event_timedget(myfifo, &now, ETIMEDOUT, &ev_code, NULL, (void *)&rcv_buf) );
-			free(rcv_buf);
+			fd_rcvbuf_free(rcv_buf);
 		} while (ev_code != FDEVP_CNX_MSG_RECV);
 		
 		/* Now close the connection */
@@ -2106,6 +2909,157 @@ int main(int argc, char *argv[])
 #endif /* DISABLE_SCTP */
 	
 
+	/* Additional connections (lanes) to an open peer: CER / CEA on a new connection, accepted only from the same instance of the peer */
+	{
+		struct connect_flags cf;
+		struct handshake_flags hf;
+		struct lane_flags lf;
+		struct fd_peer * ini = NULL, * rsp = NULL;
+		struct cnxctx * lane;
+		gnutls_certificate_credentials_t creds;
+		
+		/* Both peers are the local instance, so that the Origin-Host and Origin-State-Id of the CER / CEA match */
+		fd_g_config->cnf_diamid = strdup("lanes.test");
+		fd_g_config->cnf_diamid_len = strlen(fd_g_config->cnf_diamid);
+		fd_g_config->cnf_diamrlm = strdup("test");
+		fd_g_config->cnf_diamrlm_len = strlen(fd_g_config->cnf_diamrlm);
+		fd_g_config->cnf_orstateid = 42;
+		CHECK( 0, fd_msg_init() );
+		
+		CHECK( 0, fd_peer_alloc(&ini) );
+		CHECK( 0, fd_peer_alloc(&rsp) );
+		ini->p_hdr.info.pi_diamid = strdup(fd_g_config->cnf_diamid);
+		ini->p_hdr.info.pi_diamidlen = fd_g_config->cnf_diamid_len;
+		ini->p_hdr.info.config.pic_lanes = 2;
+		ini->p_hdr.info.runtime.pir_orstate = fd_g_config->cnf_orstateid;
+		ini->p_flags.pf_initiator = 1;
+		CHECK( 0, fd_fifo_new(&ini->p_events, 0) );
+		rsp->p_hdr.info.pi_diamid = strdup(fd_g_config->cnf_diamid);
+		rsp->p_hdr.info.pi_diamidlen = fd_g_config->cnf_diamid_len;
+		rsp->p_hdr.info.config.pic_lanes = 2;
+		rsp->p_hdr.info.runtime.pir_orstate = fd_g_config->cnf_orstateid;
+		rsp->p_state = STATE_OPEN;
+		CHECK( 0, fd_fifo_new(&rsp->p_events, 0) );
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		/* Clear principal connection */
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		ini->p_cnxctx = client_side;
+		rsp->p_cnxctx = server_side;
+		
+		/* Refused without Clear_Lanes */
+		lane_attempt(listener, ini, rsp, &lf);
+		CHECK( ECONNREFUSED, lf.ret );
+		CHECK( 0, rsp->p_lanes_cnt );
+		fd_cnx_destroy(lf.cnx);
+		
+		/* Refused from another instance of the peer */
+		rsp->p_hdr.info.config.pic_flags.clrlanes = 1;
+		rsp->p_hdr.info.runtime.pir_orstate = fd_g_config->cnf_orstateid + 1;
+		lane_attempt(listener, ini, rsp, &lf);
+		CHECK( ECONNREFUSED, lf.ret );
+		CHECK( 0, rsp->p_lanes_cnt );
+		fd_cnx_destroy(lf.cnx);
+		
+		/* Accepted otherwise */
+		rsp->p_hdr.info.runtime.pir_orstate = fd_g_config->cnf_orstateid;
+		lane_attempt(listener, ini, rsp, &lf);
+		CHECK( 0, lf.ret );
+		CHECK( 1, rsp->p_lanes_cnt );
+		fd_cnx_destroy(lf.cnx);
+		fd_lanes_clear(rsp);
+		
+		fd_cnx_destroy(client_side);
+		fd_cnx_destroy(server_side);
+		
+		/* TLS principal connection, the client presents client_cert: the lane (handshaked with the local certificate) is refused after its CEA */
+		rsp->p_hdr.info.config.pic_flags.clrlanes = 0;
+		memset(&hf, 0, sizeof(hf));
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_allocate_credentials (&creds), );
+		CHECK( GNUTLS_E_SUCCESS, ret );
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_trust_mem( creds, &ca, GNUTLS_X509_FMT_PEM), );
+		CHECK( 1, ret );
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_key_mem( creds, &client_cert, &client_priv, GNUTLS_X509_FMT_PEM), );
+		CHECK( GNUTLS_E_SUCCESS, ret );
+		hf.creds = creds;
+		
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		hf.cnx = client_side;
+		CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
+		CHECK( 0, fd_cnx_handshake(server_side, GNUTLS_SERVER, ALGO_HANDSHAKE_DEFAULT, NULL, NULL) );
+		CHECK( 0, pthread_join(thr, NULL) );
+		CHECK( 0, hf.ret );
+		ini->p_cnxctx = client_side;
+		rsp->p_cnxctx = server_side;
+		CHECK( 0, fd_cnx_getcred(client_side, &ini->p_hdr.info.runtime.pir_cert_list, &ini->p_hdr.info.runtime.pir_cert_list_size) );
+		CHECK( 0, fd_cnx_getcred(server_side, &rsp->p_hdr.info.runtime.pir_cert_list, &rsp->p_hdr.info.runtime.pir_cert_list_size) );
+		
+		lane_attempt(listener, ini, rsp, &lf);
+		lane = lane_established(rsp);
+		CHECK( 0, lane ? 1 : 0 );
+		CHECK( 0, rsp->p_lanes_cnt );
+		fd_cnx_destroy(lf.cnx);
+		
+		CHECK( 0, pthread_create(&thr, NULL, destroy_thr, client_side) );
+		fd_cnx_destroy(server_side);
+		CHECK( 0, pthread_join(thr, NULL) );
+		
+		/* TLS principal connection with the same certificate: the lane is accepted */
+		hf.creds = NULL;
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		hf.cnx = client_side;
+		CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
+		CHECK( 0, fd_cnx_handshake(server_side, GNUTLS_SERVER, ALGO_HANDSHAKE_DEFAULT, NULL, NULL) );
+		CHECK( 0, pthread_join(thr, NULL) );
+		CHECK( 0, hf.ret );
+		ini->p_cnxctx = client_side;
+		rsp->p_cnxctx = server_side;
+		CHECK( 0, fd_cnx_getcred(client_side, &ini->p_hdr.info.runtime.pir_cert_list, &ini->p_hdr.info.runtime.pir_cert_list_size) );
+		CHECK( 0, fd_cnx_getcred(server_side, &rsp->p_hdr.info.runtime.pir_cert_list, &rsp->p_hdr.info.runtime.pir_cert_list_size) );
+		
+		lane_attempt(listener, ini, rsp, &lf);
+		CHECK( 0, lf.ret );
+		lane = lane_established(rsp);
+		CHECK( 1, lane ? 1 : 0 );
+		CHECK( 0, fd_lanes_add(rsp, &lane) );
+		CHECK( 1, rsp->p_lanes_cnt );
+		
+		CHECK( 0, pthread_create(&thr, NULL, destroy_thr, lf.cnx) );
+		fd_lanes_clear(rsp);
+		CHECK( 0, pthread_join(thr, NULL) );
+		CHECK( 0, pthread_create(&thr, NULL, destroy_thr, client_side) );
+		fd_cnx_destroy(server_side);
+		CHECK( 0, pthread_join(thr, NULL) );
+		
+		/* Cleanup */
+		ini->p_cnxctx = NULL;
+		rsp->p_cnxctx = NULL;
+		ini->p_hdr.info.runtime.pir_cert_list = NULL;
+		rsp->p_hdr.info.runtime.pir_cert_list = NULL;
+		fd_event_destroy(&ini->p_events, free);
+		fd_event_destroy(&rsp->p_events, free);
+		CHECK( 0, fd_peer_free(&ini) );
+		CHECK( 0, fd_peer_free(&rsp) );
+		
+		gnutls_certificate_free_keys(creds);
+		gnutls_certificate_free_cas(creds);
+		gnutls_certificate_free_credentials(creds);
+	}
+	
 	/* Destroy the servers */
 	{
 		fd_cnx_destroy(listener);
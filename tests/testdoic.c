@@ -0,0 +1,179 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+
+#include "tests.h"
+
+/* The local instance is both the reporting server and the reacting client: the requests it routes carry its
+ OC-Supported-Features, its answers its overload reports, and these reports abate the requests routed next. */
+
+#define SERVER	"server.localdomain"
+#define REALM	"localdomain"
+
+static struct dict_object * acr_model = NULL;
+
+/* Route a request to the server. If it is not dropped, answer it, and return the reduction it reports (-1 if none) */
+static int loop_request(int * dropped, int * reported)
+{
+	struct msg * req = NULL, * ans;
+	struct rt_data * rtd = NULL;
+	struct fd_list * candidates;
+	struct rtd_candidate * c;
+	struct avp * avp;
+	struct msg_hdr * hdr;
+	int got_sf = 0;
+	
+	*reported = -1;
+	
+	CHECK( 0, fd_msg_new ( acr_model, 0, &req ) );
+	CHECK( 0, fd_msg_hdr ( req, &hdr ) );
+	hdr->msg_appl = 3;
+	CHECK( 0, fd_rtd_init(&rtd) );
+	CHECK( 0, fd_rtd_candidate_add(rtd, SERVER, strlen(SERVER), REALM, strlen(REALM)) );
+	fd_rtd_candidate_extract(rtd, &candidates, FD_SCORE_INI);
+	c = (struct rtd_candidate *)candidates->next;
+	c->score = FD_SCORE_REALM;
+	
+	/* The client side */
+	CHECK( 0, fd_doic_request(req, candidates) );
+	*dropped = (c->score < 0);
+	fd_rtd_free(&rtd);
+	if (*dropped) {
+		CHECK( 0, fd_msg_free(req) );
+		return 0;
+	}
+	
+	/* The server side */
+	CHECK( 0, fd_msg_new_answer_from_req ( fd_g_config->cnf_dict, &req, 0 ) );
+	ans = req;
+	CHECK( 0, fd_msg_add_origin ( ans, 0 ) );
+	CHECK( 0, fd_msg_answ_getq ( ans, &req ) );
+	CHECK( 0, fd_doic_answer_out(ans, req) );
+	
+	CHECK( 0, fd_msg_browse ( ans, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+	while (avp) {
+		struct avp_hdr * ahdr;
+		CHECK( 0, fd_msg_avp_hdr ( avp, &ahdr ) );
+		if (ahdr->avp_code == AC_OC_SUPPORTED_FEATURES)
+			got_sf = 1;
+		if (ahdr->avp_code == AC_OC_OLR) {
+			struct avp * rp;
+			CHECK( 0, fd_msg_browse ( avp, MSG_BRW_FIRST_CHILD, &rp, NULL) );
+			while (rp) {
+				struct avp_hdr * rhdr;
+				CHECK( 0, fd_msg_avp_hdr ( rp, &rhdr ) );
+				if (rhdr->avp_code == AC_OC_REDUCTION_PERCENTAGE)
+					*reported = rhdr->avp_value->u32;
+				CHECK( 0, fd_msg_browse ( rp, MSG_BRW_NEXT, &rp, NULL) );
+			}
+		}
+		CHECK( 0, fd_msg_browse ( avp, MSG_BRW_NEXT, &avp, NULL) );
+	}
+	CHECK( 1, got_sf );
+	
+	/* Back to the client */
+	CHECK( 0, fd_doic_answer_in(ans) );
+	CHECK( 0, fd_msg_free(ans) );
+	return 0;
+}
+
+/* Main test routine */
+int main(int argc, char *argv[])
+{
+	int i, dropped, reported, nb_dropped;
+	
+	/* First, initialize the daemon modules */
+	INIT_FD();
+	fd_g_config->cnf_diamid = strdup(SERVER);
+	fd_g_config->cnf_diamid_len = strlen(SERVER);
+	fd_g_config->cnf_diamrlm = strdup(REALM);
+	fd_g_config->cnf_diamrlm_len = strlen(REALM);
+	fd_g_config->cnf_flags.doic = 1;
+	fd_g_config->cnf_doic_depth = 10;
+	CHECK( 0, fd_queues_init() );
+	CHECK( 0, fd_msg_init() );
+	CHECK( 0, fd_doic_init() );
+	CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Accounting-Request", &acr_model, ENOENT ) );
+	
+	/* No overload: nothing is reported nor dropped */
+	for (i = 0; i < 100; i++) {
+		CHECK( 0, loop_request(&dropped, &reported) );
+		CHECK( 0, dropped );
+		CHECK( -1, reported );
+	}
+	
+	/* Induce an overload: twice the configured depth waits for dispatch */
+	for (i = 0; i < 2 * fd_g_config->cnf_doic_depth; i++) {
+		void * item = &i;
+		CHECK( 0, fd_fifo_post_noblock(fd_g_local, &item) );
+	}
+	usleep(1100000);
+	
+	/* The first answer reports it, and the client drops the requested share of the next requests */
+	CHECK( 0, loop_request(&dropped, &reported) );
+	CHECK( 0, dropped );
+	CHECK( 90, reported );
+	nb_dropped = 0;
+	for (i = 0; i < 1000; i++) {
+		CHECK( 0, loop_request(&dropped, &reported) );
+		nb_dropped += dropped;
+		if (!dropped) {
+			CHECK( 90, reported );
+		}
+	}
+	TRACE_DEBUG(INFO, "%d requests out of 1000 dropped at 90%% reduction", nb_dropped);
+	CHECK( 1, (nb_dropped > 850) && (nb_dropped < 950) ? 1 : 0 );
+	
+	/* The overload ends: the next answer reports it, and the traffic is back */
+	for (i = 0; i < 2 * fd_g_config->cnf_doic_depth; i++) {
+		void * item;
+		CHECK( 0, fd_fifo_tryget(fd_g_local, &item) );
+	}
+	usleep(1100000);
+	do {
+		CHECK( 0, loop_request(&dropped, &reported) );
+	} while (dropped);
+	CHECK( 0, reported );
+	for (i = 0; i < 100; i++) {
+		CHECK( 0, loop_request(&dropped, &reported) );
+		CHECK( 0, dropped );
+		CHECK( 0, reported );
+	}
+	
+	fd_doic_fini();
+	
+	/* That's all for the tests yet */
+	PASSTEST();
+} 
@@ -186,6 +186,30 @@ static void * test_fct2(void * data)
 	return NULL;
 }
 
+/* Post an item with a priority, to be threaded */
+struct prio_data {
+	struct fifo     * queue; /* pointer to the queue */
+	int		  prio;  /* priority of the item */
+	int		* item;  /* the item to post */
+};
+static void * post_prio_fct(void * data)
+{
+	struct prio_data * pd = (struct prio_data *) data;
+	
+	CHECK( 0, fd_fifo_post_prio(pd->queue, (void **)&pd->item, pd->prio) );
+	
+	return NULL;
+}
+
+/* Wait up to 1s for the queue to reach a length */
+static int wait_length(struct fifo * queue, int len)
+{
+	int i;
+	for (i = 0; (i < 100) && (fd_fifo_length(queue) != len); i++)
+		usleep(10000);
+	return fd_fifo_length(queue);
+}
+
 
 /* Main test routine */
 int main(int argc, char *argv[])
@@ -283,6 +307,117 @@ int main(int argc, char *argv[])
 		CHECK( 0, fd_fifo_del(&queue) );
 	}
 	
+	/* Priority classes */
+	{
+		struct fifo * queue = NULL;
+		struct msg * msg  = NULL;
+		int * item, i, prio;
+		int prios[7] = { 0, 1, 0, 2, 1, 0, 2 };
+		int order[7] = { 3, 6, 1, 4, 0, 2, 5 };
+		
+		/* The base protocol messages are in the control class, the others default to normal */
+		CHECK( 0, fd_msg_prio_get(msg1, &prio) );
+		CHECK( MSG_PRIO_NORMAL, prio );
+		CHECK( 0, fd_msg_prio_get(msg2, &prio) );
+		CHECK( MSG_PRIO_CONTROL, prio );
+		CHECK( EINVAL, fd_msg_prio_set(msg1, MSG_PRIO_CONTROL) );
+		CHECK( 0, fd_msg_prio_set(msg1, MSG_PRIO_HIGH) );
+		CHECK( 0, fd_msg_prio_get(msg1, &prio) );
+		CHECK( MSG_PRIO_HIGH, prio );
+		
+		/* Items are delivered by decreasing priority, and in order within a priority */
+		CHECK( 0, fd_fifo_new(&queue, 0) );
+		for (i = 0; i < 7; i++) {
+			CHECK( 1, (item = malloc(sizeof(int))) ? 1 : 0 );
+			*item = i;
+			CHECK( 0, fd_fifo_post_prio(queue, (void **)&item, prios[i]) );
+		}
+		CHECK( 7, fd_fifo_length(queue) );
+		for (i = 0; i < 7; i++) {
+			CHECK( 0, fd_fifo_tryget(queue, &item) );
+			CHECK( order[i], *item );
+			free(item);
+		}
+		
+		/* Prioritized items overtake a full queue, but only within the room reserved above its maximum (2 for 4) */
+		CHECK( 0, fd_fifo_set_max(queue, 4) );
+		for (i = 0; i < 4; i++) {
+			CHECK( 1, (item = malloc(sizeof(int))) ? 1 : 0 );
+			*item = i;
+			CHECK( 0, fd_fifo_trypost(queue, (void **)&item, 0) );
+		}
+		CHECK( 1, (item = malloc(sizeof(int))) ? 1 : 0 );
+		*item = 10;
+		CHECK( EWOULDBLOCK, fd_fifo_trypost(queue, (void **)&item, 0) );
+		CHECK( 0, fd_fifo_trypost(queue, (void **)&item, 1) );
+		CHECK( 1, (item = malloc(sizeof(int))) ? 1 : 0 );
+		*item = 11;
+		CHECK( 0, fd_fifo_post_prio(queue, (void **)&item, 2) );
+		CHECK( 1, (item = malloc(sizeof(int))) ? 1 : 0 );
+		*item = 12;
+		CHECK( EWOULDBLOCK, fd_fifo_trypost(queue, (void **)&item, 2) );
+		CHECK( 6, fd_fifo_length(queue) );
+		
+		/* A blocked prioritized post gets the first free place, even with a normal post waiting before it */
+		{
+			struct prio_data pd_n, pd_p;
+			pthread_t th_n, th_p;
+			
+			pd_p.queue = queue;
+			pd_p.prio = 1;
+			pd_p.item = item;
+			pd_n.queue = queue;
+			pd_n.prio = 0;
+			CHECK( 1, (pd_n.item = malloc(sizeof(int))) ? 1 : 0 );
+			*pd_n.item = 4;
+			CHECK( 0, pthread_create( &th_n, NULL, post_prio_fct, &pd_n ) );
+			usleep(50000);
+			CHECK( 0, pthread_create( &th_p, NULL, post_prio_fct, &pd_p ) );
+			usleep(50000);
+			CHECK( 6, fd_fifo_length(queue) );
+			
+			/* One item pulled: the prioritized post completes, the normal one still waits */
+			CHECK( 0, fd_fifo_tryget(queue, &item) );
+			CHECK( 11, *item );
+			free(item);
+			CHECK( 0, pthread_join( th_p, NULL ) );
+			CHECK( 6, fd_fifo_length(queue) );
+			usleep(50000);
+			CHECK( 6, fd_fifo_length(queue) );
+			
+			/* Below the maximum, the normal post completes */
+			for (i = 0; i < 3; i++) {
+				CHECK( 0, fd_fifo_tryget(queue, &item) );
+				free(item);
+			}
+			CHECK( 4, wait_length(queue, 4) );
+			CHECK( 0, pthread_join( th_n, NULL ) );
+		}
+		for (i = 0; i < 4; i++) {
+			CHECK( 0, fd_fifo_tryget(queue, &item) );
+			CHECK( i + 1, *item );
+			free(item);
+		}
+		CHECK( 0, fd_fifo_set_max(queue, 0) );
+		
+		/* The same, with messages */
+		msg = msg3;
+		CHECK( 0, fd_fifo_post_prio(queue, (void **)&msg, 0) );
+		msg = msg1;
+		CHECK( 0, fd_fifo_post_prio(queue, (void **)&msg, MSG_PRIO_HIGH) );
+		msg = msg2;
+		CHECK( 0, fd_fifo_post_prio(queue, (void **)&msg, MSG_PRIO_CONTROL) );
+		CHECK( 0, fd_fifo_tryget(queue, &msg) );
+		CHECK( msg2, msg );
+		CHECK( 0, fd_fifo_tryget(queue, &msg) );
+		CHECK( msg1, msg );
+		CHECK( 0, fd_fifo_tryget(queue, &msg) );
+		CHECK( msg3, msg );
+		CHECK( 0, fd_msg_prio_set(msg1, MSG_PRIO_NORMAL) );
+		
+		CHECK( 0, fd_fifo_del(&queue) );
+	}
+	
 	/* Test robustness, ensure no messages are lost */
 	{
 #define NBR_MSG		200
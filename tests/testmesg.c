@@ -35,6 +35,12 @@
 
 #include "tests.h"
 
+/* Called when the routing data does not use the candidates strings anymore */
+static void rtd_release_cb(void * ref)
+{
+	(*(int *)ref)++;
+}
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -1612,6 +1618,43 @@ int main(int argc, char *argv[])
 		CHECK( 0, strcmp( buf4, TEST_IP4 ) );
 	}
 	
+	/* Check the routing data candidates set from an array */
+	{
+		struct rt_data * rtd = NULL;
+		struct rtd_candidate src[3];
+		struct fd_list * candidates, * li;
+		int released = 0, i;
+		
+		memset(src, 0, sizeof(src));
+		src[0].diamid = "a.example.net"; src[0].diamidlen = strlen(src[0].diamid);
+		src[1].diamid = "b.example.net"; src[1].diamidlen = strlen(src[1].diamid);
+		src[1].realm  = "example.net";   src[1].realmlen  = strlen(src[1].realm);
+		src[2].diamid = "c.example.net"; src[2].diamidlen = strlen(src[2].diamid);
+		
+		CHECK( 0, fd_rtd_init(&rtd) );
+		CHECK( 0, fd_rtd_candidate_set(rtd, src, 3, rtd_release_cb, &released) );
+		CHECK( EINVAL, fd_rtd_candidate_set(rtd, src, 3, rtd_release_cb, &released) );
+		
+		/* The strings are not copied; the list is ordered and can be mixed with added entries */
+		fd_rtd_candidate_del(rtd, (os0_t)"B.Example.Net", strlen("B.Example.Net"));
+		CHECK( 0, fd_rtd_candidate_add(rtd, "bb.example.net", strlen("bb.example.net"), NULL, 0) );
+		fd_rtd_candidate_extract(rtd, &candidates, 0);
+		i = 0;
+		for (li = candidates->next; li != candidates; li = li->next, i++) {
+			struct rtd_candidate * c = (struct rtd_candidate *)li->o;
+			switch (i) {
+				case 0: CHECK( 1, c->diamid == src[0].diamid ? 1 : 0 ); break;
+				case 1: CHECK( 1, c->diamid == src[2].diamid ? 1 : 0 ); break;
+				case 2: CHECK( 0, strcmp(c->diamid, "bb.example.net") ); break; /* fd_os_cmp orders by length first */
+			}
+		}
+		CHECK( 3, i );
+		
+		CHECK( 0, released );
+		fd_rtd_free(&rtd);
+		CHECK( 1, released );
+	}
+	
 	/* That's all for the tests yet */
 	PASSTEST();
 } 
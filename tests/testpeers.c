@@ -38,6 +38,58 @@
 const char * ids[] = { "b11", "b14", "b1", "b4" };
 #define DomainName "localdomain"
 
+/* Number of peers and of lookups in the peer lookup test */
+#define NB_LOOKUP_PEERS	500
+#define NB_LOOKUP	1000000
+
+/* Number of requests in flight for the sent requests cache test, unless -p is given */
+#define DEFAULT_NUMBER_OF_SENTREQ 100000
+
+static void display_result(int nr, struct timespec * start, struct timespec * end, char * fct, char * type, char *op)
+{
+	long double dur = (long double)end->tv_sec + (long double)end->tv_nsec/1000000000;
+	dur -= (long double)start->tv_sec + (long double)start->tv_nsec/1000000000;
+	long double thrp = (long double)nr / dur;
+	printf("%-19s: %d %-8s %-7s in %.6LFs (%.1LFmsg/s)\n", fct, nr, type, op, dur, thrp);
+}
+
+/* Count the requests expired by the timeouts thread */
+static int expired_cnt = 0;
+static pthread_mutex_t expired_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t expired_cnd = PTHREAD_COND_INITIALIZER;
+
+static void expirecb(void * data, DiamId_t sentto, size_t senttolen, struct msg ** req)
+{
+	CHECK( 0, pthread_mutex_lock(&expired_mtx) );
+	expired_cnt++;
+	CHECK( 0, pthread_cond_signal(&expired_cnd) );
+	CHECK( 0, pthread_mutex_unlock(&expired_mtx) );
+	CHECK( 0, fd_msg_free(*req) );
+	*req = NULL;
+}
+
+/* Expiry callback that is still running when the peer is freed: it waits for the main thread, then checks the identity it received */
+static int slow_state = 0; /* 1: the callback is called, 2: the peer is freed, 3: the callback is done */
+static int slow_ok = 0;
+
+static void expirecb_slow(void * data, DiamId_t sentto, size_t senttolen, struct msg ** req)
+{
+	char * expected = data;
+	
+	CHECK( 0, pthread_mutex_lock(&expired_mtx) );
+	slow_state = 1;
+	CHECK( 0, pthread_cond_broadcast(&expired_cnd) );
+	while (slow_state < 2) {
+		CHECK( 0, pthread_cond_wait(&expired_cnd, &expired_mtx) );
+	}
+	slow_ok = (senttolen == strlen(expected)) && !memcmp(sentto, expected, senttolen);
+	slow_state = 3;
+	CHECK( 0, pthread_cond_broadcast(&expired_cnd) );
+	CHECK( 0, pthread_mutex_unlock(&expired_mtx) );
+	CHECK( 0, fd_msg_free(*req) );
+	*req = NULL;
+}
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -69,8 +121,342 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 1, &p));
 			CHECK( 0, strcmp((char *)locid, p->info.pi_diamid));
 		}
+		
+		/* The case is only ignored on request */
+		snprintf(locid, sizeof(locid), "B11.LocalDomain");
+		CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 0, &p));
+		CHECK( NULL, p );
+		CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 1, &p));
+		CHECK( 1, p ? 1 : 0 );
+		CHECK( 0, strcmp("b11." DomainName, p->info.pi_diamid));
+		
+		/* A prefix of an id is not a match */
+		snprintf(locid, sizeof(locid), "b1");
+		CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 1, &p));
+		CHECK( NULL, p );
+	}
+	
+	/* Lookups by Diameter Identity with many peers configured */
+	{
+		int i;
+		char locid[255];
+		struct peer_info inf;
+		struct peer_hdr *p;
+		struct timespec start, end;
+		
+		memset(&inf, 0, sizeof(inf));
+		inf.pi_diamid = (char *)locid;
+		for (i=0; i < NB_LOOKUP_PEERS; i++) {
+			snprintf(locid, sizeof(locid), "peer%d.lookup." DomainName, i);
+			CHECK( 0, fd_peer_add(&inf, __FILE__, NULL, NULL));
+		}
+		
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (i=0; i < NB_LOOKUP; i++) {
+			int l = snprintf(locid, sizeof(locid), "peer%d.lookup." DomainName, (i * 7) % NB_LOOKUP_PEERS);
+			CHECK( 0, fd_peer_getbyid((DiamId_t)locid, l, i % 2, &p));
+			if (!p || strcmp(locid, p->info.pi_diamid)) {
+				CHECK( 0, 1 );
+			}
+		}
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		display_result(NB_LOOKUP, &start, &end, "fd_peer_getbyid", "lookups", "done");
 	}
 	
+	/* Test the sent requests cache with a large number of requests in flight */
+	{
+		struct fd_peer * peer = NULL;
+		struct dict_object * dwr_model = NULL;
+		struct msg ** reqs;
+		struct msg * m;
+		struct msg_hdr * hdr;
+		struct timespec start, end;
+		uint32_t hbh;
+		long to_receive, window;
+		int nb = test_parameter ?: DEFAULT_NUMBER_OF_SENTREQ;
+		int i;
+		
+		CHECK( 0, fd_peer_alloc(&peer) );
+		CHECK( 0, fd_dict_search( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Device-Watchdog-Request", &dwr_model, ENOENT ) );
+		
+		reqs = calloc(nb, sizeof(struct msg *));
+		CHECK( 1, reqs ? 1 : 0 );
+		for (i = 0; i < nb; i++) {
+			CHECK( 0, fd_msg_new( dwr_model, 0, &reqs[i] ) );
+		}
+		
+		/* Store all requests with consecutive hop-by-hop ids, as the out thread does */
+		hbh = peer->p_hbh;
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (i = 0; i < nb; i++) {
+			m = reqs[i];
+			if (fd_msg_hdr(m, &hdr))
+				break;
+			hdr->msg_hbhid = hbh + i;
+			if (fd_p_sr_store(&peer->p_sr, &m, &hdr->msg_hbhid, i))
+				break;
+		}
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		CHECK( nb, i );
+		display_result(nb, &start, &end, "fd_p_sr_store", "requests", "stored");
+		
+		CHECK( 0, fd_peer_get_load_pending((struct peer_hdr *)peer, &to_receive, NULL) );
+		CHECK( nb, to_receive );
+		
+		/* A hop-by-hop id cannot be used twice */
+		CHECK( 0, fd_msg_new( dwr_model, 0, &m ) );
+		CHECK( 0, fd_msg_hdr(m, &hdr) );
+		hdr->msg_hbhid = hbh + nb / 2;
+		CHECK( EINVAL, fd_p_sr_store(&peer->p_sr, &m, &hdr->msg_hbhid, 0) );
+		CHECK( 0, fd_msg_free(m) );
+		
+		/* Unknown hop-by-hop id */
+		CHECK( 0, fd_p_sr_fetch(&peer->p_sr, hbh + nb, &m) );
+		CHECK( 1, m ? 0 : 1 );
+		
+		/* Retrieve half of the requests in reverse order, the original hop-by-hop id must be restored */
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (i = nb - 1; i >= nb / 2; i--) {
+			if (fd_p_sr_fetch(&peer->p_sr, hbh + i, &m) || (m != reqs[i]))
+				break;
+			if (fd_msg_hdr(m, &hdr) || (hdr->msg_hbhid != i))
+				break;
+		}
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		CHECK( nb / 2 - 1, i );
+		display_result(nb - nb / 2, &start, &end, "fd_p_sr_fetch", "requests", "fetched");
+		
+		for (i = nb / 2; i < nb; i++) {
+			CHECK( 0, fd_msg_free(reqs[i]) );
+		}
+		
+		CHECK( 0, fd_peer_get_load_pending((struct peer_hdr *)peer, &to_receive, NULL) );
+		CHECK( nb / 2, to_receive );
+		
+		/* The remaining requests are not routable, they are freed on disconnection */
+		fd_p_sr_on_disconnect(&peer->p_sr);
+		CHECK( 0, fd_peer_get_load_pending((struct peer_hdr *)peer, &to_receive, NULL) );
+		CHECK( 0, to_receive );
+		
+		/* Now with an answer timeout: the requests that are not answered in time are passed to the expirecb */
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start.tv_nsec += 100000000; /* 100ms */
+		if (start.tv_nsec >= 1000000000) {
+			start.tv_nsec -= 1000000000;
+			start.tv_sec += 1;
+		}
+		for (i = 0; i < 1000; i++) {
+			CHECK( 0, fd_msg_new( dwr_model, 0, &reqs[i] ) );
+			CHECK( 0, fd_msg_anscb_associate( reqs[i], (void *)expirecb, NULL, expirecb, &start ) );
+			m = reqs[i];
+			CHECK( 0, fd_msg_hdr(m, &hdr) );
+			hdr->msg_hbhid = hbh + i;
+			CHECK( 0, fd_p_sr_store(&peer->p_sr, &m, &hdr->msg_hbhid, i) );
+		}
+		
+		/* Answer the first half before the timeout */
+		for (i = 0; i < 500; i++) {
+			CHECK( 0, fd_p_sr_fetch(&peer->p_sr, hbh + i, &m) );
+			CHECK( reqs[i], m );
+			CHECK( 0, fd_msg_free(m) );
+		}
+		
+		/* Wait for the other half to expire */
+		CHECK( 0, pthread_mutex_lock(&expired_mtx) );
+		start.tv_sec += 10;
+		while (expired_cnt < 500) {
+			CHECK( 0, pthread_cond_timedwait(&expired_cnd, &expired_mtx, &start) );
+		}
+		CHECK( 0, pthread_mutex_unlock(&expired_mtx) );
+		CHECK( 500, expired_cnt );
+		CHECK( 0, fd_peer_get_load_pending((struct peer_hdr *)peer, &to_receive, NULL) );
+		CHECK( 0, to_receive );
+		CHECK( 0, fd_peer_get_window((struct peer_hdr *)peer, &window, NULL) );
+		CHECK( 0, window );
+		
+		free(reqs);
+		CHECK( 0, fd_peer_free(&peer) );
+		
+		/* With PeerWindow, the expired requests halve the window, and the answers grow it back */
+		fd_g_config->cnf_peer_window = 64;
+		CHECK( 0, fd_peer_alloc(&peer) );
+		CHECK( 0, fd_peer_get_window((struct peer_hdr *)peer, &window, &to_receive) );
+		CHECK( 64, window );
+		CHECK( 0, to_receive );
+		reqs = calloc(64, sizeof(struct msg *));
+		CHECK( 1, reqs ? 1 : 0 );
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start.tv_nsec += 100000000; /* 100ms */
+		if (start.tv_nsec >= 1000000000) {
+			start.tv_nsec -= 1000000000;
+			start.tv_sec += 1;
+		}
+		expired_cnt = 0;
+		for (i = 0; i < 64; i++) {
+			CHECK( 0, fd_msg_new( dwr_model, 0, &reqs[i] ) );
+			CHECK( 0, fd_msg_anscb_associate( reqs[i], (void *)expirecb, NULL, expirecb, &start ) );
+			m = reqs[i];
+			CHECK( 0, fd_msg_hdr(m, &hdr) );
+			hdr->msg_hbhid = hbh + i;
+			CHECK( 0, fd_p_sr_store(&peer->p_sr, &m, &hdr->msg_hbhid, i) );
+		}
+		CHECK( 0, fd_peer_get_window((struct peer_hdr *)peer, &window, &to_receive) );
+		CHECK( 64, window );
+		CHECK( 64, to_receive );
+		
+		/* A burst of timeouts only halves the window once */
+		CHECK( 0, pthread_mutex_lock(&expired_mtx) );
+		start.tv_sec += 10;
+		while (expired_cnt < 64) {
+			CHECK( 0, pthread_cond_timedwait(&expired_cnd, &expired_mtx, &start) );
+		}
+		CHECK( 0, pthread_mutex_unlock(&expired_mtx) );
+		CHECK( 0, fd_peer_get_window((struct peer_hdr *)peer, &window, &to_receive) );
+		CHECK( 32, window );
+		CHECK( 0, to_receive );
+		
+		/* One more request in flight after each window answered */
+		for (i = 0; i < 32 + 33; i++) {
+			CHECK( 0, fd_msg_new( dwr_model, 0, &m ) );
+			CHECK( 0, fd_msg_hdr(m, &hdr) );
+			hdr->msg_hbhid = hbh + i;
+			CHECK( 0, fd_p_sr_store(&peer->p_sr, &m, &hdr->msg_hbhid, i) );
+			CHECK( 0, fd_p_sr_fetch(&peer->p_sr, hbh + i, &m) );
+			CHECK( 0, fd_msg_free(m) );
+		}
+		CHECK( 0, fd_peer_get_window((struct peer_hdr *)peer, &window, NULL) );
+		CHECK( 34, window );
+		
+		/* The slots taken when a request is routed count until it is sent, so no request goes beyond PeerWindow */
+		fd_g_config->cnf_peer_window = 2;
+		CHECK( 0, fd_p_sr_reserve(&peer->p_sr) );
+		CHECK( 0, fd_p_sr_reserve(&peer->p_sr) );
+		CHECK( EBUSY, fd_p_sr_reserve(&peer->p_sr) );
+		CHECK( 0, fd_msg_new( dwr_model, 0, &m ) );
+		CHECK( 0, fd_msg_hdr(m, &hdr) );
+		hdr->msg_appl = 3;
+		hdr->msg_hbhid = hbh;
+		CHECK( 0, fd_p_sr_store(&peer->p_sr, &m, &hdr->msg_hbhid, 0) );
+		CHECK( 0, fd_peer_get_window((struct peer_hdr *)peer, NULL, &to_receive) );
+		CHECK( 1, to_receive );
+		CHECK( EBUSY, fd_p_sr_reserve(&peer->p_sr) );
+		
+		/* A request dropped before it is sent gives its slot back */
+		CHECK( 0, fd_msg_new( dwr_model, 0, &m ) );
+		CHECK( 0, fd_msg_hdr(m, &hdr) );
+		hdr->msg_appl = 3;
+		fd_p_sr_unreserve(&peer->p_sr, m);
+		CHECK( 0, fd_msg_free(m) );
+		CHECK( 0, fd_p_sr_reserve(&peer->p_sr) );
+		CHECK( EBUSY, fd_p_sr_reserve(&peer->p_sr) );
+		
+		/* And so does the answer of a request in flight */
+		CHECK( 0, fd_p_sr_fetch(&peer->p_sr, hbh, &m) );
+		CHECK( 0, fd_msg_free(m) );
+		CHECK( 0, fd_p_sr_reserve(&peer->p_sr) );
+		CHECK( EBUSY, fd_p_sr_reserve(&peer->p_sr) );
+		fd_g_config->cnf_peer_window = 0;
+		
+		free(reqs);
+		CHECK( 0, fd_peer_free(&peer) );
+		
+		/* The expirecb gets the identity of the peer even if the peer is freed while the callback runs */
+		CHECK( 0, fd_peer_alloc(&peer) );
+		peer->p_hdr.info.pi_diamid = strdup("expiry.test");
+		peer->p_hdr.info.pi_diamidlen = strlen(peer->p_hdr.info.pi_diamid);
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start.tv_nsec += 20000000; /* 20ms */
+		if (start.tv_nsec >= 1000000000) {
+			start.tv_nsec -= 1000000000;
+			start.tv_sec += 1;
+		}
+		CHECK( 0, fd_msg_new( dwr_model, 0, &m ) );
+		CHECK( 0, fd_msg_anscb_associate( m, (void *)expirecb, "expiry.test", expirecb_slow, &start ) );
+		CHECK( 0, fd_msg_hdr(m, &hdr) );
+		hdr->msg_hbhid = hbh;
+		CHECK( 0, fd_p_sr_store(&peer->p_sr, &m, &hdr->msg_hbhid, 0) );
+		
+		CHECK( 0, pthread_mutex_lock(&expired_mtx) );
+		while (slow_state < 1) {
+			CHECK( 0, pthread_cond_wait(&expired_cnd, &expired_mtx) );
+		}
+		/* Trash the identity before freeing, so that a callback reading the peer would see it */
+		memset(peer->p_hdr.info.pi_diamid, 'x', peer->p_hdr.info.pi_diamidlen);
+		CHECK( 0, fd_peer_free(&peer) );
+		slow_state = 2;
+		CHECK( 0, pthread_cond_broadcast(&expired_cnd) );
+		while (slow_state < 3) {
+			CHECK( 0, pthread_cond_wait(&expired_cnd, &expired_mtx) );
+		}
+		CHECK( 0, pthread_mutex_unlock(&expired_mtx) );
+		CHECK( 1, slow_ok );
+		
+		CHECK( 0, fd_p_sr_fini() );
+	}
+	
+	/* Fair queuing of the received messages between two peers of weights 1 and 3 */
+	{
+		struct fd_peer *pa = NULL, *pb = NULL;
+		struct dict_object * dwr, * oh;
+		char pad[200];
+		int i, na = 0, nb = 0;
+		
+		fd_g_config->cnf_qpeer_limit = 100;
+		CHECK( 0, fd_queues_init() );
+		CHECK( 0, fd_peer_alloc(&pa) );
+		CHECK( 0, fd_peer_alloc(&pb) );
+		pb->p_hdr.info.config.pic_weight = 3;
+		CHECK( 0, fd_dict_search(fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Device-Watchdog-Request", &dwr, ENOENT) );
+		CHECK( 0, fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Origin-Host", &oh, ENOENT) );
+		memset(pad, 'x', sizeof(pad));
+		
+		/* Peer A floods first, then peer B */
+		for (i = 0; i < 200; i++) {
+			struct msg * m;
+			struct avp * avp;
+			union avp_value val;
+			CHECK( 0, fd_msg_new(dwr, 0, &m) );
+			CHECK( 0, fd_msg_avp_new(oh, 0, &avp) );
+			val.os.data = (uint8_t *)pad;
+			val.os.len = sizeof(pad);
+			CHECK( 0, fd_msg_avp_setvalue(avp, &val) );
+			CHECK( 0, fd_msg_avp_add(m, MSG_BRW_LAST_CHILD, avp) );
+			CHECK( 0, fd_msg_update_length(m) );
+			CHECK( 0, fd_msg_source_set(m, (i < 100) ? "a" : "b", 1) );
+			CHECK( 0, fd_queues_post_in((i < 100) ? pa : pb, &m) );
+		}
+		CHECK( 200, fd_fifo_length(fd_g_incoming) );
+		
+		/* In the first half, B gets routed about 3 times more than A */
+		for (i = 0; i < 100; i++) {
+			void * item;
+			struct msg * m;
+			DiamId_t src;
+			CHECK( 0, fd_fifo_tryget(fd_g_incoming, &item) );
+			CHECK( 0, fd_queues_get_in(item, &m) );
+			CHECK( 1, m ? 1 : 0 );
+			CHECK( 0, fd_msg_source_get(m, &src, NULL) );
+			if (src[0] == 'a')
+				na++;
+			else
+				nb++;
+			CHECK( 0, fd_msg_free(m) );
+		}
+		CHECK( 1, (nb > 2 * na) && (nb < 4 * na) ? 1 : 0 );
+		
+		/* The backlogs are dropped with the peers */
+		CHECK( 0, fd_peer_free(&pa) );
+		CHECK( 0, fd_peer_free(&pb) );
+		while (fd_fifo_length(fd_g_incoming)) {
+			void * item;
+			struct msg * m;
+			CHECK( 0, fd_fifo_tryget(fd_g_incoming, &item) );
+			CHECK( 0, fd_queues_get_in(item, &m) );
+			CHECK( 1, m ? 0 : 1 );
+		}
+		CHECK( 0, fd_queues_fini(&fd_g_incoming) );
+		fd_g_config->cnf_qpeer_limit = 0;
+	}
 	
 	/* That's all for the tests yet */
 	PASSTEST();
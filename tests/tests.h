@@ -226,8 +226,9 @@ static inline void test_init(int argc, char * argv[], char *fname)
 	/* Add definitions of the base protocol */
 	CHECK( 0, fd_dict_base_protocol(fd_g_config->cnf_dict) );
 	
-	/* Initialize only the sessions */
+	/* Initialize only the sessions and the peers index */
 	CHECK( 0, fd_sess_start()  );
+	CHECK( 0, fd_peer_init()   );
 	
 	return;
 }
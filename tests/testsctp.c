@@ -137,6 +137,59 @@ redo2:
 	CHECK( 0, memcmp(buf1, buf2, sz) );
 	free(buf2); buf2 = NULL;
 	
+	/* The messages of a session (non-0 hint in fd_cnx_sendv_sess) stay on one stream, different sessions use different streams */
+	{
+		struct cnxctx * full, raw;
+		struct iovec iovs[9];
+		uint32_t sess[9] = { 1, 2, 1, 3, 2, 1, 3, 0, 0 }; /* the hashes of 3 Session-Ids, and 2 messages without session */
+		char msgs[9][8];
+		int strs[4] = { -1, -1, -1, -1 }; /* the stream seen for each session */
+		uint16_t nosess[2];
+		int i, n = 0;
+		
+		full = fd_cnx_cli_connect_sctp(0, TEST_PORT, &eps, NULL);
+		CHECK( 1, full ? 1 : 0 );
+		memset(&raw, 0, sizeof(raw));
+		raw.cc_socket = accept(sock, NULL, NULL);
+		CHECK( 1, (raw.cc_socket > 0) ? 1 : 0 );
+		
+		/* The streams are used once the peer is open */
+		CHECK( 0, fd_cnx_unordered_delivery(full, 1) );
+		for (i = 0; i < 9; i++) {
+			snprintf(msgs[i], sizeof(msgs[i]), "msg%d", i);
+			iovs[i].iov_base = msgs[i];
+			iovs[i].iov_len  = sizeof(msgs[i]);
+		}
+		CHECK( 0, fd_cnx_sendv_sess(full, iovs, 9, sess) );
+		
+		/* SCTP keeps the order inside a stream only, so the messages are identified by their content */
+		while (n < 9) {
+			CHECK( 0, fd_sctp_recvmeta(&raw, &str, (uint8_t **)&buf2, &sz, &ev) );
+			if (ev == FDEVP_CNX_EP_CHANGE)
+				continue;
+			CHECK( FDEVP_CNX_MSG_RECV, ev);
+			CHECK( sizeof(msgs[0]), sz );
+			i = buf2[3] - '0';
+			CHECK( 0, memcmp(msgs[i], buf2, sz) );
+			if (sess[i]) {
+				if (strs[sess[i]] < 0)
+					strs[sess[i]] = str;
+				CHECK( strs[sess[i]], str );
+			} else {
+				nosess[i - 7] = str;
+			}
+			free(buf2); buf2 = NULL;
+			n++;
+		}
+		CHECK( 1, (strs[1] != strs[2]) && (strs[1] != strs[3]) && (strs[2] != strs[3]) ? 1 : 0 );
+		
+		/* The messages without session are spread over the streams */
+		CHECK( 1, (nosess[0] != nosess[1]) ? 1 : 0 );
+		
+		fd_cnx_destroy(full);
+		close(raw.cc_socket);
+	}
+	
 	/* That's all for the tests yet */
 	PASSTEST();
 #endif /* DISABLE_SCTP */
@@ -0,0 +1,258 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+
+#include "tests.h"
+
+/* With SessionAffinity, the messages of a session are dispatched in order, including when an idle shard
+ takes over the sessions of a loaded one. */
+
+#define SERVER	"server.localdomain"
+#define REALM	"localdomain"
+
+#define NB_SHARDS	2
+#define NB_BUCKETS	1024	/* DISP_SHARD_BUCKETS */
+#define NB_MOVED	8	/* sessions expected to be taken over, up to DISP_SHARD_STEAL */
+#define NB_SESS		(NB_MOVED + 2)
+#define HOG		NB_MOVED	/* the slow session that keeps its shard busy */
+#define IDLE		(NB_MOVED + 1)	/* a session of the other shard */
+#define HOG_MSGS	20
+
+static struct dict_object * cmd_model = NULL;
+static struct dict_object * seq_model = NULL;
+static struct dict_object * sid_model = NULL;
+static struct dict_object * dh_model = NULL;
+static struct dict_object * dr_model = NULL;
+
+static char sids[NB_SESS][48];
+static int sent[NB_SESS];
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cnd = PTHREAD_COND_INITIALIZER;
+static int delivered = 0;
+static uint32_t next_seq[NB_SESS];
+static pthread_t first_thr[NB_SESS];
+static int moved[NB_SESS];
+
+/* The bucket of a Session-Id, as computed by the dispatch shards */
+static int bucket(char * sid)
+{
+	return fd_os_hash((os0_t)sid, strlen(sid)) % NB_BUCKETS;
+}
+
+/* The application callback: check the order of the messages of each session */
+static int cb_shard( struct msg ** msg, struct avp * avp, struct session * session, void * opaque, enum disp_action * action )
+{
+	struct avp * a;
+	struct avp_hdr * ahdr;
+	os0_t sid;
+	size_t sidlen;
+	uint32_t seq;
+	int s;
+	
+	CHECK( 1, session ? 1 : 0 );
+	CHECK( 0, fd_sess_getsid(session, &sid, &sidlen) );
+	for (s = 0; s < NB_SESS; s++) {
+		if ((strlen(sids[s]) == sidlen) && !memcmp(sids[s], sid, sidlen))
+			break;
+	}
+	CHECK( 1, s < NB_SESS ? 1 : 0 );
+	CHECK( 0, fd_msg_search_avp ( *msg, seq_model, &a ) );
+	CHECK( 0, fd_msg_avp_hdr ( a, &ahdr ) );
+	seq = ahdr->avp_value->u32;
+	
+	if (s == HOG)
+		usleep(5000);
+	
+	CHECK( 0, pthread_mutex_lock(&mtx) );
+	CHECK( next_seq[s], seq );
+	next_seq[s]++;
+	if (seq == 0)
+		first_thr[s] = pthread_self();
+	else if (!pthread_equal(first_thr[s], pthread_self()))
+		moved[s] = 1;
+	delivered++;
+	CHECK( 0, pthread_cond_broadcast(&cnd) );
+	CHECK( 0, pthread_mutex_unlock(&mtx) );
+	
+	CHECK( 0, fd_msg_free( *msg ) );
+	*msg = NULL;
+	*action = DISP_ACT_CONT;
+	return 0;
+}
+
+/* Post the next request of a session, as received from a peer */
+static void post(int s)
+{
+	struct msg * msg = NULL;
+	struct avp * avp;
+	union avp_value val;
+	struct msg_hdr * hdr;
+	
+	CHECK( 0, fd_msg_new ( cmd_model, 0, &msg ) );
+	CHECK( 0, fd_msg_hdr ( msg, &hdr ) );
+	hdr->msg_appl = 99;
+	
+	CHECK( 0, fd_msg_avp_new ( sid_model, 0, &avp ) );
+	val.os.data = (os0_t)sids[s];
+	val.os.len = strlen(sids[s]);
+	CHECK( 0, fd_msg_avp_setvalue ( avp, &val ) );
+	CHECK( 0, fd_msg_avp_add ( msg, MSG_BRW_LAST_CHILD, avp ) );
+	
+	CHECK( 0, fd_msg_avp_new ( dh_model, 0, &avp ) );
+	val.os.data = (os0_t)SERVER;
+	val.os.len = strlen(SERVER);
+	CHECK( 0, fd_msg_avp_setvalue ( avp, &val ) );
+	CHECK( 0, fd_msg_avp_add ( msg, MSG_BRW_LAST_CHILD, avp ) );
+	
+	CHECK( 0, fd_msg_avp_new ( dr_model, 0, &avp ) );
+	val.os.data = (os0_t)REALM;
+	val.os.len = strlen(REALM);
+	CHECK( 0, fd_msg_avp_setvalue ( avp, &val ) );
+	CHECK( 0, fd_msg_avp_add ( msg, MSG_BRW_LAST_CHILD, avp ) );
+	
+	CHECK( 0, fd_msg_avp_new ( seq_model, 0, &avp ) );
+	val.u32 = sent[s]++;
+	CHECK( 0, fd_msg_avp_setvalue ( avp, &val ) );
+	CHECK( 0, fd_msg_avp_add ( msg, MSG_BRW_LAST_CHILD, avp ) );
+	
+	CHECK( 0, fd_queues_post(fd_g_incoming, &msg) );
+}
+
+/* Wait until nb messages in total were dispatched */
+static void wait_delivered(int nb)
+{
+	struct timespec ts;
+	
+	CHECK( 0, clock_gettime(CLOCK_REALTIME, &ts) );
+	ts.tv_sec += 10;
+	CHECK( 0, pthread_mutex_lock(&mtx) );
+	while (delivered < nb)
+		CHECK( 0, pthread_cond_timedwait(&cnd, &mtx, &ts) );
+	CHECK( 0, pthread_mutex_unlock(&mtx) );
+}
+
+/* Main test routine */
+int main(int argc, char *argv[])
+{
+	struct dict_object * app;
+	struct disp_hdl * hdl = NULL;
+	struct disp_when when;
+	int i, s, total = 0, nb_moved = 0;
+	
+	/* First, initialize the daemon modules */
+	INIT_FD();
+	fd_g_config->cnf_diamid = strdup(SERVER);
+	fd_g_config->cnf_diamid_len = strlen(SERVER);
+	fd_g_config->cnf_diamrlm = strdup(REALM);
+	fd_g_config->cnf_diamrlm_len = strlen(REALM);
+	fd_g_config->cnf_flags.sess_aff = 1;
+	fd_g_config->cnf_dispthr = NB_SHARDS;
+	fd_g_config->cnf_rtinthr = 1;	/* keep the order of reception up to the shards */
+	fd_g_config->cnf_rtinthr_max = 1;
+	CHECK( 0, fd_queues_init() );
+	CHECK( 0, fd_msg_init() );
+	
+	/* A test application, with a command without rules */
+	{
+		struct dict_application_data app_data = { 99, "Application test shards" };
+		struct dict_cmd_data cmd_data = { 99, "Command test shards", CMD_FLAG_REQUEST, CMD_FLAG_REQUEST };
+		struct dict_avp_data seq_data = { 10099, 0, "AVP test sequence", 0, 0, AVP_TYPE_UNSIGNED32 };
+		
+		CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_APPLICATION, &app_data, NULL, &app ) );
+		CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_COMMAND, &cmd_data, app, &cmd_model ) );
+		CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_AVP, &seq_data, NULL, &seq_model ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Session-Id", &sid_model, ENOENT ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Destination-Host", &dh_model, ENOENT ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Destination-Realm", &dr_model, ENOENT ) );
+	}
+	memset(&when, 0, sizeof(when));
+	when.app = app;
+	CHECK( 0, fd_disp_register( cb_shard, DISP_HOW_APPID, &when, NULL, &hdl ) );
+	CHECK( 0, fd_disp_app_support ( app, NULL, 1, 0 ) );
+	
+	/* Pick the sessions: all but IDLE start on shard 0, in different buckets */
+	for (i = 0, s = 0; s < NB_SESS; i++) {
+		char sid[48];
+		int b, j, ok;
+		
+		snprintf(sid, sizeof(sid), "%s;shard;%d", SERVER, i);
+		b = bucket(sid);
+		ok = ((b % NB_SHARDS) == ((s == IDLE) ? 1 : 0));
+		for (j = 0; ok && (j < s); j++)
+			ok = (bucket(sids[j]) != b);
+		if (ok)
+			strcpy(sids[s++], sid);
+	}
+	
+	CHECK( 0, fd_rtdisp_init() );
+	
+	/* Some activity on the sessions that will move */
+	for (s = 0; s < NB_MOVED; s++)
+		post(s);
+	total += NB_MOVED;
+	wait_delivered(total);
+	
+	/* Then shard 0 gets busy with a slow session */
+	for (i = 0; i < HOG_MSGS; i++)
+		post(HOG);
+	total += HOG_MSGS;
+	
+	/* Shard 1 dispatches a message, finds its queue empty and takes over the idle sessions of shard 0 */
+	post(IDLE);
+	total++;
+	
+	/* The next messages of all the sessions, interleaved */
+	for (i = 0; i < 5; i++) {
+		for (s = 0; s < NB_SESS; s++)
+			post(s);
+		total += NB_SESS;
+	}
+	wait_delivered(total);
+	
+	/* All the messages were received in order (checked in cb_shard), and some sessions changed of thread */
+	for (s = 0; s < NB_SESS; s++) {
+		CHECK( sent[s], next_seq[s] );
+		nb_moved += moved[s];
+	}
+	CHECK( 0, moved[HOG] );
+	CHECK( 0, moved[IDLE] );
+	CHECK( 1, nb_moved > 0 ? 1 : 0 );
+	
+	CHECK( 0, fd_rtdisp_fini() );
+	
+	/* That's all for the tests yet */
+	PASSTEST();
+}
@@ -0,0 +1,145 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+#include "tests.h"
+
+/* Requests that waited too long in the queues are answered DIAMETER_TOO_BUSY, and the local requests whose
+ answer timeout is passed DIAMETER_UNABLE_TO_DELIVER; the other messages are left alone. */
+
+#define SERVER	"server.localdomain"
+#define REALM	"localdomain"
+
+static struct dict_object * acr_model = NULL;
+static int expired = 0;
+
+/* Never called for a request that was not sent */
+static void expire_cb(void * data, DiamId_t sentto, size_t senttolen, struct msg ** req)
+{
+	CHECK( (void *)&expired, data );
+	expired++;
+	CHECK( 0, fd_msg_free(*req) );
+	*req = NULL;
+}
+
+/* Create a local request that arrived ago_ms milliseconds ago */
+static struct msg * new_request(int ago_ms)
+{
+	struct msg * req = NULL;
+	struct msg_hdr * hdr;
+	struct timespec ts;
+	
+	CHECK( 0, fd_msg_new ( acr_model, 0, &req ) );
+	CHECK( 0, fd_msg_hdr ( req, &hdr ) );
+	hdr->msg_appl = 3;
+	CHECK( 0, clock_gettime(CLOCK_REALTIME, &ts) );
+	ts.tv_sec -= ago_ms / 1000;
+	CHECK( 0, fd_msg_arrival_set(req, &ts) );
+	return req;
+}
+
+/* Main test routine */
+int main(int argc, char *argv[])
+{
+	struct msg * msg;
+	struct msg_hdr * hdr;
+	struct timespec ts;
+	struct avp * avp;
+	struct avp_hdr * ahdr;
+	struct dict_object * rc_model = NULL;
+	long long shed_to, shed_res;
+	
+	/* First, initialize the daemon modules */
+	INIT_FD();
+	fd_g_config->cnf_diamid = strdup(SERVER);
+	fd_g_config->cnf_diamid_len = strlen(SERVER);
+	fd_g_config->cnf_diamrlm = strdup(REALM);
+	fd_g_config->cnf_diamrlm_len = strlen(REALM);
+	CHECK( 0, fd_queues_init() );
+	CHECK( 0, fd_msg_init() );
+	CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Accounting-Request", &acr_model, ENOENT ) );
+	CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Result-Code", &rc_model, ENOENT ) );
+	
+	/* Without MaxResidence, an old request is processed */
+	msg = new_request(5000);
+	CHECK( 0, fd_rtdisp_shed(&msg) );
+	CHECK( 1, msg ? 1 : 0 );
+	
+	/* With it, the request is answered DIAMETER_TOO_BUSY in the local queue */
+	fd_g_config->cnf_max_residence = 2000;
+	CHECK( 0, fd_rtdisp_shed(&msg) );
+	CHECK( NULL, msg );
+	CHECK( 0, fd_fifo_tryget(fd_g_incoming, &msg) );
+	CHECK( 0, fd_msg_hdr ( msg, &hdr ) );
+	CHECK( 0, hdr->msg_flags & CMD_FLAG_REQUEST );
+	CHECK( 0, fd_msg_search_avp ( msg, rc_model, &avp ) );
+	CHECK( 0, fd_msg_avp_hdr ( avp, &ahdr ) );
+	CHECK( ER_DIAMETER_TOO_BUSY, ahdr->avp_value->u32 );
+	
+	/* The answer itself is never shed */
+	CHECK( 0, clock_gettime(CLOCK_REALTIME, &ts) );
+	ts.tv_sec -= 5;
+	CHECK( 0, fd_msg_arrival_set(msg, &ts) );
+	CHECK( 0, fd_rtdisp_shed(&msg) );
+	CHECK( 1, msg ? 1 : 0 );
+	CHECK( 0, fd_msg_free(msg) );
+	
+	/* A recent request is processed */
+	msg = new_request(1000);
+	CHECK( 0, fd_rtdisp_shed(&msg) );
+	CHECK( 1, msg ? 1 : 0 );
+	
+	/* Unless its answer timeout is already passed */
+	CHECK( 0, clock_gettime(CLOCK_REALTIME, &ts) );
+	ts.tv_sec -= 1;
+	CHECK( 0, fd_msg_anscb_associate( msg, NULL, &expired, expire_cb, &ts ) );
+	CHECK( 0, fd_rtdisp_shed(&msg) );
+	CHECK( NULL, msg );
+	CHECK( 0, expired );
+	CHECK( 0, fd_fifo_tryget(fd_g_incoming, &msg) );
+	CHECK( 0, fd_msg_hdr ( msg, &hdr ) );
+	CHECK( 0, hdr->msg_flags & CMD_FLAG_REQUEST );
+	CHECK( CMD_FLAG_ERROR, hdr->msg_flags & CMD_FLAG_ERROR );
+	CHECK( 0, fd_msg_search_avp ( msg, rc_model, &avp ) );
+	CHECK( 0, fd_msg_avp_hdr ( avp, &ahdr ) );
+	CHECK( ER_DIAMETER_UNABLE_TO_DELIVER, ahdr->avp_value->u32 );
+	CHECK( 0, fd_msg_free(msg) );
+	
+	CHECK( 0, fd_stat_getshed(&shed_to, &shed_res) );
+	CHECK( 1, shed_to );
+	CHECK( 1, shed_res );
+	
+	/* That's all for the tests yet */
+	PASSTEST();
+} 